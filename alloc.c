@@ -0,0 +1,323 @@
+/*
+** This file implements the memory allocators of the driver, which are
+** installed through SQLITE_CONFIG_MALLOC before sqlite3_initialize() is
+** invoked.  The "counting" allocator passes all requests on to the
+** default allocator of SQLite, while the "pool" allocator keeps freed
+** blocks of up to ALLOC_CLASS_MAX bytes on free lists per power-of-two
+** size class for reuse.  Both count allocations per size class, since
+** SQLite does not pass call sites to the allocator, and track the peak
+** number of bytes in use for the report shown on exit.  Usage example:
+**
+**     nadeko --allocator pool --lookaside 1200,500 --page-cache 4096 script.sql
+*/
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ALLOC_CLASS_MIN_SHIFT 4
+#define ALLOC_CLASS_COUNT 13
+#define ALLOC_CLASS_MAX (1 << (ALLOC_CLASS_MIN_SHIFT + ALLOC_CLASS_COUNT - 1))
+#define ALLOC_HEADER_SIZE 8
+
+/* alloc_stats holds the counters shown by allocReport()
+*/
+typedef struct alloc_stats alloc_stats;
+struct alloc_stats {
+    sqlite3_int64 nMalloc;  /* Number of calls to xMalloc() */
+    sqlite3_int64 nRealloc; /* Number of calls to xRealloc() */
+    sqlite3_int64 nFree;    /* Number of calls to xFree() */
+    sqlite3_int64 nReused;  /* Number of blocks taken from a free list */
+    sqlite3_int64 nCurrent; /* Number of bytes currently allocated */
+    sqlite3_int64 nPeak;    /* Highest value of nCurrent */
+    sqlite3_int64 aClass[ALLOC_CLASS_COUNT + 1]; /* Allocations per class */
+};
+
+static const char *const azAllocName[] = {"counting", "pool", 0};
+
+static sqlite3_mem_methods allocDefault;
+static sqlite3_mem_methods allocBase;
+static alloc_stats allocStats;
+static void *aAllocFreeList[ALLOC_CLASS_COUNT];
+static pthread_mutex_t allocMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+** Return the size class of an allocation of the given size, where
+** ALLOC_CLASS_COUNT stands for allocations too large for any class.
+*/
+static int allocClass(int nByte) {
+    int iClass = 0;
+    int nClass = 1 << ALLOC_CLASS_MIN_SHIFT;
+    for (; iClass < ALLOC_CLASS_COUNT && nClass < nByte; iClass++) {
+        nClass <<= 1;
+    }
+
+    return iClass;
+}
+
+/*
+** Round the given size up to the size actually allocated by the pool.
+*/
+static int allocPoolRoundup(int nByte) {
+    int iClass = allocClass(nByte);
+    if (iClass < ALLOC_CLASS_COUNT) return 1 << (ALLOC_CLASS_MIN_SHIFT + iClass);
+    return (nByte + 7) & ~7;
+}
+
+/*
+** Return the usable size of the given pool allocation.
+*/
+static int allocPoolSize(void *p) {
+    return (int)(*(sqlite3_int64 *)((char *)(p)-ALLOC_HEADER_SIZE));
+}
+
+/*
+** Allocate a block from the pool, reusing a freed block of the same
+** size class if there is one.
+*/
+static void *allocPoolMalloc(int nByte) {
+    int nSize = allocPoolRoundup(nByte);
+    int iClass = allocClass(nSize);
+    char *pBlock;
+    if (iClass < ALLOC_CLASS_COUNT && aAllocFreeList[iClass]) {
+        pBlock = aAllocFreeList[iClass];
+        aAllocFreeList[iClass] = *(void **)(pBlock);
+        allocStats.nReused++;
+    } else if (!(pBlock = allocDefault.xMalloc(nSize + ALLOC_HEADER_SIZE))) {
+        return 0;
+    }
+    *(sqlite3_int64 *)(pBlock) = nSize;
+
+    return pBlock + ALLOC_HEADER_SIZE;
+}
+
+/*
+** Return the given block to the free list of its size class.
+*/
+static void allocPoolFree(void *p) {
+    char *pBlock = (char *)(p)-ALLOC_HEADER_SIZE;
+    int iClass = allocClass(allocPoolSize(p));
+    if (iClass < ALLOC_CLASS_COUNT) {
+        *(void **)(pBlock) = aAllocFreeList[iClass];
+        aAllocFreeList[iClass] = pBlock;
+    } else {
+        allocDefault.xFree(pBlock);
+    }
+}
+
+/*
+** Resize the given block, keeping it if it already has the right size.
+*/
+static void *allocPoolRealloc(void *p, int nByte) {
+    int nOld = allocPoolSize(p);
+    if (allocPoolRoundup(nByte) == nOld) return p;
+    void *pNew = allocPoolMalloc(nByte);
+    if (pNew == 0) return 0;
+    memcpy(pNew, p, nOld < nByte ? nOld : nByte);
+    allocPoolFree(p);
+
+    return pNew;
+}
+
+/*
+** Initialize the default allocator underneath the pool.
+*/
+static int allocPoolInit(void *pUnused) {
+    (void)(pUnused);
+    return allocDefault.xInit(allocDefault.pAppData);
+}
+
+/*
+** Release all blocks on the free lists and shut down the default
+** allocator underneath the pool.
+*/
+static void allocPoolShutdown(void *pUnused) {
+    (void)(pUnused);
+    for (int n = 0; n < ALLOC_CLASS_COUNT; n++) {
+        while (aAllocFreeList[n]) {
+            void *pBlock = aAllocFreeList[n];
+            aAllocFreeList[n] = *(void **)(pBlock);
+            allocDefault.xFree(pBlock);
+        }
+    }
+    allocDefault.xShutdown(allocDefault.pAppData);
+}
+
+/*
+** Count an allocation of the given block as part of allocStats.  Must be
+** called with the mutex held.
+*/
+static void allocCountMalloc(void *p) {
+    if (p == 0) return;
+    int nSize = allocBase.xSize(p);
+    allocStats.aClass[allocClass(nSize)]++;
+    allocStats.nCurrent += nSize;
+    if (allocStats.nCurrent > allocStats.nPeak) allocStats.nPeak = allocStats.nCurrent;
+}
+
+/*
+** Allocate a block from the underlying allocator and count it.
+*/
+static void *allocCountingMalloc(int nByte) {
+    pthread_mutex_lock(&allocMutex);
+    void *p = allocBase.xMalloc(nByte);
+    allocStats.nMalloc++;
+    allocCountMalloc(p);
+    pthread_mutex_unlock(&allocMutex);
+
+    return p;
+}
+
+/*
+** Return a block to the underlying allocator and count it.
+*/
+static void allocCountingFree(void *p) {
+    pthread_mutex_lock(&allocMutex);
+    allocStats.nFree++;
+    allocStats.nCurrent -= allocBase.xSize(p);
+    allocBase.xFree(p);
+    pthread_mutex_unlock(&allocMutex);
+}
+
+/*
+** Resize a block using the underlying allocator and count it.
+*/
+static void *allocCountingRealloc(void *p, int nByte) {
+    pthread_mutex_lock(&allocMutex);
+    int nOld = allocBase.xSize(p);
+    void *pNew = allocBase.xRealloc(p, nByte);
+    allocStats.nRealloc++;
+    if (pNew) {
+        allocStats.nCurrent -= nOld;
+        allocCountMalloc(pNew);
+    }
+    pthread_mutex_unlock(&allocMutex);
+
+    return pNew;
+}
+
+/*
+** Return the usable size of the given block.
+*/
+static int allocCountingSize(void *p) {
+    return allocBase.xSize(p);
+}
+
+/*
+** Round the given size up as done by the underlying allocator.
+*/
+static int allocCountingRoundup(int nByte) {
+    return allocBase.xRoundup(nByte);
+}
+
+/*
+** Initialize the underlying allocator.
+*/
+static int allocCountingInit(void *pUnused) {
+    (void)(pUnused);
+    return allocBase.xInit(allocBase.pAppData);
+}
+
+/*
+** Shut down the underlying allocator.
+*/
+static void allocCountingShutdown(void *pUnused) {
+    (void)(pUnused);
+    allocBase.xShutdown(allocBase.pAppData);
+}
+
+/*
+** Check the given allocator name for validity.
+*/
+static int allocValidate(const char *zName) {
+    for (const char *const *az = azAllocName; *az; az++) {
+        if (!strcmp(zName, *az)) return SQLITE_OK;
+    }
+    fprintf(stderr, "error: unknown allocator \"%s\"\n", zName);
+
+    return SQLITE_ERROR;
+}
+
+/*
+** Install the allocator with the given name.  Must be invoked before
+** sqlite3_initialize().
+*/
+static int allocConfigure(const char *zName) {
+    static const sqlite3_mem_methods counting = {allocCountingMalloc,
+        allocCountingFree,
+        allocCountingRealloc,
+        allocCountingSize,
+        allocCountingRoundup,
+        allocCountingInit,
+        allocCountingShutdown,
+        0};
+    static const sqlite3_mem_methods pool = {allocPoolMalloc,
+        allocPoolFree,
+        allocPoolRealloc,
+        allocPoolSize,
+        allocPoolRoundup,
+        allocPoolInit,
+        allocPoolShutdown,
+        0};
+
+    int rc = sqlite3_config(SQLITE_CONFIG_GETMALLOC, &allocDefault);
+    if (rc) return rc;
+    allocBase = strcmp(zName, "pool") ? allocDefault : pool;
+
+    return sqlite3_config(SQLITE_CONFIG_MALLOC, &counting);
+}
+
+/*
+** Report the peak memory usage and allocation counts of the installed
+** allocator, along with lookaside and page cache usage of the given
+** connection unless it is NULL.
+*/
+static void allocReport(sqlite3 *db, const char *zName) {
+    int iUsed, iHit, iMiss, iMissSize, iMissFull, iUnused;
+
+    pthread_mutex_lock(&allocMutex);
+    alloc_stats stats = allocStats;
+    pthread_mutex_unlock(&allocMutex);
+
+    fprintf(stderr,
+        "memory: %s: peak %lld bytes, %lld allocations, %lld reallocations, "
+        "%lld frees, %lld reused\n",
+        zName,
+        stats.nPeak,
+        stats.nMalloc,
+        stats.nRealloc,
+        stats.nFree,
+        stats.nReused);
+    for (int n = 0; n < ALLOC_CLASS_COUNT; n++) {
+        if (stats.aClass[n] == 0) continue;
+        fprintf(stderr,
+            "memory: up to %d bytes: %lld allocations\n",
+            1 << (ALLOC_CLASS_MIN_SHIFT + n),
+            stats.aClass[n]);
+    }
+    if (stats.aClass[ALLOC_CLASS_COUNT]) {
+        fprintf(stderr,
+            "memory: over %d bytes: %lld allocations\n",
+            ALLOC_CLASS_MAX,
+            stats.aClass[ALLOC_CLASS_COUNT]);
+    }
+
+    if (db == 0) return;
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_USED, &iUsed, &iUnused, 0);
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &iHit, &iUnused, 0);
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &iMiss, &iUnused, 0);
+    fprintf(stderr,
+        "memory: page cache: %d bytes used, %d hits, %d misses\n",
+        iUsed,
+        iHit,
+        iMiss);
+
+    sqlite3_db_status(db, SQLITE_DBSTATUS_LOOKASIDE_HIT, &iUnused, &iHit, 0);
+    sqlite3_db_status(db, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, &iUnused, &iMissSize, 0);
+    sqlite3_db_status(db, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, &iUnused, &iMissFull, 0);
+    fprintf(stderr,
+        "memory: lookaside: %d hits, %d misses by size, %d misses when full\n",
+        iHit,
+        iMissSize,
+        iMissFull);
+}
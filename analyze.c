@@ -0,0 +1,218 @@
+/*
+** This file implements the static analysis of script statements used by
+** the driver.  A statement is prepared with an authorizer callback which
+** collects the tables it reads, writes, creates and drops without
+** executing it.  Tables which merely gain or lose an index or trigger
+** are hosts rather than written tables, as their contents stay the same.
+** Statements which touch temporary or attached databases, control
+** transactions or whose effects cannot otherwise be attributed to tables
+** of the main database are marked as barriers.  Usage example:
+**
+**     analyze_access access;
+**     memset(&access, 0, sizeof(access));
+**     rc = analyzeStatement(db, "INSERT INTO a SELECT * FROM b", &access, &zErr);
+*/
+#include <sqlite3.h>
+#include <string.h>
+
+/* analyze_set is a set of table names
+*/
+typedef struct analyze_set analyze_set;
+struct analyze_set {
+    char **azName; /* Names in the set */
+    int nName;     /* Number of names */
+    int nAlloc;    /* Allocated size of azName */
+};
+
+/* analyze_access describes the tables a single statement accesses
+*/
+typedef struct analyze_access analyze_access;
+struct analyze_access {
+    analyze_set read;   /* Tables read by the statement */
+    analyze_set write;  /* Tables written by the statement */
+    analyze_set create; /* Schema objects created by the statement */
+    analyze_set drop;   /* Schema objects dropped by the statement */
+    analyze_set host;   /* Tables whose indexes or triggers are changed */
+    int isBarrier;      /* True if the accesses cannot be attributed */
+    int isWriter;       /* True if the statement writes the database */
+};
+
+/*
+** Add a name to the given set unless already present.
+*/
+static int analyzeSetAdd(analyze_set *pSet, const char *zName) {
+    for (int n = 0; n < pSet->nName; n++) {
+        if (!sqlite3_stricmp(pSet->azName[n], zName)) return SQLITE_OK;
+    }
+    if (pSet->nName == pSet->nAlloc) {
+        int nAlloc = pSet->nAlloc ? pSet->nAlloc * 2 : 8;
+        char **azNew = sqlite3_realloc(pSet->azName, nAlloc * sizeof(*azNew));
+        if (azNew == 0) return SQLITE_NOMEM;
+        pSet->azName = azNew;
+        pSet->nAlloc = nAlloc;
+    }
+    if (!(pSet->azName[pSet->nName] = sqlite3_mprintf("%s", zName))) {
+        return SQLITE_NOMEM;
+    }
+    pSet->nName++;
+
+    return SQLITE_OK;
+}
+
+/*
+** Return true if the given set contains the given name.
+*/
+static int analyzeSetContains(const analyze_set *pSet, const char *zName) {
+    for (int n = 0; n < pSet->nName; n++) {
+        if (!sqlite3_stricmp(pSet->azName[n], zName)) return 1;
+    }
+
+    return 0;
+}
+
+/*
+** Return true if the given sets have at least one name in common.
+*/
+static int analyzeSetIntersects(const analyze_set *pA, const analyze_set *pB) {
+    for (int n = 0; n < pA->nName; n++) {
+        if (analyzeSetContains(pB, pA->azName[n])) return 1;
+    }
+
+    return 0;
+}
+
+/*
+** Release all memory held by the given set.
+*/
+static void analyzeSetFree(analyze_set *pSet) {
+    for (int n = 0; n < pSet->nName; n++) {
+        sqlite3_free(pSet->azName[n]);
+    }
+    sqlite3_free(pSet->azName);
+    memset(pSet, 0, sizeof(*pSet));
+}
+
+/*
+** Release all memory held by the given access description.
+*/
+static void analyzeAccessFree(analyze_access *pAccess) {
+    analyzeSetFree(&pAccess->read);
+    analyzeSetFree(&pAccess->write);
+    analyzeSetFree(&pAccess->create);
+    analyzeSetFree(&pAccess->drop);
+    analyzeSetFree(&pAccess->host);
+    pAccess->isBarrier = 0;
+    pAccess->isWriter = 0;
+}
+
+/*
+** Authorizer callback which records the tables accessed by the
+** statement being prepared in the given access description.
+*/
+static int analyzeAuthorizer(void *pArg, int iAction, const char *z1, const char *z2,
+    const char *zDb, const char *zTriggerUnused) {
+    (void)(zTriggerUnused);
+
+    analyze_access *pAccess = pArg;
+    int rc = SQLITE_OK;
+    if (zDb && sqlite3_stricmp(zDb, "main")) pAccess->isBarrier = 1;
+
+    switch (iAction) {
+    case SQLITE_READ:
+        rc = analyzeSetAdd(&pAccess->read, z1);
+        break;
+    case SQLITE_INSERT:
+    case SQLITE_UPDATE:
+    case SQLITE_DELETE:
+        rc = analyzeSetAdd(&pAccess->write, z1);
+        break;
+    case SQLITE_CREATE_TABLE:
+    case SQLITE_CREATE_VIEW:
+    case SQLITE_CREATE_VTABLE:
+        rc = analyzeSetAdd(&pAccess->write, z1) || analyzeSetAdd(&pAccess->create, z1);
+        break;
+    case SQLITE_DROP_TABLE:
+    case SQLITE_DROP_VIEW:
+    case SQLITE_DROP_VTABLE:
+        rc = analyzeSetAdd(&pAccess->write, z1) || analyzeSetAdd(&pAccess->drop, z1);
+        break;
+    case SQLITE_CREATE_INDEX:
+    case SQLITE_CREATE_TRIGGER:
+        rc = analyzeSetAdd(&pAccess->write, z1) || analyzeSetAdd(&pAccess->host, z2) ||
+             analyzeSetAdd(&pAccess->create, z1);
+        break;
+    case SQLITE_DROP_INDEX:
+    case SQLITE_DROP_TRIGGER:
+        rc = analyzeSetAdd(&pAccess->write, z1) || analyzeSetAdd(&pAccess->host, z2) ||
+             analyzeSetAdd(&pAccess->drop, z1);
+        break;
+    case SQLITE_ALTER_TABLE:
+        rc = analyzeSetAdd(&pAccess->write, z2);
+        break;
+    case SQLITE_REINDEX:
+        if (z1) rc = analyzeSetAdd(&pAccess->write, z1);
+        break;
+    case SQLITE_CREATE_TEMP_INDEX:
+    case SQLITE_CREATE_TEMP_TABLE:
+    case SQLITE_CREATE_TEMP_TRIGGER:
+    case SQLITE_CREATE_TEMP_VIEW:
+    case SQLITE_DROP_TEMP_INDEX:
+    case SQLITE_DROP_TEMP_TABLE:
+    case SQLITE_DROP_TEMP_TRIGGER:
+    case SQLITE_DROP_TEMP_VIEW:
+    case SQLITE_ATTACH:
+    case SQLITE_DETACH:
+    case SQLITE_PRAGMA:
+    case SQLITE_TRANSACTION:
+    case SQLITE_SAVEPOINT:
+    case SQLITE_ANALYZE:
+        pAccess->isBarrier = 1;
+        break;
+    }
+
+    return rc ? SQLITE_DENY : SQLITE_OK;
+}
+
+/*
+** Return true if the main schema contains a virtual table of the
+** given name.
+*/
+static int analyzeIsVirtual(sqlite3 *db, const char *zName) {
+    sqlite3_stmt *pSelect;
+    sqlite3_prepare_v2(db,
+        "SELECT 1 FROM main.sqlite_schema WHERE type = 'table' AND name = ? "
+        "AND sql LIKE 'CREATE VIRTUAL TABLE%'",
+        -1,
+        &pSelect,
+        0);
+    sqlite3_bind_text(pSelect, 1, zName, -1, SQLITE_STATIC);
+    int result = sqlite3_step(pSelect) == SQLITE_ROW;
+    sqlite3_finalize(pSelect);
+
+    return result;
+}
+
+/*
+** Prepare the given statement on the given connection and describe the
+** tables it accesses.  Writing statements whose writes cannot be
+** attributed to any table, such as VACUUM, are marked as barriers.
+*/
+static int analyzeStatement(
+    sqlite3 *db, const char *zSql, analyze_access *pAccess, char **pzErr) {
+    sqlite3_stmt *pStmt = 0;
+    analyzeAccessFree(pAccess);
+
+    sqlite3_set_authorizer(db, analyzeAuthorizer, pAccess);
+    int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+    sqlite3_set_authorizer(db, 0, 0);
+    if (rc != SQLITE_OK) {
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        return rc;
+    }
+
+    pAccess->isWriter = !sqlite3_stmt_readonly(pStmt);
+    if (pAccess->isWriter && pAccess->write.nName == 0) pAccess->isBarrier = 1;
+    sqlite3_finalize(pStmt);
+
+    return SQLITE_OK;
+}
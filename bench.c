@@ -0,0 +1,204 @@
+/*
+** This file implements the benchmark mode of the driver.  The statements
+** of a script are executed for a number of warmup iterations, which are
+** not measured, followed by a number of measured iterations.  The wall
+** time of every statement and of every whole iteration is recorded, and
+** the minimum, median, 95th percentile and standard deviation of each
+** are written to stdout as JSON, together with the peak memory used by
+** SQLite during any measured iteration.  If requested, the database is
+** reset before every iteration, so that scripts which create tables can
+** be measured repeatedly.  Usage example:
+**
+**     nadeko --bench --repeat 20 --warmup 2 --wipe --output out.db script.sql
+*/
+#include <limits.h>
+#include <math.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_DEFAULT_REPEAT 10
+#define BENCH_DEFAULT_WARMUP 1
+
+/* bench_options controls how benchRun() measures scripts
+*/
+typedef struct bench_options bench_options;
+struct bench_options {
+    int nRepeat; /* Number of measured iterations */
+    int nWarmup; /* Number of unmeasured iterations before them */
+    int isReset; /* True to reset the database before every iteration */
+};
+
+/* bench_summary holds the statistics of a series of wall times
+*/
+typedef struct bench_summary bench_summary;
+struct bench_summary {
+    sqlite3_int64 iMin;    /* Fastest time in microseconds */
+    sqlite3_int64 iMedian; /* Median time in microseconds */
+    sqlite3_int64 iP95;    /* 95th percentile in microseconds */
+    double rStddev;        /* Population standard deviation in microseconds */
+};
+
+static bench_options benchOptions = {BENCH_DEFAULT_REPEAT, BENCH_DEFAULT_WARMUP, 0};
+
+/*
+** Compare two wall times for qsort().
+*/
+static int benchCompare(const void *pA, const void *pB) {
+    sqlite3_int64 iA = *(const sqlite3_int64 *)(pA);
+    sqlite3_int64 iB = *(const sqlite3_int64 *)(pB);
+    return (iA > iB) - (iA < iB);
+}
+
+/*
+** Summarize the given wall times, sorting them in place.
+*/
+static void benchSummarize(sqlite3_int64 *aTime, int nTime, bench_summary *pSummary) {
+    double rSum = 0, rSquares = 0;
+    qsort(aTime, nTime, sizeof(*aTime), benchCompare);
+    for (int n = 0; n < nTime; n++) {
+        rSum += aTime[n];
+        rSquares += (double)(aTime[n]) * aTime[n];
+    }
+
+    double rMean = rSum / nTime;
+    double rVariance = rSquares / nTime - rMean * rMean;
+    pSummary->iMin = aTime[0];
+    pSummary->iMedian = nTime % 2 ? aTime[nTime / 2]
+                                  : (aTime[nTime / 2 - 1] + aTime[nTime / 2]) / 2;
+    pSummary->iP95 = aTime[(nTime * 95 + 99) / 100 - 1];
+    pSummary->rStddev = rVariance > 0 ? sqrt(rVariance) : 0;
+}
+
+/*
+** Write the statistics of the given wall times as JSON members.
+*/
+static void benchWriteSummary(FILE *fd, sqlite3_int64 *aTime, int nTime) {
+    bench_summary summary;
+    benchSummarize(aTime, nTime, &summary);
+    fprintf(fd,
+        "\"min_us\": %lld, \"median_us\": %lld, \"p95_us\": %lld, \"stddev_us\": %.1f",
+        summary.iMin,
+        summary.iMedian,
+        summary.iP95,
+        summary.rStddev);
+}
+
+/*
+** Reset the given database to an empty state, as done by --wipe.
+*/
+static int benchReset(sqlite3 *db) {
+    int rc = sqlite3_db_config(db, SQLITE_DBCONFIG_RESET_DATABASE, 1, 0) ||
+             sqlite3_exec(db, "VACUUM", 0, 0, 0) ||
+             sqlite3_db_config(db, SQLITE_DBCONFIG_RESET_DATABASE, 0, 0);
+    if (rc) fprintf(stderr, "internal: resetting database: %s\n", sqlite3_errmsg(db));
+
+    return rc;
+}
+
+/*
+** Execute all statements of the given script once, storing the wall
+** time of each statement at the given stride and of the whole iteration
+** in the given arrays unless they are NULL.
+*/
+static int benchIterate(
+    sqlite3 *db, script *pScript, sqlite3_int64 *aStmtTime, sqlite3_int64 *pTotal) {
+    sqlite3_int64 iStart = timelineNow();
+    for (int n = 0; n < pScript->nStmt; n++) {
+        script_statement *pStmt = &pScript->aStmt[n];
+        char *zErr = 0;
+        sqlite3_int64 iBefore = timelineNow();
+        TIMELINE_BEGIN("driver", "statement", pStmt->zSql);
+        int rc = sqlite3_exec(db, pStmt->zSql, 0, 0, &zErr);
+        TIMELINE_END("driver", "statement");
+        if (rc != SQLITE_OK) {
+            fprintf(stderr,
+                "error: %s:%llu: %s\n",
+                pScript->zFilename,
+                pStmt->iLinum,
+                zErr ? zErr : sqlite3_errstr(rc));
+            sqlite3_free(zErr);
+            return SQLITE_ERROR;
+        }
+        if (aStmtTime) aStmtTime[n * benchOptions.nRepeat] = timelineNow() - iBefore;
+    }
+    if (pTotal) *pTotal = timelineNow() - iStart;
+
+    return SQLITE_OK;
+}
+
+/*
+** Write the measurements of the given script as JSON to stdout.
+*/
+static void benchReport(script *pScript,
+    sqlite3_int64 *aStmtTime,
+    sqlite3_int64 *aTotal,
+    sqlite3_int64 iHighwater) {
+    int nRepeat = benchOptions.nRepeat;
+    printf("{\n  \"script\": ");
+    timelineWriteString(stdout, pScript->zFilename, INT_MAX);
+    printf(",\n  \"repeat\": %d,\n  \"warmup\": %d,\n  \"reset\": %s,\n",
+        nRepeat,
+        benchOptions.nWarmup,
+        benchOptions.isReset ? "true" : "false");
+    printf("  \"memory_highwater\": %lld,\n  \"total\": {", iHighwater);
+    benchWriteSummary(stdout, aTotal, nRepeat);
+    printf("},\n  \"statements\": [");
+    for (int n = 0; n < pScript->nStmt; n++) {
+        printf("%s\n    {\"line\": %llu, \"sql\": ",
+            n ? "," : "",
+            pScript->aStmt[n].iLinum);
+        timelineWriteString(stdout, pScript->aStmt[n].zSql, TIMELINE_DETAIL_SIZE);
+        printf(", ");
+        benchWriteSummary(stdout, aStmtTime + n * nRepeat, nRepeat);
+        printf("}");
+    }
+    printf("\n  ]\n}\n");
+    fflush(stdout);
+}
+
+/*
+** Measure the given script as configured by benchOptions and report
+** the results to stdout.
+*/
+static int benchRun(sqlite3 *db, const char *zFilename) {
+    script scr;
+    int rc = loadScript(&scr, zFilename);
+    if (rc) return rc;
+
+    int nRepeat = benchOptions.nRepeat;
+    sqlite3_int64 *aTotal = sqlite3_malloc64(nRepeat * sizeof(*aTotal));
+    sqlite3_int64 *aStmtTime =
+        sqlite3_malloc64((sqlite3_int64)(scr.nStmt + 1) * nRepeat * sizeof(*aStmtTime));
+    if (aTotal == 0 || aStmtTime == 0) {
+        fprintf(stderr, "error: %s: out of memory\n", zFilename);
+        rc = SQLITE_NOMEM;
+    }
+
+    for (int n = 0; rc == SQLITE_OK && n < benchOptions.nWarmup; n++) {
+        if (benchOptions.isReset && (rc = benchReset(db))) break;
+        TIMELINE_BEGIN("driver", "warmup", zFilename);
+        rc = benchIterate(db, &scr, 0, 0);
+        TIMELINE_END("driver", "warmup");
+    }
+
+    sqlite3_int64 iHighwater = 0;
+    for (int n = 0; rc == SQLITE_OK && n < nRepeat; n++) {
+        if (benchOptions.isReset && (rc = benchReset(db))) break;
+        sqlite3_memory_highwater(1);
+        TIMELINE_BEGIN("driver", "iteration", zFilename);
+        rc = benchIterate(db, &scr, aStmtTime + n, aTotal + n);
+        TIMELINE_END("driver", "iteration");
+        if (sqlite3_memory_highwater(0) > iHighwater) {
+            iHighwater = sqlite3_memory_highwater(0);
+        }
+    }
+
+    if (rc == SQLITE_OK) benchReport(&scr, aStmtTime, aTotal, iHighwater);
+    sqlite3_free(aStmtTime);
+    sqlite3_free(aTotal);
+    freeScript(&scr);
+
+    return rc;
+}
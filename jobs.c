@@ -0,0 +1,288 @@
+/*
+** This file implements parallel execution of multiple scripts.  Every
+** script runs on its own connection and thread against its own temporary
+** database file.  Once all scripts have succeeded, their databases are
+** attached to the output connection one after another and merged in a
+** single transaction.  Tables of the same name are merged by appending
+** rows, while virtual tables are not carried over, along with their
+** shadow tables and the chunks shared by nadeko() tables.  Usage example:
+**
+**     nadeko --jobs 4 --output out.db a.sql b.sql c.sql
+*/
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+** Condition on the schema entry s of the database attached under the
+** alias given as argument, which is true unless s is, or belongs to, one
+** of the shadow tables created by the modules below for the virtual
+** tables of that database.  Tables which merely share the prefix of a
+** virtual table are merged like any other table.
+*/
+#define JOBS_SHADOW_SQL \
+    "NOT EXISTS (SELECT 1 FROM \"%w\".sqlite_schema AS v, (VALUES " \
+    "('nadeko', 'store'), ('nadeko', 'fts'), ('nadeko', 'trigram'), " \
+    "('nadeko', 'chunks'), ('nadeko_catalog', 'member'), " \
+    "('nadeko_catalog', 'filter'), ('fts5', 'data'), ('fts5', 'idx'), " \
+    "('fts5', 'content'), ('fts5', 'docsize'), ('fts5', 'config')) AS k " \
+    "WHERE v.type = 'table' AND s.tbl_name = v.name || '_' || k.column2 " \
+    "AND replace(v.sql, ' (', '(') || '(' " \
+    "LIKE 'CREATE VIRTUAL TABLE%% USING ' || k.column1 || '(%%') " \
+    "AND s.tbl_name != 'nadeko_chunk'"
+
+/* jobs_pool is the state shared between all worker threads
+*/
+typedef struct jobs_pool jobs_pool;
+struct jobs_pool {
+    char **azScript;   /* Scripts to execute */
+    char **azDatabase; /* Database file of each script */
+    int *aResult;      /* Result code of each script */
+    int nScript;       /* Number of scripts */
+    int iNext;         /* Index of the next script to execute */
+    int iOpenFlags;    /* Flags passed to sqlite3_open_v2() */
+    int (*xPrepare)(sqlite3 *, char **); /* Configures each new connection */
+    pthread_mutex_t mutex;
+};
+
+/*
+** Execute a single script against its own database.
+*/
+static int jobsRunScript(jobs_pool *pPool, int iScript) {
+    sqlite3 *db = 0;
+    char *zErr = 0;
+    int rc;
+
+    if (pPool->azDatabase[iScript] == 0) return SQLITE_NOMEM;
+    remove(pPool->azDatabase[iScript]);
+    TIMELINE_BEGIN("driver", "job", pPool->azScript[iScript]);
+    if ((rc = sqlite3_open_v2(pPool->azDatabase[iScript], &db, pPool->iOpenFlags, 0))) {
+        fprintf(stderr, "error: opening database: %s\n", sqlite3_errstr(rc));
+    } else if ((rc = pPool->xPrepare(db, &zErr))) {
+        fprintf(stderr, "error: %s\n", zErr);
+    } else {
+        rc = readAndLoadFile(db, pPool->azScript[iScript]);
+    }
+    sqlite3_free(zErr);
+    sqlite3_close(db);
+    TIMELINE_END("driver", "job");
+
+    return rc;
+}
+
+/*
+** Main loop of each worker thread.
+*/
+static void *jobsWorkerMain(void *pArg) {
+    jobs_pool *pPool = pArg;
+    for (;;) {
+        pthread_mutex_lock(&pPool->mutex);
+        int iScript = pPool->iNext++;
+        pthread_mutex_unlock(&pPool->mutex);
+        if (iScript >= pPool->nScript) return 0;
+        pPool->aResult[iScript] = jobsRunScript(pPool, iScript);
+    }
+}
+
+/*
+** Return true if the main schema of the given database already
+** contains an object with the given name.
+*/
+static int jobsSchemaContains(sqlite3 *db, const char *zName) {
+    sqlite3_stmt *pSelect;
+    sqlite3_prepare_v2(
+        db, "SELECT 1 FROM main.sqlite_schema WHERE name = ?", -1, &pSelect, 0);
+    sqlite3_bind_text(pSelect, 1, zName, -1, SQLITE_STATIC);
+    int result = sqlite3_step(pSelect) == SQLITE_ROW;
+    sqlite3_finalize(pSelect);
+
+    return result;
+}
+
+/*
+** Copy all tables and their rows from the database attached under the
+** given alias into the main database, except for virtual tables and the
+** shadow tables backing them.  All other schema objects are
+** queued, so that indexes are built only once and triggers do not fire
+** while rows are being copied.
+*/
+static int jobsMergeTables(sqlite3 *db, const char *zAlias, char **pzErr) {
+    sqlite3_stmt *pSelect;
+    char *zSel = sqlite3_mprintf("SELECT name, sql FROM \"%w\".sqlite_schema AS s "
+                                 "WHERE type = 'table' AND sql NOT NULL "
+                                 "AND name NOT LIKE 'sqlite_%%' AND " JOBS_SHADOW_SQL
+                                 " ORDER BY rowid",
+        zAlias,
+        zAlias);
+    int rc = zSel ? sqlite3_prepare_v2(db, zSel, -1, &pSelect, 0) : SQLITE_NOMEM;
+    sqlite3_free(zSel);
+    if (rc) {
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        return rc;
+    }
+
+    while (rc == SQLITE_OK && sqlite3_step(pSelect) == SQLITE_ROW) {
+        const char *zName = (const char *)(sqlite3_column_text(pSelect, 0));
+        const char *zSql = (const char *)(sqlite3_column_text(pSelect, 1));
+        if (!sqlite3_strnicmp(zSql, "CREATE VIRTUAL TABLE", 20)) continue;
+        if (!jobsSchemaContains(db, zName)) {
+            rc = sqlite3_exec(db, zSql, 0, 0, pzErr);
+        }
+        if (rc == SQLITE_OK) {
+            rc = nadekoExecPrintf(db,
+                pzErr,
+                "INSERT INTO main.\"%w\" SELECT * FROM \"%w\".\"%w\"",
+                zName,
+                zAlias,
+                zName);
+        }
+    }
+    sqlite3_finalize(pSelect);
+
+    return rc || nadekoExecPrintf(db,
+                     pzErr,
+                     "INSERT INTO temp.jobs_schema SELECT name, sql "
+                     "FROM \"%w\".sqlite_schema AS s WHERE type != 'table' "
+                     "AND sql NOT NULL AND name NOT LIKE 'sqlite_%%' "
+                     "AND " JOBS_SHADOW_SQL " ORDER BY rowid",
+                     zAlias,
+                     zAlias);
+}
+
+/*
+** Create all schema objects queued by jobsMergeTables().
+*/
+static int jobsMergeSchema(sqlite3 *db, char **pzErr) {
+    sqlite3_stmt *pSelect;
+    int rc = sqlite3_prepare_v2(
+        db, "SELECT name, sql FROM temp.jobs_schema ORDER BY rowid", -1, &pSelect, 0);
+    if (rc) return rc;
+
+    while (rc == SQLITE_OK && sqlite3_step(pSelect) == SQLITE_ROW) {
+        const char *zName = (const char *)(sqlite3_column_text(pSelect, 0));
+        const char *zSql = (const char *)(sqlite3_column_text(pSelect, 1));
+        if (!jobsSchemaContains(db, zName)) {
+            rc = sqlite3_exec(db, zSql, 0, 0, pzErr);
+        }
+    }
+    sqlite3_finalize(pSelect);
+
+    return rc;
+}
+
+/*
+** Merge all job databases into the main database of the given
+** connection.  As attached databases cannot be detached within a
+** transaction, one transaction is used per group of databases which
+** can be attached at the same time, usually all of them.
+*/
+static int jobsMerge(sqlite3 *db, char **azDatabase, int nDatabase) {
+    char *zErr = 0;
+    int rc = SQLITE_OK;
+
+    int nLimit = sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, nDatabase);
+    int nGroup = sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1);
+    if (nGroup < 1) nGroup = 1;
+
+    TIMELINE_BEGIN("driver", "merge", 0);
+    rc = sqlite3_exec(db, "CREATE TEMP TABLE jobs_schema(name TEXT, sql TEXT)", 0, 0, &zErr);
+    for (int iFirst = 0; rc == SQLITE_OK && iFirst < nDatabase; iFirst += nGroup) {
+        int nAttached = 0;
+        for (; rc == SQLITE_OK && nAttached < nGroup && iFirst + nAttached < nDatabase;
+             nAttached++) {
+            rc = nadekoExecPrintf(
+                db, &zErr, "ATTACH %Q AS job%d", azDatabase[iFirst + nAttached], nAttached);
+            if (rc) break;
+        }
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(db, "BEGIN", 0, 0, &zErr);
+        }
+        for (int n = 0; rc == SQLITE_OK && n < nAttached; n++) {
+            char *zAlias = sqlite3_mprintf("job%d", n);
+            rc = zAlias ? jobsMergeTables(db, zAlias, &zErr) : SQLITE_NOMEM;
+            sqlite3_free(zAlias);
+        }
+        if (rc == SQLITE_OK && iFirst + nGroup >= nDatabase) {
+            rc = jobsMergeSchema(db, &zErr);
+        }
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(db, "COMMIT", 0, 0, &zErr);
+        }
+        if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        for (int n = 0; n < nAttached; n++) {
+            nadekoExecPrintf(db, 0, "DETACH job%d", n);
+        }
+    }
+    sqlite3_exec(db, "DROP TABLE IF EXISTS temp.jobs_schema", 0, 0, 0);
+    sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, nLimit);
+    TIMELINE_END("driver", "merge");
+
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "error: merging results: %s\n", zErr ? zErr : sqlite3_errmsg(db));
+    }
+    sqlite3_free(zErr);
+
+    return rc;
+}
+
+/*
+** Execute the given scripts using the given number of worker threads
+** and merge their results into the main database of the given connection.
+*/
+static int jobsRun(sqlite3 *db, char **azScript, int nScript, int nJobs, int iOpenFlags,
+    int (*xPrepare)(sqlite3 *, char **)) {
+    jobs_pool pool;
+    const char *zTempDir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    int rc = SQLITE_OK;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.azScript = azScript;
+    pool.nScript = nScript;
+    pool.iOpenFlags = iOpenFlags;
+    pool.xPrepare = xPrepare;
+    pool.azDatabase = sqlite3_malloc(nScript * sizeof(*pool.azDatabase));
+    pool.aResult = sqlite3_malloc(nScript * sizeof(*pool.aResult));
+    pthread_t *aThread = sqlite3_malloc(nJobs * sizeof(*aThread));
+    if (!pool.azDatabase || !pool.aResult || !aThread) {
+        sqlite3_free(pool.azDatabase);
+        sqlite3_free(pool.aResult);
+        sqlite3_free(aThread);
+        return SQLITE_NOMEM;
+    }
+    for (int n = 0; n < nScript; n++) {
+        pool.azDatabase[n] =
+            sqlite3_mprintf("%s/nadeko-%d-job%d.db", zTempDir, (int)(getpid()), n);
+        pool.aResult[n] = pool.azDatabase[n] ? SQLITE_OK : SQLITE_NOMEM;
+    }
+    pthread_mutex_init(&pool.mutex, 0);
+
+    int nThread = 0;
+    for (; nThread < nJobs && nThread < nScript; nThread++) {
+        if (pthread_create(&aThread[nThread], 0, jobsWorkerMain, &pool)) break;
+    }
+    if (nThread == 0) jobsWorkerMain(&pool);
+    for (int n = 0; n < nThread; n++) {
+        pthread_join(aThread[n], 0);
+    }
+
+    for (int n = 0; n < nScript; n++) {
+        if (pool.aResult[n] && !rc) rc = pool.aResult[n];
+    }
+    if (rc == SQLITE_OK) {
+        rc = jobsMerge(db, pool.azDatabase, nScript);
+    }
+
+    for (int n = 0; n < nScript; n++) {
+        if (pool.azDatabase[n]) remove(pool.azDatabase[n]);
+        sqlite3_free(pool.azDatabase[n]);
+    }
+    pthread_mutex_destroy(&pool.mutex);
+    sqlite3_free(pool.azDatabase);
+    sqlite3_free(pool.aResult);
+    sqlite3_free(aThread);
+
+    return rc;
+}
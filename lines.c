@@ -14,6 +14,11 @@
 #endif
 SQLITE_EXTENSION_INIT1
 
+#ifndef TIMELINE_BEGIN
+#define TIMELINE_BEGIN(zCat, zName, zDetail)
+#define TIMELINE_END(zCat, zName)
+#endif
+
 /* lines_vtab is a subclass of sqlite3_vtab which is
 ** the underlying representation of the virtual table
 */
@@ -189,6 +194,7 @@ static int linesFilter(sqlite3_vtab_cursor *pVtabCur,
     lines_cursor *pCur = (lines_cursor *)pVtabCur;
     int rc = SQLITE_OK;
 
+    TIMELINE_BEGIN("lines", "filter", 0);
     const sqlite_int64 iOldBytes = pCur->iBytes;
     pCur->pValue = argv[0];
     pCur->iBytes = sqlite3_value_bytes(argv[0]);
@@ -212,10 +218,13 @@ static int linesFilter(sqlite3_vtab_cursor *pVtabCur,
     default:
         pVtabCur->pVtab->zErrMsg =
             sqlite3_mprintf("first argument to lines() not a string or blob");
+        TIMELINE_END("lines", "filter");
         return SQLITE_ERROR;
     }
 
-    return rc || linesNext(pVtabCur);
+    rc = rc || linesNext(pVtabCur);
+    TIMELINE_END("lines", "filter");
+    return rc;
 }
 
 /*
@@ -1,6 +1,24 @@
+#define _POSIX_C_SOURCE 200809L
+#include "timeline.c"
+#include "progress.c"
+#include "trace.c"
+#include "stage.c"
+#include "tuning.c"
+#include "alloc.c"
 #include "lines.c"
 #include "nadeko.c"
+#include "analyze.c"
+#include "memo.c"
+#include "resume.c"
+#include "shard.c"
+#include "script.c"
+#include "jobs.c"
+#include "schedule.c"
+#include "serve.c"
+#include "bench.c"
+#include "watch.c"
 #include <errno.h>
+#include <limits.h>
 #include <sqlite3.h>
 #include <stdio.h>
 #include <string.h>
@@ -9,93 +27,6 @@
     SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW | SQLITE_TRACE_CLOSE
 #define FLAG_SQLITE_OPEN \
     SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX
-#define READ_BUFFER_SIZE 1 << 16
-
-void consumeSingleStatement(char **ppPoint, sqlite3_int64 *pLinum, int isOutside) {
-    int isInLargeComment = 0;
-    for (;;) {
-        if (*ppPoint[0] == '\0') {
-            break;
-        } else if (*ppPoint[0] == '\n') {
-            *pLinum += 1;
-            *ppPoint += 1;
-        } else if (*ppPoint[0] == ' ') {
-            *ppPoint += 1;
-        } else if (isInLargeComment) {
-            if (!strncmp(*ppPoint, "*/", 2)) {
-                isInLargeComment = 0;
-                *ppPoint += 2;
-            } else {
-                *ppPoint += 1;
-            }
-        } else if (!strncmp(*ppPoint, "/*", 2)) {
-            isInLargeComment = 1;
-            *ppPoint += 2;
-        } else if (!strncmp(*ppPoint, "--", 2)) {
-            *ppPoint = strchr(*ppPoint, '\n');
-            if (!*ppPoint) *ppPoint = strchr(*ppPoint, '\0');
-        } else if (*ppPoint[0] == ';') {
-            *ppPoint += 1;
-            if (!isOutside) break;
-        } else {
-            if (isOutside) break;
-            *ppPoint += 1;
-        }
-    }
-}
-
-int readAndLoadFile(sqlite3 *db, const char *zFilename) {
-    FILE *fd = fopen(zFilename, "r");
-    if (fd == 0) {
-        fprintf(stderr, "error: opening \"%s\": %s\n", zFilename, strerror(errno));
-        return errno;
-    }
-
-    char buf[READ_BUFFER_SIZE];
-    memset(buf, 0, READ_BUFFER_SIZE);
-    if (fread(buf, sizeof(*buf), READ_BUFFER_SIZE, fd) && ferror(fd)) {
-        fprintf(stderr, "error: reading \"%s\": %s\n", zFilename, strerror(errno));
-        fclose(fd);
-        return errno;
-    } else if (!feof(fd)) {
-        fprintf(stderr, "error: reading \"%s\": %s\n", zFilename, "buffer too small");
-        fclose(fd);
-        return errno;
-    }
-
-    sqlite3_int64 iEndLinum = 1;
-    char *pEnd = buf;
-    for (;;) {
-        // Find start of SQL statement
-        char *pStart = pEnd;
-        sqlite3_int64 iStartLinum = iEndLinum;
-        consumeSingleStatement(&pStart, &iStartLinum, 1);
-        if (pStart[0] == '\0') {
-            fclose(fd);
-            return SQLITE_OK;
-        };
-
-        // Find end of SQL statement
-        pEnd = pStart;
-        iEndLinum = iStartLinum;
-        consumeSingleStatement(&pEnd, &iEndLinum, 0);
-        if (pEnd[0] == '\0') {
-            fprintf(stderr, "error: %s:%llu: unterminated SQL\n", zFilename, iStartLinum);
-            fclose(fd);
-            return SQLITE_ERROR;
-        };
-
-        // Execute current SQL statement
-        char *zErr = 0;
-        pEnd[-1] = '\0';
-        if (sqlite3_exec(db, pStart, 0, 0, &zErr) != SQLITE_OK) {
-            fprintf(stderr, "error: %s:%llu: %s\n", zFilename, iStartLinum, zErr);
-            sqlite3_free(zErr);
-            fclose(fd);
-            return SQLITE_ERROR;
-        }
-    }
-}
 
 void debugLogCallback(void *pVoidUnused, int iResultUnused, const char *zMsg) {
     (void)(pVoidUnused);
@@ -104,79 +35,169 @@ void debugLogCallback(void *pVoidUnused, int iResultUnused, const char *zMsg) {
     fprintf(stderr, "debug: %s\n", zMsg);
 }
 
-int traceLogCallback(unsigned int uMask, void *pCtxUnused, void *pData, void *pExtra) {
-    (void)(pCtxUnused);
-
-    char *zSql = 0;
-    char *pNewline;
-    switch (uMask) {
-    case SQLITE_TRACE_STMT:
-        zSql = sqlite3_expanded_sql(pData);
-        if ((pNewline = strchr(zSql, '\n'))) {
-            fprintf(stderr, "trace: prepare: %.*s...\n", (int)(pNewline - zSql), zSql);
-        } else {
-            fprintf(stderr, "trace: prepare: %s\n", zSql);
-        }
-        break;
-    case SQLITE_TRACE_ROW:
-        zSql = sqlite3_expanded_sql(pData);
-        if (!zSql) break;
-        fprintf(stderr, "trace: row: statement resulted in ");
-        for (int column = 0; column < sqlite3_column_count(pData); column++) {
-            fprintf(stderr,
-                "%s%s",
-                column == 0 ? "" : ",",
-                sqlite3_column_type(pData, column) == SQLITE_BLOB
-                    ? "BLOB"
-                    : (char *)(sqlite3_column_text(pData, column)));
-        }
-        fputc('\n', stderr);
-        break;
-    case SQLITE_TRACE_PROFILE:
-        zSql = sqlite3_expanded_sql(pData);
-        fprintf(stderr,
-            "trace: profile: statement took %fms\n",
-            *(int *)(pExtra) / 1000000.0);
-        break;
-    case SQLITE_TRACE_CLOSE:
-        fprintf(stderr, "trace: close database connection\n");
-        break;
-    }
-    if (zSql) sqlite3_free(zSql);
-
-    return SQLITE_OK;
-}
-
 char *stringOptionDatabase = ":memory:";
 char *stringOptionWorkingDirectory = ".";
+char *stringOptionTimeline = 0;
+char *stringOptionPreset = 0;
+char *stringOptionServe = 0;
+char *stringOptionConnect = 0;
+char *stringOptionAllocator = 0;
 int isOptionDebug = 0;
 int isOptionTrace = 0;
 int isOptionWipe = 0;
+int isOptionStage = 0;
+int isOptionWatch = 0;
+int isOptionBench = 0;
+int iOptionJobs = 0;
+int iOptionParallel = 0;
+int iOptionScripts = 0;
+
+/*
+** Store the argument of the switch at the given index into the given
+** string, advancing the index past the argument on success.
+*/
+int parseSwitchArgument(int argc, char *argv[], int *pn, char **pzValue) {
+    if (*pn + 1 < argc && strncmp(argv[*pn + 1], "--", 2)) {
+        *pzValue = argv[++*pn];
+        return SQLITE_OK;
+    } else {
+        fprintf(stderr, "error: missing argument to switch \"%s\"\n", argv[*pn]);
+        return SQLITE_ERROR;
+    }
+}
 
 int parseCommandArgs(int argc, char *argv[]) {
     int iPositional = 0;
+    int nSwitch = 0;
+    char *zValue = 0;
     for (int n = 1; n < argc; n++) {
         argv[1 + iPositional] = argv[n];
+        if (!strncmp(argv[n], "--", 2)) nSwitch++;
         if (!strcmp(argv[n], "--debug")) {
             isOptionDebug = 1;
         } else if (!strcmp(argv[n], "--trace")) {
             isOptionTrace = 1;
+        } else if (!strcmp(argv[n], "--trace-sample")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            if (traceParseSample(zValue)) {
+                fprintf(stderr, "error: invalid sampling rates \"%s\"\n", zValue);
+                return SQLITE_ERROR;
+            }
+            isOptionTrace = 1;
+        } else if (!strcmp(argv[n], "--progress")) {
+            progressOptions.isReport = 1;
+        } else if (!strcmp(argv[n], "--statement-timeout")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            if ((progressOptions.iBudget = atof(zValue) * 1e6) <= 0) {
+                fprintf(stderr, "error: invalid statement timeout \"%s\"\n", zValue);
+                return SQLITE_ERROR;
+            }
         } else if (!strcmp(argv[n], "--wipe")) {
             isOptionWipe = 1;
+        } else if (!strcmp(argv[n], "--stage-in-memory")) {
+            isOptionStage = 1;
+        } else if (!strcmp(argv[n], "--transaction")) {
+            scriptOptions.nTransaction = INT_MAX;
+        } else if (!strcmp(argv[n], "--transaction-batch")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            if ((scriptOptions.nTransaction = atoi(zValue)) <= 0) {
+                fprintf(stderr, "error: invalid batch size \"%s\"\n", zValue);
+                return SQLITE_ERROR;
+            }
+        } else if (!strcmp(argv[n], "--memoize")) {
+            scriptOptions.isMemoize = 1;
+        } else if (!strcmp(argv[n], "--resume")) {
+            scriptOptions.isResume = 1;
+        } else if (!strcmp(argv[n], "--watch")) {
+            isOptionWatch = 1;
+        } else if (!strcmp(argv[n], "--bench")) {
+            isOptionBench = 1;
+        } else if (!strcmp(argv[n], "--repeat")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            if ((benchOptions.nRepeat = atoi(zValue)) <= 0) {
+                fprintf(stderr, "error: invalid number of repetitions \"%s\"\n", zValue);
+                return SQLITE_ERROR;
+            }
+        } else if (!strcmp(argv[n], "--warmup")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            if ((benchOptions.nWarmup = atoi(zValue)) < 0) {
+                fprintf(stderr, "error: invalid number of warmups \"%s\"\n", zValue);
+                return SQLITE_ERROR;
+            }
+        } else if (!strcmp(argv[n], "--jobs")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            if ((iOptionJobs = atoi(zValue)) <= 0) {
+                fprintf(stderr, "error: invalid number of jobs \"%s\"\n", zValue);
+                return SQLITE_ERROR;
+            }
+        } else if (!strcmp(argv[n], "--shards")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            if ((shardOptions.nShard = atoi(zValue)) <= 0) {
+                fprintf(stderr, "error: invalid number of shards \"%s\"\n", zValue);
+                return SQLITE_ERROR;
+            }
+        } else if (!strcmp(argv[n], "--parallel-statements")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            if ((iOptionParallel = atoi(zValue)) <= 0) {
+                fprintf(stderr, "error: invalid number of connections \"%s\"\n", zValue);
+                return SQLITE_ERROR;
+            }
         } else if (!strcmp(argv[n], "--output")) {
-            if (n + 1 < argc && strncmp(argv[n + 1], "--", 2)) {
-                stringOptionDatabase = argv[++n];
-            } else {
-                fprintf(stderr, "error: missing argument to switch \"%s\"\n", argv[n]);
+            if (parseSwitchArgument(argc, argv, &n, &stringOptionDatabase)) {
                 return SQLITE_ERROR;
             }
         } else if (!strcmp(argv[n], "--cwd")) {
-            if (n + 1 < argc && strncmp(argv[n + 1], "--", 2)) {
-                stringOptionWorkingDirectory = argv[++n];
-            } else {
-                fprintf(stderr, "error: missing argument to switch \"%s\"\n", argv[n]);
+            if (parseSwitchArgument(argc, argv, &n, &stringOptionWorkingDirectory)) {
+                return SQLITE_ERROR;
+            }
+        } else if (!strcmp(argv[n], "--timeline")) {
+            if (parseSwitchArgument(argc, argv, &n, &stringOptionTimeline)) {
+                return SQLITE_ERROR;
+            }
+        } else if (!strcmp(argv[n], "--serve")) {
+            if (parseSwitchArgument(argc, argv, &n, &stringOptionServe)) {
+                return SQLITE_ERROR;
+            }
+        } else if (!strcmp(argv[n], "--connect")) {
+            if (parseSwitchArgument(argc, argv, &n, &stringOptionConnect)) {
                 return SQLITE_ERROR;
             }
+        } else if (!strcmp(argv[n], "--profile-preset")) {
+            if (parseSwitchArgument(argc, argv, &n, &stringOptionPreset)) {
+                return SQLITE_ERROR;
+            }
+        } else if (!strcmp(argv[n], "--cache-size")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            tuningOptions.zCacheSize = zValue;
+        } else if (!strcmp(argv[n], "--mmap-size")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            tuningOptions.zMmapSize = zValue;
+        } else if (!strcmp(argv[n], "--journal")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            tuningOptions.zJournal = zValue;
+        } else if (!strcmp(argv[n], "--allocator")) {
+            if (parseSwitchArgument(argc, argv, &n, &stringOptionAllocator)) {
+                return SQLITE_ERROR;
+            }
+        } else if (!strcmp(argv[n], "--lookaside")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            if (sscanf(zValue,
+                    "%d,%d",
+                    &tuningOptions.iLookasideSize,
+                    &tuningOptions.iLookasideCount) != 2 ||
+                tuningOptions.iLookasideSize < 0 || tuningOptions.iLookasideCount < 0) {
+                fprintf(stderr, "error: invalid lookaside \"%s\"\n", zValue);
+                return SQLITE_ERROR;
+            }
+        } else if (!strcmp(argv[n], "--page-cache")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            if ((tuningOptions.iPageCacheCount = atoi(zValue)) <= 0) {
+                fprintf(stderr, "error: invalid page cache size \"%s\"\n", zValue);
+                return SQLITE_ERROR;
+            }
+        } else if (!strcmp(argv[n], "--threading")) {
+            if (parseSwitchArgument(argc, argv, &n, &zValue)) return SQLITE_ERROR;
+            tuningOptions.zThreading = zValue;
         } else if (!strncmp(argv[n], "--", 2)) {
             fprintf(stderr, "error: unknown switch \"%s\"\n", argv[n]);
             return SQLITE_ERROR;
@@ -185,55 +206,220 @@ int parseCommandArgs(int argc, char *argv[]) {
         }
     }
 
-    if (iPositional < 1) {
+    if (iPositional < 1 && !stringOptionServe) {
         fprintf(stderr, "error: missing positional argument\n");
         return SQLITE_ERROR;
-    } else if (iPositional > 1) {
+    } else if ((iPositional > 1 && !iOptionJobs) || (iPositional && stringOptionServe)) {
         fprintf(stderr, "error: too many positional arguments\n");
         return SQLITE_ERROR;
+    } else if (iOptionJobs && tuningOptions.zThreading &&
+               !sqlite3_stricmp(tuningOptions.zThreading, "single")) {
+        fprintf(stderr, "error: parallel jobs require a multi-threaded mode\n");
+        return SQLITE_ERROR;
+    } else if (shardOptions.nShard > 1 && tuningOptions.zThreading &&
+               !sqlite3_stricmp(tuningOptions.zThreading, "single")) {
+        fprintf(stderr, "error: shards require a multi-threaded mode\n");
+        return SQLITE_ERROR;
+    } else if (stringOptionPreset && tuningApplyPreset(stringOptionPreset)) {
+        return SQLITE_ERROR;
+    } else if (tuningValidate()) {
+        return SQLITE_ERROR;
+    } else if (stringOptionAllocator && allocValidate(stringOptionAllocator)) {
+        return SQLITE_ERROR;
     }
 
+    if (stringOptionConnect && nSwitch > 1) {
+        fprintf(stderr, "error: connecting cannot be combined with other switches\n");
+        return SQLITE_ERROR;
+    }
+
+    if (stringOptionServe && (iOptionJobs || iOptionParallel || isOptionStage)) {
+        fprintf(stderr, "error: serving cannot be combined with "
+                        "jobs, parallel statements or staging\n");
+        return SQLITE_ERROR;
+    } else if (isOptionWatch &&
+               (stringOptionServe || iOptionJobs || iOptionParallel || isOptionStage)) {
+        fprintf(stderr, "error: watching cannot be combined with "
+                        "serving, jobs, parallel statements or staging\n");
+        return SQLITE_ERROR;
+    } else if (isOptionWatch) {
+        scriptOptions.isMemoize = 1;
+    }
+
+    if (isOptionBench && (stringOptionServe || isOptionWatch || iOptionJobs ||
+                             iOptionParallel || scriptOptions.nTransaction ||
+                             scriptOptions.isMemoize || scriptOptions.isResume)) {
+        fprintf(stderr, "error: benchmarking cannot be combined with serving, "
+                        "watching, jobs, parallel statements, transactions, "
+                        "memoization or resuming\n");
+        return SQLITE_ERROR;
+    } else if (isOptionBench) {
+        benchOptions.isReset = isOptionWipe;
+    }
+
+    if (scriptOptions.isMemoize && (iOptionJobs || iOptionParallel)) {
+        fprintf(stderr, "error: memoization cannot be combined with "
+                        "jobs or parallel statements\n");
+        return SQLITE_ERROR;
+    } else if (scriptOptions.isResume &&
+               (iOptionJobs || iOptionParallel || isOptionStage)) {
+        fprintf(stderr, "error: resuming cannot be combined with "
+                        "jobs, parallel statements or staging\n");
+        return SQLITE_ERROR;
+    } else if (iOptionParallel &&
+               (iOptionJobs || scriptOptions.nTransaction || isOptionStage)) {
+        fprintf(stderr, "error: parallel statements cannot be combined with "
+                        "jobs, transactions or staging\n");
+        return SQLITE_ERROR;
+    } else if (iOptionParallel && !strcmp(stringOptionDatabase, ":memory:")) {
+        fprintf(stderr, "error: parallel statements require a database file\n");
+        return SQLITE_ERROR;
+    } else if (iOptionParallel && tuningOptions.zThreading &&
+               !sqlite3_stricmp(tuningOptions.zThreading, "single")) {
+        fprintf(stderr, "error: parallel statements require a multi-threaded mode\n");
+        return SQLITE_ERROR;
+    } else if (iOptionParallel) {
+        tuningOptions.zJournal = "wal";
+        tuningOptions.zLocking = "normal";
+    }
+
+    if (isOptionStage && !strcmp(stringOptionDatabase, ":memory:")) {
+        isOptionStage = 0;
+    } else if (isOptionStage && !tuningOptions.zCacheSize) {
+        tuningOptions.zCacheSize = STAGE_DEFAULT_CACHE_SIZE;
+    }
+
+    iOptionScripts = iPositional;
     return SQLITE_OK;
 }
 
+/*
+** Apply tuning, tracing and all extensions to a new connection,
+** describing the failing step in the given error message on failure.
+*/
+int prepareConnection(sqlite3 *db, char **pzErr) {
+    char *zErr = 0;
+    int rc;
+
+    if ((rc = tuningConfigureConnection(db, &zErr))) {
+        *pzErr = sqlite3_mprintf("tuning database: %s", zErr);
+    } else if (isOptionTrace &&
+               (rc = sqlite3_trace_v2(
+                    db, traceMask(FLAG_SQLITE_TRACE), traceLogCallback, 0))) {
+        *pzErr = sqlite3_mprintf("setting tracing: %s", sqlite3_errstr(rc));
+    } else if ((rc = sqlite3_nadeko_init(db, &zErr, 0)) ||
+               (rc = sqlite3_lines_init(db, &zErr, 0))) {
+        *pzErr = sqlite3_mprintf("initializing extension: %s", sqlite3_errmsg(db));
+    }
+    if (zErr) sqlite3_free(zErr);
+
+    return rc;
+}
+
+/*
+** Submit the given script to the server named by --connect, which
+** resolves relative paths against the working directory of the client.
+*/
+int submitToServer(const char *zScript) {
+    char *zDirectory = stageAbsolutePath(stringOptionWorkingDirectory);
+    char *zPath = stageAbsolutePath(zScript);
+    int rc;
+
+    if (!zDirectory || !zPath) {
+        fprintf(stderr, "error: resolving script path: %s\n", strerror(errno));
+        rc = SQLITE_ERROR;
+    } else {
+        rc = serveSubmit(stringOptionConnect, zDirectory, zPath);
+    }
+    sqlite3_free(zDirectory);
+    sqlite3_free(zPath);
+
+    return rc;
+}
+
 int main(int argc, char *argv[]) {
     sqlite3 *db = 0;
     char *zErr = 0;
+    char *zStageOutput = 0;
     int rc = SQLITE_OK;
 
+    shardOptions.iOpenFlags = FLAG_SQLITE_OPEN;
+    shardOptions.xPrepare = prepareConnection;
     if ((rc = parseCommandArgs(argc, argv)) == SQLITE_DONE) {
         return SQLITE_OK;
     } else if (rc != SQLITE_OK) {
         return SQLITE_ERROR;
+    } else if (stringOptionConnect) {
+        return submitToServer(argv[1]);
     }
 
-    if (isOptionDebug && (rc = sqlite3_config(SQLITE_CONFIG_LOG, debugLogCallback, 0))) {
+    if (stringOptionTimeline && (rc = timelineOpen(stringOptionTimeline))) {
+        fprintf(stderr, "error: opening timeline: %s\n", strerror(errno));
+    } else if ((rc = progressStart())) {
+        fprintf(stderr, "internal: starting progress reports: %s\n", sqlite3_errstr(rc));
+    } else if (isOptionDebug &&
+               (rc = sqlite3_config(SQLITE_CONFIG_LOG, debugLogCallback, 0))) {
         fprintf(stderr, "internal: setting debug: %s\n", sqlite3_errstr(rc));
+    } else if (stringOptionAllocator && (rc = allocConfigure(stringOptionAllocator))) {
+        fprintf(stderr, "internal: installing allocator: %s\n", sqlite3_errstr(rc));
+    } else if ((rc = tuningConfigureGlobal())) {
+        fprintf(stderr, "internal: configuring sqlite: %s\n", sqlite3_errstr(rc));
     } else if ((rc = sqlite3_initialize())) {
         fprintf(stderr, "internal: initializing sqlite: %s\n", sqlite3_errstr(rc));
-    } else if ((rc = sqlite3_open_v2(stringOptionDatabase, &db, FLAG_SQLITE_OPEN, 0))) {
+    } else if (isOptionStage &&
+               !(zStageOutput = stageAbsolutePath(stringOptionDatabase))) {
+        fprintf(stderr, "error: resolving output path: %s\n", strerror(errno));
+        rc = SQLITE_ERROR;
+    } else if ((rc = sqlite3_open_v2(zStageOutput ? "" : stringOptionDatabase,
+                    &db,
+                    tuningOpenFlags(FLAG_SQLITE_OPEN),
+                    0))) {
         fprintf(stderr, "error: opening database: %s\n", sqlite3_errstr(rc));
+    } else if (zStageOutput && !isOptionWipe && (rc = stageLoad(db, zStageOutput))) {
+        fprintf(stderr, "error: loading output database: %s\n", sqlite3_errstr(rc));
     } else if (isOptionWipe &&
                (rc = sqlite3_db_config(db, SQLITE_DBCONFIG_RESET_DATABASE, 1, 0) ||
                      sqlite3_exec(db, "VACUUM", 0, 0, 0) ||
                      sqlite3_db_config(db, SQLITE_DBCONFIG_RESET_DATABASE, 0, 0))) {
         fprintf(stderr, "internal: wiping database: %s\n", sqlite3_errstr(rc));
-    } else if (isOptionTrace &&
-               (rc = sqlite3_trace_v2(db, FLAG_SQLITE_TRACE, traceLogCallback, 0))) {
-        fprintf(stderr, "internal: setting tracing: %s\n", sqlite3_errstr(rc));
-    } else if ((rc = sqlite3_nadeko_init(db, &zErr, 0))) {
-        fprintf(stderr, "internal: initializing extension: %s\n", sqlite3_errmsg(db));
-    } else if ((rc = sqlite3_lines_init(db, &zErr, 0))) {
-        fprintf(stderr, "internal: initializing extension: %s\n", sqlite3_errmsg(db));
+    } else if (isOptionTrace && (rc = traceStart())) {
+        fprintf(stderr, "internal: starting trace writer: %s\n", sqlite3_errstr(rc));
+        isOptionTrace = 0;
+    } else if ((rc = prepareConnection(db, &zErr))) {
+        fprintf(stderr, "error: %s\n", zErr);
     } else if (chdir(stringOptionWorkingDirectory)) {
         fprintf(stderr, "error: changing directory: %s\n", strerror(errno));
+    } else if (stringOptionServe) {
+        rc = serveRun(db, stringOptionServe);
+    } else if (isOptionWatch) {
+        rc = watchRun(&db, argv[1], tuningOpenFlags(FLAG_SQLITE_OPEN), prepareConnection);
+    } else if (isOptionBench) {
+        rc = benchRun(db, argv[1]);
+    } else if (iOptionJobs) {
+        rc = jobsRun(db,
+            argv + 1,
+            iOptionScripts,
+            iOptionJobs,
+            FLAG_SQLITE_OPEN,
+            prepareConnection);
+    } else if (iOptionParallel) {
+        rc = scheduleRun(db, argv[1], iOptionParallel, FLAG_SQLITE_OPEN, prepareConnection);
     } else {
         rc = readAndLoadFile(db, argv[1]);
     }
 
+    if (rc == SQLITE_OK && zStageOutput &&
+        (rc = stagePersist(db, zStageOutput, &zErr))) {
+        fprintf(stderr, "error: persisting database: %s\n", zErr);
+    }
+
     if (zErr) sqlite3_free(zErr);
+    if (zStageOutput) sqlite3_free(zStageOutput);
+    if (stringOptionAllocator) allocReport(db, stringOptionAllocator);
     if (db) sqlite3_close(db);
+    if (isOptionTrace) traceStop();
     sqlite3_shutdown();
+    timelineClose();
 
     return rc;
 }
@@ -0,0 +1,544 @@
+/*
+** This file implements make-style memoization of script statements
+** across runs against the same output database.  Every statement is
+** keyed by a hash of its text and fingerprinted by a hash of its text
+** together with the identity of every input it reads: the path, size and
+** modification time of each file behind a nadeko() table, and the
+** version of each ordinary table.  The version of a table is the
+** fingerprint of the statement which last wrote it, so unchanged
+** statements over unchanged inputs reproduce the same versions and the
+** whole chain of dependent statements may be skipped.
+**
+** A statement is skipped if its fingerprint matches the recorded one and
+** it is still the last writer of all its outputs, which must exist.  A
+** statement that only drops objects is skipped if they do not exist or
+** their last writer would be skipped.  Objects created by a statement
+** are dropped before it is executed again if they keep it from being
+** prepared, as happens without IF NOT EXISTS.  This includes tables but
+** not indexes or triggers created by a former text of the statement.
+**
+** Statements which write nadeko() tables or whose accesses cannot be
+** attributed always execute and give their outputs a fresh version.
+** Inputs which are invisible to SQLite, like files read by SQL functions,
+** are not tracked.  The state is kept in the tables nadeko_memo and
+** nadeko_memo_version of the main database.  Usage example:
+**
+**     nadeko --memoize --output out.db script.sql
+*/
+#include <dirent.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define MEMO_HASH_SIZE 17
+#define MEMO_FNV_OFFSET 14695981039346656037ULL
+#define MEMO_FNV_PRIME 1099511628211ULL
+
+/* memo_state is the memoization state of a single statement between
+** memoPrepare() and memoRecord()
+*/
+typedef struct memo_state memo_state;
+struct memo_state {
+    const char *zSql;           /* Text of the statement */
+    char zKey[MEMO_HASH_SIZE];  /* Hash of the statement text */
+    char zHash[MEMO_HASH_SIZE]; /* Hash of the statement text and its inputs */
+    analyze_access access;      /* Tables accessed by the statement */
+    char *zInputs;              /* Tables read, each terminated by a newline */
+    char *zOutputs;             /* Objects written, each terminated by a newline */
+    char *zCreates;             /* Objects created, each terminated by a newline */
+    char *zDrops;               /* Objects dropped, each terminated by a newline */
+    int isAnalyzed;             /* True if the accesses are known */
+    int isMemoizable;           /* True if the statement may be skipped later */
+};
+
+/*
+** Fold the given bytes into the given FNV-1a hash.
+*/
+static void memoHashUpdate(sqlite3_uint64 *pHash, const void *pData, size_t nData) {
+    const unsigned char *p = pData;
+    for (size_t n = 0; n < nData; n++) {
+        *pHash = (*pHash ^ p[n]) * MEMO_FNV_PRIME;
+    }
+}
+
+/*
+** Fold the identity of the given file into the given hash.
+*/
+static void memoHashStat(sqlite3_uint64 *pHash, const struct stat *pStat) {
+    sqlite3_int64 aIdentity[3] = {
+        pStat->st_size, pStat->st_mtim.tv_sec, pStat->st_mtim.tv_nsec};
+    memoHashUpdate(pHash, aIdentity, sizeof(aIdentity));
+}
+
+/*
+** Add the hashes of all entries below the given directory to the given
+** sum, which does not depend on the order of the entries.
+*/
+static void memoHashDirectory(const char *zDirectory, sqlite3_uint64 *pSum) {
+    DIR *pDir = opendir(zDirectory);
+    if (pDir == 0) return;
+
+    struct dirent *pEntry;
+    while ((pEntry = readdir(pDir))) {
+        if (!strcmp(pEntry->d_name, ".") || !strcmp(pEntry->d_name, "..")) continue;
+        char *zPath = sqlite3_mprintf("%s/%s", zDirectory, pEntry->d_name);
+        struct stat st;
+        if (zPath && !lstat(zPath, &st)) {
+            sqlite3_uint64 iHash = MEMO_FNV_OFFSET;
+            memoHashUpdate(&iHash, zPath, strlen(zPath));
+            memoHashStat(&iHash, &st);
+            *pSum += iHash;
+            if (S_ISDIR(st.st_mode)) memoHashDirectory(zPath, pSum);
+        }
+        sqlite3_free(zPath);
+    }
+    closedir(pDir);
+}
+
+/*
+** Fold the identity of the archive or directory at the given path into
+** the given hash.
+*/
+static void memoHashSource(sqlite3_uint64 *pHash, const char *zPath) {
+    struct stat st;
+    memoHashUpdate(pHash, zPath, strlen(zPath) + 1);
+    if (stat(zPath, &st)) {
+        memoHashUpdate(pHash, "missing", 7);
+    } else if (S_ISDIR(st.st_mode)) {
+        sqlite3_uint64 iSum = 0;
+        memoHashDirectory(zPath, &iSum);
+        memoHashUpdate(pHash, &iSum, sizeof(iSum));
+    } else {
+        memoHashStat(pHash, &st);
+    }
+}
+
+/*
+** Return the first argument of the given nadeko() table definition
+** with its quotes removed, or NULL if there is none.
+*/
+static char *memoSourcePath(const char *zSql) {
+    const char *zStart = strchr(zSql, '(');
+    if (zStart == 0) return 0;
+    for (zStart++; *zStart == ' '; zStart++) {
+    }
+    if (*zStart != '\'' && *zStart != '"') return 0;
+    const char *zEnd = strchr(zStart + 1, *zStart);
+    if (zEnd == 0) return 0;
+
+    return sqlite3_mprintf("%.*s", (int)(zEnd - zStart - 1), zStart + 1);
+}
+
+/*
+** Write the given hash as a string of MEMO_HASH_SIZE bytes.
+*/
+static void memoHashFinish(sqlite3_uint64 iHash, char *zOut) {
+    sqlite3_snprintf(MEMO_HASH_SIZE, zOut, "%016llx", iHash);
+}
+
+/*
+** Write the key of the given statement as a string of MEMO_HASH_SIZE
+** bytes.
+*/
+static void memoKey(const char *zSql, char *zOut) {
+    sqlite3_uint64 iHash = MEMO_FNV_OFFSET;
+    memoHashUpdate(&iHash, zSql, strlen(zSql));
+    memoHashFinish(iHash, zOut);
+}
+
+/*
+** Return true if the given name belongs to an internal table, which is
+** never tracked.
+*/
+static int memoIsInternal(const char *zName) {
+    return !sqlite3_strnicmp(zName, "sqlite_", 7) ||
+           !sqlite3_strnicmp(zName, "nadeko_memo", 11);
+}
+
+/*
+** Return true if the given newline terminated list contains the given
+** name of the given length.
+*/
+static int memoListContains(const char *zList, const char *zName, int nName) {
+    for (const char *z = zList; *z;) {
+        const char *zEnd = strchr(z, '\n');
+        if (zEnd - z == nName && !sqlite3_strnicmp(z, zName, nName)) return 1;
+        z = zEnd + 1;
+    }
+
+    return 0;
+}
+
+/*
+** Join all names of the given set which are not internal into a newline
+** terminated list.
+*/
+static char *memoListJoin(const analyze_set *pSet) {
+    sqlite3_str *pStr = sqlite3_str_new(0);
+    for (int n = 0; n < pSet->nName; n++) {
+        if (memoIsInternal(pSet->azName[n])) continue;
+        sqlite3_str_appendf(pStr, "%s\n", pSet->azName[n]);
+    }
+
+    int rc = sqlite3_str_errcode(pStr);
+    char *zList = sqlite3_str_finish(pStr);
+
+    return zList || rc ? zList : sqlite3_mprintf("");
+}
+
+/*
+** Prepare a statement, execute it with the given name bound to its
+** first parameter and return its first result column, or NULL.
+*/
+static char *memoQueryName(sqlite3 *db, const char *zSql, const char *zName, int nName) {
+    sqlite3_stmt *pSelect;
+    char *zResult = 0;
+    if (sqlite3_prepare_v2(db, zSql, -1, &pSelect, 0)) return 0;
+    sqlite3_bind_text(pSelect, 1, zName, nName, SQLITE_STATIC);
+    if (sqlite3_step(pSelect) == SQLITE_ROW && sqlite3_column_text(pSelect, 0)) {
+        zResult = sqlite3_mprintf("%s", sqlite3_column_text(pSelect, 0));
+    }
+    sqlite3_finalize(pSelect);
+
+    return zResult;
+}
+
+/*
+** Compute the hash of the given statement text together with the
+** current identity of all tables of the given list.
+*/
+static void memoHashInputs(
+    sqlite3 *db, const char *zSql, const char *zInputs, char *zOut) {
+    sqlite3_uint64 iHash = MEMO_FNV_OFFSET;
+    memoHashUpdate(&iHash, zSql, strlen(zSql) + 1);
+
+    for (const char *z = zInputs; *z;) {
+        const char *zEnd = strchr(z, '\n');
+        int nName = zEnd - z;
+        memoHashUpdate(&iHash, z, nName + 1);
+
+        char *zVersion = memoQueryName(
+            db, "SELECT hash FROM main.nadeko_memo_version WHERE name = ?", z, nName);
+        char *zDefinition = memoQueryName(db,
+            "SELECT sql FROM main.sqlite_schema WHERE type = 'table' AND name = ? "
+            "AND sql LIKE 'CREATE VIRTUAL TABLE%USING nadeko%'",
+            z,
+            nName);
+        char *zPath = zDefinition ? memoSourcePath(zDefinition) : 0;
+        if (zVersion) memoHashUpdate(&iHash, zVersion, strlen(zVersion));
+        memoHashUpdate(&iHash, "", 1);
+        if (zPath) memoHashSource(&iHash, zPath);
+        sqlite3_free(zVersion);
+        sqlite3_free(zDefinition);
+        sqlite3_free(zPath);
+
+        z = zEnd + 1;
+    }
+    memoHashFinish(iHash, zOut);
+}
+
+/*
+** Return true if the given name of the given length exists in the main
+** schema.
+*/
+static int memoExists(sqlite3 *db, const char *zName, int nName) {
+    char *zFound = memoQueryName(
+        db, "SELECT name FROM main.sqlite_schema WHERE name = ?", zName, nName);
+    sqlite3_free(zFound);
+
+    return zFound != 0;
+}
+
+/*
+** Return true if all objects of the given list exist and have last been
+** written by the statement with the given fingerprint.
+*/
+static int memoIsUpToDate(sqlite3 *db, const char *zOutputs, const char *zHash) {
+    for (const char *z = zOutputs; *z;) {
+        const char *zEnd = strchr(z, '\n');
+        int nName = zEnd - z;
+        char *zVersion = memoQueryName(
+            db, "SELECT hash FROM main.nadeko_memo_version WHERE name = ?", z, nName);
+        int isUpToDate = memoExists(db, z, nName) && zVersion && !strcmp(zVersion, zHash);
+        sqlite3_free(zVersion);
+        if (!isUpToDate) return 0;
+        z = zEnd + 1;
+    }
+
+    return *zOutputs != '\0';
+}
+
+/*
+** Return true if the statement recorded with the given fingerprint
+** would be skipped in the current state.
+*/
+static int memoIsCurrent(sqlite3 *db, const char *zHash) {
+    sqlite3_stmt *pSelect;
+    char zCurrent[MEMO_HASH_SIZE];
+    int result = 0;
+    if (sqlite3_prepare_v2(db,
+            "SELECT sql, inputs, outputs FROM main.nadeko_memo WHERE hash = ?",
+            -1,
+            &pSelect,
+            0)) {
+        return 0;
+    }
+    sqlite3_bind_text(pSelect, 1, zHash, -1, SQLITE_STATIC);
+    if (sqlite3_step(pSelect) == SQLITE_ROW) {
+        memoHashInputs(db,
+            (const char *)(sqlite3_column_text(pSelect, 0)),
+            (const char *)(sqlite3_column_text(pSelect, 1)),
+            zCurrent);
+        result = !strcmp(zCurrent, zHash) &&
+                 memoIsUpToDate(
+                     db, (const char *)(sqlite3_column_text(pSelect, 2)), zHash);
+    }
+    sqlite3_finalize(pSelect);
+
+    return result;
+}
+
+/*
+** Return true if dropping all objects of the given list is redundant,
+** as none of them exists or their last writer would be skipped.
+*/
+static int memoIsDropRedundant(sqlite3 *db, const char *zDrops) {
+    for (const char *z = zDrops; *z;) {
+        const char *zEnd = strchr(z, '\n');
+        int nName = zEnd - z;
+        char *zVersion = memoQueryName(
+            db, "SELECT hash FROM main.nadeko_memo_version WHERE name = ?", z, nName);
+        int isRedundant =
+            !memoExists(db, z, nName) || (zVersion && memoIsCurrent(db, zVersion));
+        sqlite3_free(zVersion);
+        if (!isRedundant) return 0;
+        z = zEnd + 1;
+    }
+
+    return 1;
+}
+
+/*
+** Drop all objects of the given list which exist in the main schema and
+** have been written by a memoized statement.
+*/
+static int memoDropCreated(sqlite3 *db, const char *zCreates, char **pzErr) {
+    int rc = SQLITE_OK;
+    for (const char *z = zCreates; rc == SQLITE_OK && *z;) {
+        const char *zEnd = strchr(z, '\n');
+        int nName = zEnd - z;
+        char *zType = memoQueryName(db,
+            "SELECT type FROM main.sqlite_schema WHERE name = ?1 "
+            "AND name IN (SELECT name FROM main.nadeko_memo_version)",
+            z,
+            nName);
+        if (zType) {
+            rc = nadekoExecPrintf(
+                db, pzErr, "DROP %s IF EXISTS main.\"%.*w\"", zType, nName, z);
+        }
+        sqlite3_free(zType);
+        z = zEnd + 1;
+    }
+
+    return rc;
+}
+
+/*
+** Create the tables holding the memoization state unless they exist.
+*/
+static int memoBegin(sqlite3 *db, char **pzErr) {
+    return sqlite3_exec(db,
+        "CREATE TABLE IF NOT EXISTS main.nadeko_memo(statement TEXT PRIMARY KEY, "
+        "sql TEXT, hash TEXT, inputs TEXT, outputs TEXT, creates TEXT, drops TEXT);"
+        "CREATE TABLE IF NOT EXISTS main.nadeko_memo_version(name TEXT PRIMARY KEY, "
+        "hash TEXT);"
+        "CREATE TEMP TABLE IF NOT EXISTS memo_keep(statement TEXT PRIMARY KEY);",
+        0,
+        0,
+        pzErr);
+}
+
+/*
+** Mark the given statement as part of the script being executed.
+*/
+static int memoKeep(sqlite3 *db, const char *zSql, char **pzErr) {
+    char zKey[MEMO_HASH_SIZE];
+    memoKey(zSql, zKey);
+
+    return nadekoExecPrintf(
+        db, pzErr, "INSERT OR IGNORE INTO temp.memo_keep VALUES (%Q)", zKey);
+}
+
+/*
+** Forget all statements which are not part of the script being
+** executed, so that their outputs are not mistaken as up to date.
+*/
+static int memoPurge(sqlite3 *db, char **pzErr) {
+    return sqlite3_exec(db,
+        "DELETE FROM main.nadeko_memo "
+        "WHERE statement NOT IN (SELECT statement FROM temp.memo_keep);"
+        "DROP TABLE temp.memo_keep;",
+        0,
+        0,
+        pzErr);
+}
+
+/*
+** Release all memory held by the given state.
+*/
+static void memoStateFree(memo_state *pState) {
+    analyzeAccessFree(&pState->access);
+    sqlite3_free(pState->zInputs);
+    sqlite3_free(pState->zOutputs);
+    sqlite3_free(pState->zCreates);
+    sqlite3_free(pState->zDrops);
+    memset(pState, 0, sizeof(*pState));
+}
+
+/*
+** Decide whether the given statement may be skipped.  Otherwise
+** fingerprint its inputs, to be recorded by memoRecord() once it has
+** been executed successfully.  If the objects the statement created when
+** last executed keep it from being prepared, they are dropped first.
+*/
+static int memoPrepare(
+    sqlite3 *db, const char *zSql, memo_state *pState, int *pisSkipped, char **pzErr) {
+    sqlite3_stmt *pSelect;
+    char *zCreated = 0;
+    int rc;
+
+    memoStateFree(pState);
+    pState->zSql = zSql;
+    memoKey(zSql, pState->zKey);
+    *pisSkipped = 0;
+
+    // Check the recorded fingerprint and outputs
+    if ((rc = sqlite3_prepare_v2(db,
+             "SELECT hash, inputs, outputs, creates FROM main.nadeko_memo "
+             "WHERE statement = ?",
+             -1,
+             &pSelect,
+             0))) {
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        return rc;
+    }
+    sqlite3_bind_text(pSelect, 1, pState->zKey, -1, SQLITE_STATIC);
+    if (sqlite3_step(pSelect) == SQLITE_ROW) {
+        const char *zHash = (const char *)(sqlite3_column_text(pSelect, 0));
+        const char *zInputs = (const char *)(sqlite3_column_text(pSelect, 1));
+        const char *zOutputs = (const char *)(sqlite3_column_text(pSelect, 2));
+        memoHashInputs(db, zSql, zInputs, pState->zHash);
+        *pisSkipped =
+            !strcmp(pState->zHash, zHash) && memoIsUpToDate(db, zOutputs, zHash);
+        zCreated = sqlite3_mprintf("%s", sqlite3_column_text(pSelect, 3));
+    }
+    sqlite3_finalize(pSelect);
+
+    // Objects which keep the statement from being prepared are reported
+    // to the authorizer before the failure, unless the statement changed
+    char *zErr = 0;
+    if (!*pisSkipped && analyzeStatement(db, zSql, &pState->access, &zErr)) {
+        char *zFailed = memoListJoin(&pState->access.create);
+        sqlite3_free(zErr);
+        zErr = 0;
+        if (zFailed && (rc = memoDropCreated(db, zFailed, pzErr)) == SQLITE_OK &&
+            (!zCreated || (rc = memoDropCreated(db, zCreated, pzErr)) == SQLITE_OK)) {
+            analyzeStatement(db, zSql, &pState->access, &zErr);
+        }
+        sqlite3_free(zFailed);
+    }
+    sqlite3_free(zCreated);
+
+    // Statements which cannot be analyzed fail to execute as well
+    if (rc || *pisSkipped || zErr) {
+        sqlite3_free(zErr);
+        return rc;
+    }
+
+    analyze_access *pAccess = &pState->access;
+    pState->zInputs = memoListJoin(&pAccess->read);
+    pState->zOutputs = memoListJoin(&pAccess->write);
+    pState->zCreates = memoListJoin(&pAccess->create);
+    pState->zDrops = memoListJoin(&pAccess->drop);
+    if (!pState->zInputs || !pState->zOutputs || !pState->zCreates || !pState->zDrops) {
+        return SQLITE_NOMEM;
+    }
+    memoHashInputs(db, zSql, pState->zInputs, pState->zHash);
+    pState->isAnalyzed = 1;
+
+    // Dropping objects which would be recreated as they are is redundant
+    int isDropOnly = !pAccess->isBarrier && *pState->zOutputs;
+    for (const char *z = pState->zOutputs; *z; z = strchr(z, '\n') + 1) {
+        if (!memoListContains(pState->zDrops, z, strchr(z, '\n') - z)) isDropOnly = 0;
+    }
+    if (isDropOnly && memoIsDropRedundant(db, pState->zDrops)) {
+        *pisSkipped = 1;
+        return SQLITE_OK;
+    }
+
+    pState->isMemoizable =
+        !isDropOnly && !pAccess->isBarrier && pAccess->isWriter && *pState->zOutputs;
+    for (int n = 0; n < pAccess->write.nName; n++) {
+        const char *zName = pAccess->write.azName[n];
+        if (!analyzeSetContains(&pAccess->create, zName) && analyzeIsVirtual(db, zName)) {
+            pState->isMemoizable = 0;
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+/*
+** Record the outcome of a statement which has been prepared by
+** memoPrepare() and executed successfully.
+*/
+static int memoRecord(sqlite3 *db, memo_state *pState, char **pzErr) {
+    char zVersion[MEMO_HASH_SIZE];
+    sqlite3_uint64 iRandom;
+    int rc = SQLITE_OK;
+    if (!pState->isAnalyzed) return SQLITE_OK;
+
+    // Outputs of statements which cannot be memoized change every time
+    if (pState->isMemoizable) {
+        memcpy(zVersion, pState->zHash, MEMO_HASH_SIZE);
+    } else {
+        sqlite3_randomness(sizeof(iRandom), &iRandom);
+        memoHashFinish(iRandom, zVersion);
+    }
+
+    for (const char *z = pState->zOutputs; rc == SQLITE_OK && *z;) {
+        const char *zEnd = strchr(z, '\n');
+        int nName = zEnd - z;
+        if (memoListContains(pState->zDrops, z, nName)) {
+            rc = nadekoExecPrintf(db,
+                pzErr,
+                "DELETE FROM main.nadeko_memo_version WHERE name = '%.*q'",
+                nName,
+                z);
+        } else {
+            rc = nadekoExecPrintf(db,
+                pzErr,
+                "INSERT OR REPLACE INTO main.nadeko_memo_version VALUES ('%.*q', %Q)",
+                nName,
+                z,
+                zVersion);
+        }
+        z = zEnd + 1;
+    }
+
+    if (rc == SQLITE_OK && pState->isMemoizable) {
+        rc = nadekoExecPrintf(db,
+            pzErr,
+            "INSERT OR REPLACE INTO main.nadeko_memo VALUES (%Q, %Q, %Q, %Q, %Q, %Q, %Q)",
+            pState->zKey,
+            pState->zSql,
+            pState->zHash,
+            pState->zInputs,
+            pState->zOutputs,
+            pState->zCreates,
+            pState->zDrops);
+    }
+
+    return rc;
+}
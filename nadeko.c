@@ -4,18 +4,31 @@
 ** contents of files stored in the associated archive or directory as
 ** values of the "filename" and "contents" column respectively.
 ** Support for each archive format or filesystem access is determined
-** by the support of BSD libarchive for the given format or OS.
-** Filesystems only support read access.  Usage example:
+** by the support of BSD libarchive for the given format or OS.  The
+** nadeko_grep, nadeko_diff, nadeko_catalog, nadeko_extract and
+** nadeko_convert tables build on it, each described together with its
+** module below.  Usage example:
 **
 **     CREATE VIRTUAL TABLE archive USING nadeko('./example.tar');
 **     SELECT filename, contents FROM archive;
 **     INSERT OR REPLACE INTO archive(filename, contents)
 **     VALUES ('example.txt', 'Domine, quo vadis?');
 */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #ifndef SQLITEINT_H
 #include <sqlite3ext.h>
 #endif
@@ -24,6 +37,37 @@ SQLITE_EXTENSION_INIT1
 #include <archive_entry.h>
 
 #define NADEKO_BUFFER_SIZE (1 << 16)
+#define NADEKO_TOKENIZER "unicode61"
+#define NADEKO_TEXT_SQL \
+    "CASE WHEN instr(substr(contents, 1, 8192), x'00') THEN NULL ELSE contents END"
+#define NADEKO_TRIGRAM_COUNT (1 << 24)
+#define NADEKO_TRIGRAM_MAX 20000
+#define NADEKO_TRIGRAM_ANY (-1)
+#define NADEKO_GREP_TRIGRAMS 32
+#define NADEKO_CHUNK_MIN (1 << 11)
+#define NADEKO_CHUNK_AVG (1 << 13)
+#define NADEKO_CHUNK_MAX (1 << 16)
+#define NADEKO_CHUNK_MASK_SMALL (~(sqlite3_uint64)(0) << (64 - 15))
+#define NADEKO_CHUNK_MASK_LARGE (~(sqlite3_uint64)(0) << (64 - 11))
+#define NADEKO_HASH_INIT ((sqlite3_int64)(14695981039346656037ull))
+#define NADEKO_BLOOM_BITS 10
+#define NADEKO_BLOOM_HASHES 7
+#define NADEKO_THREADS 16
+#define NADEKO_ZIP_BUFFER (1 << 26)
+#define NADEKO_SAMPLE_SIZE (3 * 4096)
+#define NADEKO_STORE_ENTROPY 7.5
+#define NADEKO_STORE_SHARE 0.9
+#define NADEKO_EXTRACT_BUFFER (1 << 26)
+#define NADEKO_CONVERT_BUFFER (1 << 24)
+
+#ifndef TIMELINE_BEGIN
+#define TIMELINE_BEGIN(zCat, zName, zDetail)
+#define TIMELINE_END(zCat, zName)
+#endif
+#ifndef PROGRESS_ENTRY
+#define PROGRESS_ENTRY(zName)
+#define PROGRESS_BYTES(nByte)
+#endif
 
 /*
 ** Test if the given filename points at a directory using
@@ -110,6 +154,18 @@ static char *nadekoUnquote(const char *zString) {
     return result;
 }
 
+/*
+** Return a 32-bit FNV-1a hash of the given path.
+*/
+static unsigned int nadekoHashPath(const char *zPath) {
+    unsigned int iHash = 2166136261u;
+    for (; *zPath; zPath++) {
+        iHash = (iHash ^ (unsigned char)(*zPath)) * 16777619u;
+    }
+
+    return iHash;
+}
+
 /*
 ** Copied verbatim from fts5ExecPrintf() in fts5_storage.c.
 */
@@ -158,6 +214,7 @@ static int nadekoFillBlobFromArchive(struct archive *a, sqlite3 *db, const char
                 return rc;
             }
             iOffset += iRead;
+            PROGRESS_BYTES(iRead);
         }
     }
 }
@@ -191,6 +248,19 @@ struct nadeko_vtab {
     int isFilesystem;
     sqlite3_int64 iKnown;
     sqlite3_int64 iBegun;
+    sqlite3_int64 iEntry; /* Number of entries seen, including other shards */
+    int iShard;           /* Shard of the entries to return */
+    int nShard;           /* Number of shards, zero if not sharded */
+    char *zIndex;         /* Full-text index of the store, NULL if none */
+    char *zTokenizer;     /* Tokenizer of the full-text index */
+    char *zTrigram;       /* Trigram index of the store, NULL if none */
+    unsigned char *aTrigramBit; /* Trigrams seen in the current member */
+    int *aTrigram;              /* Distinct trigrams of the current member */
+    char *zChunks;              /* Chunks of the stored files, NULL if unchunked */
+    char **azPending;           /* Members of a directory changed by the transaction */
+    int nPending;               /* Number of entries in azPending */
+    int nPendingAlloc;          /* Allocated size of azPending */
+    unsigned char *aRemove;     /* True for each pending member to remove on commit */
     char *zFilename;
     char *zTempname;
     char *zDb;
@@ -224,10 +294,50 @@ static int nadekoDisconnect(sqlite3_vtab *pVtab) {
     sqlite3_free(pNdk->zTempname);
     sqlite3_free(pNdk->zDb);
     sqlite3_free(pNdk->zTable);
+    sqlite3_free(pNdk->zIndex);
+    sqlite3_free(pNdk->zTokenizer);
+    sqlite3_free(pNdk->zTrigram);
+    sqlite3_free(pNdk->aTrigramBit);
+    sqlite3_free(pNdk->zChunks);
+    for (int n = 0; n < pNdk->nPending; n++) sqlite3_free(pNdk->azPending[n]);
+    sqlite3_free(pNdk->azPending);
+    sqlite3_free(pNdk->aRemove);
     sqlite3_free(pVtab);
     return SQLITE_OK;
 }
 
+/*
+** Apply the given option argument of the form 'shard=k/n', 'fts',
+** 'fts=tokenizer', 'trigram' or 'chunked' to the given table.
+*/
+static int nadekoParseOption(nadeko_vtab *pNdk, const char *zArg, const char *zName) {
+    char *zOption = nadekoUnquote(zArg);
+    char cEnd = 0;
+    int rc = SQLITE_ERROR;
+    if (zOption == 0) {
+        rc = SQLITE_ERROR;
+    } else if (!strncmp(zOption, "shard=", 6)) {
+        rc = sscanf(zOption, "shard=%d/%d%c", &pNdk->iShard, &pNdk->nShard, &cEnd) == 2 &&
+                     pNdk->nShard > 0 && pNdk->iShard >= 0 && pNdk->iShard < pNdk->nShard
+                 ? SQLITE_OK
+                 : SQLITE_ERROR;
+    } else if (!strcmp(zOption, "fts") || !strncmp(zOption, "fts=", 4)) {
+        pNdk->zIndex = sqlite3_mprintf("%s_fts", zName);
+        pNdk->zTokenizer =
+            sqlite3_mprintf("%s", zOption[3] ? zOption + 4 : NADEKO_TOKENIZER);
+        rc = pNdk->zIndex && pNdk->zTokenizer ? SQLITE_OK : SQLITE_NOMEM;
+    } else if (!strcmp(zOption, "trigram")) {
+        pNdk->zTrigram = sqlite3_mprintf("%s_trigram", zName);
+        rc = pNdk->zTrigram ? SQLITE_OK : SQLITE_NOMEM;
+    } else if (!strcmp(zOption, "chunked")) {
+        pNdk->zChunks = sqlite3_mprintf("%s_chunks", zName);
+        rc = pNdk->zChunks ? SQLITE_OK : SQLITE_NOMEM;
+    }
+    sqlite3_free(zOption);
+
+    return rc;
+}
+
 /*
 ** The nadekoConnect() method is invoked to create a new
 ** template virtual table.
@@ -255,11 +365,23 @@ static int nadekoConnect(sqlite3 *db, void *pAuxUnused, int argc, const char *co
     pNew->zTable = sqlite3_mprintf("%s_store", argv[2]);
     *ppVtab = (sqlite3_vtab *)pNew;
 
-    if (argc != 4) {
+    if (argc < 4) {
         nadekoDisconnect(&pNew->base);
         *pzErr = sqlite3_mprintf("wrong number of arguments to nadeko()");
         return SQLITE_ERROR;
     }
+    for (int n = 4; n < argc; n++) {
+        if (nadekoParseOption(pNew, argv[n], argv[2])) {
+            nadekoDisconnect(&pNew->base);
+            *pzErr = sqlite3_mprintf("unknown option to nadeko() %s", argv[n]);
+            return SQLITE_ERROR;
+        }
+    }
+    if (pNew->zChunks && (pNew->zIndex || pNew->zTrigram)) {
+        nadekoDisconnect(&pNew->base);
+        *pzErr = sqlite3_mprintf("chunked tables do not support fts or trigram indexes");
+        return SQLITE_ERROR;
+    }
     if ((pNew->zFilename = nadekoUnquote(argv[3])) == 0) {
         nadekoDisconnect(&pNew->base);
         *pzErr = sqlite3_mprintf("first argument to nadeko() not a string");
@@ -268,16 +390,16 @@ static int nadekoConnect(sqlite3 *db, void *pAuxUnused, int argc, const char *co
     if (!(pNew->zTempname = tmpnam(sqlite3_malloc(L_tmpnam * sizeof(char))))) {
         return SQLITE_NOMEM;
     }
+    TIMELINE_BEGIN("nadeko", "open", pNew->zFilename);
     if ((pNew->isFilesystem = nadekoIsDirectory(pNew->zFilename))) {
-        if ((rc = nadekoOpenDirectory(&pNew->pArchive, pNew->zFilename, pzErr))) {
-            nadekoDisconnect(&pNew->base);
-            return SQLITE_ERROR;
-        }
+        rc = nadekoOpenDirectory(&pNew->pArchive, pNew->zFilename, pzErr);
     } else {
-        if ((rc = nadekoOpenArchive(&pNew->pArchive, pNew->zFilename, pzErr))) {
-            nadekoDisconnect(&pNew->base);
-            return SQLITE_ERROR;
-        }
+        rc = nadekoOpenArchive(&pNew->pArchive, pNew->zFilename, pzErr);
+    }
+    TIMELINE_END("nadeko", "open");
+    if (rc) {
+        nadekoDisconnect(&pNew->base);
+        return SQLITE_ERROR;
     }
 
     /* For convenience, define symbolic names for the index to each column. */
@@ -300,8 +422,60 @@ static int nadekoCreate(sqlite3 *db, void *pAux, int argc, const char *const *ar
         ")",
         argv[1],
         argv[2]);
+    if (rc || (rc = nadekoConnect(db, pAux, argc, argv, ppVtab, pzErr))) return rc;
+
+    // The full-text index reads indexed documents from the store, while the
+    // trigram index maps trigrams to the rowids of stored members and chunks
+    // are shared by all chunked tables of the database
+    nadeko_vtab *pNdk = (nadeko_vtab *)(*ppVtab);
+    if (pNdk->zIndex && (rc = nadekoExecPrintf(db,
+                             pzErr,
+                             "CREATE VIRTUAL TABLE IF NOT EXISTS %s.%s USING fts5("
+                             "filename, contents, content=%Q, content_rowid='rowid', "
+                             "tokenize=%Q)",
+                             pNdk->zDb,
+                             pNdk->zIndex,
+                             pNdk->zTable,
+                             pNdk->zTokenizer))) {
+        nadekoDisconnect(*ppVtab);
+        *ppVtab = 0;
+    } else if (pNdk->zTrigram && (rc = nadekoExecPrintf(db,
+                                      pzErr,
+                                      "CREATE TABLE IF NOT EXISTS %s.%s ("
+                                      "  trigram INTEGER,"
+                                      "  member INTEGER,"
+                                      "  PRIMARY KEY (trigram, member)"
+                                      ") WITHOUT ROWID",
+                                      pNdk->zDb,
+                                      pNdk->zTrigram))) {
+        nadekoDisconnect(*ppVtab);
+        *ppVtab = 0;
+    } else if (pNdk->zChunks && (rc = nadekoExecPrintf(db,
+                                     pzErr,
+                                     "CREATE TABLE IF NOT EXISTS %s.nadeko_chunk ("
+                                     "  id INTEGER PRIMARY KEY,"
+                                     "  hash INTEGER,"
+                                     "  size INTEGER,"
+                                     "  refs INTEGER,"
+                                     "  data BLOB"
+                                     ");"
+                                     "CREATE INDEX IF NOT EXISTS %s.nadeko_chunk_hash "
+                                     "ON nadeko_chunk (hash);"
+                                     "CREATE TABLE IF NOT EXISTS %s.%s ("
+                                     "  member INTEGER,"
+                                     "  seq INTEGER,"
+                                     "  chunk INTEGER,"
+                                     "  PRIMARY KEY (member, seq)"
+                                     ") WITHOUT ROWID",
+                                     pNdk->zDb,
+                                     pNdk->zDb,
+                                     pNdk->zDb,
+                                     pNdk->zChunks))) {
+        nadekoDisconnect(*ppVtab);
+        *ppVtab = 0;
+    }
 
-    return rc || nadekoConnect(db, pAux, argc, argv, ppVtab, pzErr);
+    return rc;
 }
 
 /*
@@ -310,7 +484,33 @@ static int nadekoCreate(sqlite3 *db, void *pAux, int argc, const char *const *ar
 */
 static int nadekoDestroy(sqlite3_vtab *pVtab) {
     nadeko_vtab *pNdk = (nadeko_vtab *)(pVtab);
-    int rc = nadekoExecPrintf(pNdk->db, 0, "DROP TABLE %s.%s", pNdk->zDb, pNdk->zTable);
+    int rc = SQLITE_OK;
+    if (pNdk->zIndex) {
+        rc = nadekoExecPrintf(
+            pNdk->db, 0, "DROP TABLE IF EXISTS %s.%s", pNdk->zDb, pNdk->zIndex);
+    }
+    if (rc == SQLITE_OK && pNdk->zTrigram) {
+        rc = nadekoExecPrintf(
+            pNdk->db, 0, "DROP TABLE IF EXISTS %s.%s", pNdk->zDb, pNdk->zTrigram);
+    }
+    if (rc == SQLITE_OK && pNdk->zChunks) {
+        rc = nadekoExecPrintf(pNdk->db,
+            0,
+            "UPDATE %s.nadeko_chunk SET refs = refs - "
+            "(SELECT count(*) FROM %s.%s WHERE chunk = id) "
+            "WHERE id IN (SELECT chunk FROM %s.%s);"
+            "DELETE FROM %s.nadeko_chunk WHERE refs <= 0;"
+            "DROP TABLE IF EXISTS %s.%s",
+            pNdk->zDb,
+            pNdk->zDb,
+            pNdk->zChunks,
+            pNdk->zDb,
+            pNdk->zChunks,
+            pNdk->zDb,
+            pNdk->zDb,
+            pNdk->zChunks);
+    }
+    rc = rc || nadekoExecPrintf(pNdk->db, 0, "DROP TABLE %s.%s", pNdk->zDb, pNdk->zTable);
     return rc || nadekoDisconnect(pVtab);
 }
 
@@ -361,6 +561,559 @@ static int nadekoClose(sqlite3_vtab_cursor *pVtabCur) {
     return SQLITE_OK;
 }
 
+/* nadeko_chunker splits the contents of a single member into chunks
+** stored in the shared chunk table of the database
+*/
+typedef struct nadeko_chunker nadeko_chunker;
+struct nadeko_chunker {
+    sqlite3_stmt *pFind;                     /* Find a chunk by hash and size */
+    sqlite3_stmt *pAdd;                      /* Add a new chunk */
+    sqlite3_stmt *pRef;                      /* Reference an existing chunk */
+    sqlite3_stmt *pLink;                     /* Append a chunk to the member */
+    sqlite3_int64 iMember;                   /* Rowid of the member */
+    int iSeq;                                /* Number of chunks so far */
+    int nBuf;                                /* Bytes pending in aBuf */
+    unsigned char aBuf[2 * NADEKO_CHUNK_MAX]; /* Contents not yet chunked */
+};
+
+static sqlite3_uint64 aNadekoGear[256];
+
+/*
+** Fill the table of random values used by the rolling hash of
+** nadekoChunkCut(), which must be identical across runs and hosts.
+*/
+static void nadekoChunkInitGear(void) {
+    sqlite3_uint64 iState = 0;
+    for (int n = 0; n < 256; n++) {
+        sqlite3_uint64 iValue = (iState += 0x9e3779b97f4a7c15ull);
+        iValue = (iValue ^ (iValue >> 30)) * 0xbf58476d1ce4e5b9ull;
+        iValue = (iValue ^ (iValue >> 27)) * 0x94d049bb133111ebull;
+        aNadekoGear[n] = iValue ^ (iValue >> 31);
+    }
+}
+
+/*
+** Return the length of the chunk at the start of the given data, using
+** the normalized content-defined chunking of FastCDC.  Cut points only
+** depend on the preceding 64 bytes, so that inserting or appending data
+** leaves the other chunks of a member unchanged.
+*/
+static int nadekoChunkCut(const unsigned char *aData, int nData) {
+    if (nData <= NADEKO_CHUNK_MIN) return nData;
+    if (nData > NADEKO_CHUNK_MAX) nData = NADEKO_CHUNK_MAX;
+    int nNormal = nData < NADEKO_CHUNK_AVG ? nData : NADEKO_CHUNK_AVG;
+
+    sqlite3_uint64 iHash = 0;
+    int n = NADEKO_CHUNK_MIN;
+    for (; n < nNormal; n++) {
+        iHash = (iHash << 1) + aNadekoGear[aData[n]];
+        if (!(iHash & NADEKO_CHUNK_MASK_SMALL)) return n;
+    }
+    for (; n < nData; n++) {
+        iHash = (iHash << 1) + aNadekoGear[aData[n]];
+        if (!(iHash & NADEKO_CHUNK_MASK_LARGE)) return n;
+    }
+
+    return nData;
+}
+
+/*
+** Continue the 64-bit FNV-1a hash with the given state, which starts out
+** as NADEKO_HASH_INIT, over the given data.
+*/
+static sqlite3_int64 nadekoHash(sqlite3_int64 iState, const void *pData, int nData) {
+    const unsigned char *aData = pData;
+    sqlite3_uint64 iHash = (sqlite3_uint64)(iState);
+    for (int n = 0; n < nData; n++) {
+        iHash = (iHash ^ aData[n]) * 1099511628211ull;
+    }
+
+    return (sqlite3_int64)(iHash);
+}
+
+/*
+** Prepare the given chunker for the contents of the member with the
+** given rowid.  The chunker must be released with nadekoChunkEnd().
+*/
+static int nadekoChunkBegin(nadeko_chunker *p, nadeko_vtab *pNdk, sqlite3_int64 iMember) {
+    char *azSql[4];
+    azSql[0] = sqlite3_mprintf(
+        "SELECT id, data FROM %s.nadeko_chunk WHERE hash = ? AND size = ?", pNdk->zDb);
+    azSql[1] = sqlite3_mprintf(
+        "INSERT INTO %s.nadeko_chunk (hash, size, refs, data) VALUES (?, ?, 1, ?)",
+        pNdk->zDb);
+    azSql[2] = sqlite3_mprintf(
+        "UPDATE %s.nadeko_chunk SET refs = refs + 1 WHERE id = ?", pNdk->zDb);
+    azSql[3] = sqlite3_mprintf("INSERT INTO %s.%s (member, seq, chunk) VALUES (?, ?, ?)",
+        pNdk->zDb,
+        pNdk->zChunks);
+
+    int rc = SQLITE_OK;
+    sqlite3_stmt **apStmt[4] = {&p->pFind, &p->pAdd, &p->pRef, &p->pLink};
+    for (int n = 0; n < 4; n++) {
+        *apStmt[n] = 0;
+        if (rc == SQLITE_OK) {
+            rc = azSql[n] ? sqlite3_prepare_v2(pNdk->db, azSql[n], -1, apStmt[n], 0)
+                          : SQLITE_NOMEM;
+        }
+        sqlite3_free(azSql[n]);
+    }
+    p->iMember = iMember;
+    p->iSeq = 0;
+    p->nBuf = 0;
+
+    return rc;
+}
+
+/*
+** Store the given chunk unless an identical one is already stored, and
+** append it to the chunks of the member.
+*/
+static int nadekoChunkStore(nadeko_chunker *p, const unsigned char *aData, int nData) {
+    sqlite3_int64 iChunk = 0;
+    sqlite3_bind_int64(p->pFind, 1, nadekoHash(NADEKO_HASH_INIT, aData, nData));
+    sqlite3_bind_int(p->pFind, 2, nData);
+    while (iChunk == 0 && sqlite3_step(p->pFind) == SQLITE_ROW) {
+        if (!memcmp(sqlite3_column_blob(p->pFind, 1), aData, nData)) {
+            iChunk = sqlite3_column_int64(p->pFind, 0);
+        }
+    }
+    sqlite3_reset(p->pFind);
+
+    sqlite3_stmt *pWrite = iChunk ? p->pRef : p->pAdd;
+    if (iChunk) {
+        sqlite3_bind_int64(pWrite, 1, iChunk);
+    } else {
+        sqlite3_bind_int64(pWrite, 1, nadekoHash(NADEKO_HASH_INIT, aData, nData));
+        sqlite3_bind_int(pWrite, 2, nData);
+        sqlite3_bind_blob(pWrite, 3, aData, nData, SQLITE_STATIC);
+    }
+    int rc = sqlite3_step(pWrite);
+    sqlite3_reset(pWrite);
+    if (rc != SQLITE_DONE) return sqlite3_errcode(sqlite3_db_handle(pWrite));
+    if (iChunk == 0) iChunk = sqlite3_last_insert_rowid(sqlite3_db_handle(pWrite));
+
+    sqlite3_bind_int64(p->pLink, 1, p->iMember);
+    sqlite3_bind_int(p->pLink, 2, p->iSeq++);
+    sqlite3_bind_int64(p->pLink, 3, iChunk);
+    rc = sqlite3_step(p->pLink);
+    sqlite3_reset(p->pLink);
+    if (rc != SQLITE_DONE) return sqlite3_errcode(sqlite3_db_handle(p->pLink));
+
+    return SQLITE_OK;
+}
+
+/*
+** Split the pending contents of the given chunker into chunks as long
+** as at least nKeep bytes remain pending, which must be positive unless
+** all contents were written.
+*/
+static int nadekoChunkFlush(nadeko_chunker *p, int nKeep) {
+    int iOffset = 0;
+    int rc = SQLITE_OK;
+    while (rc == SQLITE_OK && p->nBuf - iOffset > 0 && p->nBuf - iOffset >= nKeep) {
+        int nChunk = nadekoChunkCut(p->aBuf + iOffset, p->nBuf - iOffset);
+        rc = nadekoChunkStore(p, p->aBuf + iOffset, nChunk);
+        iOffset += nChunk;
+    }
+    memmove(p->aBuf, p->aBuf + iOffset, p->nBuf - iOffset);
+    p->nBuf -= iOffset;
+
+    return rc;
+}
+
+/*
+** Add the given data to the contents of the member of the chunker.
+*/
+static int nadekoChunkWrite(nadeko_chunker *p, const void *pData, int nData) {
+    const unsigned char *aData = pData;
+    int rc = SQLITE_OK;
+    while (rc == SQLITE_OK && nData > 0) {
+        int nCopy = (int)(sizeof(p->aBuf)) - p->nBuf;
+        if (nCopy > nData) nCopy = nData;
+        memcpy(p->aBuf + p->nBuf, aData, nCopy);
+        p->nBuf += nCopy;
+        aData += nCopy;
+        nData -= nCopy;
+        rc = nadekoChunkFlush(p, NADEKO_CHUNK_MAX);
+    }
+
+    return rc;
+}
+
+/*
+** Chunk the remaining contents of the given chunker, unless rc is an
+** error code, and release it.
+*/
+static int nadekoChunkEnd(nadeko_chunker *p, int rc) {
+    if (rc == SQLITE_OK) rc = nadekoChunkFlush(p, 0);
+    sqlite3_finalize(p->pFind);
+    sqlite3_finalize(p->pAdd);
+    sqlite3_finalize(p->pRef);
+    sqlite3_finalize(p->pLink);
+
+    return rc;
+}
+
+/*
+** Chunk the contents of the current entry of the given archive into
+** the member with the given rowid.  Unless a statement writing to the
+** database is in progress, the chunks of a member are written within a
+** savepoint, as scans would otherwise commit every chunk on its own.
+*/
+static int nadekoFillChunksFromArchive(
+    struct archive *a, nadeko_vtab *pNdk, sqlite3_int64 iMember) {
+    nadeko_chunker *p = sqlite3_malloc(sizeof(*p));
+    if (p == 0) return SQLITE_NOMEM;
+
+    int isSavepoint = !nadekoExecPrintf(pNdk->db, 0, "SAVEPOINT nadeko_chunk");
+    int rc = nadekoChunkBegin(p, pNdk, iMember);
+    while (rc == SQLITE_OK) {
+        char aBuf[NADEKO_BUFFER_SIZE];
+        int iRead = archive_read_data(a, aBuf, NADEKO_BUFFER_SIZE);
+        if (iRead <= 0) {
+            rc = iRead ? SQLITE_ERROR : SQLITE_OK;
+            break;
+        }
+        rc = nadekoChunkWrite(p, aBuf, iRead);
+        PROGRESS_BYTES(iRead);
+    }
+    rc = nadekoChunkEnd(p, rc);
+    sqlite3_free(p);
+    if (isSavepoint && rc) nadekoExecPrintf(pNdk->db, 0, "ROLLBACK TO nadeko_chunk");
+    if (isSavepoint) nadekoExecPrintf(pNdk->db, 0, "RELEASE nadeko_chunk");
+
+    return rc;
+}
+
+/*
+** Chunk the given value into the member with the given rowid.
+*/
+static int nadekoFillChunksFromValue(
+    nadeko_vtab *pNdk, sqlite3_int64 iMember, sqlite3_value *pValue) {
+    nadeko_chunker *p = sqlite3_malloc(sizeof(*p));
+    if (p == 0) return SQLITE_NOMEM;
+
+    int rc = nadekoChunkBegin(p, pNdk, iMember);
+    if (rc == SQLITE_OK) {
+        rc = nadekoChunkWrite(p, sqlite3_value_blob(pValue), sqlite3_value_bytes(pValue));
+    }
+    rc = nadekoChunkEnd(p, rc);
+    sqlite3_free(p);
+
+    return rc;
+}
+
+/*
+** Prepare a statement selecting the chunks of the member with the given
+** rowid in order.
+*/
+static int nadekoChunkSelect(
+    nadeko_vtab *pNdk, sqlite3_int64 iMember, sqlite3_stmt **ppStmt) {
+    char *zSel = sqlite3_mprintf("SELECT c.data FROM %s.%s AS m, %s.nadeko_chunk AS c "
+                                 "WHERE m.member = %lld AND c.id = m.chunk "
+                                 "ORDER BY m.seq",
+        pNdk->zDb,
+        pNdk->zChunks,
+        pNdk->zDb,
+        iMember);
+    int rc = zSel ? sqlite3_prepare_v2(pNdk->db, zSel, -1, ppStmt, 0) : SQLITE_NOMEM;
+    sqlite3_free(zSel);
+
+    return rc;
+}
+
+/*
+** Return the size of the chunked member with the given rowid.
+*/
+static sqlite3_int64 nadekoChunkSize(nadeko_vtab *pNdk, sqlite3_int64 iMember) {
+    sqlite3_stmt *pSize;
+    sqlite3_int64 nSize = 0;
+    char *zSel = sqlite3_mprintf("SELECT sum(c.size) "
+                                 "FROM %s.%s AS m, %s.nadeko_chunk AS c "
+                                 "WHERE m.member = %lld AND c.id = m.chunk",
+        pNdk->zDb,
+        pNdk->zChunks,
+        pNdk->zDb,
+        iMember);
+    if (zSel && sqlite3_prepare_v2(pNdk->db, zSel, -1, &pSize, 0) == SQLITE_OK) {
+        if (sqlite3_step(pSize) == SQLITE_ROW) nSize = sqlite3_column_int64(pSize, 0);
+        sqlite3_finalize(pSize);
+    }
+    sqlite3_free(zSel);
+
+    return nSize;
+}
+
+/*
+** Reassemble the chunked member with the given rowid into a buffer
+** obtained from sqlite3_malloc64().
+*/
+static int nadekoChunkRead(nadeko_vtab *pNdk,
+    sqlite3_int64 iMember,
+    unsigned char **paData,
+    sqlite3_int64 *pnData) {
+    sqlite3_int64 nSize = nadekoChunkSize(pNdk, iMember);
+    unsigned char *aData = sqlite3_malloc64(nSize ? nSize : 1);
+    sqlite3_stmt *pSelect = 0;
+    if (aData == 0) return SQLITE_NOMEM;
+
+    sqlite3_int64 iOffset = 0;
+    int rc = nadekoChunkSelect(pNdk, iMember, &pSelect);
+    while (rc == SQLITE_OK && sqlite3_step(pSelect) == SQLITE_ROW) {
+        int nChunk = sqlite3_column_bytes(pSelect, 0);
+        if (iOffset + nChunk > nSize) break;
+        memcpy(aData + iOffset, sqlite3_column_blob(pSelect, 0), nChunk);
+        iOffset += nChunk;
+    }
+    if (sqlite3_finalize(pSelect) && rc == SQLITE_OK) rc = sqlite3_errcode(pNdk->db);
+    if (rc) {
+        sqlite3_free(aData);
+        return rc;
+    }
+    *paData = aData;
+    *pnData = iOffset;
+
+    return SQLITE_OK;
+}
+
+/*
+** Reassemble the chunked member with the given rowid as the result of
+** the given context.
+*/
+static int nadekoChunkResult(
+    nadeko_vtab *pNdk, sqlite3_int64 iMember, sqlite3_context *pCtx) {
+    unsigned char *aData;
+    sqlite3_int64 nData;
+    int rc = nadekoChunkRead(pNdk, iMember, &aData, &nData);
+    if (rc == SQLITE_OK) sqlite3_result_blob64(pCtx, aData, nData, sqlite3_free);
+
+    return rc;
+}
+
+/*
+** Write the chunks of the member with the given rowid to the given
+** archive handle.
+*/
+static int nadekoFillArchiveFromChunks(
+    struct archive *a, nadeko_vtab *pNdk, sqlite3_int64 iMember) {
+    sqlite3_stmt *pSelect = 0;
+    int rc = nadekoChunkSelect(pNdk, iMember, &pSelect);
+    while (rc == SQLITE_OK && sqlite3_step(pSelect) == SQLITE_ROW) {
+        if (archive_write_data(a,
+                sqlite3_column_blob(pSelect, 0),
+                sqlite3_column_bytes(pSelect, 0)) == -1) {
+            rc = SQLITE_ERROR;
+        }
+    }
+    if (sqlite3_finalize(pSelect) && rc == SQLITE_OK) rc = SQLITE_ERROR;
+
+    return rc;
+}
+
+/*
+** Release the chunks of the member with the given rowid, removing those
+** no longer referenced by any member of any table.
+*/
+static int nadekoChunkRelease(nadeko_vtab *pNdk, sqlite3_int64 iMember) {
+    return nadekoExecPrintf(pNdk->db,
+        0,
+        "UPDATE %s.nadeko_chunk SET refs = refs - "
+        "(SELECT count(*) FROM %s.%s WHERE member = %lld AND chunk = id) "
+        "WHERE id IN (SELECT chunk FROM %s.%s WHERE member = %lld);"
+        "DELETE FROM %s.nadeko_chunk WHERE refs <= 0 "
+        "AND id IN (SELECT chunk FROM %s.%s WHERE member = %lld);"
+        "DELETE FROM %s.%s WHERE member = %lld",
+        pNdk->zDb,
+        pNdk->zDb,
+        pNdk->zChunks,
+        iMember,
+        pNdk->zDb,
+        pNdk->zChunks,
+        iMember,
+        pNdk->zDb,
+        pNdk->zDb,
+        pNdk->zChunks,
+        iMember,
+        pNdk->zDb,
+        pNdk->zChunks,
+        iMember);
+}
+
+/*
+** Add the distinct trigrams of the contents stored at the given rowid to
+** the trigram index of the given table, or remove them if isDelete is
+** true.  Members with more than NADEKO_TRIGRAM_MAX distinct trigrams,
+** which are mostly compressed or random data, are recorded with the
+** single trigram NADEKO_TRIGRAM_ANY instead and never ruled out.
+*/
+static int nadekoTrigramUpdate(nadeko_vtab *pNdk, sqlite3_int64 iRowid, int isDelete) {
+    if (pNdk->aTrigramBit == 0) {
+        int nBit = NADEKO_TRIGRAM_COUNT / 8;
+        pNdk->aTrigramBit = sqlite3_malloc(nBit + (NADEKO_TRIGRAM_MAX + 1) * sizeof(int));
+        if (pNdk->aTrigramBit == 0) return SQLITE_NOMEM;
+        memset(pNdk->aTrigramBit, 0, nBit);
+        pNdk->aTrigram = (int *)(pNdk->aTrigramBit + nBit);
+    }
+
+    // Rows without contents have no trigrams
+    sqlite3_blob *pBlob;
+    if (sqlite3_blob_open(
+            pNdk->db, pNdk->zDb, pNdk->zTable, "contents", iRowid, 0, &pBlob)) {
+        return SQLITE_OK;
+    }
+
+    int rc = SQLITE_OK;
+    int nTrigram = 0;
+    int nBlob = sqlite3_blob_bytes(pBlob);
+    unsigned int iTrigram = 0;
+    unsigned char *aBit = pNdk->aTrigramBit;
+    for (int iOffset = 0; iOffset < nBlob && nTrigram <= NADEKO_TRIGRAM_MAX;
+         iOffset += NADEKO_BUFFER_SIZE) {
+        unsigned char aBuf[NADEKO_BUFFER_SIZE];
+        int nRead = nBlob - iOffset < NADEKO_BUFFER_SIZE ? nBlob - iOffset
+                                                         : NADEKO_BUFFER_SIZE;
+        if ((rc = sqlite3_blob_read(pBlob, aBuf, nRead, iOffset))) break;
+        for (int n = 0; n < nRead && nTrigram <= NADEKO_TRIGRAM_MAX; n++) {
+            iTrigram = ((iTrigram << 8) | aBuf[n]) % NADEKO_TRIGRAM_COUNT;
+            if (iOffset + n < 2 || aBit[iTrigram / 8] & (1 << (iTrigram % 8))) continue;
+            aBit[iTrigram / 8] |= 1 << (iTrigram % 8);
+            pNdk->aTrigram[nTrigram++] = iTrigram;
+        }
+    }
+    sqlite3_blob_close(pBlob);
+    for (int n = 0; n < nTrigram; n++) {
+        aBit[pNdk->aTrigram[n] / 8] = 0;
+    }
+    if (rc) return rc;
+    if (nTrigram > NADEKO_TRIGRAM_MAX) {
+        pNdk->aTrigram[0] = NADEKO_TRIGRAM_ANY;
+        nTrigram = 1;
+    }
+
+    sqlite3_stmt *pWrite;
+    const char *zFormat = isDelete ? "DELETE FROM %s.%s WHERE trigram = ? AND member = ?"
+                                   : "INSERT OR IGNORE INTO %s.%s VALUES (?, ?)";
+    char *zWrite = sqlite3_mprintf(zFormat, pNdk->zDb, pNdk->zTrigram);
+    rc = zWrite ? sqlite3_prepare(pNdk->db, zWrite, -1, &pWrite, 0) : SQLITE_NOMEM;
+    sqlite3_free(zWrite);
+    if (rc) return rc;
+    sqlite3_bind_int64(pWrite, 2, iRowid);
+    for (int n = 0; n < nTrigram && rc == SQLITE_OK; n++) {
+        sqlite3_bind_int(pWrite, 1, pNdk->aTrigram[n]);
+        if (sqlite3_step(pWrite) != SQLITE_DONE) rc = sqlite3_errcode(pNdk->db);
+        sqlite3_reset(pWrite);
+    }
+    sqlite3_finalize(pWrite);
+
+    return rc;
+}
+
+/*
+** Add the stored row with the given rowid to the full-text and trigram
+** indexes of the given table, if any.  Contents which look binary, as
+** they contain a NUL byte early on, are indexed by filename only in the
+** full-text index.
+*/
+static int nadekoIndexInsert(nadeko_vtab *pNdk, sqlite3_int64 iRowid) {
+    int rc = SQLITE_OK;
+    if (pNdk->zIndex) {
+        rc = nadekoExecPrintf(pNdk->db,
+            0,
+            "INSERT INTO %s.%s (rowid, filename, contents) "
+            "SELECT rowid, filename, " NADEKO_TEXT_SQL " FROM %s.%s WHERE rowid = %lld",
+            pNdk->zDb,
+            pNdk->zIndex,
+            pNdk->zDb,
+            pNdk->zTable,
+            iRowid);
+    }
+    if (rc == SQLITE_OK && pNdk->zTrigram) rc = nadekoTrigramUpdate(pNdk, iRowid, 0);
+
+    return rc;
+}
+
+/*
+** Remove the stored rows with the given rowid, unless it is NULL, or the
+** given filename, unless it is NULL, from the full-text and trigram
+** indexes of the given table, if any, and release their chunks, before
+** the store replaces or deletes them.
+*/
+static int nadekoIndexDelete(
+    nadeko_vtab *pNdk, const sqlite3_int64 *piRowid, const char *zFilename) {
+    int rc = SQLITE_OK;
+    if (pNdk->zTrigram || pNdk->zChunks) {
+        sqlite3_stmt *pSelect;
+        char *zSel = sqlite3_mprintf("SELECT rowid FROM %s.%s "
+                                     "WHERE rowid = ?1 OR filename = ?2",
+            pNdk->zDb,
+            pNdk->zTable);
+        rc = zSel ? sqlite3_prepare(pNdk->db, zSel, -1, &pSelect, 0) : SQLITE_NOMEM;
+        sqlite3_free(zSel);
+        if (rc) return rc;
+        if (piRowid) sqlite3_bind_int64(pSelect, 1, *piRowid);
+        if (zFilename) sqlite3_bind_text(pSelect, 2, zFilename, -1, SQLITE_STATIC);
+        while (rc == SQLITE_OK && sqlite3_step(pSelect) == SQLITE_ROW) {
+            sqlite3_int64 iMember = sqlite3_column_int64(pSelect, 0);
+            rc = pNdk->zChunks ? nadekoChunkRelease(pNdk, iMember)
+                               : nadekoTrigramUpdate(pNdk, iMember, 1);
+        }
+        sqlite3_finalize(pSelect);
+        if (rc) return rc;
+    }
+    if (pNdk->zIndex) {
+        sqlite3_stmt *pDelete;
+        char *zDel = sqlite3_mprintf("INSERT INTO %s.%s (%s, rowid, filename, contents) "
+                                     "SELECT 'delete', rowid, filename, " NADEKO_TEXT_SQL
+                                     " FROM %s.%s WHERE rowid = ?1 OR filename = ?2",
+            pNdk->zDb,
+            pNdk->zIndex,
+            pNdk->zIndex,
+            pNdk->zDb,
+            pNdk->zTable);
+        rc = zDel ? sqlite3_prepare(pNdk->db, zDel, -1, &pDelete, 0) : SQLITE_NOMEM;
+        sqlite3_free(zDel);
+        if (rc) return rc;
+        if (piRowid) sqlite3_bind_int64(pDelete, 1, *piRowid);
+        if (zFilename) sqlite3_bind_text(pDelete, 2, zFilename, -1, SQLITE_STATIC);
+        sqlite3_step(pDelete);
+        rc = sqlite3_finalize(pDelete);
+    }
+
+    return rc;
+}
+
+/*
+** Return the path of the given entry, relative to the directory if
+** reading from disk.
+*/
+static const char *nadekoEntryPath(nadeko_vtab *pNdk, struct archive_entry *pEntry) {
+    const char *zPath = archive_entry_pathname(pEntry);
+    if (pNdk->isFilesystem) {
+        zPath += strlen(pNdk->zFilename);
+        if (zPath[0] == '/') zPath++;
+    }
+
+    return zPath;
+}
+
+/*
+** Parse and return the next entry header belonging to the shard of the
+** given table.  Entries of directories are assigned to shards by the
+** hash of their path, as their order is not stable, while entries of
+** archives are assigned by their index.
+*/
+static int nadekoShardNextHeader(nadeko_vtab *pNdk, struct archive_entry **ppEntry) {
+    for (;;) {
+        int rc = nadekoArchiveNextHeader(pNdk->pArchive, ppEntry);
+        if (rc != ARCHIVE_OK || pNdk->nShard == 0) return rc;
+        unsigned int iKey = pNdk->isFilesystem
+                                ? nadekoHashPath(nadekoEntryPath(pNdk, *ppEntry))
+                                : (unsigned int)(pNdk->iEntry++);
+        if (iKey % pNdk->nShard == (unsigned int)(pNdk->iShard)) return ARCHIVE_OK;
+    }
+}
+
 /*
 ** Advance a nadeko_cursor to its next row of output.
 */
@@ -370,24 +1123,36 @@ static int nadekoNext(sqlite3_vtab_cursor *pVtabCur) {
     pCur->iRowid++;
 
     if (pCur->pParent->pArchive != 0 && pCur->iRowid > pCur->pParent->iKnown) {
-        switch (nadekoArchiveNextHeader(pCur->pParent->pArchive, &pCur->pEntry)) {
-        case ARCHIVE_OK:
-            sqlite3_bind_int(pCur->pInsert, 1, pCur->pParent->iKnown + 1);
-            const char *pathname = archive_entry_pathname(pCur->pEntry);
-            if (pCur->pParent->isFilesystem) {
-                pathname += strlen(pCur->pParent->zFilename);
-                if (pathname[0] == '/') pathname++;
-            }
+        TIMELINE_BEGIN("nadeko", "header", 0);
+        int iHeader = nadekoShardNextHeader(pCur->pParent, &pCur->pEntry);
+        TIMELINE_END("nadeko", "header");
+        switch (iHeader) {
+        case ARCHIVE_OK:;
+            sqlite3_int64 iRowid = pCur->pParent->iKnown + 1;
+            const char *pathname = nadekoEntryPath(pCur->pParent, pCur->pEntry);
+            if ((rc = nadekoIndexDelete(pCur->pParent, &iRowid, pathname))) break;
+            sqlite3_bind_int64(pCur->pInsert, 1, iRowid);
             sqlite3_bind_text(pCur->pInsert, 2, pathname, -1, SQLITE_TRANSIENT);
-            sqlite3_bind_zeroblob(pCur->pInsert, 3, archive_entry_size(pCur->pEntry));
+            sqlite3_int64 nSize = archive_entry_size(pCur->pEntry);
+            sqlite3_bind_zeroblob(pCur->pInsert, 3, pCur->pParent->zChunks ? 0 : nSize);
             sqlite3_step(pCur->pInsert);
             sqlite3_reset(pCur->pInsert);
-            if ((rc = nadekoFillBlobFromArchive(pCur->pParent->pArchive,
-                     pCur->pParent->db,
-                     pCur->pParent->zDb,
-                     pCur->pParent->zTable,
-                     "contents",
-                     pCur->iRowid))) {
+            PROGRESS_ENTRY(pathname);
+            TIMELINE_BEGIN("nadeko", "fill", pathname);
+            if (pCur->pParent->zChunks) {
+                rc = nadekoFillChunksFromArchive(
+                    pCur->pParent->pArchive, pCur->pParent, pCur->iRowid);
+            } else {
+                rc = nadekoFillBlobFromArchive(pCur->pParent->pArchive,
+                    pCur->pParent->db,
+                    pCur->pParent->zDb,
+                    pCur->pParent->zTable,
+                    "contents",
+                    pCur->iRowid);
+            }
+            TIMELINE_END("nadeko", "fill");
+            if (rc == SQLITE_OK) rc = nadekoIndexInsert(pCur->pParent, pCur->iRowid);
+            if (rc) {
                 pVtabCur->pVtab->zErrMsg =
                     sqlite3_mprintf("%s", archive_error_string(pCur->pParent->pArchive));
                 rc = SQLITE_ERROR;
@@ -435,6 +1200,10 @@ static int nadekoColumn(sqlite3_vtab_cursor *pVtabCur, /* The cursor */
         break;
     default:
         assert(iColumn == NADEKO_CONTENTS);
+        if (pCur->pParent->zChunks &&
+            sqlite3_column_type(pCur->pSelect, 1) != SQLITE_NULL) {
+            return nadekoChunkResult(pCur->pParent, pCur->iRowid, pCtx);
+        }
         sqlite3_result_blob(pCtx,
             sqlite3_column_blob(pCur->pSelect, 1),
             sqlite3_column_bytes(pCur->pSelect, 1),
@@ -505,184 +1274,3898 @@ static int nadekoBestIndex(
 ** to return true when its input is the part of a shadow table name past
 ** the last "_" character.
 */
-static int nadekoShadowName(const char *pName) { return sqlite3_stricmp(pName, "store"); }
+static int nadekoShadowName(const char *pName) {
+    return !sqlite3_stricmp(pName, "store") || !sqlite3_stricmp(pName, "fts") ||
+           !sqlite3_stricmp(pName, "trigram") || !sqlite3_stricmp(pName, "chunks");
+}
 
-static int nadekoUpdate(
-    sqlite3_vtab *pVtab, int argc, sqlite3_value **argv, sqlite_int64 *pRowid) {
-    nadeko_vtab *pNdk = (nadeko_vtab *)(pVtab);
+/*
+** Return the number of worker threads to use, which is the number of
+** online CPUs up to NADEKO_THREADS.
+*/
+static int nadekoThreadCount(void) {
+    long nThread = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nThread < 1) nThread = 1;
+    if (nThread > NADEKO_THREADS) nThread = NADEKO_THREADS;
+    return (int)(nThread);
+}
 
-    if (argc == 1) {
-        // DELETE
-        sqlite3_stmt *pDelete;
-        char *zDel =
-            sqlite3_mprintf("DELETE FROM %s.%s WHERE rowid = ?", pNdk->zDb, pNdk->zTable);
-        sqlite3_prepare(pNdk->db, zDel, -1, &pDelete, 0);
-        sqlite3_free(zDel);
-        sqlite3_bind_value(pDelete, 1, argv[0]);
-        sqlite3_step(pDelete);
-        sqlite3_finalize(pDelete);
-    } else {
-        // INSERT OR UPDATE
-        // TODO: Handle "INSERT OR REPLACE" specially
-        sqlite3_stmt *pInsert;
-        char *zIns =
-            sqlite3_mprintf("INSERT OR REPLACE INTO %s.%s (rowid, filename, contents)"
-                            "VALUES (?, ?, ?)",
-                pNdk->zDb,
-                pNdk->zTable);
+/* nadeko_extract_row is a member considered by the nadeko_extract table,
+** or written on sync of a directory, along with the outcome of writing it
+*/
+typedef struct nadeko_extract_row nadeko_extract_row;
+struct nadeko_extract_row {
+    char *zName;          /* Path of the member */
+    char *zPath;          /* Path of the extracted file */
+    sqlite3_int64 nSize;  /* Size of the member, negative unless a file */
+    unsigned char *aData; /* Contents until written by a worker */
+    const char *zError;   /* Reason the member was not extracted */
+    int iErrno;           /* Error writing the member */
+};
+
+/* nadeko_extract_pool is the state shared between nadekoExtractRun() or
+** nadekoSyncDirectory() and the workers writing their files
+*/
+typedef struct nadeko_extract_pool nadeko_extract_pool;
+struct nadeko_extract_pool {
+    nadeko_extract_row **apJob; /* Members to write in order */
+    int nJob;                   /* Number of members queued */
+    int nAlloc;                 /* Allocated size of apJob */
+    int iNext;                  /* Index of the next member to write */
+    int nWritten;               /* Number of members written */
+    int isDone;                 /* True once all members are queued */
+    sqlite3_int64 nBuffered;    /* Bytes of contents not yet written */
+    pthread_mutex_t mutex;
+    pthread_cond_t work; /* Signalled when members are queued */
+    pthread_cond_t room; /* Signalled when members are written */
+};
+
+/* nadeko_extract_worker is a thread writing extracted files, which it
+** syncs all together once all members are written
+*/
+typedef struct nadeko_extract_worker nadeko_extract_worker;
+struct nadeko_extract_worker {
+    nadeko_extract_pool *pPool;  /* Pool the worker takes members from */
+    nadeko_extract_row **apRow;  /* Files written, to be synced */
+    int nRow;                    /* Number of files written */
+    int nAlloc;                  /* Allocated size of apRow */
+    pthread_t thread;
+};
+
+/* nadeko_extract_seen is a hash set of the paths of the files extracted
+** so far, used to keep writes of members sharing a path in order
+*/
+typedef struct nadeko_extract_seen nadeko_extract_seen;
+struct nadeko_extract_seen {
+    const char **azPath; /* Slots of the set, NULL if empty */
+    int nPath;           /* Number of paths in the set */
+    int nSlot;           /* Number of slots, a power of two */
+};
+
+/*
+** Append the given row to the given array, growing it as needed.
+*/
+static int nadekoExtractAppend(
+    nadeko_extract_row ***papRow, int *pnRow, int *pnAlloc, nadeko_extract_row *pRow) {
+    if (*pnRow == *pnAlloc) {
+        int nAlloc = *pnAlloc ? 2 * *pnAlloc : 64;
+        nadeko_extract_row **apNew =
+            sqlite3_realloc64(*papRow, (sqlite3_int64)(nAlloc) * sizeof(*apNew));
+        if (apNew == 0) return SQLITE_NOMEM;
+        *papRow = apNew;
+        *pnAlloc = nAlloc;
+    }
+    (*papRow)[(*pnRow)++] = pRow;
+
+    return SQLITE_OK;
+}
+
+/*
+** Create the missing parent directories of the given path.
+*/
+static int nadekoExtractParents(char *zPath) {
+    for (char *z = zPath + 1; *z; z++) {
+        if (*z != '/') continue;
+        *z = 0;
+        int rc = mkdir(zPath, 0755) && errno != EEXIST ? errno : 0;
+        *z = '/';
+        if (rc) return rc;
+    }
+
+    return 0;
+}
+
+/*
+** Return true if the given member name could refer to a file outside of
+** the destination directory.
+*/
+static int nadekoExtractIsUnsafe(const char *zName) {
+    if (zName[0] == '/' || zName[0] == 0) return 1;
+    for (const char *z = zName; *z; z = strchr(z, '/') ? strchr(z, '/') + 1 : "") {
+        if (z[0] == '.' && z[1] == '.' && (z[2] == '/' || z[2] == 0)) return 1;
+    }
+
+    return 0;
+}
+
+/*
+** Create the file of the given row, preallocating its size, and return
+** its descriptor or -1 on error.
+*/
+static int nadekoExtractOpen(nadeko_extract_row *pRow) {
+    int fd = open(pRow->zPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        pRow->iErrno = errno;
+    } else if (pRow->nSize > 0) {
+        // Filesystems without support for preallocation are written as is
+        posix_fallocate(fd, 0, pRow->nSize);
+    }
+
+    return fd;
+}
+
+/*
+** Write the given data to the file of the given row.
+*/
+static void nadekoExtractWrite(
+    nadeko_extract_row *pRow, int fd, const unsigned char *aData, sqlite3_int64 nData) {
+    while (nData > 0 && pRow->iErrno == 0) {
+        ssize_t nWrite = write(fd, aData, nData);
+        if (nWrite < 0 && errno != EINTR) {
+            pRow->iErrno = errno;
+        } else if (nWrite > 0) {
+            aData += nWrite;
+            nData -= nWrite;
+        }
+    }
+}
+
+/*
+** Sync the files of the given rows to disk.
+*/
+static void nadekoExtractSync(nadeko_extract_row **apRow, int nRow) {
+    for (int n = 0; n < nRow; n++) {
+        int fd = open(apRow[n]->zPath, O_RDONLY);
+        if (fd < 0 || fsync(fd)) {
+            if (apRow[n]->iErrno == 0) apRow[n]->iErrno = errno;
+        }
+        if (fd >= 0) close(fd);
+    }
+}
+
+/*
+** Main loop of each worker thread.
+*/
+static void *nadekoExtractWorkerMain(void *pArg) {
+    nadeko_extract_worker *p = pArg;
+    nadeko_extract_pool *pPool = p->pPool;
+    pthread_mutex_lock(&pPool->mutex);
+    for (;;) {
+        while (pPool->iNext == pPool->nJob && !pPool->isDone) {
+            pthread_cond_wait(&pPool->work, &pPool->mutex);
+        }
+        if (pPool->iNext == pPool->nJob) break;
+        nadeko_extract_row *pRow = pPool->apJob[pPool->iNext++];
+        pthread_mutex_unlock(&pPool->mutex);
+
+        int fd = nadekoExtractOpen(pRow);
+        if (fd >= 0) {
+            nadekoExtractWrite(pRow, fd, pRow->aData, pRow->nSize);
+            if (close(fd) && pRow->iErrno == 0) pRow->iErrno = errno;
+        }
+        int rc = nadekoExtractAppend(&p->apRow, &p->nRow, &p->nAlloc, pRow);
+
+        pthread_mutex_lock(&pPool->mutex);
+        if (rc && pRow->iErrno == 0) pRow->iErrno = ENOMEM;
+        pPool->nBuffered -= pRow->nSize;
+        pPool->nWritten++;
+        sqlite3_free(pRow->aData);
+        pRow->aData = 0;
+        pthread_cond_signal(&pPool->room);
+    }
+    pthread_mutex_unlock(&pPool->mutex);
+
+    // Syncing all files at the end lets the filesystem batch their writes
+    nadekoExtractSync(p->apRow, p->nRow);
+
+    return 0;
+}
+
+/*
+** Add the given path to the given set, setting *pisSeen to true if it
+** was already part of it.  The path must outlive the set.
+*/
+static int nadekoExtractSeen(nadeko_extract_seen *p, const char *zPath, int *pisSeen) {
+    if (2 * (p->nPath + 1) > p->nSlot) {
+        int nSlot = p->nSlot ? 2 * p->nSlot : 1024;
+        const char **azNew = sqlite3_malloc64((sqlite3_int64)(nSlot) * sizeof(*azNew));
+        if (azNew == 0) return SQLITE_NOMEM;
+        memset(azNew, 0, nSlot * sizeof(*azNew));
+        for (int n = 0; n < p->nSlot; n++) {
+            if (p->azPath[n] == 0) continue;
+            unsigned int i = nadekoHashPath(p->azPath[n]) & (nSlot - 1);
+            while (azNew[i]) i = (i + 1) & (nSlot - 1);
+            azNew[i] = p->azPath[n];
+        }
+        sqlite3_free(p->azPath);
+        p->azPath = azNew;
+        p->nSlot = nSlot;
+    }
+
+    unsigned int i = nadekoHashPath(zPath) & (p->nSlot - 1);
+    for (; p->azPath[i]; i = (i + 1) & (p->nSlot - 1)) {
+        if (!strcmp(p->azPath[i], zPath)) {
+            *pisSeen = 1;
+            return SQLITE_OK;
+        }
+    }
+    p->azPath[i] = zPath;
+    p->nPath++;
+    *pisSeen = 0;
+
+    return SQLITE_OK;
+}
+
+/*
+** Wait until the workers of the given pool have written all members
+** queued so far.
+*/
+static void nadekoExtractDrain(nadeko_extract_pool *pPool) {
+    pthread_mutex_lock(&pPool->mutex);
+    while (pPool->nWritten < pPool->nJob) {
+        pthread_cond_wait(&pPool->room, &pPool->mutex);
+    }
+    pthread_mutex_unlock(&pPool->mutex);
+}
+
+/*
+** Queue the given row, whose contents are in memory, for a worker of the
+** given pool, waiting while too much data is buffered.
+*/
+static int nadekoExtractQueue(nadeko_extract_pool *pPool, nadeko_extract_row *pRow) {
+    pthread_mutex_lock(&pPool->mutex);
+    while (pPool->nBuffered >= NADEKO_EXTRACT_BUFFER) {
+        pthread_cond_wait(&pPool->room, &pPool->mutex);
+    }
+    int rc = nadekoExtractAppend(&pPool->apJob, &pPool->nJob, &pPool->nAlloc, pRow);
+    if (rc == SQLITE_OK) pPool->nBuffered += pRow->nSize;
+    pthread_cond_signal(&pPool->work);
+    pthread_mutex_unlock(&pPool->mutex);
+
+    return rc;
+}
+
+/*
+** Return the path of the given member of the directory of the given
+** table, or of the temporary file it is written to until commit.
+*/
+static char *nadekoDirectoryPath(nadeko_vtab *pNdk, const char *zName, int isTemp) {
+    if (!isTemp) return sqlite3_mprintf("%s/%s", pNdk->zFilename, zName);
+    const char *zBase = strrchr(zName, '/');
+    int nParent = zBase ? (int)(zBase - zName) + 1 : 0;
+    return sqlite3_mprintf("%s/%.*s.%s.nadeko-%ld",
+        pNdk->zFilename,
+        nParent,
+        zName,
+        zName + nParent,
+        (long)(getpid()));
+}
+
+/*
+** Record the given member of a directory as changed.  Whether it is
+** written or removed is decided by the store when the transaction is
+** synced.
+*/
+static int nadekoDirectoryStage(nadeko_vtab *pNdk, const char *zName) {
+    if (zName == 0 || nadekoExtractIsUnsafe(zName)) {
+        pNdk->base.zErrMsg = sqlite3_mprintf(
+            "invalid filename for directory %s: %s", pNdk->zFilename, zName);
+        return SQLITE_ERROR;
+    }
+    if (pNdk->nPending == pNdk->nPendingAlloc) {
+        int nAlloc = pNdk->nPendingAlloc ? 2 * pNdk->nPendingAlloc : 64;
+        char **azNew =
+            sqlite3_realloc64(pNdk->azPending, (sqlite3_int64)(nAlloc) * sizeof(*azNew));
+        if (azNew == 0) return SQLITE_NOMEM;
+        pNdk->azPending = azNew;
+        pNdk->nPendingAlloc = nAlloc;
+    }
+    if ((pNdk->azPending[pNdk->nPending] = sqlite3_mprintf("%s", zName)) == 0) {
+        return SQLITE_NOMEM;
+    }
+    pNdk->nPending++;
+
+    return SQLITE_OK;
+}
+
+/*
+** Record the stored member with the given rowid as changed, if any.
+*/
+static int nadekoDirectoryStageRowid(nadeko_vtab *pNdk, sqlite3_int64 iRowid) {
+    sqlite3_stmt *pSelect;
+    char *zSel = sqlite3_mprintf(
+        "SELECT filename FROM %s.%s WHERE rowid = ?", pNdk->zDb, pNdk->zTable);
+    int rc = sqlite3_prepare_v2(pNdk->db, zSel, -1, &pSelect, 0);
+    sqlite3_free(zSel);
+    if (rc) return rc;
+    sqlite3_bind_int64(pSelect, 1, iRowid);
+    if (sqlite3_step(pSelect) == SQLITE_ROW) {
+        rc = nadekoDirectoryStage(pNdk, (const char *)(sqlite3_column_text(pSelect, 0)));
+    }
+    sqlite3_finalize(pSelect);
+
+    return rc;
+}
+
+/*
+** Forget all changes recorded for the directory of the given table.
+*/
+static void nadekoDirectoryReset(nadeko_vtab *pNdk) {
+    for (int n = 0; n < pNdk->nPending; n++) sqlite3_free(pNdk->azPending[n]);
+    sqlite3_free(pNdk->azPending);
+    sqlite3_free(pNdk->aRemove);
+    pNdk->azPending = 0;
+    pNdk->aRemove = 0;
+    pNdk->nPending = pNdk->nPendingAlloc = 0;
+}
+
+/*
+** Compare two strings pointed at for qsort().
+*/
+static int nadekoCompareString(const void *pA, const void *pB) {
+    return strcmp(*(char *const *)(pA), *(char *const *)(pB));
+}
+
+/*
+** Sort the given array of strings and free duplicates, returning the
+** number of distinct strings.
+*/
+static int nadekoSortUnique(char **azString, int nString) {
+    int nUnique = 0;
+    qsort(azString, nString, sizeof(*azString), nadekoCompareString);
+    for (int n = 0; n < nString; n++) {
+        if (nUnique && !strcmp(azString[nUnique - 1], azString[n])) {
+            sqlite3_free(azString[n]);
+        } else {
+            azString[nUnique++] = azString[n];
+        }
+    }
+
+    return nUnique;
+}
+
+/*
+** Write the members of a directory changed by the current transaction
+** to temporary files next to them, using a pool of workers which sync
+** their files all together once they are done.  Members no longer in
+** the store are marked for removal.  The files only replace the members
+** once the transaction commits.
+*/
+static int nadekoSyncDirectory(nadeko_vtab *pNdk) {
+    pNdk->nPending = nadekoSortUnique(pNdk->azPending, pNdk->nPending);
+    if ((pNdk->aRemove = sqlite3_malloc(pNdk->nPending + 1)) == 0) return SQLITE_NOMEM;
+    memset(pNdk->aRemove, 0, pNdk->nPending + 1);
+
+    sqlite3_stmt *pSelect;
+    char *zSel = sqlite3_mprintf("SELECT rowid, contents FROM %s.%s WHERE filename = ?",
+        pNdk->zDb,
+        pNdk->zTable);
+    int rc = sqlite3_prepare_v2(pNdk->db, zSel, -1, &pSelect, 0);
+    sqlite3_free(zSel);
+    if (rc) return rc;
+
+    int nThread = nadekoThreadCount();
+    nadeko_extract_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.mutex, 0);
+    pthread_cond_init(&pool.work, 0);
+    pthread_cond_init(&pool.room, 0);
+    nadeko_extract_worker *aWorker = sqlite3_malloc(nThread * sizeof(*aWorker));
+    nadeko_extract_row *aRow = sqlite3_malloc64(
+        (sqlite3_int64)(pNdk->nPending + 1) * sizeof(*aRow));
+    int nWorker = 0, nRow = 0;
+    if (aWorker == 0 || aRow == 0) rc = SQLITE_NOMEM;
+    for (; rc == SQLITE_OK && nWorker < nThread; nWorker++) {
+        memset(&aWorker[nWorker], 0, sizeof(*aWorker));
+        aWorker[nWorker].pPool = &pool;
+        nadeko_extract_worker *p = &aWorker[nWorker];
+        if (pthread_create(&p->thread, 0, nadekoExtractWorkerMain, p)) {
+            rc = SQLITE_ERROR;
+            break;
+        }
+    }
+
+    for (int n = 0; rc == SQLITE_OK && n < pNdk->nPending; n++) {
+        sqlite3_bind_text(pSelect, 1, pNdk->azPending[n], -1, SQLITE_STATIC);
+        int iStep = sqlite3_step(pSelect);
+        if (iStep != SQLITE_ROW) {
+            pNdk->aRemove[n] = 1;
+            rc = iStep == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(pNdk->db);
+            sqlite3_reset(pSelect);
+            continue;
+        }
+        PROGRESS_ENTRY(pNdk->azPending[n]);
+
+        nadeko_extract_row *pRow = &aRow[nRow];
+        memset(pRow, 0, sizeof(*pRow));
+        pRow->zName = pNdk->azPending[n];
+        if ((pRow->zPath = nadekoDirectoryPath(pNdk, pRow->zName, 1)) == 0) {
+            rc = SQLITE_NOMEM;
+        } else if (pNdk->zChunks && sqlite3_column_type(pSelect, 1) != SQLITE_NULL) {
+            rc = nadekoChunkRead(
+                pNdk, sqlite3_column_int64(pSelect, 0), &pRow->aData, &pRow->nSize);
+        } else {
+            pRow->nSize = sqlite3_column_bytes(pSelect, 1);
+            if ((pRow->aData = sqlite3_malloc64(pRow->nSize + 1)) == 0) {
+                rc = SQLITE_NOMEM;
+            } else if (pRow->nSize) {
+                memcpy(pRow->aData, sqlite3_column_blob(pSelect, 1), pRow->nSize);
+            }
+        }
+        sqlite3_reset(pSelect);
+        if (pRow->zPath) nRow++;
+        if (rc) break;
+
+        PROGRESS_BYTES(pRow->nSize);
+        if ((pRow->iErrno = nadekoExtractParents(pRow->zPath)) == 0) {
+            rc = nadekoExtractQueue(&pool, pRow);
+        }
+    }
+    sqlite3_finalize(pSelect);
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.isDone = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.mutex);
+    for (int n = 0; n < nWorker; n++) {
+        pthread_join(aWorker[n].thread, 0);
+        sqlite3_free(aWorker[n].apRow);
+    }
+
+    for (int n = 0; n < nRow; n++) {
+        if (rc == SQLITE_OK && aRow[n].iErrno) {
+            pNdk->base.zErrMsg = sqlite3_mprintf("cannot write %s in directory %s: %s",
+                aRow[n].zName,
+                pNdk->zFilename,
+                strerror(aRow[n].iErrno));
+            rc = SQLITE_ERROR;
+        }
+        sqlite3_free(aRow[n].aData);
+    }
+    for (int n = 0; n < nRow; n++) {
+        if (rc) remove(aRow[n].zPath);
+        sqlite3_free(aRow[n].zPath);
+    }
+
+    sqlite3_free(aRow);
+    sqlite3_free(pool.apJob);
+    sqlite3_free(aWorker);
+    pthread_cond_destroy(&pool.room);
+    pthread_cond_destroy(&pool.work);
+    pthread_mutex_destroy(&pool.mutex);
+
+    return rc;
+}
+
+/*
+** Sync the given directory to disk.
+*/
+static int nadekoSyncPath(const char *zPath) {
+    int fd = zPath ? open(zPath, O_RDONLY) : -1;
+    int rc = fd < 0 || fsync(fd) ? SQLITE_ERROR : SQLITE_OK;
+    if (fd >= 0) close(fd);
+
+    return rc;
+}
+
+/*
+** Move the temporary files written by nadekoSyncDirectory() over the
+** members they replace, keeping their modes, and remove the members
+** marked for removal, then sync the directories containing them.
+*/
+static int nadekoCommitDirectory(nadeko_vtab *pNdk) {
+    int rc = SQLITE_OK;
+    for (int n = 0; n < pNdk->nPending; n++) {
+        struct stat st;
+        char *zPath = nadekoDirectoryPath(pNdk, pNdk->azPending[n], 0);
+        char *zTemp = nadekoDirectoryPath(pNdk, pNdk->azPending[n], 1);
+        if (zPath == 0 || zTemp == 0) {
+            rc = SQLITE_NOMEM;
+        } else if (pNdk->aRemove[n]) {
+            if (remove(zPath) && errno != ENOENT) rc = SQLITE_ERROR;
+        } else if ((!stat(zPath, &st) && chmod(zTemp, st.st_mode & 07777)) ||
+                   rename(zTemp, zPath)) {
+            remove(zTemp);
+            rc = SQLITE_ERROR;
+        }
+        sqlite3_free(zTemp);
+        sqlite3_free(zPath);
+    }
+
+    // Members are sorted, so that each directory containing them, including
+    // those created for new members, is synced once after all renames
+    if (nadekoSyncPath(pNdk->zFilename)) rc = SQLITE_ERROR;
+    for (int n = 0; n < pNdk->nPending; n++) {
+        const char *zName = pNdk->azPending[n];
+        const char *zPrev = n ? pNdk->azPending[n - 1] : "";
+        int nCommon = 0;
+        while (zName[nCommon] && zName[nCommon] == zPrev[nCommon]) nCommon++;
+        for (const char *z = strchr(zName, '/'); z; z = strchr(z + 1, '/')) {
+            if (z - zName < nCommon) continue;
+            char *zDir =
+                sqlite3_mprintf("%s/%.*s", pNdk->zFilename, (int)(z - zName), zName);
+            if (nadekoSyncPath(zDir)) rc = SQLITE_ERROR;
+            sqlite3_free(zDir);
+        }
+    }
+    nadekoDirectoryReset(pNdk);
+
+    return rc;
+}
+
+/*
+** Remove the temporary files written by nadekoSyncDirectory(), if any.
+*/
+static void nadekoRollbackDirectory(nadeko_vtab *pNdk) {
+    for (int n = 0; pNdk->aRemove && n < pNdk->nPending; n++) {
+        if (pNdk->aRemove[n]) continue;
+        char *zTemp = nadekoDirectoryPath(pNdk, pNdk->azPending[n], 1);
+        if (zTemp) remove(zTemp);
+        sqlite3_free(zTemp);
+    }
+    nadekoDirectoryReset(pNdk);
+}
+
+static int nadekoUpdate(
+    sqlite3_vtab *pVtab, int argc, sqlite3_value **argv, sqlite_int64 *pRowid) {
+    nadeko_vtab *pNdk = (nadeko_vtab *)(pVtab);
+
+    // Tables created within an open transaction never see xBegin()
+    if (pNdk->nShard) {
+        pVtab->zErrMsg = sqlite3_mprintf("shards are not writable using nadeko()");
+        return SQLITE_ERROR;
+    } else {
+        pNdk->iBegun = 1;
+    }
+
+    // Members of directories are staged by name, including the previous
+    // name of updated members, and written or removed on sync
+    if (pNdk->isFilesystem) {
+        int rc = sqlite3_value_type(argv[0]) == SQLITE_NULL
+                     ? SQLITE_OK
+                     : nadekoDirectoryStageRowid(pNdk, sqlite3_value_int64(argv[0]));
+        if (rc == SQLITE_OK && argc > 1) {
+            rc = nadekoDirectoryStage(pNdk, (const char *)(sqlite3_value_text(argv[2])));
+        }
+        if (rc) return rc;
+    }
+
+    if (argc == 1) {
+        // DELETE
+        sqlite3_int64 iRowid = sqlite3_value_int64(argv[0]);
+        int rc = nadekoIndexDelete(pNdk, &iRowid, 0);
+        if (rc) return rc;
+        sqlite3_stmt *pDelete;
+        char *zDel =
+            sqlite3_mprintf("DELETE FROM %s.%s WHERE rowid = ?", pNdk->zDb, pNdk->zTable);
+        sqlite3_prepare(pNdk->db, zDel, -1, &pDelete, 0);
+        sqlite3_free(zDel);
+        sqlite3_bind_value(pDelete, 1, argv[0]);
+        sqlite3_step(pDelete);
+        sqlite3_finalize(pDelete);
+    } else {
+        // INSERT OR UPDATE
+        // TODO: Handle "INSERT OR REPLACE" specially
+        sqlite3_int64 iRowid = sqlite3_value_int64(argv[1]);
+        int rc = nadekoIndexDelete(pNdk,
+            sqlite3_value_type(argv[1]) == SQLITE_NULL ? 0 : &iRowid,
+            (const char *)(sqlite3_value_text(argv[2])));
+        if (rc) return rc;
+        sqlite3_stmt *pInsert;
+        char *zIns =
+            sqlite3_mprintf("INSERT OR REPLACE INTO %s.%s (rowid, filename, contents)"
+                            "VALUES (?, ?, ?)",
+                pNdk->zDb,
+                pNdk->zTable);
         sqlite3_prepare(pNdk->db, zIns, -1, &pInsert, 0);
         sqlite3_free(zIns);
         sqlite3_bind_value(pInsert, 1, argv[1]);
         sqlite3_bind_value(pInsert, 2, argv[2]);
-        sqlite3_bind_value(pInsert, 3, argv[3]);
-        if (sqlite3_step(pInsert)) {
+        if (pNdk->zChunks && sqlite3_value_type(argv[3]) != SQLITE_NULL) {
+            sqlite3_bind_zeroblob(pInsert, 3, 0);
+        } else {
+            sqlite3_bind_value(pInsert, 3, argv[3]);
+        }
+        if (sqlite3_step(pInsert) != SQLITE_DONE) {
             sqlite3_finalize(pInsert);
             return sqlite3_extended_errcode(pNdk->db);
         }
-        *pRowid = sqlite3_last_insert_rowid(pNdk->db);
-        sqlite3_finalize(pInsert);
+        *pRowid = sqlite3_last_insert_rowid(pNdk->db);
+        sqlite3_finalize(pInsert);
+        if (pNdk->zChunks && sqlite3_value_type(argv[3]) != SQLITE_NULL &&
+            (rc = nadekoFillChunksFromValue(pNdk, *pRowid, argv[3]))) {
+            return rc;
+        }
+        if ((rc = nadekoIndexInsert(pNdk, *pRowid))) return rc;
+    }
+
+    return SQLITE_OK;
+}
+
+static int nadekoBegin(sqlite3_vtab *pVtab) {
+    nadeko_vtab *pNdk = (nadeko_vtab *)(pVtab);
+    if (pNdk->nShard) {
+        pVtab->zErrMsg = sqlite3_mprintf("shards are not writable using nadeko()");
+        return SQLITE_ERROR;
+    } else {
+        pNdk->iBegun = 1;
+        return SQLITE_OK;
+    }
+}
+
+/*
+** Return log2(x) of the given positive integer in fixed point with 16
+** fractional bits.
+*/
+static sqlite3_int64 nadekoLog2(sqlite3_uint64 x) {
+    sqlite3_int64 iLog = 0;
+    while (x >> (iLog + 1)) iLog++;
+
+    // Square the mantissa in 2.30 fixed point once per fractional bit
+    sqlite3_uint64 y = iLog > 30 ? x >> (iLog - 30) : x << (30 - iLog);
+    iLog <<= 16;
+    for (int n = 15; n >= 0; n--) {
+        y = (y * y) >> 30;
+        if (y >= (sqlite3_uint64)(2) << 30) {
+            y >>= 1;
+            iLog |= (sqlite3_int64)(1) << n;
+        }
+    }
+
+    return iLog;
+}
+
+/*
+** Copy windows at the start, middle and end of the given data into the
+** given buffer of NADEKO_SAMPLE_SIZE bytes and return their total size.
+*/
+static int nadekoSample(
+    const unsigned char *aData, sqlite3_int64 nData, unsigned char *aSample) {
+    if (nData <= NADEKO_SAMPLE_SIZE) {
+        memcpy(aSample, aData, nData);
+        return (int)(nData);
+    }
+    int nWindow = NADEKO_SAMPLE_SIZE / 3;
+    memcpy(aSample, aData, nWindow);
+    memcpy(aSample + nWindow, aData + (nData - nWindow) / 2, nWindow);
+    memcpy(aSample + 2 * nWindow, aData + nData - nWindow, nWindow);
+    return 3 * nWindow;
+}
+
+/*
+** Return true if the member sampled by nadekoSample() is not worth
+** compressing, as it starts with the magic bytes of a compressed format
+** or its bytes are close to uniformly distributed.
+*/
+static int nadekoIsIncompressible(const unsigned char *aSample, int nSample) {
+    static const struct {
+        int iOffset;
+        int nMagic;
+        const char *zMagic;
+    } aMagic[] = {
+        {0, 3, "\xff\xd8\xff"},             /* JPEG */
+        {0, 8, "\x89PNG\r\n\x1a\n"},        /* PNG */
+        {0, 4, "GIF8"},                     /* GIF */
+        {8, 4, "WEBP"},                     /* WebP */
+        {4, 4, "ftyp"},                     /* MP4, MOV, HEIC */
+        {0, 4, "\x1a\x45\xdf\xa3"},         /* Matroska, WebM */
+        {0, 4, "OggS"},                     /* Ogg */
+        {0, 4, "fLaC"},                     /* FLAC */
+        {0, 3, "ID3"},                      /* MP3 */
+        {0, 2, "\x1f\x8b"},                 /* gzip */
+        {0, 3, "BZh"},                      /* bzip2 */
+        {0, 6, "\xfd" "7zXZ\0"},            /* xz */
+        {0, 4, "\x28\xb5\x2f\xfd"},         /* zstd */
+        {0, 4, "\x04\x22\x4d\x18"},         /* lz4 */
+        {0, 6, "7z\xbc\xaf\x27\x1c"},       /* 7z */
+        {0, 4, "Rar!"},                     /* RAR */
+        {0, 4, "PK\x03\x04"},               /* zip, jar, docx */
+    };
+    for (size_t n = 0; n < sizeof(aMagic) / sizeof(aMagic[0]); n++) {
+        if (nSample >= aMagic[n].iOffset + aMagic[n].nMagic &&
+            !memcmp(aSample + aMagic[n].iOffset, aMagic[n].zMagic, aMagic[n].nMagic)) {
+            return 1;
+        }
+    }
+    if (nSample < NADEKO_SAMPLE_SIZE / 3) return 0;
+
+    // The entropy of the sample is log2(N) - sum(c * log2(c)) / N bits per
+    // byte, where c counts the occurrences of each byte value
+    int aCount[256] = {0};
+    for (int n = 0; n < nSample; n++) aCount[aSample[n]]++;
+    sqlite3_int64 iEntropy = nSample * nadekoLog2(nSample);
+    for (int n = 0; n < 256; n++) {
+        if (aCount[n]) iEntropy -= aCount[n] * nadekoLog2(aCount[n]);
+    }
+
+    return iEntropy >= nSample * (sqlite3_int64)(NADEKO_STORE_ENTROPY * 65536);
+}
+
+/*
+** Return true if nearly all bytes stored by the given table belong to
+** members which are not worth compressing.
+*/
+static int nadekoIsStoreIncompressible(nadeko_vtab *pNdk) {
+    sqlite3_stmt *pSelect;
+    char *zSel = sqlite3_mprintf("SELECT rowid, contents IS NULL, length(contents) "
+                                 "FROM %s.%s",
+        pNdk->zDb,
+        pNdk->zTable);
+    if (zSel == 0 || sqlite3_prepare_v2(pNdk->db, zSel, -1, &pSelect, 0)) {
+        sqlite3_free(zSel);
+        return 0;
+    }
+    sqlite3_free(zSel);
+
+    sqlite3_int64 nTotal = 0, nStore = 0;
+    sqlite3_blob *pBlob = 0;
+    while (sqlite3_step(pSelect) == SQLITE_ROW) {
+        sqlite3_int64 iMember = sqlite3_column_int64(pSelect, 0);
+        unsigned char aSample[NADEKO_SAMPLE_SIZE];
+        unsigned char *aData = 0;
+        sqlite3_int64 nData = sqlite3_column_int64(pSelect, 2);
+        int nSample = 0;
+        if (sqlite3_column_int(pSelect, 1)) {
+            continue;
+        } else if (pNdk->zChunks) {
+            if (nadekoChunkRead(pNdk, iMember, &aData, &nData)) break;
+            nSample = nadekoSample(aData, nData, aSample);
+            sqlite3_free(aData);
+        } else if (pBlob ? sqlite3_blob_reopen(pBlob, iMember)
+                         : sqlite3_blob_open(pNdk->db,
+                               pNdk->zDb,
+                               pNdk->zTable,
+                               "contents",
+                               iMember,
+                               0,
+                               &pBlob)) {
+            break;
+        } else if (nData <= NADEKO_SAMPLE_SIZE) {
+            nSample = sqlite3_blob_read(pBlob, aSample, nData, 0) ? 0 : (int)(nData);
+        } else {
+            int nWindow = NADEKO_SAMPLE_SIZE / 3;
+            int aOffset[3] = {0, (int)(nData - nWindow) / 2, (int)(nData - nWindow)};
+            nSample = 3 * nWindow;
+            for (int n = 0; n < 3; n++) {
+                unsigned char *aWindow = aSample + n * nWindow;
+                if (sqlite3_blob_read(pBlob, aWindow, nWindow, aOffset[n])) nSample = 0;
+            }
+        }
+        nTotal += nData;
+        if (nadekoIsIncompressible(aSample, nSample)) nStore += nData;
+    }
+    sqlite3_blob_close(pBlob);
+    sqlite3_finalize(pSelect);
+
+    return nTotal > 0 && nStore >= nTotal * NADEKO_STORE_SHARE;
+}
+
+/* nadeko_zip_member is a member of a zip archive written by
+** nadekoSyncZip(), which a worker compresses into a zip of its own
+*/
+typedef struct nadeko_zip_member nadeko_zip_member;
+struct nadeko_zip_member {
+    char *zName;             /* Path of the member */
+    unsigned char *aData;    /* Contents until compressed */
+    sqlite3_int64 nData;     /* Size of the contents */
+    int iWorker;             /* Worker whose spill file holds the member */
+    sqlite3_int64 iOffset;   /* Offset of the member in the spill file */
+    sqlite3_int64 nLocal;    /* Size of local header, data and descriptor */
+    unsigned char *aCentral; /* Central directory record of the member */
+    int nCentral;            /* Size of aCentral */
+};
+
+/* nadeko_zip_pool is the state shared between nadekoSyncZip() and the
+** workers compressing its members
+*/
+typedef struct nadeko_zip_pool nadeko_zip_pool;
+struct nadeko_zip_pool {
+    nadeko_zip_member **apMember; /* Members in archive order */
+    int nMember;                  /* Number of members queued */
+    int nAlloc;                   /* Allocated size of apMember */
+    int iNext;                    /* Index of the next member to compress */
+    int isDone;                   /* True once all members are queued */
+    sqlite3_int64 nBuffered;      /* Bytes of contents not yet compressed */
+    int rc;                       /* First error of any worker */
+    pthread_mutex_t mutex;
+    pthread_cond_t work; /* Signalled when members are queued */
+    pthread_cond_t room; /* Signalled when members are compressed */
+};
+
+/* nadeko_zip_worker is a thread appending compressed members to a spill
+** file of its own
+*/
+typedef struct nadeko_zip_worker nadeko_zip_worker;
+struct nadeko_zip_worker {
+    nadeko_zip_pool *pPool; /* Pool the worker takes members from */
+    FILE *pSpill;           /* Compressed members */
+    sqlite3_int64 nSpill;   /* Size of the spill file */
+    int iWorker;            /* Index of the worker */
+    pthread_t thread;
+};
+
+/*
+** Return the little-endian integer of the given size at the given
+** location.
+*/
+static sqlite3_uint64 nadekoZipGet(const unsigned char *aData, int nByte) {
+    sqlite3_uint64 iValue = 0;
+    while (nByte-- > 0) iValue = (iValue << 8) | aData[nByte];
+    return iValue;
+}
+
+/*
+** Store the given integer as a little-endian integer of the given size.
+*/
+static void nadekoZipPut(unsigned char *aData, int nByte, sqlite3_uint64 iValue) {
+    for (int n = 0; n < nByte; n++, iValue >>= 8) aData[n] = iValue & 0xff;
+}
+
+/*
+** Append data written by libarchive to the spill file of a worker.
+*/
+static la_ssize_t nadekoZipWrite(
+    struct archive *aUnused, void *pArg, const void *pData, size_t nData) {
+    (void)(aUnused);
+
+    nadeko_zip_worker *p = pArg;
+    if (fwrite(pData, 1, nData, p->pSpill) != nData) return -1;
+    p->nSpill += nData;
+    return nData;
+}
+
+/*
+** Split the zip of a single member just appended to the spill file of
+** the given worker into its local part, which is left in place, and its
+** central directory record, which is read into memory.
+*/
+static int nadekoZipSplit(nadeko_zip_worker *p, nadeko_zip_member *pMember) {
+    // The end of central directory record follows the zip64 record and its
+    // locator, which libarchive only writes for huge members
+    unsigned char aTail[98];
+    sqlite3_int64 nZip = p->nSpill - pMember->iOffset;
+    int nTail = nZip < (int)(sizeof(aTail)) ? (int)(nZip) : (int)(sizeof(aTail));
+    if (nTail < 22 || fseek(p->pSpill, (long)(p->nSpill - nTail), SEEK_SET) ||
+        fread(aTail, 1, nTail, p->pSpill) != (size_t)(nTail)) {
+        return SQLITE_IOERR;
+    }
+    unsigned char *aEnd = aTail + nTail - 22;
+    if (nadekoZipGet(aEnd, 4) != 0x06054b50) return SQLITE_CORRUPT;
+    sqlite3_uint64 nCentral = nadekoZipGet(aEnd + 12, 4);
+    sqlite3_uint64 iCentral = nadekoZipGet(aEnd + 16, 4);
+    if (nCentral == 0xffffffff || iCentral == 0xffffffff) {
+        if (nTail < 98 || nadekoZipGet(aTail, 4) != 0x06064b50) return SQLITE_CORRUPT;
+        nCentral = nadekoZipGet(aTail + 40, 8);
+        iCentral = nadekoZipGet(aTail + 48, 8);
+    }
+    if (nCentral < 46 || nCentral > 0xffff * 4 ||
+        iCentral + nCentral > (sqlite3_uint64)(nZip)) {
+        return SQLITE_CORRUPT;
+    }
+
+    // Leave room for a zip64 extra field holding the relocated offset
+    pMember->nLocal = iCentral;
+    pMember->nCentral = (int)(nCentral);
+    if ((pMember->aCentral = sqlite3_malloc(pMember->nCentral + 12)) == 0) {
+        return SQLITE_NOMEM;
+    }
+    if (fseek(p->pSpill, (long)(pMember->iOffset + iCentral), SEEK_SET) ||
+        fread(pMember->aCentral, 1, pMember->nCentral, p->pSpill) != nCentral ||
+        fseek(p->pSpill, 0, SEEK_END)) {
+        return SQLITE_IOERR;
+    }
+
+    return SQLITE_OK;
+}
+
+/*
+** Compress the given member into a zip of its own appended to the spill
+** file of the given worker.
+*/
+static int nadekoZipCompress(nadeko_zip_worker *p, nadeko_zip_member *pMember) {
+    struct archive *a = archive_write_new();
+    struct archive_entry *pEntry = archive_entry_new();
+    int rc = SQLITE_ERROR;
+    pMember->iWorker = p->iWorker;
+    pMember->iOffset = p->nSpill;
+    unsigned char aSample[NADEKO_SAMPLE_SIZE];
+    int nSample = nadekoSample(pMember->aData, pMember->nData, aSample);
+    int isStore = nadekoIsIncompressible(aSample, nSample);
+    if (a && pEntry && archive_write_set_format_zip(a) == ARCHIVE_OK &&
+        (!isStore ||
+            archive_write_set_format_option(a, "zip", "compression", "store") ==
+                ARCHIVE_OK) &&
+        archive_write_set_bytes_in_last_block(a, 1) == ARCHIVE_OK &&
+        archive_write_open(a, p, 0, nadekoZipWrite, 0) == ARCHIVE_OK) {
+        archive_entry_set_pathname(pEntry, pMember->zName);
+        archive_entry_set_size(pEntry, pMember->nData);
+        archive_entry_set_filetype(pEntry, AE_IFREG);
+        archive_entry_set_perm(pEntry, 0644);
+        la_ssize_t nData = pMember->nData;
+        if (archive_write_header(a, pEntry) == ARCHIVE_OK &&
+            (nData == 0 || archive_write_data(a, pMember->aData, nData) == nData) &&
+            archive_write_close(a) == ARCHIVE_OK) {
+            rc = SQLITE_OK;
+        }
+    }
+    archive_entry_free(pEntry);
+    archive_write_free(a);
+
+    return rc ? rc : nadekoZipSplit(p, pMember);
+}
+
+/*
+** Main loop of each worker thread.
+*/
+static void *nadekoZipWorkerMain(void *pArg) {
+    nadeko_zip_worker *p = pArg;
+    nadeko_zip_pool *pPool = p->pPool;
+    pthread_mutex_lock(&pPool->mutex);
+    for (;;) {
+        while (pPool->iNext == pPool->nMember && !pPool->isDone) {
+            pthread_cond_wait(&pPool->work, &pPool->mutex);
+        }
+        if (pPool->iNext == pPool->nMember || pPool->rc) break;
+        nadeko_zip_member *pMember = pPool->apMember[pPool->iNext++];
+        pthread_mutex_unlock(&pPool->mutex);
+
+        int rc = nadekoZipCompress(p, pMember);
+
+        pthread_mutex_lock(&pPool->mutex);
+        pPool->nBuffered -= pMember->nData;
+        sqlite3_free(pMember->aData);
+        pMember->aData = 0;
+        if (rc && pPool->rc == SQLITE_OK) pPool->rc = rc;
+        pthread_cond_signal(&pPool->room);
+    }
+    pthread_mutex_unlock(&pPool->mutex);
+
+    return 0;
+}
+
+/*
+** Queue the given member for compression, waiting while the contents of
+** too many members are waiting for a worker.
+*/
+static int nadekoZipQueue(nadeko_zip_pool *pPool, nadeko_zip_member *pMember) {
+    pthread_mutex_lock(&pPool->mutex);
+    while (pPool->nBuffered >= NADEKO_ZIP_BUFFER && pPool->rc == SQLITE_OK) {
+        pthread_cond_wait(&pPool->room, &pPool->mutex);
+    }
+    int rc = pPool->rc;
+    if (rc == SQLITE_OK && pPool->nMember == pPool->nAlloc) {
+        int nAlloc = pPool->nAlloc ? 2 * pPool->nAlloc : 64;
+        nadeko_zip_member **apNew = sqlite3_realloc64(
+            pPool->apMember, (sqlite3_int64)(nAlloc) * sizeof(*apNew));
+        if (apNew) {
+            pPool->apMember = apNew;
+            pPool->nAlloc = nAlloc;
+        } else {
+            rc = SQLITE_NOMEM;
+        }
+    }
+    if (rc == SQLITE_OK) {
+        pPool->apMember[pPool->nMember++] = pMember;
+        pPool->nBuffered += pMember->nData;
+        pthread_cond_signal(&pPool->work);
+    }
+    pthread_mutex_unlock(&pPool->mutex);
+
+    return rc;
+}
+
+/*
+** Set the offset of the local header in the central directory record of
+** the given member, moving it into a zip64 extra field if it does not
+** fit into 32 bits.
+*/
+static void nadekoZipRelocate(nadeko_zip_member *pMember, sqlite3_uint64 iLocal) {
+    unsigned char *a = pMember->aCentral;
+    if (iLocal < 0xffffffff) {
+        nadekoZipPut(a + 42, 4, iLocal);
+        return;
+    }
+
+    // The offset follows the sizes in an existing zip64 extra field
+    int nName = (int)(nadekoZipGet(a + 28, 2));
+    int nExtra = (int)(nadekoZipGet(a + 30, 2));
+    unsigned char *aExtra = a + 46 + nName;
+    int iZip64 = -1;
+    for (int i = 0; i + 4 <= nExtra; i += 4 + (int)(nadekoZipGet(aExtra + i + 2, 2))) {
+        if (nadekoZipGet(aExtra + i, 2) == 0x0001) {
+            iZip64 = i;
+            break;
+        }
+    }
+    int nInsert = iZip64 < 0 ? 12 : 8;
+    int iInsert = nExtra;
+    if (iZip64 >= 0) iInsert = iZip64 + 4 + (int)(nadekoZipGet(aExtra + iZip64 + 2, 2));
+    memmove(aExtra + iInsert + nInsert,
+        aExtra + iInsert,
+        pMember->nCentral - (46 + nName + iInsert));
+    if (iZip64 < 0) {
+        nadekoZipPut(aExtra + iInsert, 2, 0x0001);
+        nadekoZipPut(aExtra + iInsert + 2, 2, 8);
+        nadekoZipPut(aExtra + iInsert + 4, 8, iLocal);
+    } else {
+        nadekoZipPut(aExtra + iZip64 + 2, 2, nadekoZipGet(aExtra + iZip64 + 2, 2) + 8);
+        nadekoZipPut(aExtra + iInsert, 8, iLocal);
+    }
+    nadekoZipPut(a + 30, 2, nExtra + nInsert);
+    nadekoZipPut(a + 42, 4, 0xffffffff);
+    if (nadekoZipGet(a + 6, 2) < 45) nadekoZipPut(a + 6, 2, 45);
+    pMember->nCentral += nInsert;
+}
+
+/*
+** Write the compressed members of the given pool to the given file in
+** order, followed by their central directory.
+*/
+static int nadekoZipStitch(
+    nadeko_zip_pool *pPool, nadeko_zip_worker *aWorker, const char *zFilename) {
+    FILE *pOut = fopen(zFilename, "wb");
+    if (pOut == 0) return SQLITE_CANTOPEN;
+
+    int rc = SQLITE_OK;
+    sqlite3_uint64 iOut = 0;
+    for (int n = 0; n < pPool->nMember && rc == SQLITE_OK; n++) {
+        nadeko_zip_member *pMember = pPool->apMember[n];
+        FILE *pSpill = aWorker[pMember->iWorker].pSpill;
+        if (fseek(pSpill, (long)(pMember->iOffset), SEEK_SET)) rc = SQLITE_IOERR;
+        for (sqlite3_int64 nLeft = pMember->nLocal; nLeft > 0 && rc == SQLITE_OK;) {
+            char aBuf[NADEKO_BUFFER_SIZE];
+            size_t nCopy = nLeft < NADEKO_BUFFER_SIZE ? nLeft : NADEKO_BUFFER_SIZE;
+            if (fread(aBuf, 1, nCopy, pSpill) != nCopy ||
+                fwrite(aBuf, 1, nCopy, pOut) != nCopy) {
+                rc = SQLITE_IOERR;
+            }
+            nLeft -= nCopy;
+        }
+        nadekoZipRelocate(pMember, iOut);
+        iOut += pMember->nLocal;
+    }
+
+    sqlite3_uint64 iCentral = iOut;
+    for (int n = 0; n < pPool->nMember && rc == SQLITE_OK; n++) {
+        nadeko_zip_member *pMember = pPool->apMember[n];
+        size_t nCentral = pMember->nCentral;
+        if (fwrite(pMember->aCentral, 1, nCentral, pOut) != nCentral) rc = SQLITE_IOERR;
+        iOut += pMember->nCentral;
+    }
+
+    // Archives with too many members or too large for 32-bit fields end
+    // with a zip64 end of central directory record and its locator
+    unsigned char aEnd[98];
+    unsigned char *a = aEnd;
+    sqlite3_uint64 nMember = pPool->nMember;
+    sqlite3_uint64 nCentral = iOut - iCentral;
+    int isZip64 = nMember >= 0xffff || nCentral >= 0xffffffff || iCentral >= 0xffffffff;
+    if (isZip64) {
+        nadekoZipPut(a, 4, 0x06064b50);
+        nadekoZipPut(a + 4, 8, 44);
+        nadekoZipPut(a + 12, 2, 45);
+        nadekoZipPut(a + 14, 2, 45);
+        nadekoZipPut(a + 16, 8, 0);
+        nadekoZipPut(a + 24, 8, nMember);
+        nadekoZipPut(a + 32, 8, nMember);
+        nadekoZipPut(a + 40, 8, nCentral);
+        nadekoZipPut(a + 48, 8, iCentral);
+        nadekoZipPut(a + 56, 4, 0x07064b50);
+        nadekoZipPut(a + 60, 4, 0);
+        nadekoZipPut(a + 64, 8, iOut);
+        nadekoZipPut(a + 72, 4, 1);
+        a += 76;
+    }
+    nadekoZipPut(a, 4, 0x06054b50);
+    nadekoZipPut(a + 4, 4, 0);
+    nadekoZipPut(a + 8, 2, isZip64 ? 0xffff : nMember);
+    nadekoZipPut(a + 10, 2, isZip64 ? 0xffff : nMember);
+    nadekoZipPut(a + 12, 4, isZip64 ? 0xffffffff : nCentral);
+    nadekoZipPut(a + 16, 4, isZip64 ? 0xffffffff : iCentral);
+    nadekoZipPut(a + 20, 2, 0);
+    a += 22;
+    if (rc == SQLITE_OK && fwrite(aEnd, 1, a - aEnd, pOut) != (size_t)(a - aEnd)) {
+        rc = SQLITE_IOERR;
+    }
+    if (fclose(pOut) && rc == SQLITE_OK) rc = SQLITE_IOERR;
+
+    return rc;
+}
+
+/*
+** Write the store of the given table as a zip archive to its temporary
+** file.  Members are independent in zip archives, so workers compress
+** them in parallel into zips of their own, which are then stitched
+** together in order behind a single central directory.
+*/
+static int nadekoSyncZip(nadeko_vtab *pNdk) {
+    int nThread = nadekoThreadCount();
+
+    nadeko_zip_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.mutex, 0);
+    pthread_cond_init(&pool.work, 0);
+    pthread_cond_init(&pool.room, 0);
+    nadeko_zip_worker *aWorker = sqlite3_malloc(nThread * sizeof(*aWorker));
+    int nWorker = 0;
+    int rc = aWorker ? SQLITE_OK : SQLITE_NOMEM;
+    for (; rc == SQLITE_OK && nWorker < nThread; nWorker++) {
+        nadeko_zip_worker *p = &aWorker[nWorker];
+        memset(p, 0, sizeof(*p));
+        p->pPool = &pool;
+        p->iWorker = nWorker;
+        if ((p->pSpill = tmpfile()) == 0) {
+            rc = SQLITE_CANTOPEN;
+        } else if (pthread_create(&p->thread, 0, nadekoZipWorkerMain, p)) {
+            fclose(p->pSpill);
+            rc = SQLITE_ERROR;
+        } else {
+            continue;
+        }
+        break;
+    }
+
+    sqlite3_stmt *pSelect = 0;
+    char *zSel = sqlite3_mprintf(
+        "SELECT filename, rowid, contents FROM %s.%s", pNdk->zDb, pNdk->zTable);
+    if (rc == SQLITE_OK) {
+        rc = zSel ? sqlite3_prepare_v2(pNdk->db, zSel, -1, &pSelect, 0) : SQLITE_NOMEM;
+    }
+    sqlite3_free(zSel);
+    while (rc == SQLITE_OK && sqlite3_step(pSelect) == SQLITE_ROW) {
+        const char *zName = (const char *)(sqlite3_column_text(pSelect, 0));
+        nadeko_zip_member *pMember = sqlite3_malloc(sizeof(*pMember));
+        if (pMember == 0) {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+        memset(pMember, 0, sizeof(*pMember));
+        PROGRESS_ENTRY(zName);
+        pMember->zName = sqlite3_mprintf("%s", zName);
+        if (pNdk->zChunks && sqlite3_column_type(pSelect, 2) != SQLITE_NULL) {
+            rc = nadekoChunkRead(
+                pNdk, sqlite3_column_int64(pSelect, 1), &pMember->aData, &pMember->nData);
+        } else {
+            pMember->nData = sqlite3_column_bytes(pSelect, 2);
+            if ((pMember->aData = sqlite3_malloc64(pMember->nData + 1))) {
+                memcpy(pMember->aData, sqlite3_column_blob(pSelect, 2), pMember->nData);
+            }
+        }
+        if (rc == SQLITE_OK && (pMember->zName == 0 || pMember->aData == 0)) {
+            rc = SQLITE_NOMEM;
+        }
+        if (rc || (rc = nadekoZipQueue(&pool, pMember))) {
+            sqlite3_free(pMember->zName);
+            sqlite3_free(pMember->aData);
+            sqlite3_free(pMember);
+        }
+    }
+    if (pSelect && sqlite3_finalize(pSelect) && rc == SQLITE_OK) {
+        rc = sqlite3_errcode(pNdk->db);
+    }
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.isDone = 1;
+    if (rc && pool.rc == SQLITE_OK) pool.rc = rc;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.mutex);
+    for (int n = 0; n < nWorker; n++) pthread_join(aWorker[n].thread, 0);
+    if (rc == SQLITE_OK) rc = pool.rc;
+
+    if (rc == SQLITE_OK) rc = nadekoZipStitch(&pool, aWorker, pNdk->zTempname);
+    for (int n = 0; n < pool.nMember; n++) {
+        sqlite3_free(pool.apMember[n]->zName);
+        sqlite3_free(pool.apMember[n]->aData);
+        sqlite3_free(pool.apMember[n]->aCentral);
+        sqlite3_free(pool.apMember[n]);
+    }
+    for (int n = 0; n < nWorker; n++) fclose(aWorker[n].pSpill);
+    sqlite3_free(pool.apMember);
+    sqlite3_free(aWorker);
+    pthread_cond_destroy(&pool.room);
+    pthread_cond_destroy(&pool.work);
+    pthread_mutex_destroy(&pool.mutex);
+
+    return rc;
+}
+
+/*
+** Return true if the given filename has a ".zip" extension.
+*/
+static int nadekoIsZip(const char *zFilename) {
+    const char *zExt = strrchr(zFilename, '.');
+    return zExt && !sqlite3_stricmp(zExt, ".zip");
+}
+
+static int nadekoSync(sqlite3_vtab *pVtab) {
+    nadeko_vtab *pNdk = (nadeko_vtab *)(pVtab);
+    if (pNdk->iBegun == 0) {
+        return SQLITE_OK;
+    }
+
+    TIMELINE_BEGIN("nadeko", "sync", pNdk->zFilename);
+    if (pNdk->isFilesystem) {
+        int rc = nadekoSyncDirectory(pNdk);
+        TIMELINE_END("nadeko", "sync");
+        return rc;
+    }
+    if (nadekoIsZip(pNdk->zFilename)) {
+        int rc = nadekoSyncZip(pNdk);
+        if (rc) {
+            pVtab->zErrMsg =
+                sqlite3_mprintf("cannot write zip archive %s", pNdk->zFilename);
+        }
+        TIMELINE_END("nadeko", "sync");
+        return rc;
+    }
+    struct archive *a = archive_write_new();
+    int rc = SQLITE_OK;
+    archive_write_set_format_filter_by_ext(a, pNdk->zFilename);
+
+    // 7z archives are compressed as a single stream, so that members can
+    // only be stored without compression all together
+    if (archive_format(a) == ARCHIVE_FORMAT_7ZIP && nadekoIsStoreIncompressible(pNdk)) {
+        archive_write_set_format_option(a, "7zip", "compression", "store");
+    }
+    archive_write_open_filename(a, pNdk->zTempname);
+
+    sqlite3_stmt *pSelect;
+    char *zSel =
+        sqlite3_mprintf("SELECT filename, rowid FROM %s.%s", pNdk->zDb, pNdk->zTable);
+    sqlite3_prepare(pNdk->db, zSel, -1, &pSelect, 0);
+    sqlite3_free(zSel);
+
+    sqlite3_blob *pBlob = 0;
+    struct archive_entry *entry = archive_entry_new();
+    for (;;) {
+        switch (sqlite3_step(pSelect)) {
+        case SQLITE_ROW:
+            if (pBlob) {
+                sqlite3_blob_reopen(pBlob, sqlite3_column_int64(pSelect, 1));
+            } else {
+                sqlite3_blob_open(pNdk->db,
+                    pNdk->zDb,
+                    pNdk->zTable,
+                    "contents",
+                    sqlite3_column_int(pSelect, 1),
+                    0,
+                    &pBlob);
+            }
+            archive_entry_set_pathname(entry, (char *)(sqlite3_column_text(pSelect, 0)));
+            sqlite3_int64 iMember = sqlite3_column_int64(pSelect, 1);
+            archive_entry_set_size(entry,
+                pNdk->zChunks ? nadekoChunkSize(pNdk, iMember)
+                              : sqlite3_blob_bytes(pBlob));
+            archive_entry_set_filetype(entry, AE_IFREG);
+            archive_entry_set_perm(entry, 0644);
+            if ((rc = archive_write_header(a, entry))) {
+                pVtab->zErrMsg =
+                    sqlite3_mprintf("%s", archive_error_string(pNdk->pArchive));
+                rc = SQLITE_ERROR;
+                goto cleanup;
+            };
+            if ((rc = pNdk->zChunks ? nadekoFillArchiveFromChunks(a, pNdk, iMember)
+                                    : nadekoFillArchiveFromBlob(a, pBlob))) {
+                pVtab->zErrMsg =
+                    sqlite3_mprintf("%s", archive_error_string(pNdk->pArchive));
+                rc = SQLITE_ERROR;
+                goto cleanup;
+            };
+            archive_entry_clear(entry);
+            break;
+        case SQLITE_DONE:
+            rc = SQLITE_OK;
+            goto cleanup;
+        default:
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    sqlite3_blob_close(pBlob);
+    sqlite3_finalize(pSelect);
+    archive_entry_free(entry);
+    archive_write_close(a);
+    archive_write_free(a);
+    TIMELINE_END("nadeko", "sync");
+
+    return rc;
+}
+
+static int nadekoCommit(sqlite3_vtab *pVtab) {
+    nadeko_vtab *pNdk = (nadeko_vtab *)(pVtab);
+    if (pNdk->iBegun == 0) {
+        return SQLITE_OK;
+    } else {
+        pNdk->iBegun = 0;
+    }
+
+    if (pNdk->isFilesystem) return nadekoCommitDirectory(pNdk);
+    if (rename(pNdk->zTempname, pNdk->zFilename)) {
+        remove(pNdk->zTempname);
+        return SQLITE_ERROR;
+    } else {
+        return SQLITE_OK;
+    }
+}
+
+static int nadekoRollback(sqlite3_vtab *pVtab) {
+    nadeko_vtab *pNdk = (nadeko_vtab *)(pVtab);
+    if (pNdk->iBegun == 0) {
+        return SQLITE_OK;
+    } else {
+        pNdk->iBegun = 0;
+    }
+
+    if (pNdk->isFilesystem) {
+        nadekoRollbackDirectory(pNdk);
+        return SQLITE_OK;
+    }
+    remove(pNdk->zTempname);
+    return SQLITE_OK;
+}
+
+/*
+** This following structure defines all the methods for the
+** virtual table.  Changes to directories are staged and written on
+** commit by a pool of threads to temporary files, which are synced
+** together and renamed over the files they replace.  Members of zip
+** archives are compressed in parallel when written, except for members
+** which look already compressed.  Optional arguments following the
+** filename are 'shard=k/n', which restricts the table to the k-th of n
+** disjoint shards of the entries for read access, 'fts' or
+** 'fts=TOKENIZER', which maintains an FTS5 index named after the table
+** with a "_fts" suffix, 'trigram', which maintains the trigram index
+** read by nadeko_grep, and 'chunked', which stores files as
+** content-defined chunks shared by all chunked tables through the
+** "nadeko_chunk" table.
+**
+**     CREATE VIRTUAL TABLE src USING nadeko('./src.tar', 'fts');
+**     SELECT filename FROM src_fts WHERE src_fts MATCH 'quo vadis';
+*/
+static sqlite3_module nadekoModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ nadekoCreate,
+    /* xConnect    */ nadekoConnect,
+    /* xBestIndex  */ nadekoBestIndex,
+    /* xDisconnect */ nadekoDisconnect,
+    /* xDestroy    */ nadekoDestroy,
+    /* xOpen       */ nadekoOpen,
+    /* xClose      */ nadekoClose,
+    /* xFilter     */ nadekoFilter,
+    /* xNext       */ nadekoNext,
+    /* xEof        */ nadekoEof,
+    /* xColumn     */ nadekoColumn,
+    /* xRowid      */ nadekoRowid,
+    /* xUpdate     */ nadekoUpdate,
+    /* xBegin      */ nadekoBegin,
+    /* xSync       */ nadekoSync,
+    /* xCommit     */ nadekoCommit,
+    /* xRollback   */ nadekoRollback,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ nadekoShadowName};
+
+/* nadeko_grep_vtab is a subclass of sqlite3_vtab which is the
+** underlying representation of the eponymous nadeko_grep table
+*/
+typedef struct nadeko_grep_vtab nadeko_grep_vtab;
+struct nadeko_grep_vtab {
+    sqlite3_vtab base; /* Base class - must be first */
+    sqlite3 *db;       /* Connection the table belongs to */
+};
+
+/* nadeko_grep_cursor is a subclass of sqlite3_vtab_cursor which
+** scans over the stored members matching a regular expression
+*/
+typedef struct nadeko_grep_cursor nadeko_grep_cursor;
+struct nadeko_grep_cursor {
+    sqlite3_vtab_cursor base; /* Base class - must be first */
+    sqlite3_stmt *pSelect;    /* Candidate members of the table */
+    regex_t regex;            /* The compiled regular expression */
+    int isCompiled;           /* True once regex must be freed */
+    char *pBuffer;            /* NUL-terminated copy of the contents */
+    sqlite3_int64 nBuffer;    /* Allocated size of pBuffer */
+    sqlite3_int64 iEof;
+};
+
+/*
+** Return the offset just past the atom of the given regular expression
+** starting at the given offset, skipping escapes, bracket expressions
+** and parenthesized groups as a whole.
+*/
+static int nadekoGrepSkip(const char *zRegex, int i) {
+    if (zRegex[i] == '\\') {
+        return zRegex[i + 1] ? i + 2 : i + 1;
+    } else if (zRegex[i] == '[') {
+        i++;
+        if (zRegex[i] == '^') i++;
+        if (zRegex[i] == ']') i++;
+        while (zRegex[i] && zRegex[i] != ']') {
+            const char *zClose = 0;
+            if (zRegex[i] == '[' && zRegex[i + 1] && strchr(":.=", zRegex[i + 1])) {
+                char zEnd[3] = {zRegex[i + 1], ']', 0};
+                zClose = strstr(zRegex + i + 2, zEnd);
+            }
+            i = zClose ? (int)(zClose - zRegex) + 2 : i + 1;
+        }
+        return zRegex[i] ? i + 1 : i;
+    } else if (zRegex[i] == '(') {
+        for (i++; zRegex[i] && zRegex[i] != ')';) {
+            i = nadekoGrepSkip(zRegex, i);
+        }
+        return zRegex[i] ? i + 1 : i;
+    } else {
+        return i + 1;
+    }
+}
+
+/*
+** Store up to nMax trigrams which every match of the given extended
+** regular expression must contain into the given array and return
+** their number.  Only runs of literal characters which are neither
+** optional nor part of an alternation are taken into account.
+*/
+static int nadekoGrepTrigrams(const char *zRegex, int *aTrigram, int nMax) {
+    for (int i = 0; zRegex[i]; i = nadekoGrepSkip(zRegex, i)) {
+        if (zRegex[i] == '|') return 0;
+    }
+
+    int nTrigram = 0;
+    int nRun = 0;
+    unsigned int iTrigram = 0;
+    for (int i = 0; zRegex[i] && nTrigram < nMax;) {
+        int iNext = nadekoGrepSkip(zRegex, i);
+        unsigned char cLiteral = zRegex[iNext - 1];
+        int isLiteral = zRegex[i] == '\\' ? iNext == i + 2 && !isalnum(cLiteral)
+                                           : !strchr(".[]()^$*+?{}|", zRegex[i]);
+        int isOptional = zRegex[iNext] == '*' || zRegex[iNext] == '?' ||
+                         (zRegex[iNext] == '{' && zRegex[iNext + 1] == '0');
+        int isRepeated = zRegex[iNext] == '+' || zRegex[iNext] == '{';
+        if (zRegex[iNext] == '{') {
+            while (zRegex[iNext] && zRegex[iNext] != '}') iNext++;
+        }
+        i = zRegex[iNext] && strchr("*?+}", zRegex[iNext]) ? iNext + 1 : iNext;
+
+        if (!isLiteral || isOptional) {
+            nRun = 0;
+            continue;
+        }
+        iTrigram = ((iTrigram << 8) | cLiteral) % NADEKO_TRIGRAM_COUNT;
+        if (++nRun >= 3) aTrigram[nTrigram++] = iTrigram;
+        if (isRepeated) nRun = 1;
+    }
+
+    return nTrigram;
+}
+
+/*
+** Test if the given contents contain a match of the regular expression
+** of the given cursor.  Contents are matched as a series of strings
+** separated by NUL bytes, with newlines ending lines as for grep(1).
+*/
+static int nadekoGrepMatch(nadeko_grep_cursor *pCur, const void *pContents, int nBytes) {
+    if (nBytes + 1 > pCur->nBuffer) {
+        sqlite3_free(pCur->pBuffer);
+        pCur->nBuffer = nBytes + 1;
+        if ((pCur->pBuffer = sqlite3_malloc64(pCur->nBuffer)) == 0) {
+            pCur->nBuffer = 0;
+            return -1;
+        }
+    }
+    if (nBytes > 0) memcpy(pCur->pBuffer, pContents, nBytes);
+    pCur->pBuffer[nBytes] = 0;
+
+    for (char *z = pCur->pBuffer; z <= pCur->pBuffer + nBytes; z += strlen(z) + 1) {
+        if (regexec(&pCur->regex, z, 0, 0, 0) == 0) return 1;
+    }
+    return 0;
+}
+
+/*
+** The nadekoGrepConnect() method is invoked to create the eponymous
+** nadeko_grep table.
+*/
+static int nadekoGrepConnect(sqlite3 *db,
+    void *pAuxUnused,
+    int argcUnused,
+    const char *const *argvUnused,
+    sqlite3_vtab **ppVtab,
+    char **pzErrUnused) {
+    (void)(pAuxUnused);
+    (void)(argcUnused);
+    (void)(argvUnused);
+    (void)(pzErrUnused);
+
+    nadeko_grep_vtab *pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0) return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->db = db;
+
+#define NADEKO_GREP_FILENAME 0
+#define NADEKO_GREP_CONTENTS 1
+#define NADEKO_GREP_SOURCE 2
+#define NADEKO_GREP_REGEX 3
+    return sqlite3_declare_vtab(db,
+        "CREATE TABLE x(filename TEXT, contents BLOB, source HIDDEN, regex HIDDEN)");
+}
+
+/*
+** This method is the destructor for the nadeko_grep table.
+*/
+static int nadekoGrepDisconnect(sqlite3_vtab *pVtab) {
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+/*
+** Constructor for a new nadeko_grep_cursor object.
+*/
+static int nadekoGrepOpen(sqlite3_vtab *pVTabUnused, sqlite3_vtab_cursor **ppVtabCur) {
+    (void)(pVTabUnused);
+
+    nadeko_grep_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+    if (pCur == 0) return SQLITE_NOMEM;
+    memset(pCur, 0, sizeof(*pCur));
+    *ppVtabCur = &pCur->base;
+    return SQLITE_OK;
+}
+
+/*
+** Release the statement and regular expression of the given cursor.
+*/
+static void nadekoGrepReset(nadeko_grep_cursor *pCur) {
+    sqlite3_finalize(pCur->pSelect);
+    pCur->pSelect = 0;
+    if (pCur->isCompiled) regfree(&pCur->regex);
+    pCur->isCompiled = 0;
+}
+
+/*
+** Destructor for a nadeko_grep_cursor.
+*/
+static int nadekoGrepClose(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_grep_cursor *pCur = (nadeko_grep_cursor *)pVtabCur;
+    nadekoGrepReset(pCur);
+    sqlite3_free(pCur->pBuffer);
+    sqlite3_free(pCur);
+    return SQLITE_OK;
+}
+
+/*
+** Advance a nadeko_grep_cursor to the next candidate member which
+** actually matches the regular expression.
+*/
+static int nadekoGrepNext(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_grep_cursor *pCur = (nadeko_grep_cursor *)pVtabCur;
+    for (;;) {
+        switch (sqlite3_step(pCur->pSelect)) {
+        case SQLITE_ROW:
+            if (sqlite3_column_type(pCur->pSelect, 2) == SQLITE_NULL) continue;
+            switch (nadekoGrepMatch(pCur,
+                sqlite3_column_blob(pCur->pSelect, 2),
+                sqlite3_column_bytes(pCur->pSelect, 2))) {
+            case 1:
+                return SQLITE_OK;
+            case 0:
+                continue;
+            default:
+                return SQLITE_NOMEM;
+            }
+        case SQLITE_DONE:
+            pCur->iEof = 1;
+            return SQLITE_OK;
+        default:
+            return sqlite3_errcode(sqlite3_db_handle(pCur->pSelect));
+        }
+    }
+}
+
+/*
+** Return values of columns for the row at which the nadeko_grep_cursor
+** is currently pointing.
+*/
+static int nadekoGrepColumn(sqlite3_vtab_cursor *pVtabCur, /* The cursor */
+    sqlite3_context *pCtx, /* First argument to sqlite3_result_...() */
+    int iColumn            /* Which column to return */
+) {
+    nadeko_grep_cursor *pCur = (nadeko_grep_cursor *)pVtabCur;
+    switch (iColumn) {
+    case NADEKO_GREP_FILENAME:
+        sqlite3_result_value(pCtx, sqlite3_column_value(pCur->pSelect, 1));
+        break;
+    case NADEKO_GREP_CONTENTS:
+        sqlite3_result_value(pCtx, sqlite3_column_value(pCur->pSelect, 2));
+        break;
+    default:
+        break;
+    }
+    return SQLITE_OK;
+}
+
+/*
+** Return the rowid of the current member within the store.
+*/
+static int nadekoGrepRowid(sqlite3_vtab_cursor *pVtabCur, sqlite_int64 *pRowid) {
+    nadeko_grep_cursor *pCur = (nadeko_grep_cursor *)pVtabCur;
+    *pRowid = sqlite3_column_int64(pCur->pSelect, 0);
+    return SQLITE_OK;
+}
+
+/*
+** Return TRUE if the cursor has been moved off of the last
+** row of output.
+*/
+static int nadekoGrepEof(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_grep_cursor *pCur = (nadeko_grep_cursor *)pVtabCur;
+    return pCur->iEof;
+}
+
+/*
+** Compile the regular expression and select the candidate members of
+** the given nadeko() table.  If the table has a trigram index, only
+** members containing all trigrams required by the regular expression
+** are read from the store.
+*/
+static int nadekoGrepFilter(sqlite3_vtab_cursor *pVtabCur,
+    int idxNumUnused,
+    const char *idxStrUnused,
+    int argcUnused,
+    sqlite3_value **argv) {
+    (void)(idxNumUnused);
+    (void)(idxStrUnused);
+    (void)(argcUnused);
+
+    nadeko_grep_cursor *pCur = (nadeko_grep_cursor *)pVtabCur;
+    sqlite3 *db = ((nadeko_grep_vtab *)(pVtabCur->pVtab))->db;
+    const char *zSource = (const char *)(sqlite3_value_text(argv[0]));
+    const char *zRegex = (const char *)(sqlite3_value_text(argv[1]));
+    nadekoGrepReset(pCur);
+    pCur->iEof = 0;
+    if (zSource == 0 || zRegex == 0) {
+        pVtabCur->pVtab->zErrMsg =
+            sqlite3_mprintf("arguments to nadeko_grep() not a table name and regex");
+        return SQLITE_ERROR;
+    }
+
+    int rc = regcomp(&pCur->regex, zRegex, REG_EXTENDED | REG_NOSUB | REG_NEWLINE);
+    if (rc) {
+        char zErr[128];
+        regerror(rc, &pCur->regex, zErr, sizeof(zErr));
+        pVtabCur->pVtab->zErrMsg = sqlite3_mprintf("%s: %s", zRegex, zErr);
+        return SQLITE_ERROR;
+    }
+    pCur->isCompiled = 1;
+
+    TIMELINE_BEGIN("nadeko", "grep", zRegex);
+    int aTrigram[NADEKO_GREP_TRIGRAMS];
+    int nTrigram = 0;
+    char *zStore = sqlite3_mprintf("%s_store", zSource);
+    char *zTrigram = sqlite3_mprintf("%s_trigram", zSource);
+    char *zChunks = sqlite3_mprintf("%s_chunks", zSource);
+    sqlite3_str *pStr = sqlite3_str_new(db);
+    if (zStore == 0 || zTrigram == 0 || zChunks == 0) {
+        rc = SQLITE_NOMEM;
+    } else if (sqlite3_table_column_metadata(db, 0, zStore, "contents", 0, 0, 0, 0, 0)) {
+        pVtabCur->pVtab->zErrMsg = sqlite3_mprintf("no such nadeko() table: %s", zSource);
+        rc = SQLITE_ERROR;
+    } else if (!sqlite3_table_column_metadata(db, 0, zChunks, "chunk", 0, 0, 0, 0, 0)) {
+        pVtabCur->pVtab->zErrMsg =
+            sqlite3_mprintf("chunked tables not supported by nadeko_grep(): %s", zSource);
+        rc = SQLITE_ERROR;
+    } else if (!sqlite3_table_column_metadata(db, 0, zTrigram, "member", 0, 0, 0, 0, 0)) {
+        nTrigram = nadekoGrepTrigrams(zRegex, aTrigram, NADEKO_GREP_TRIGRAMS);
+    }
+
+    // Candidates contain every required trigram or were too varied to index
+    sqlite3_str_appendf(pStr, "SELECT rowid, filename, contents FROM \"%w\"", zStore);
+    for (int n = 0; n < nTrigram; n++) {
+        sqlite3_str_appendf(pStr,
+            "%sSELECT member FROM \"%w\" WHERE trigram = %d",
+            n ? " INTERSECT " : " WHERE rowid IN (",
+            zTrigram,
+            aTrigram[n]);
+    }
+    if (nTrigram) {
+        sqlite3_str_appendf(pStr,
+            " UNION SELECT member FROM \"%w\" WHERE trigram = %d)",
+            zTrigram,
+            NADEKO_TRIGRAM_ANY);
+    }
+    char *zSql = sqlite3_str_finish(pStr);
+    if (rc == SQLITE_OK) {
+        rc = zSql ? sqlite3_prepare_v2(db, zSql, -1, &pCur->pSelect, 0) : SQLITE_NOMEM;
+    }
+    sqlite3_free(zSql);
+    sqlite3_free(zChunks);
+    sqlite3_free(zTrigram);
+    sqlite3_free(zStore);
+
+    rc = rc || nadekoGrepNext(pVtabCur);
+    TIMELINE_END("nadeko", "grep");
+    return rc;
+}
+
+/*
+** SQLite will invoke this method one or more times while planning a query
+** that uses the table.  Both the table name and the regular expression
+** are required.
+*/
+static int nadekoGrepBestIndex(sqlite3_vtab *pVTabUnused, sqlite3_index_info *pIdxInfo) {
+    (void)(pVTabUnused);
+
+    int nArg = 0;
+    const struct sqlite3_index_constraint *pConstraint = pIdxInfo->aConstraint;
+    for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++) {
+        if (pConstraint->usable && pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ &&
+            (pConstraint->iColumn == NADEKO_GREP_SOURCE ||
+                pConstraint->iColumn == NADEKO_GREP_REGEX)) {
+            pIdxInfo->aConstraintUsage[i].argvIndex =
+                pConstraint->iColumn - NADEKO_GREP_SOURCE + 1;
+            pIdxInfo->aConstraintUsage[i].omit = 1;
+            nArg++;
+        }
+    };
+
+    return nArg == 2 ? SQLITE_OK : SQLITE_CONSTRAINT;
+}
+
+/*
+** This following structure defines all the methods for the
+** nadeko_grep table, which uses the trigram index of a nadeko() table
+** to read only the files which may match a POSIX extended regular
+** expression.
+**
+**     CREATE VIRTUAL TABLE bin USING nadeko('./bin.tar', 'trigram');
+**     SELECT filename FROM nadeko_grep('bin', 'quo_?vadis[0-9]+');
+*/
+static sqlite3_module nadekoGrepModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ nadekoGrepConnect,
+    /* xBestIndex  */ nadekoGrepBestIndex,
+    /* xDisconnect */ nadekoGrepDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ nadekoGrepOpen,
+    /* xClose      */ nadekoGrepClose,
+    /* xFilter     */ nadekoGrepFilter,
+    /* xNext       */ nadekoGrepNext,
+    /* xEof        */ nadekoGrepEof,
+    /* xColumn     */ nadekoGrepColumn,
+    /* xRowid      */ nadekoGrepRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+
+/* nadeko_diff_member is a member of either archive compared by the
+** nadeko_diff table
+*/
+typedef struct nadeko_diff_member nadeko_diff_member;
+struct nadeko_diff_member {
+    char *zName;          /* Path of the member */
+    sqlite3_int64 iIndex; /* Position of the member within its archive */
+    sqlite3_int64 nSize;  /* Size recorded in the header */
+    sqlite3_int64 iHash;  /* Hash of the contents if isHashed */
+    unsigned char aDigest[32]; /* SHA-256 recorded by the format if isDigest */
+    int isDigest;         /* True if the format records a digest */
+    int isHashed;         /* True once the contents were hashed */
+    int isWanted;         /* True if the contents must be hashed */
+};
+
+/* nadeko_diff_side holds the members of either compared archive
+*/
+typedef struct nadeko_diff_side nadeko_diff_side;
+struct nadeko_diff_side {
+    nadeko_diff_member *aMember; /* Members sorted by name */
+    int nMember;                 /* Number of members */
+    int nAlloc;                  /* Allocated size of aMember */
+    int isStream;                /* True if skipping contents means reading them */
+};
+
+/* nadeko_diff_row is a row of the result of the nadeko_diff table
+*/
+typedef struct nadeko_diff_row nadeko_diff_row;
+struct nadeko_diff_row {
+    nadeko_diff_member *apMember[2]; /* Member of either archive, if any */
+    const char *zStatus;             /* Outcome of the comparison */
+};
+
+/* nadeko_diff_cursor is a subclass of sqlite3_vtab_cursor which scans
+** over the compared members of two archives
+*/
+typedef struct nadeko_diff_cursor nadeko_diff_cursor;
+struct nadeko_diff_cursor {
+    sqlite3_vtab_cursor base;  /* Base class - must be first */
+    nadeko_diff_side aSide[2]; /* Members of both archives */
+    nadeko_diff_row *aRow;     /* Rows of the result */
+    int nRow;                  /* Number of rows */
+    int iRow;                  /* Current row */
+};
+
+/*
+** Compare two members by name and position for qsort().
+*/
+static int nadekoDiffCompare(const void *pA, const void *pB) {
+    const nadeko_diff_member *p1 = pA;
+    const nadeko_diff_member *p2 = pB;
+    int iCmp = strcmp(p1->zName, p2->zName);
+    if (iCmp) return iCmp;
+    return (p1->iIndex > p2->iIndex) - (p1->iIndex < p2->iIndex);
+}
+
+/*
+** Return the member of the given side with the given name and position,
+** or NULL if it is not the last member of that name.
+*/
+static nadeko_diff_member *nadekoDiffFind(
+    nadeko_diff_side *pSide, const char *zName, sqlite3_int64 iIndex) {
+    nadeko_diff_member key;
+    key.zName = (char *)(zName);
+    key.iIndex = iIndex;
+    return bsearch(
+        &key, pSide->aMember, pSide->nMember, sizeof(key), nadekoDiffCompare);
+}
+
+/*
+** Read the headers of the given archive or directory into the given
+** side, hashing the contents of all members if skipping them costs as
+** much as reading them.  If isSecond is true, only the members marked as
+** wanted by an earlier scan are hashed instead.
+*/
+static int nadekoDiffScan(
+    nadeko_diff_side *pSide, const char *zFilename, int isSecond, char **pzErr) {
+    struct archive *a;
+    int isFilesystem = nadekoIsDirectory(zFilename);
+    int rc = isFilesystem ? nadekoOpenDirectory(&a, zFilename, pzErr)
+                          : nadekoOpenArchive(&a, zFilename, pzErr);
+    if (rc) return SQLITE_ERROR;
+
+    TIMELINE_BEGIN("nadeko", isSecond ? "diff hash" : "diff scan", zFilename);
+    struct archive_entry *pEntry;
+    for (sqlite3_int64 iIndex = 0; rc == SQLITE_OK; iIndex++) {
+        int iHeader = nadekoArchiveNextHeader(a, &pEntry);
+        if (iHeader == ARCHIVE_EOF) break;
+        if (iHeader != ARCHIVE_OK) {
+            *pzErr = sqlite3_mprintf("%s: %s", zFilename, archive_error_string(a));
+            rc = SQLITE_ERROR;
+            break;
+        }
+        const char *zName = archive_entry_pathname(pEntry);
+        if (isFilesystem) {
+            zName += strlen(zFilename);
+            if (zName[0] == '/') zName++;
+        }
+        PROGRESS_ENTRY(zName);
+
+        nadeko_diff_member *pMember;
+        if (isSecond) {
+            pMember = nadekoDiffFind(pSide, zName, iIndex);
+            if (pMember == 0 || !pMember->isWanted) continue;
+        } else {
+            if (iIndex == 0 && !isFilesystem) {
+                pSide->isStream = archive_filter_count(a) > 1 &&
+                                  archive_filter_code(a, 0) != ARCHIVE_FILTER_NONE;
+            }
+            if (pSide->nMember == pSide->nAlloc) {
+                int nAlloc = pSide->nAlloc ? 2 * pSide->nAlloc : 64;
+                nadeko_diff_member *aNew = sqlite3_realloc64(
+                    pSide->aMember, (sqlite3_int64)(nAlloc) * sizeof(*aNew));
+                if (aNew == 0) {
+                    rc = SQLITE_NOMEM;
+                    break;
+                }
+                pSide->aMember = aNew;
+                pSide->nAlloc = nAlloc;
+            }
+            pMember = &pSide->aMember[pSide->nMember];
+            memset(pMember, 0, sizeof(*pMember));
+            if ((pMember->zName = sqlite3_mprintf("%s", zName)) == 0) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            pSide->nMember++;
+            pMember->iIndex = iIndex;
+            pMember->nSize = archive_entry_size(pEntry);
+            const unsigned char *aDigest =
+                archive_entry_digest(pEntry, ARCHIVE_ENTRY_DIGEST_SHA256);
+            for (int n = 0; aDigest && n < (int)(sizeof(pMember->aDigest)); n++) {
+                pMember->isDigest |= aDigest[n] != 0;
+            }
+            if (pMember->isDigest) memcpy(pMember->aDigest, aDigest, 32);
+            if (!pSide->isStream || pMember->isDigest) continue;
+        }
+
+        pMember->iHash = NADEKO_HASH_INIT;
+        for (;;) {
+            char aBuf[NADEKO_BUFFER_SIZE];
+            int iRead = archive_read_data(a, aBuf, NADEKO_BUFFER_SIZE);
+            if (iRead == 0) break;
+            if (iRead < 0) {
+                *pzErr = sqlite3_mprintf("%s: %s", zFilename, archive_error_string(a));
+                rc = SQLITE_ERROR;
+                break;
+            }
+            pMember->iHash = nadekoHash(pMember->iHash, aBuf, iRead);
+            PROGRESS_BYTES(iRead);
+        }
+        pMember->isHashed = 1;
+    }
+    TIMELINE_END("nadeko", isSecond ? "diff hash" : "diff scan");
+    archive_read_free(a);
+
+    return rc;
+}
+
+/*
+** Sort the members of the given side by name, keeping only the last
+** member of each name as extraction would.
+*/
+static void nadekoDiffSort(nadeko_diff_side *pSide) {
+    qsort(pSide->aMember, pSide->nMember, sizeof(*pSide->aMember), nadekoDiffCompare);
+    int nKeep = 0;
+    for (int n = 0; n < pSide->nMember; n++) {
+        if (n + 1 < pSide->nMember &&
+            !strcmp(pSide->aMember[n].zName, pSide->aMember[n + 1].zName)) {
+            sqlite3_free(pSide->aMember[n].zName);
+        } else {
+            pSide->aMember[nKeep++] = pSide->aMember[n];
+        }
+    }
+    pSide->nMember = nKeep;
+}
+
+/*
+** Decide the status of the given row, returning NULL if the contents
+** of both members must be hashed to do so.
+*/
+static const char *nadekoDiffStatus(nadeko_diff_row *pRow) {
+    nadeko_diff_member *pA = pRow->apMember[0];
+    nadeko_diff_member *pB = pRow->apMember[1];
+    if (pA == 0) return "added";
+    if (pB == 0) return "removed";
+    if (pA->nSize != pB->nSize) return "modified";
+    if (pA->isDigest && pB->isDigest) {
+        return memcmp(pA->aDigest, pB->aDigest, 32) ? "modified" : "unchanged";
+    }
+    if (pA->isHashed && pB->isHashed) {
+        return pA->iHash != pB->iHash ? "modified" : "unchanged";
+    }
+    return 0;
+}
+
+/*
+** Release the members and rows of the given cursor.
+*/
+static void nadekoDiffReset(nadeko_diff_cursor *pCur) {
+    for (int i = 0; i < 2; i++) {
+        for (int n = 0; n < pCur->aSide[i].nMember; n++) {
+            sqlite3_free(pCur->aSide[i].aMember[n].zName);
+        }
+        sqlite3_free(pCur->aSide[i].aMember);
+    }
+    sqlite3_free(pCur->aRow);
+    memset(pCur->aSide, 0, sizeof(pCur->aSide));
+    pCur->aRow = 0;
+    pCur->nRow = 0;
+    pCur->iRow = 0;
+}
+
+/*
+** Compare the two given archives or directories into the rows of the
+** given cursor.  Headers are read first, and only members whose status
+** is still unknown afterwards are hashed by a second scan.
+*/
+static int nadekoDiffCompute(
+    nadeko_diff_cursor *pCur, const char *const *azFilename, char **pzErr) {
+    int rc = SQLITE_OK;
+    for (int i = 0; i < 2 && rc == SQLITE_OK; i++) {
+        rc = nadekoDiffScan(&pCur->aSide[i], azFilename[i], 0, pzErr);
+        if (rc == SQLITE_OK) nadekoDiffSort(&pCur->aSide[i]);
+    }
+    if (rc) return rc;
+
+    nadeko_diff_side *pA = &pCur->aSide[0];
+    nadeko_diff_side *pB = &pCur->aSide[1];
+    pCur->aRow = sqlite3_malloc64(
+        (sqlite3_int64)(pA->nMember + pB->nMember + 1) * sizeof(*pCur->aRow));
+    if (pCur->aRow == 0) return SQLITE_NOMEM;
+
+    int isAmbiguous[2] = {0, 0};
+    for (int iA = 0, iB = 0; iA < pA->nMember || iB < pB->nMember;) {
+        nadeko_diff_row *pRow = &pCur->aRow[pCur->nRow++];
+        int iCmp = 1;
+        if (iA < pA->nMember) {
+            iCmp = iB < pB->nMember ? strcmp(pA->aMember[iA].zName, pB->aMember[iB].zName)
+                                    : -1;
+        }
+        pRow->apMember[0] = iCmp <= 0 ? &pA->aMember[iA++] : 0;
+        pRow->apMember[1] = iCmp >= 0 ? &pB->aMember[iB++] : 0;
+        if ((pRow->zStatus = nadekoDiffStatus(pRow))) continue;
+        for (int i = 0; i < 2; i++) {
+            if (pRow->apMember[i]->isHashed) continue;
+            pRow->apMember[i]->isWanted = 1;
+            isAmbiguous[i] = 1;
+        }
+    }
+
+    for (int i = 0; i < 2 && rc == SQLITE_OK; i++) {
+        if (isAmbiguous[i]) rc = nadekoDiffScan(&pCur->aSide[i], azFilename[i], 1, pzErr);
+    }
+    for (int n = 0; n < pCur->nRow && rc == SQLITE_OK; n++) {
+        if (pCur->aRow[n].zStatus == 0) {
+            pCur->aRow[n].zStatus = nadekoDiffStatus(&pCur->aRow[n]);
+        }
+    }
+
+    return rc;
+}
+
+/*
+** The nadekoDiffConnect() method is invoked to create the eponymous
+** nadeko_diff table.
+*/
+static int nadekoDiffConnect(sqlite3 *db,
+    void *pAuxUnused,
+    int argcUnused,
+    const char *const *argvUnused,
+    sqlite3_vtab **ppVtab,
+    char **pzErrUnused) {
+    (void)(pAuxUnused);
+    (void)(argcUnused);
+    (void)(argvUnused);
+    (void)(pzErrUnused);
+
+    sqlite3_vtab *pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = pNew;
+    if (pNew == 0) return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+
+#define NADEKO_DIFF_FILENAME 0
+#define NADEKO_DIFF_STATUS 1
+#define NADEKO_DIFF_SIZE_A 2
+#define NADEKO_DIFF_SIZE_B 3
+#define NADEKO_DIFF_A 4
+#define NADEKO_DIFF_B 5
+    return sqlite3_declare_vtab(db,
+        "CREATE TABLE x(filename TEXT, status TEXT, size_a INTEGER, size_b INTEGER, "
+        "a HIDDEN, b HIDDEN)");
+}
+
+/*
+** This method is the destructor for the nadeko_diff table.
+*/
+static int nadekoDiffDisconnect(sqlite3_vtab *pVtab) {
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+/*
+** Constructor for a new nadeko_diff_cursor object.
+*/
+static int nadekoDiffOpen(sqlite3_vtab *pVTabUnused, sqlite3_vtab_cursor **ppVtabCur) {
+    (void)(pVTabUnused);
+
+    nadeko_diff_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+    if (pCur == 0) return SQLITE_NOMEM;
+    memset(pCur, 0, sizeof(*pCur));
+    *ppVtabCur = &pCur->base;
+    return SQLITE_OK;
+}
+
+/*
+** Destructor for a nadeko_diff_cursor.
+*/
+static int nadekoDiffClose(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_diff_cursor *pCur = (nadeko_diff_cursor *)pVtabCur;
+    nadekoDiffReset(pCur);
+    sqlite3_free(pCur);
+    return SQLITE_OK;
+}
+
+/*
+** Advance a nadeko_diff_cursor to its next row of output.
+*/
+static int nadekoDiffNext(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_diff_cursor *pCur = (nadeko_diff_cursor *)pVtabCur;
+    pCur->iRow++;
+    return SQLITE_OK;
+}
+
+/*
+** Return values of columns for the row at which the nadeko_diff_cursor
+** is currently pointing.
+*/
+static int nadekoDiffColumn(sqlite3_vtab_cursor *pVtabCur, /* The cursor */
+    sqlite3_context *pCtx, /* First argument to sqlite3_result_...() */
+    int iColumn            /* Which column to return */
+) {
+    nadeko_diff_cursor *pCur = (nadeko_diff_cursor *)pVtabCur;
+    nadeko_diff_row *pRow = &pCur->aRow[pCur->iRow];
+    nadeko_diff_member *pMember = pRow->apMember[pRow->apMember[0] == 0];
+    switch (iColumn) {
+    case NADEKO_DIFF_FILENAME:
+        sqlite3_result_text(pCtx, pMember->zName, -1, SQLITE_TRANSIENT);
+        break;
+    case NADEKO_DIFF_STATUS:
+        sqlite3_result_text(pCtx, pRow->zStatus, -1, SQLITE_STATIC);
+        break;
+    case NADEKO_DIFF_SIZE_A:
+    case NADEKO_DIFF_SIZE_B:
+        pMember = pRow->apMember[iColumn - NADEKO_DIFF_SIZE_A];
+        if (pMember) sqlite3_result_int64(pCtx, pMember->nSize);
+        break;
+    default:
+        break;
+    }
+    return SQLITE_OK;
+}
+
+/*
+** Return the rowid for the current row.
+*/
+static int nadekoDiffRowid(sqlite3_vtab_cursor *pVtabCur, sqlite_int64 *pRowid) {
+    nadeko_diff_cursor *pCur = (nadeko_diff_cursor *)pVtabCur;
+    *pRowid = pCur->iRow + 1;
+    return SQLITE_OK;
+}
+
+/*
+** Return TRUE if the cursor has been moved off of the last
+** row of output.
+*/
+static int nadekoDiffEof(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_diff_cursor *pCur = (nadeko_diff_cursor *)pVtabCur;
+    return pCur->iRow >= pCur->nRow;
+}
+
+/*
+** Compare the two archives or directories given as arguments.
+*/
+static int nadekoDiffFilter(sqlite3_vtab_cursor *pVtabCur,
+    int idxNumUnused,
+    const char *idxStrUnused,
+    int argcUnused,
+    sqlite3_value **argv) {
+    (void)(idxNumUnused);
+    (void)(idxStrUnused);
+    (void)(argcUnused);
+
+    nadeko_diff_cursor *pCur = (nadeko_diff_cursor *)pVtabCur;
+    const char *azFilename[2] = {(const char *)(sqlite3_value_text(argv[0])),
+        (const char *)(sqlite3_value_text(argv[1]))};
+    nadekoDiffReset(pCur);
+    if (azFilename[0] == 0 || azFilename[1] == 0) {
+        pVtabCur->pVtab->zErrMsg =
+            sqlite3_mprintf("arguments to nadeko_diff() not two filenames");
+        return SQLITE_ERROR;
+    }
+
+    char *zErr = 0;
+    int rc = nadekoDiffCompute(pCur, azFilename, &zErr);
+    if (rc) {
+        sqlite3_free(pVtabCur->pVtab->zErrMsg);
+        pVtabCur->pVtab->zErrMsg = zErr;
+        nadekoDiffReset(pCur);
+    } else {
+        sqlite3_free(zErr);
+    }
+
+    return rc;
+}
+
+/*
+** SQLite will invoke this method one or more times while planning a query
+** that uses the table.  Both archives are required.
+*/
+static int nadekoDiffBestIndex(sqlite3_vtab *pVTabUnused, sqlite3_index_info *pIdxInfo) {
+    (void)(pVTabUnused);
+
+    int nArg = 0;
+    const struct sqlite3_index_constraint *pConstraint = pIdxInfo->aConstraint;
+    for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++) {
+        int iArg = pConstraint->iColumn - NADEKO_DIFF_A;
+        if (pConstraint->usable && pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ &&
+            (iArg == 0 || iArg == 1)) {
+            pIdxInfo->aConstraintUsage[i].argvIndex = iArg + 1;
+            pIdxInfo->aConstraintUsage[i].omit = 1;
+            nArg++;
+        }
+    };
+
+    return nArg == 2 ? SQLITE_OK : SQLITE_CONSTRAINT;
+}
+
+/*
+** This following structure defines all the methods for the
+** nadeko_diff table, which compares two archives or directories by the
+** sizes and recorded digests of their members, hashing contents only
+** where these cannot tell members apart.
+**
+**     SELECT filename, status FROM nadeko_diff('./monday.tar', './tuesday.tar');
+*/
+static sqlite3_module nadekoDiffModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ nadekoDiffConnect,
+    /* xBestIndex  */ nadekoDiffBestIndex,
+    /* xDisconnect */ nadekoDiffDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ nadekoDiffOpen,
+    /* xClose      */ nadekoDiffClose,
+    /* xFilter     */ nadekoDiffFilter,
+    /* xNext       */ nadekoDiffNext,
+    /* xEof        */ nadekoDiffEof,
+    /* xColumn     */ nadekoDiffColumn,
+    /* xRowid      */ nadekoDiffRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+
+/* nadeko_catalog_vtab is a subclass of sqlite3_vtab which is the
+** underlying representation of a nadeko_catalog table
+*/
+typedef struct nadeko_catalog_vtab nadeko_catalog_vtab;
+struct nadeko_catalog_vtab {
+    sqlite3_vtab base; /* Base class - must be first */
+    sqlite3 *db;       /* Database connection */
+    char *zDb;         /* Schema of the shadow tables */
+    char *zMember;     /* Members of the cataloged archives */
+    char *zFilter;     /* Archives and the filters over their member names */
+};
+
+/* nadeko_catalog_cursor is a subclass of sqlite3_vtab_cursor which scans
+** over the cataloged members, testing the filters of all archives first
+** if looking up a member by name
+*/
+typedef struct nadeko_catalog_cursor nadeko_catalog_cursor;
+struct nadeko_catalog_cursor {
+    sqlite3_vtab_cursor base; /* Base class - must be first */
+    sqlite3_stmt *pStmt;      /* Statement returning the current row */
+    sqlite3_stmt *pFilter;    /* Filters of all archives if looking up by name */
+    sqlite3_uint64 iHash;     /* Hash of the name looked up */
+    int isEof;                /* True once all rows were returned */
+};
+
+/*
+** Return the hash of the given member name underlying the bit positions
+** in the filters of the catalog.
+*/
+static sqlite3_uint64 nadekoBloomHash(const char *zName) {
+    sqlite3_uint64 iValue = nadekoHash(NADEKO_HASH_INIT, zName, (int)(strlen(zName)));
+    iValue = (iValue ^ (iValue >> 30)) * 0xbf58476d1ce4e5b9ull;
+    iValue = (iValue ^ (iValue >> 27)) * 0x94d049bb133111ebull;
+    return iValue ^ (iValue >> 31);
+}
+
+/*
+** Return the position of the n-th bit set for the given hash in a filter
+** of the given number of bits, using double hashing.
+*/
+static sqlite3_uint64 nadekoBloomBit(sqlite3_uint64 iHash, int n, sqlite3_uint64 nBit) {
+    sqlite3_uint64 iStep = (iHash >> 32) | 1;
+    return ((iHash & 0xffffffffu) + n * iStep) % nBit;
+}
+
+/*
+** Return true if the given filter may contain the name with the given
+** hash.  Filters of archives still being cataloged contain all names.
+*/
+static int nadekoBloomTest(
+    const unsigned char *aFilter, int nFilter, sqlite3_uint64 iHash) {
+    if (nFilter == 0) return 1;
+    for (int n = 0; n < NADEKO_BLOOM_HASHES; n++) {
+        sqlite3_uint64 iBit = nadekoBloomBit(iHash, n, (sqlite3_uint64)(nFilter) * 8);
+        if (!(aFilter[iBit / 8] & (1 << (iBit % 8)))) return 0;
+    }
+
+    return 1;
+}
+
+/*
+** Replace the members of the given archive or directory in the catalog
+** by those read from its headers, along with the filter over their
+** names, and return the id of the archive.  Contents are never read, so
+** the hash of a member is only known if the format records a digest.
+*/
+static int nadekoCatalogScan(nadeko_catalog_vtab *pCat,
+    const char *zArchive,
+    sqlite3_int64 *piArchive,
+    char **pzErr) {
+    struct archive *a;
+    int isFilesystem = nadekoIsDirectory(zArchive);
+    int rc = isFilesystem ? nadekoOpenDirectory(&a, zArchive, pzErr)
+                          : nadekoOpenArchive(&a, zArchive, pzErr);
+    if (rc) return SQLITE_ERROR;
+
+    sqlite3_stmt *pInsert = 0;
+    sqlite3_uint64 *aHash = 0;
+    int nHash = 0, nAlloc = 0;
+    rc = nadekoExecPrintf(pCat->db,
+        pzErr,
+        "DELETE FROM %s.%s WHERE archive = (SELECT id FROM %s.%s WHERE archive = %Q);"
+        "INSERT OR REPLACE INTO %s.%s (id, archive, filter) "
+        "VALUES ((SELECT id FROM %s.%s WHERE archive = %Q), %Q, NULL)",
+        pCat->zDb,
+        pCat->zMember,
+        pCat->zDb,
+        pCat->zFilter,
+        zArchive,
+        pCat->zDb,
+        pCat->zFilter,
+        pCat->zDb,
+        pCat->zFilter,
+        zArchive,
+        zArchive);
+    *piArchive = sqlite3_last_insert_rowid(pCat->db);
+    if (rc == SQLITE_OK) {
+        char *zIns = sqlite3_mprintf("INSERT OR REPLACE INTO %s.%s "
+                                     "(archive, member, size, mtime, hash) "
+                                     "VALUES (?, ?, ?, ?, ?)",
+            pCat->zDb,
+            pCat->zMember);
+        rc = sqlite3_prepare_v2(pCat->db, zIns, -1, &pInsert, 0);
+        sqlite3_free(zIns);
+    }
+
+    TIMELINE_BEGIN("nadeko", "catalog", zArchive);
+    while (rc == SQLITE_OK) {
+        struct archive_entry *pEntry;
+        int iHeader = nadekoArchiveNextHeader(a, &pEntry);
+        if (iHeader == ARCHIVE_EOF) break;
+        if (iHeader != ARCHIVE_OK) {
+            *pzErr = sqlite3_mprintf("%s: %s", zArchive, archive_error_string(a));
+            rc = SQLITE_ERROR;
+            break;
+        }
+        const char *zName = archive_entry_pathname(pEntry);
+        if (isFilesystem) {
+            zName += strlen(zArchive);
+            if (zName[0] == '/') zName++;
+        }
+        PROGRESS_ENTRY(zName);
+
+        if (nHash == nAlloc) {
+            nAlloc = nAlloc ? 2 * nAlloc : 256;
+            sqlite3_uint64 *aNew =
+                sqlite3_realloc64(aHash, (sqlite3_int64)(nAlloc) * sizeof(*aNew));
+            if (aNew == 0) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            aHash = aNew;
+        }
+        aHash[nHash++] = nadekoBloomHash(zName);
+
+        const unsigned char *aDigest =
+            archive_entry_digest(pEntry, ARCHIVE_ENTRY_DIGEST_SHA256);
+        int isDigest = 0;
+        for (int n = 0; aDigest && n < 32; n++) isDigest |= aDigest[n] != 0;
+        sqlite3_bind_int64(pInsert, 1, *piArchive);
+        sqlite3_bind_text(pInsert, 2, zName, -1, SQLITE_TRANSIENT);
+        if (archive_entry_size_is_set(pEntry)) {
+            sqlite3_bind_int64(pInsert, 3, archive_entry_size(pEntry));
+        } else {
+            sqlite3_bind_null(pInsert, 3);
+        }
+        if (archive_entry_mtime_is_set(pEntry)) {
+            sqlite3_bind_int64(pInsert, 4, archive_entry_mtime(pEntry));
+        } else {
+            sqlite3_bind_null(pInsert, 4);
+        }
+        if (isDigest) {
+            sqlite3_bind_blob(pInsert, 5, aDigest, 32, SQLITE_TRANSIENT);
+        } else {
+            sqlite3_bind_null(pInsert, 5);
+        }
+        if (sqlite3_step(pInsert) != SQLITE_DONE) {
+            *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(pCat->db));
+            rc = SQLITE_ERROR;
+        }
+        sqlite3_reset(pInsert);
+    }
+    TIMELINE_END("nadeko", "catalog");
+    sqlite3_finalize(pInsert);
+    archive_read_free(a);
+
+    // Filters are sized for their archive, with NADEKO_BLOOM_BITS bits per
+    // member giving about 1% false positives
+    sqlite3_uint64 nBit = ((sqlite3_uint64)(nHash) * NADEKO_BLOOM_BITS + 63) / 64 * 64;
+    if (nBit == 0) nBit = 64;
+    unsigned char *aFilter = rc ? 0 : sqlite3_malloc64(nBit / 8);
+    if (rc == SQLITE_OK && aFilter == 0) rc = SQLITE_NOMEM;
+    if (rc == SQLITE_OK) {
+        memset(aFilter, 0, nBit / 8);
+        for (int i = 0; i < nHash; i++) {
+            for (int n = 0; n < NADEKO_BLOOM_HASHES; n++) {
+                sqlite3_uint64 iBit = nadekoBloomBit(aHash[i], n, nBit);
+                aFilter[iBit / 8] |= 1 << (iBit % 8);
+            }
+        }
+        char *zUpd = sqlite3_mprintf(
+            "UPDATE %s.%s SET filter = ? WHERE id = ?", pCat->zDb, pCat->zFilter);
+        rc = sqlite3_prepare_v2(pCat->db, zUpd, -1, &pInsert, 0);
+        sqlite3_free(zUpd);
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_blob64(pInsert, 1, aFilter, nBit / 8, SQLITE_STATIC);
+            sqlite3_bind_int64(pInsert, 2, *piArchive);
+            if (sqlite3_step(pInsert) != SQLITE_DONE) rc = SQLITE_ERROR;
+            sqlite3_finalize(pInsert);
+        }
+    }
+    sqlite3_free(aFilter);
+    sqlite3_free(aHash);
+
+    return rc;
+}
+
+/*
+** This method is the destructor for nadeko_catalog_vtab objects.
+*/
+static int nadekoCatalogDisconnect(sqlite3_vtab *pVtab) {
+    nadeko_catalog_vtab *pCat = (nadeko_catalog_vtab *)(pVtab);
+    sqlite3_free(pCat->zDb);
+    sqlite3_free(pCat->zMember);
+    sqlite3_free(pCat->zFilter);
+    sqlite3_free(pCat);
+    return SQLITE_OK;
+}
+
+/*
+** The nadekoCatalogConnect() method is invoked to connect to an existing
+** nadeko_catalog table, which takes no arguments.
+*/
+static int nadekoCatalogConnect(sqlite3 *db,
+    void *pAuxUnused,
+    int argc,
+    const char *const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr) {
+    (void)(pAuxUnused);
+
+    nadeko_catalog_vtab *pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)(pNew);
+    if (pNew == 0) return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->db = db;
+    pNew->zDb = sqlite3_mprintf("%s", argv[1]);
+    pNew->zMember = sqlite3_mprintf("%s_member", argv[2]);
+    pNew->zFilter = sqlite3_mprintf("%s_filter", argv[2]);
+    if (pNew->zDb == 0 || pNew->zMember == 0 || pNew->zFilter == 0) {
+        nadekoCatalogDisconnect(&pNew->base);
+        *ppVtab = 0;
+        return SQLITE_NOMEM;
+    }
+    if (argc > 3) {
+        nadekoCatalogDisconnect(&pNew->base);
+        *ppVtab = 0;
+        *pzErr = sqlite3_mprintf("wrong number of arguments to nadeko_catalog()");
+        return SQLITE_ERROR;
+    }
+
+#define NADEKO_CATALOG_ARCHIVE 0
+#define NADEKO_CATALOG_MEMBER 1
+    return sqlite3_declare_vtab(db,
+        "CREATE TABLE x(archive TEXT, member TEXT, size INTEGER, mtime INTEGER, "
+        "hash BLOB)");
+}
+
+/*
+** The nadekoCatalogCreate() method is invoked to create a new
+** nadeko_catalog table and its shadow tables.
+*/
+static int nadekoCatalogCreate(sqlite3 *db,
+    void *pAux,
+    int argc,
+    const char *const *argv,
+    sqlite3_vtab **ppVtab,
+    char **pzErr) {
+    int rc = nadekoCatalogConnect(db, pAux, argc, argv, ppVtab, pzErr);
+    if (rc) return rc;
+
+    // Members are only indexed by archive, as the filters stand in for an
+    // index over the names of all members
+    nadeko_catalog_vtab *pCat = (nadeko_catalog_vtab *)(*ppVtab);
+    if ((rc = nadekoExecPrintf(db,
+             pzErr,
+             "CREATE TABLE IF NOT EXISTS %s.%s ("
+             "  id INTEGER PRIMARY KEY,"
+             "  archive TEXT UNIQUE,"
+             "  filter BLOB"
+             ");"
+             "CREATE TABLE IF NOT EXISTS %s.%s ("
+             "  archive INTEGER,"
+             "  member TEXT,"
+             "  size INTEGER,"
+             "  mtime INTEGER,"
+             "  hash BLOB,"
+             "  PRIMARY KEY (archive, member)"
+             ") WITHOUT ROWID",
+             pCat->zDb,
+             pCat->zFilter,
+             pCat->zDb,
+             pCat->zMember))) {
+        nadekoCatalogDisconnect(*ppVtab);
+        *ppVtab = 0;
+    }
+
+    return rc;
+}
+
+/*
+** This method is the destructor for nadeko_catalog_vtab objects as well
+** as their shadow tables.
+*/
+static int nadekoCatalogDestroy(sqlite3_vtab *pVtab) {
+    nadeko_catalog_vtab *pCat = (nadeko_catalog_vtab *)(pVtab);
+    int rc = nadekoExecPrintf(pCat->db,
+        0,
+        "DROP TABLE IF EXISTS %s.%s; DROP TABLE IF EXISTS %s.%s",
+        pCat->zDb,
+        pCat->zMember,
+        pCat->zDb,
+        pCat->zFilter);
+    return rc || nadekoCatalogDisconnect(pVtab);
+}
+
+/*
+** Constructor for a new nadeko_catalog_cursor object.
+*/
+static int nadekoCatalogOpen(sqlite3_vtab *pVTabUnused, sqlite3_vtab_cursor **ppVtabCur) {
+    (void)(pVTabUnused);
+
+    nadeko_catalog_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+    if (pCur == 0) return SQLITE_NOMEM;
+    memset(pCur, 0, sizeof(*pCur));
+    *ppVtabCur = &pCur->base;
+    return SQLITE_OK;
+}
+
+/*
+** Release the statements of the given cursor.
+*/
+static void nadekoCatalogReset(nadeko_catalog_cursor *pCur) {
+    sqlite3_finalize(pCur->pStmt);
+    sqlite3_finalize(pCur->pFilter);
+    pCur->pStmt = 0;
+    pCur->pFilter = 0;
+    pCur->isEof = 1;
+}
+
+/*
+** Destructor for a nadeko_catalog_cursor.
+*/
+static int nadekoCatalogClose(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_catalog_cursor *pCur = (nadeko_catalog_cursor *)pVtabCur;
+    nadekoCatalogReset(pCur);
+    sqlite3_free(pCur);
+    return SQLITE_OK;
+}
+
+/*
+** Advance a nadeko_catalog_cursor to its next row of output.  If looking
+** up a member by name, only archives whose filter may contain the name
+** are searched for it.
+*/
+static int nadekoCatalogNext(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_catalog_cursor *pCur = (nadeko_catalog_cursor *)pVtabCur;
+    if (pCur->pFilter == 0) {
+        int rc = sqlite3_step(pCur->pStmt);
+        pCur->isEof = rc != SQLITE_ROW;
+        return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+    }
+
+    for (;;) {
+        int rc = sqlite3_step(pCur->pFilter);
+        if (rc != SQLITE_ROW) {
+            pCur->isEof = 1;
+            return rc == SQLITE_DONE ? SQLITE_OK : rc;
+        }
+        if (!nadekoBloomTest(sqlite3_column_blob(pCur->pFilter, 2),
+                sqlite3_column_bytes(pCur->pFilter, 2),
+                pCur->iHash)) {
+            continue;
+        }
+        sqlite3_reset(pCur->pStmt);
+        sqlite3_bind_value(pCur->pStmt, 1, sqlite3_column_value(pCur->pFilter, 0));
+        sqlite3_bind_value(pCur->pStmt, 3, sqlite3_column_value(pCur->pFilter, 1));
+        if ((rc = sqlite3_step(pCur->pStmt)) == SQLITE_ROW) return SQLITE_OK;
+        if (rc != SQLITE_DONE) return rc;
+    }
+}
+
+/*
+** Return values of columns for the row at which the nadeko_catalog_cursor
+** is currently pointing.
+*/
+static int nadekoCatalogColumn(sqlite3_vtab_cursor *pVtabCur, /* The cursor */
+    sqlite3_context *pCtx, /* First argument to sqlite3_result_...() */
+    int iColumn            /* Which column to return */
+) {
+    nadeko_catalog_cursor *pCur = (nadeko_catalog_cursor *)pVtabCur;
+    sqlite3_result_value(pCtx, sqlite3_column_value(pCur->pStmt, iColumn));
+    return SQLITE_OK;
+}
+
+/*
+** Return the rowid for the current row, which is the id of its archive.
+*/
+static int nadekoCatalogRowid(sqlite3_vtab_cursor *pVtabCur, sqlite_int64 *pRowid) {
+    nadeko_catalog_cursor *pCur = (nadeko_catalog_cursor *)pVtabCur;
+    *pRowid = sqlite3_column_int64(pCur->pStmt, 5);
+    return SQLITE_OK;
+}
+
+/*
+** Return TRUE if the cursor has been moved off of the last
+** row of output.
+*/
+static int nadekoCatalogEof(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_catalog_cursor *pCur = (nadeko_catalog_cursor *)pVtabCur;
+    return pCur->isEof;
+}
+
+/*
+** Start a scan of the catalog as planned by nadekoCatalogBestIndex(),
+** where bit 0 of idxNum restricts the archive and bit 1 the member.
+*/
+static int nadekoCatalogFilter(sqlite3_vtab_cursor *pVtabCur,
+    int idxNum,
+    const char *idxStrUnused,
+    int argc,
+    sqlite3_value **argv) {
+    (void)(idxStrUnused);
+
+    nadeko_catalog_cursor *pCur = (nadeko_catalog_cursor *)pVtabCur;
+    nadeko_catalog_vtab *pCat = (nadeko_catalog_vtab *)(pVtabCur->pVtab);
+    nadekoCatalogReset(pCur);
+
+    char *zSql;
+    int rc = SQLITE_OK;
+    if (idxNum == 2) {
+        const char *zName = (const char *)(sqlite3_value_text(argv[0]));
+        if (zName == 0) return SQLITE_OK;
+        pCur->iHash = nadekoBloomHash(zName);
+        zSql = sqlite3_mprintf("SELECT id, archive, filter FROM %s.%s",
+            pCat->zDb,
+            pCat->zFilter);
+        rc = zSql ? sqlite3_prepare_v2(pCat->db, zSql, -1, &pCur->pFilter, 0)
+                  : SQLITE_NOMEM;
+        sqlite3_free(zSql);
+        zSql = sqlite3_mprintf("SELECT ?3, member, size, mtime, hash, archive "
+                               "FROM %s.%s WHERE archive = ?1 AND member = ?2",
+            pCat->zDb,
+            pCat->zMember);
+    } else {
+        zSql = sqlite3_mprintf("SELECT f.archive, m.member, m.size, m.mtime, m.hash, "
+                               "m.archive FROM %s.%s AS f JOIN %s.%s AS m "
+                               "ON m.archive = f.id WHERE %s AND %s",
+            pCat->zDb,
+            pCat->zFilter,
+            pCat->zDb,
+            pCat->zMember,
+            idxNum & 1 ? "f.archive = ?1" : "1",
+            idxNum & 2 ? "m.member = ?2" : "1");
+    }
+    if (rc == SQLITE_OK) {
+        rc = zSql ? sqlite3_prepare_v2(pCat->db, zSql, -1, &pCur->pStmt, 0)
+                  : SQLITE_NOMEM;
+    }
+    sqlite3_free(zSql);
+    if (rc) {
+        pVtabCur->pVtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(pCat->db));
+        return rc;
+    }
+    for (int n = 0; n < argc; n++) {
+        sqlite3_bind_value(pCur->pStmt, idxNum == 2 ? 2 : n + 1, argv[n]);
+    }
+    pCur->isEof = 0;
+
+    return nadekoCatalogNext(pVtabCur);
+}
+
+/*
+** SQLite will invoke this method one or more times while planning a query
+** that uses the table.  Looking up members by name tests the filters of
+** all archives, which is cheaper than a scan of all members but more
+** expensive than looking up the members of a single archive.
+*/
+static int nadekoCatalogBestIndex(
+    sqlite3_vtab *pVTabUnused, sqlite3_index_info *pIdxInfo) {
+    (void)(pVTabUnused);
+
+    int aConstraint[2] = {-1, -1};
+    const struct sqlite3_index_constraint *pConstraint = pIdxInfo->aConstraint;
+    for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++) {
+        if (pConstraint->usable && pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ &&
+            (pConstraint->iColumn == NADEKO_CATALOG_ARCHIVE ||
+                pConstraint->iColumn == NADEKO_CATALOG_MEMBER)) {
+            aConstraint[pConstraint->iColumn] = i;
+        }
+    };
+
+    int nArg = 0;
+    pIdxInfo->idxNum = 0;
+    for (int n = 0; n < 2; n++) {
+        if (aConstraint[n] < 0) continue;
+        pIdxInfo->aConstraintUsage[aConstraint[n]].argvIndex = ++nArg;
+        pIdxInfo->aConstraintUsage[aConstraint[n]].omit = 1;
+        pIdxInfo->idxNum |= 1 << n;
+    }
+    pIdxInfo->estimatedCost = pIdxInfo->idxNum == 0   ? 1e7
+                              : pIdxInfo->idxNum == 2 ? 1e4
+                                                      : 10;
+    pIdxInfo->estimatedRows = pIdxInfo->idxNum == 0 ? 1000000 : 10;
+
+    return SQLITE_OK;
+}
+
+/*
+** SQLite will invoke this method to determine whether a certain real table
+** is in fact a shadow table for a nadeko_catalog table.
+*/
+static int nadekoCatalogShadowName(const char *pName) {
+    return !sqlite3_stricmp(pName, "member") || !sqlite3_stricmp(pName, "filter");
+}
+
+/*
+** Catalog the archive given as the only value of an inserted row, and
+** remove all members of the archive of a deleted row.
+*/
+static int nadekoCatalogUpdate(
+    sqlite3_vtab *pVtab, int argc, sqlite3_value **argv, sqlite_int64 *pRowid) {
+    nadeko_catalog_vtab *pCat = (nadeko_catalog_vtab *)(pVtab);
+
+    if (argc == 1) {
+        // DELETE
+        return nadekoExecPrintf(pCat->db,
+            &pVtab->zErrMsg,
+            "DELETE FROM %s.%s WHERE archive = %lld;"
+            "DELETE FROM %s.%s WHERE id = %lld",
+            pCat->zDb,
+            pCat->zMember,
+            sqlite3_value_int64(argv[0]),
+            pCat->zDb,
+            pCat->zFilter,
+            sqlite3_value_int64(argv[0]));
+    }
+
+    int isOnlyArchive = 1;
+    for (int n = 3; n < argc; n++) {
+        isOnlyArchive &= sqlite3_value_type(argv[n]) == SQLITE_NULL;
+    }
+    const char *zArchive = (const char *)(sqlite3_value_text(argv[2]));
+    if (sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+        pVtab->zErrMsg = sqlite3_mprintf("nadeko_catalog() rows cannot be updated");
+        return SQLITE_ERROR;
+    } else if (zArchive == 0 || !isOnlyArchive) {
+        pVtab->zErrMsg =
+            sqlite3_mprintf("only the archive is inserted into nadeko_catalog()");
+        return SQLITE_ERROR;
+    }
+
+    char *zErr = 0;
+    int rc = nadekoCatalogScan(pCat, zArchive, pRowid, &zErr);
+    if (rc) {
+        sqlite3_free(pVtab->zErrMsg);
+        pVtab->zErrMsg = zErr ? zErr : sqlite3_mprintf("%s", sqlite3_errmsg(pCat->db));
+    }
+
+    return rc;
+}
+
+/*
+** This following structure defines all the methods for the
+** nadeko_catalog table, which records the members of any number of
+** archives, read from their headers alone, together with a Bloom filter
+** over the member names of each archive, so that looking up a member by
+** name only searches the archives which may contain it.
+**
+**     CREATE VIRTUAL TABLE fleet USING nadeko_catalog;
+**     INSERT INTO fleet(archive) VALUES ('./monday.tar'), ('./tuesday.tar');
+**     SELECT archive, size FROM fleet WHERE member = 'example.txt';
+*/
+static sqlite3_module nadekoCatalogModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ nadekoCatalogCreate,
+    /* xConnect    */ nadekoCatalogConnect,
+    /* xBestIndex  */ nadekoCatalogBestIndex,
+    /* xDisconnect */ nadekoCatalogDisconnect,
+    /* xDestroy    */ nadekoCatalogDestroy,
+    /* xOpen       */ nadekoCatalogOpen,
+    /* xClose      */ nadekoCatalogClose,
+    /* xFilter     */ nadekoCatalogFilter,
+    /* xNext       */ nadekoCatalogNext,
+    /* xEof        */ nadekoCatalogEof,
+    /* xColumn     */ nadekoCatalogColumn,
+    /* xRowid      */ nadekoCatalogRowid,
+    /* xUpdate     */ nadekoCatalogUpdate,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ nadekoCatalogShadowName};
+
+/* nadeko_extract_cursor is a subclass of sqlite3_vtab_cursor which scans
+** over the members extracted by the nadeko_extract table
+*/
+typedef struct nadeko_extract_cursor nadeko_extract_cursor;
+struct nadeko_extract_cursor {
+    sqlite3_vtab_cursor base;    /* Base class - must be first */
+    nadeko_extract_row **apRow;  /* Members in archive order */
+    int nRow;                    /* Number of members */
+    int nAlloc;                  /* Allocated size of apRow */
+    int iRow;                    /* Current member */
+};
+
+/*
+** Extract the contents of the current entry of the given archive into
+** the file of the given row.  Members of known size which fit into the
+** buffer are queued for a worker, while others are written right away.
+*/
+static int nadekoExtractMember(struct archive *a,
+    nadeko_extract_pool *pPool,
+    nadeko_extract_row *pRow,
+    nadeko_extract_row ***papSync,
+    int *pnSync,
+    int *pnSyncAlloc) {
+    if (pRow->nSize >= 0 && pRow->nSize <= NADEKO_EXTRACT_BUFFER) {
+        if ((pRow->aData = sqlite3_malloc64(pRow->nSize + 1)) == 0) return SQLITE_NOMEM;
+        sqlite3_int64 nRead = 0;
+        for (;;) {
+            la_ssize_t iRead =
+                archive_read_data(a, pRow->aData + nRead, pRow->nSize - nRead + 1);
+            if (iRead < 0) return SQLITE_ERROR;
+            if (iRead == 0) break;
+            nRead += iRead;
+            PROGRESS_BYTES(iRead);
+            if (nRead > pRow->nSize) return SQLITE_ERROR;
+        }
+        pRow->nSize = nRead;
+
+        return nadekoExtractQueue(pPool, pRow);
+    }
+
+    int fd = nadekoExtractOpen(pRow);
+    for (pRow->nSize = 0;;) {
+        char aBuf[NADEKO_BUFFER_SIZE];
+        la_ssize_t iRead = archive_read_data(a, aBuf, NADEKO_BUFFER_SIZE);
+        if (iRead < 0) {
+            if (fd >= 0) close(fd);
+            return SQLITE_ERROR;
+        }
+        if (iRead == 0) break;
+        if (fd >= 0) nadekoExtractWrite(pRow, fd, (unsigned char *)(aBuf), iRead);
+        pRow->nSize += iRead;
+        PROGRESS_BYTES(iRead);
+    }
+    if (fd >= 0 && close(fd) && pRow->iErrno == 0) pRow->iErrno = errno;
+
+    return nadekoExtractAppend(papSync, pnSync, pnSyncAlloc, pRow);
+}
+
+/*
+** Sync the given directory and the directories within it containing the
+** given rows, including those created by nadekoExtractParents(), once
+** each so that the entries of the synced files are durable as well.
+*/
+static int nadekoExtractSyncParents(
+    const char *zDest, nadeko_extract_row **apRow, int nRow) {
+    char **azDir = 0;
+    int nDir = 0, nAlloc = 0;
+    int rc = SQLITE_OK;
+    for (int n = 0; rc == SQLITE_OK && n < nRow; n++) {
+        if (apRow[n]->zError) continue;
+        const char *zName = apRow[n]->zName;
+        for (const char *z = strchr(zName, '/'); z; z = strchr(z + 1, '/')) {
+            char *zDir = sqlite3_mprintf("%s/%.*s", zDest, (int)(z - zName), zName);
+            if (zDir == 0) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            if (nDir && !strcmp(azDir[nDir - 1], zDir)) {
+                sqlite3_free(zDir);
+                continue;
+            }
+            if (nDir == nAlloc) {
+                nAlloc = nAlloc ? 2 * nAlloc : 64;
+                char **azNew =
+                    sqlite3_realloc64(azDir, (sqlite3_int64)(nAlloc) * sizeof(*azNew));
+                if (azNew == 0) {
+                    sqlite3_free(zDir);
+                    rc = SQLITE_NOMEM;
+                    break;
+                }
+                azDir = azNew;
+            }
+            azDir[nDir++] = zDir;
+        }
+    }
+
+    nDir = nadekoSortUnique(azDir, nDir);
+    for (int n = 0; n < nDir; n++) {
+        if (rc == SQLITE_OK && nadekoSyncPath(azDir[n])) rc = SQLITE_ERROR;
+        sqlite3_free(azDir[n]);
+    }
+    sqlite3_free(azDir);
+    if (rc == SQLITE_OK && nadekoSyncPath(zDest)) rc = SQLITE_ERROR;
+
+    return rc;
+}
+
+/*
+** Extract the members of the given archive or directory matching the
+** given GLOB pattern, or all members if it is NULL, into the given
+** directory, recording the outcome of each member in the given cursor.
+*/
+static int nadekoExtractRun(nadeko_extract_cursor *pCur,
+    const char *zArchive,
+    const char *zDest,
+    const char *zFilter,
+    char **pzErr) {
+    struct archive *a;
+    int isFilesystem = nadekoIsDirectory(zArchive);
+    int rc = isFilesystem ? nadekoOpenDirectory(&a, zArchive, pzErr)
+                          : nadekoOpenArchive(&a, zArchive, pzErr);
+    if (rc) return SQLITE_ERROR;
+
+    int nThread = nadekoThreadCount();
+    nadeko_extract_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.mutex, 0);
+    pthread_cond_init(&pool.work, 0);
+    pthread_cond_init(&pool.room, 0);
+    nadeko_extract_worker *aWorker = sqlite3_malloc(nThread * sizeof(*aWorker));
+    int nWorker = 0;
+    if (aWorker == 0) rc = SQLITE_NOMEM;
+    for (; rc == SQLITE_OK && nWorker < nThread; nWorker++) {
+        memset(&aWorker[nWorker], 0, sizeof(*aWorker));
+        aWorker[nWorker].pPool = &pool;
+        nadeko_extract_worker *p = &aWorker[nWorker];
+        if (pthread_create(&p->thread, 0, nadekoExtractWorkerMain, p)) {
+            rc = SQLITE_ERROR;
+            break;
+        }
+    }
+
+    // Directories are created and files too large for the buffer are
+    // written on this thread, and synced after the workers are done
+    nadeko_extract_row **apSync = 0, **apDir = 0;
+    int nSync = 0, nSyncAlloc = 0, nDir = 0, nDirAlloc = 0;
+    nadeko_extract_seen seen;
+    memset(&seen, 0, sizeof(seen));
+    TIMELINE_BEGIN("nadeko", "extract", zArchive);
+    while (rc == SQLITE_OK) {
+        struct archive_entry *pEntry;
+        int iHeader = nadekoArchiveNextHeader(a, &pEntry);
+        if (iHeader == ARCHIVE_EOF) break;
+        if (iHeader != ARCHIVE_OK) {
+            *pzErr = sqlite3_mprintf("%s: %s", zArchive, archive_error_string(a));
+            rc = SQLITE_ERROR;
+            break;
+        }
+        const char *zName = archive_entry_pathname(pEntry);
+        if (isFilesystem) {
+            zName += strlen(zArchive);
+            if (zName[0] == '/') zName++;
+        }
+        if (zFilter && sqlite3_strglob(zFilter, zName)) continue;
+        PROGRESS_ENTRY(zName);
+
+        nadeko_extract_row *pRow = sqlite3_malloc(sizeof(*pRow));
+        if (pRow == 0) {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+        memset(pRow, 0, sizeof(*pRow));
+        pRow->nSize = -1;
+        pRow->zName = sqlite3_mprintf("%s", zName);
+        pRow->zPath = sqlite3_mprintf("%s/%s", zDest, zName);
+        rc = pRow->zName && pRow->zPath ? SQLITE_OK : SQLITE_NOMEM;
+        if (rc == SQLITE_OK) {
+            rc = nadekoExtractAppend(&pCur->apRow, &pCur->nRow, &pCur->nAlloc, pRow);
+        }
+        if (rc) {
+            sqlite3_free(pRow->zName);
+            sqlite3_free(pRow->zPath);
+            sqlite3_free(pRow);
+            break;
+        }
+
+        mode_t iType = archive_entry_filetype(pEntry);
+        if (nadekoExtractIsUnsafe(zName)) {
+            pRow->zError = "path outside of destination";
+        } else if (iType != AE_IFREG && iType != AE_IFDIR) {
+            pRow->zError = "not a regular file or directory";
+        } else if ((pRow->iErrno = nadekoExtractParents(pRow->zPath))) {
+            continue;
+        } else if (iType == AE_IFDIR) {
+            if (mkdir(pRow->zPath, 0755) && errno != EEXIST) {
+                pRow->iErrno = errno;
+            } else {
+                rc = nadekoExtractAppend(&apDir, &nDir, &nDirAlloc, pRow);
+            }
+        } else {
+            // Archives appended to may contain a path more than once, whose
+            // later members must be written after the earlier ones
+            int isSeen;
+            if ((rc = nadekoExtractSeen(&seen, pRow->zPath, &isSeen))) break;
+            if (isSeen) nadekoExtractDrain(&pool);
+            if (archive_entry_size_is_set(pEntry)) {
+                pRow->nSize = archive_entry_size(pEntry);
+            }
+            rc = nadekoExtractMember(a, &pool, pRow, &apSync, &nSync, &nSyncAlloc);
+            if (rc == SQLITE_ERROR) {
+                *pzErr = sqlite3_mprintf("%s: %s", zArchive, archive_error_string(a));
+            }
+        }
+    }
+    TIMELINE_END("nadeko", "extract");
+    archive_read_free(a);
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.isDone = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.mutex);
+    for (int n = 0; n < nWorker; n++) {
+        pthread_join(aWorker[n].thread, 0);
+        sqlite3_free(aWorker[n].apRow);
+    }
+    if (rc == SQLITE_OK) {
+        nadekoExtractSync(apSync, nSync);
+        nadekoExtractSync(apDir, nDir);
+        rc = nadekoExtractSyncParents(zDest, pCur->apRow, pCur->nRow);
+        if (rc == SQLITE_ERROR) *pzErr = sqlite3_mprintf("cannot sync %s", zDest);
+    }
+
+    sqlite3_free(apSync);
+    sqlite3_free(apDir);
+    sqlite3_free(seen.azPath);
+    sqlite3_free(pool.apJob);
+    sqlite3_free(aWorker);
+    pthread_cond_destroy(&pool.room);
+    pthread_cond_destroy(&pool.work);
+    pthread_mutex_destroy(&pool.mutex);
+
+    return rc;
+}
+
+/*
+** The nadekoExtractConnect() method is invoked to create the eponymous
+** nadeko_extract table.
+*/
+static int nadekoExtractConnect(sqlite3 *db,
+    void *pAuxUnused,
+    int argcUnused,
+    const char *const *argvUnused,
+    sqlite3_vtab **ppVtab,
+    char **pzErrUnused) {
+    (void)(pAuxUnused);
+    (void)(argcUnused);
+    (void)(argvUnused);
+    (void)(pzErrUnused);
+
+    sqlite3_vtab *pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = pNew;
+    if (pNew == 0) return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+
+#define NADEKO_EXTRACT_FILENAME 0
+#define NADEKO_EXTRACT_PATH 1
+#define NADEKO_EXTRACT_SIZE 2
+#define NADEKO_EXTRACT_ERROR 3
+#define NADEKO_EXTRACT_ARCHIVE 4
+#define NADEKO_EXTRACT_DEST 5
+#define NADEKO_EXTRACT_FILTER 6
+    return sqlite3_declare_vtab(db,
+        "CREATE TABLE x(filename TEXT, path TEXT, size INTEGER, error TEXT, "
+        "archive HIDDEN, dest HIDDEN, filter HIDDEN)");
+}
+
+/*
+** This method is the destructor for the nadeko_extract table.
+*/
+static int nadekoExtractDisconnect(sqlite3_vtab *pVtab) {
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+/*
+** Constructor for a new nadeko_extract_cursor object.
+*/
+static int nadekoExtractOpenCursor(
+    sqlite3_vtab *pVTabUnused, sqlite3_vtab_cursor **ppVtabCur) {
+    (void)(pVTabUnused);
+
+    nadeko_extract_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+    if (pCur == 0) return SQLITE_NOMEM;
+    memset(pCur, 0, sizeof(*pCur));
+    *ppVtabCur = &pCur->base;
+    return SQLITE_OK;
+}
+
+/*
+** Release the rows of the given cursor.
+*/
+static void nadekoExtractReset(nadeko_extract_cursor *pCur) {
+    for (int n = 0; n < pCur->nRow; n++) {
+        sqlite3_free(pCur->apRow[n]->zName);
+        sqlite3_free(pCur->apRow[n]->zPath);
+        sqlite3_free(pCur->apRow[n]->aData);
+        sqlite3_free(pCur->apRow[n]);
+    }
+    sqlite3_free(pCur->apRow);
+    pCur->apRow = 0;
+    pCur->nRow = 0;
+    pCur->nAlloc = 0;
+    pCur->iRow = 0;
+}
+
+/*
+** Destructor for a nadeko_extract_cursor.
+*/
+static int nadekoExtractClose(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_extract_cursor *pCur = (nadeko_extract_cursor *)pVtabCur;
+    nadekoExtractReset(pCur);
+    sqlite3_free(pCur);
+    return SQLITE_OK;
+}
+
+/*
+** Advance a nadeko_extract_cursor to its next row of output.
+*/
+static int nadekoExtractNext(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_extract_cursor *pCur = (nadeko_extract_cursor *)pVtabCur;
+    pCur->iRow++;
+    return SQLITE_OK;
+}
+
+/*
+** Return values of columns for the row at which the nadeko_extract_cursor
+** is currently pointing.
+*/
+static int nadekoExtractColumn(sqlite3_vtab_cursor *pVtabCur, /* The cursor */
+    sqlite3_context *pCtx, /* First argument to sqlite3_result_...() */
+    int iColumn            /* Which column to return */
+) {
+    nadeko_extract_cursor *pCur = (nadeko_extract_cursor *)pVtabCur;
+    nadeko_extract_row *pRow = pCur->apRow[pCur->iRow];
+    switch (iColumn) {
+    case NADEKO_EXTRACT_FILENAME:
+        sqlite3_result_text(pCtx, pRow->zName, -1, SQLITE_TRANSIENT);
+        break;
+    case NADEKO_EXTRACT_PATH:
+        if (pRow->zError) break;
+        sqlite3_result_text(pCtx, pRow->zPath, -1, SQLITE_TRANSIENT);
+        break;
+    case NADEKO_EXTRACT_SIZE:
+        if (pRow->nSize >= 0) sqlite3_result_int64(pCtx, pRow->nSize);
+        break;
+    case NADEKO_EXTRACT_ERROR:
+        if (pRow->zError) {
+            sqlite3_result_text(pCtx, pRow->zError, -1, SQLITE_STATIC);
+        } else if (pRow->iErrno) {
+            sqlite3_result_text(pCtx, strerror(pRow->iErrno), -1, SQLITE_TRANSIENT);
+        }
+        break;
+    default:
+        break;
+    }
+    return SQLITE_OK;
+}
+
+/*
+** Return the rowid for the current row.
+*/
+static int nadekoExtractRowid(sqlite3_vtab_cursor *pVtabCur, sqlite_int64 *pRowid) {
+    nadeko_extract_cursor *pCur = (nadeko_extract_cursor *)pVtabCur;
+    *pRowid = pCur->iRow + 1;
+    return SQLITE_OK;
+}
+
+/*
+** Return TRUE if the cursor has been moved off of the last
+** row of output.
+*/
+static int nadekoExtractEof(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_extract_cursor *pCur = (nadeko_extract_cursor *)pVtabCur;
+    return pCur->iRow >= pCur->nRow;
+}
+
+/*
+** Extract the archive given as the first argument into the directory
+** given as the second argument, restricted to the members matching the
+** GLOB pattern given as the optional third argument.
+*/
+static int nadekoExtractFilter(sqlite3_vtab_cursor *pVtabCur,
+    int idxNumUnused,
+    const char *idxStrUnused,
+    int argc,
+    sqlite3_value **argv) {
+    (void)(idxNumUnused);
+    (void)(idxStrUnused);
+
+    nadeko_extract_cursor *pCur = (nadeko_extract_cursor *)pVtabCur;
+    const char *zArchive = (const char *)(sqlite3_value_text(argv[0]));
+    const char *zDest = (const char *)(sqlite3_value_text(argv[1]));
+    const char *zFilter = argc > 2 ? (const char *)(sqlite3_value_text(argv[2])) : 0;
+    nadekoExtractReset(pCur);
+    if (zArchive == 0 || zDest == 0) {
+        pVtabCur->pVtab->zErrMsg =
+            sqlite3_mprintf("arguments to nadeko_extract() not an archive and directory");
+        return SQLITE_ERROR;
+    }
+
+    char *zErr = 0;
+    int rc = nadekoExtractRun(pCur, zArchive, zDest, zFilter, &zErr);
+    if (rc) {
+        sqlite3_free(pVtabCur->pVtab->zErrMsg);
+        pVtabCur->pVtab->zErrMsg = zErr;
+    } else {
+        sqlite3_free(zErr);
+    }
+
+    return rc;
+}
+
+/*
+** SQLite will invoke this method one or more times while planning a query
+** that uses the table.  The archive and directory are required, while
+** the pattern is optional.
+*/
+static int nadekoExtractBestIndex(
+    sqlite3_vtab *pVTabUnused, sqlite3_index_info *pIdxInfo) {
+    (void)(pVTabUnused);
+
+    int aConstraint[3] = {-1, -1, -1};
+    const struct sqlite3_index_constraint *pConstraint = pIdxInfo->aConstraint;
+    for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++) {
+        int iArg = pConstraint->iColumn - NADEKO_EXTRACT_ARCHIVE;
+        if (pConstraint->usable && pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ &&
+            iArg >= 0 && iArg < 3) {
+            aConstraint[iArg] = i;
+        }
+    };
+    if (aConstraint[0] < 0 || aConstraint[1] < 0) return SQLITE_CONSTRAINT;
+
+    for (int n = 0; n < 3 && aConstraint[n] >= 0; n++) {
+        pIdxInfo->aConstraintUsage[aConstraint[n]].argvIndex = n + 1;
+        pIdxInfo->aConstraintUsage[aConstraint[n]].omit = 1;
+    }
+
+    return SQLITE_OK;
+}
+
+/*
+** This following structure defines all the methods for the
+** nadeko_extract table, which extracts the members of an archive
+** matching an optional GLOB pattern straight to a directory, returning
+** the outcome for each member.
+**
+**     SELECT filename, error FROM nadeko_extract('./example.tar', './out', '*.txt');
+*/
+static sqlite3_module nadekoExtractModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ nadekoExtractConnect,
+    /* xBestIndex  */ nadekoExtractBestIndex,
+    /* xDisconnect */ nadekoExtractDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ nadekoExtractOpenCursor,
+    /* xClose      */ nadekoExtractClose,
+    /* xFilter     */ nadekoExtractFilter,
+    /* xNext       */ nadekoExtractNext,
+    /* xEof        */ nadekoExtractEof,
+    /* xColumn     */ nadekoExtractColumn,
+    /* xRowid      */ nadekoExtractRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+
+/* nadeko_convert_block is a header or block of data passed from the
+** thread reading the source archive to the thread writing the target
+*/
+typedef struct nadeko_convert_block nadeko_convert_block;
+struct nadeko_convert_block {
+    nadeko_convert_block *pNext;  /* Next block in the pipe */
+    struct archive_entry *pEntry; /* Header of the next member, if any */
+    int nData;                    /* Size of aData */
+    unsigned char aData[];        /* Data of the current member */
+};
+
+/* nadeko_convert_pipe is the state shared between the reading and the
+** writing thread of nadekoConvertRun()
+*/
+typedef struct nadeko_convert_pipe nadeko_convert_pipe;
+struct nadeko_convert_pipe {
+    struct archive *a;           /* Source archive */
+    const char *zSource;         /* Filename of the source archive */
+    const char *zGlob;           /* Pattern of members to convert, or NULL */
+    int isFilesystem;            /* True if the source is a directory */
+    nadeko_convert_block *pHead; /* Oldest block not yet written */
+    nadeko_convert_block *pTail; /* Newest block */
+    sqlite3_int64 nBuffered;     /* Bytes of data not yet written */
+    int isDone;                  /* True once the reader is done */
+    int isCancelled;             /* True if the writer gave up */
+    char *zErr;                  /* Error of the reader, if any */
+    pthread_mutex_t mutex;
+    pthread_cond_t more; /* Signalled when blocks are added */
+    pthread_cond_t room; /* Signalled when blocks are taken */
+};
+
+/* nadeko_convert_cursor is a subclass of sqlite3_vtab_cursor which scans
+** over the members converted by the nadeko_convert table
+*/
+typedef struct nadeko_convert_cursor nadeko_convert_cursor;
+struct nadeko_convert_cursor {
+    sqlite3_vtab_cursor base; /* Base class - must be first */
+    char **azName;            /* Names of the converted members */
+    sqlite3_int64 *anSize;    /* Sizes of the converted members */
+    int nRow;                 /* Number of converted members */
+    int nAlloc;               /* Allocated size of azName and anSize */
+    int iRow;                 /* Current member */
+};
+
+/*
+** Append the given block to the given pipe, waiting while too much data
+** is buffered.  Return false if the writer gave up.
+*/
+static int nadekoConvertPush(nadeko_convert_pipe *p, nadeko_convert_block *pBlock) {
+    pthread_mutex_lock(&p->mutex);
+    while (p->nBuffered >= NADEKO_CONVERT_BUFFER && !p->isCancelled) {
+        pthread_cond_wait(&p->room, &p->mutex);
+    }
+    int isCancelled = p->isCancelled;
+    if (!isCancelled) {
+        pBlock->pNext = 0;
+        if (p->pTail) {
+            p->pTail->pNext = pBlock;
+        } else {
+            p->pHead = pBlock;
+        }
+        p->pTail = pBlock;
+        p->nBuffered += pBlock->nData;
+        pthread_cond_signal(&p->more);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    if (isCancelled) {
+        archive_entry_free(pBlock->pEntry);
+        sqlite3_free(pBlock);
     }
 
-    return SQLITE_OK;
+    return !isCancelled;
 }
 
-static int nadekoBegin(sqlite3_vtab *pVtab) {
-    nadeko_vtab *pNdk = (nadeko_vtab *)(pVtab);
-    if (pNdk->isFilesystem) {
-        pVtab->zErrMsg = sqlite3_mprintf("directories are not writable using nadeko()");
-        return SQLITE_ERROR;
-    } else {
-        pNdk->iBegun = 1;
-        return SQLITE_OK;
+/*
+** Take the oldest block from the given pipe, waiting for the reader.
+** Return NULL once the reader is done.
+*/
+static nadeko_convert_block *nadekoConvertPop(nadeko_convert_pipe *p) {
+    pthread_mutex_lock(&p->mutex);
+    while (p->pHead == 0 && !p->isDone) pthread_cond_wait(&p->more, &p->mutex);
+    nadeko_convert_block *pBlock = p->pHead;
+    if (pBlock) {
+        p->pHead = pBlock->pNext;
+        if (p->pHead == 0) p->pTail = 0;
+        p->nBuffered -= pBlock->nData;
+        pthread_cond_signal(&p->room);
     }
+    pthread_mutex_unlock(&p->mutex);
+
+    return pBlock;
 }
 
-static int nadekoSync(sqlite3_vtab *pVtab) {
-    nadeko_vtab *pNdk = (nadeko_vtab *)(pVtab);
-    if (pNdk->iBegun == 0) {
-        return SQLITE_OK;
+/*
+** Main loop of the thread reading and decompressing the source archive.
+*/
+static void *nadekoConvertReaderMain(void *pArg) {
+    nadeko_convert_pipe *p = pArg;
+    char *zErr = 0;
+    for (int isOpen = 1; isOpen && zErr == 0;) {
+        struct archive_entry *pEntry;
+        int iHeader = nadekoArchiveNextHeader(p->a, &pEntry);
+        if (iHeader == ARCHIVE_EOF) break;
+        if (iHeader != ARCHIVE_OK) {
+            zErr = sqlite3_mprintf("%s: %s", p->zSource, archive_error_string(p->a));
+            break;
+        }
+        const char *zName = archive_entry_pathname(pEntry);
+        if (p->isFilesystem) {
+            zName += strlen(p->zSource);
+            if (zName[0] == '/') zName++;
+        }
+        if (p->zGlob && sqlite3_strglob(p->zGlob, zName)) continue;
+
+        nadeko_convert_block *pBlock = sqlite3_malloc(sizeof(*pBlock));
+        if (pBlock == 0 || (pBlock->pEntry = archive_entry_clone(pEntry)) == 0) {
+            sqlite3_free(pBlock);
+            zErr = sqlite3_mprintf("out of memory");
+            break;
+        }
+        pBlock->nData = 0;
+        if (p->isFilesystem) archive_entry_copy_pathname(pBlock->pEntry, zName);
+        isOpen = nadekoConvertPush(p, pBlock);
+
+        while (isOpen) {
+            pBlock = sqlite3_malloc(sizeof(*pBlock) + NADEKO_BUFFER_SIZE);
+            if (pBlock == 0) {
+                zErr = sqlite3_mprintf("out of memory");
+                break;
+            }
+            la_ssize_t iRead = archive_read_data(p->a, pBlock->aData, NADEKO_BUFFER_SIZE);
+            if (iRead <= 0) {
+                if (iRead < 0) {
+                    zErr = sqlite3_mprintf(
+                        "%s: %s", p->zSource, archive_error_string(p->a));
+                }
+                sqlite3_free(pBlock);
+                break;
+            }
+            pBlock->pEntry = 0;
+            pBlock->nData = (int)(iRead);
+            isOpen = nadekoConvertPush(p, pBlock);
+        }
+    }
+
+    pthread_mutex_lock(&p->mutex);
+    p->isDone = 1;
+    p->zErr = zErr;
+    pthread_cond_signal(&p->more);
+    pthread_mutex_unlock(&p->mutex);
+
+    return 0;
+}
+
+/*
+** Split the given options into the pattern of members to convert, given
+** as "glob=PATTERN", and the remaining options, which are passed on to
+** archive_write_set_options().
+*/
+static int nadekoConvertOptions(const char *zOptions, char **pzGlob, char **pzWrite) {
+    sqlite3_str *pWrite = sqlite3_str_new(0);
+    *pzGlob = 0;
+    for (const char *z = zOptions; z && *z;) {
+        int n = (int)(strcspn(z, ","));
+        if (n > 5 && !strncmp(z, "glob=", 5)) {
+            sqlite3_free(*pzGlob);
+            *pzGlob = sqlite3_mprintf("%.*s", n - 5, z + 5);
+        } else if (n > 0) {
+            if (sqlite3_str_length(pWrite)) sqlite3_str_appendchar(pWrite, 1, ',');
+            sqlite3_str_append(pWrite, z, n);
+        }
+        z += z[n] ? n + 1 : n;
+    }
+    int rc = sqlite3_str_errcode(pWrite);
+    *pzWrite = sqlite3_str_finish(pWrite);
+
+    return rc;
+}
+
+/*
+** Set format and filters of the given archive from the extension of the
+** given filename, also accepting compression suffixes which are unknown
+** to archive_write_set_format_filter_by_ext(), such as ".tar.zst".
+*/
+static int nadekoConvertFormat(struct archive *a, const char *zTarget) {
+    static const char *const azSuffix[][2] = {{".zst", "zstd"},
+        {".lz4", "lz4"},
+        {".lz", "lzip"},
+        {".lzo", "lzop"}};
+
+    size_t nTarget = strlen(zTarget);
+    for (size_t n = 0; n < sizeof(azSuffix) / sizeof(*azSuffix); n++) {
+        size_t nSuffix = strlen(azSuffix[n][0]);
+        if (nTarget <= nSuffix || strcmp(zTarget + nTarget - nSuffix, azSuffix[n][0])) {
+            continue;
+        }
+        char *zStem = sqlite3_mprintf("%.*s", (int)(nTarget - nSuffix), zTarget);
+        if (zStem == 0) return ARCHIVE_FATAL;
+        int iStatus = archive_write_set_format_filter_by_ext(a, zStem);
+        sqlite3_free(zStem);
+        if (iStatus != ARCHIVE_OK) return iStatus;
+        return archive_write_add_filter_by_name(a, azSuffix[n][1]);
+    }
+
+    return archive_write_set_format_filter_by_ext(a, zTarget);
+}
+
+/*
+** Record the given member as converted by the given cursor.
+*/
+static int nadekoConvertAppend(
+    nadeko_convert_cursor *pCur, const char *zName, sqlite3_int64 nSize) {
+    if (pCur->nRow == pCur->nAlloc) {
+        int nAlloc = pCur->nAlloc ? 2 * pCur->nAlloc : 64;
+        char **azNew =
+            sqlite3_realloc64(pCur->azName, (sqlite3_int64)(nAlloc) * sizeof(*azNew));
+        if (azNew) pCur->azName = azNew;
+        sqlite3_int64 *anNew =
+            sqlite3_realloc64(pCur->anSize, (sqlite3_int64)(nAlloc) * sizeof(*anNew));
+        if (anNew) pCur->anSize = anNew;
+        if (azNew == 0 || anNew == 0) return SQLITE_NOMEM;
+        pCur->nAlloc = nAlloc;
+    }
+    if ((pCur->azName[pCur->nRow] = sqlite3_mprintf("%s", zName)) == 0) {
+        return SQLITE_NOMEM;
     }
+    pCur->anSize[pCur->nRow++] = nSize;
+
+    return SQLITE_OK;
+}
 
+/*
+** Convert the given archive or directory into an archive of the format
+** and filters implied by the extension of the given filename.  The source
+** is read and decompressed by a thread of its own, while the calling
+** thread compresses and writes the target.
+*/
+static int nadekoConvertRun(nadeko_convert_cursor *pCur,
+    const char *zSource,
+    const char *zTarget,
+    const char *zOptions,
+    char **pzErr) {
+    nadeko_convert_pipe pipe;
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.zSource = zSource;
+    pipe.isFilesystem = nadekoIsDirectory(zSource);
+    int rc = pipe.isFilesystem ? nadekoOpenDirectory(&pipe.a, zSource, pzErr)
+                               : nadekoOpenArchive(&pipe.a, zSource, pzErr);
+    if (rc) return SQLITE_ERROR;
+
+    char *zGlob = 0, *zWrite = 0;
     struct archive *a = archive_write_new();
-    int rc = SQLITE_OK;
-    archive_write_set_format_filter_by_ext(a, pNdk->zFilename);
-    archive_write_open_filename(a, pNdk->zTempname);
+    if ((rc = nadekoConvertOptions(zOptions, &zGlob, &zWrite))) {
+        archive_write_free(a);
+        archive_read_free(pipe.a);
+        sqlite3_free(zGlob);
+        return rc;
+    }
+    pipe.zGlob = zGlob;
+    if (nadekoConvertFormat(a, zTarget) != ARCHIVE_OK ||
+        (zWrite && archive_write_set_options(a, zWrite) < ARCHIVE_WARN) ||
+        archive_write_open_filename(a, zTarget) != ARCHIVE_OK) {
+        *pzErr = sqlite3_mprintf("%s: %s", zTarget, archive_error_string(a));
+        archive_write_free(a);
+        archive_read_free(pipe.a);
+        sqlite3_free(zGlob);
+        sqlite3_free(zWrite);
+        return SQLITE_ERROR;
+    }
+    sqlite3_free(zWrite);
 
-    sqlite3_stmt *pSelect;
-    char *zSel =
-        sqlite3_mprintf("SELECT filename, rowid FROM %s.%s", pNdk->zDb, pNdk->zTable);
-    sqlite3_prepare(pNdk->db, zSel, -1, &pSelect, 0);
-    sqlite3_free(zSel);
+    pthread_t reader;
+    pthread_mutex_init(&pipe.mutex, 0);
+    pthread_cond_init(&pipe.more, 0);
+    pthread_cond_init(&pipe.room, 0);
+    int isStarted = !pthread_create(&reader, 0, nadekoConvertReaderMain, &pipe);
+    if (!isStarted) {
+        *pzErr = sqlite3_mprintf("%s: cannot start reader thread", zSource);
+        rc = SQLITE_ERROR;
+    }
 
-    sqlite3_blob *pBlob = 0;
-    struct archive_entry *entry = archive_entry_new();
-    for (;;) {
-        switch (sqlite3_step(pSelect)) {
-        case SQLITE_ROW:
-            if (pBlob) {
-                sqlite3_blob_reopen(pBlob, sqlite3_column_int64(pSelect, 1));
-            } else {
-                sqlite3_blob_open(pNdk->db,
-                    pNdk->zDb,
-                    pNdk->zTable,
-                    "contents",
-                    sqlite3_column_int(pSelect, 1),
-                    0,
-                    &pBlob);
-            }
-            archive_entry_set_pathname(entry, (char *)(sqlite3_column_text(pSelect, 0)));
-            archive_entry_set_size(entry, sqlite3_blob_bytes(pBlob));
-            archive_entry_set_filetype(entry, AE_IFREG);
-            archive_entry_set_perm(entry, 0644);
-            if ((rc = archive_write_header(a, entry))) {
-                pVtab->zErrMsg =
-                    sqlite3_mprintf("%s", archive_error_string(pNdk->pArchive));
-                rc = SQLITE_ERROR;
-                goto cleanup;
-            };
-            if ((rc = nadekoFillArchiveFromBlob(a, pBlob))) {
-                pVtab->zErrMsg =
-                    sqlite3_mprintf("%s", archive_error_string(pNdk->pArchive));
+    TIMELINE_BEGIN("nadeko", "convert", zSource);
+    nadeko_convert_block *pBlock;
+    while (rc == SQLITE_OK && (pBlock = nadekoConvertPop(&pipe))) {
+        if (pBlock->pEntry) {
+            const char *zName = archive_entry_pathname(pBlock->pEntry);
+            PROGRESS_ENTRY(zName);
+            rc = nadekoConvertAppend(pCur, zName, archive_entry_size(pBlock->pEntry));
+            if (rc == SQLITE_OK &&
+                archive_write_header(a, pBlock->pEntry) < ARCHIVE_WARN) {
+                *pzErr = sqlite3_mprintf("%s: %s", zTarget, archive_error_string(a));
                 rc = SQLITE_ERROR;
-                goto cleanup;
-            };
-            archive_entry_clear(entry);
-            break;
-        case SQLITE_DONE:
-            rc = SQLITE_OK;
-            goto cleanup;
-        default:
-            goto cleanup;
+            }
+            archive_entry_free(pBlock->pEntry);
+        } else if (archive_write_data(a, pBlock->aData, pBlock->nData) < 0) {
+            *pzErr = sqlite3_mprintf("%s: %s", zTarget, archive_error_string(a));
+            rc = SQLITE_ERROR;
+        } else {
+            PROGRESS_BYTES(pBlock->nData);
         }
+        sqlite3_free(pBlock);
     }
+    TIMELINE_END("nadeko", "convert");
 
-cleanup:
-    sqlite3_blob_close(pBlob);
-    sqlite3_finalize(pSelect);
-    archive_entry_free(entry);
-    archive_write_close(a);
+    pthread_mutex_lock(&pipe.mutex);
+    pipe.isCancelled = 1;
+    pthread_cond_signal(&pipe.room);
+    pthread_mutex_unlock(&pipe.mutex);
+    if (isStarted) pthread_join(reader, 0);
+    while ((pBlock = pipe.pHead)) {
+        pipe.pHead = pBlock->pNext;
+        archive_entry_free(pBlock->pEntry);
+        sqlite3_free(pBlock);
+    }
+    if (rc == SQLITE_OK && pipe.zErr) {
+        *pzErr = pipe.zErr;
+        pipe.zErr = 0;
+        rc = SQLITE_ERROR;
+    }
+    if (archive_write_close(a) != ARCHIVE_OK && rc == SQLITE_OK) {
+        *pzErr = sqlite3_mprintf("%s: %s", zTarget, archive_error_string(a));
+        rc = SQLITE_ERROR;
+    }
+    if (rc) remove(zTarget);
+
+    sqlite3_free(pipe.zErr);
+    sqlite3_free(zGlob);
     archive_write_free(a);
+    archive_read_free(pipe.a);
+    pthread_cond_destroy(&pipe.room);
+    pthread_cond_destroy(&pipe.more);
+    pthread_mutex_destroy(&pipe.mutex);
 
     return rc;
 }
 
-static int nadekoCommit(sqlite3_vtab *pVtab) {
-    nadeko_vtab *pNdk = (nadeko_vtab *)(pVtab);
-    if (pNdk->iBegun == 0) {
-        return SQLITE_OK;
-    } else {
-        pNdk->iBegun = 0;
+/*
+** The nadekoConvertConnect() method is invoked to create the eponymous
+** nadeko_convert table.
+*/
+static int nadekoConvertConnect(sqlite3 *db,
+    void *pAuxUnused,
+    int argcUnused,
+    const char *const *argvUnused,
+    sqlite3_vtab **ppVtab,
+    char **pzErrUnused) {
+    (void)(pAuxUnused);
+    (void)(argcUnused);
+    (void)(argvUnused);
+    (void)(pzErrUnused);
+
+    sqlite3_vtab *pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = pNew;
+    if (pNew == 0) return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+
+#define NADEKO_CONVERT_FILENAME 0
+#define NADEKO_CONVERT_SIZE 1
+#define NADEKO_CONVERT_SRC 2
+#define NADEKO_CONVERT_DST 3
+#define NADEKO_CONVERT_OPTIONS 4
+    return sqlite3_declare_vtab(db,
+        "CREATE TABLE x(filename TEXT, size INTEGER, "
+        "src HIDDEN, dst HIDDEN, options HIDDEN)");
+}
+
+/*
+** This method is the destructor for the nadeko_convert table.
+*/
+static int nadekoConvertDisconnect(sqlite3_vtab *pVtab) {
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+/*
+** Constructor for a new nadeko_convert_cursor object.
+*/
+static int nadekoConvertOpenCursor(
+    sqlite3_vtab *pVTabUnused, sqlite3_vtab_cursor **ppVtabCur) {
+    (void)(pVTabUnused);
+
+    nadeko_convert_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+    if (pCur == 0) return SQLITE_NOMEM;
+    memset(pCur, 0, sizeof(*pCur));
+    *ppVtabCur = &pCur->base;
+    return SQLITE_OK;
+}
+
+/*
+** Release the rows of the given cursor.
+*/
+static void nadekoConvertReset(nadeko_convert_cursor *pCur) {
+    for (int n = 0; n < pCur->nRow; n++) sqlite3_free(pCur->azName[n]);
+    sqlite3_free(pCur->azName);
+    sqlite3_free(pCur->anSize);
+    pCur->azName = 0;
+    pCur->anSize = 0;
+    pCur->nRow = 0;
+    pCur->nAlloc = 0;
+    pCur->iRow = 0;
+}
+
+/*
+** Destructor for a nadeko_convert_cursor.
+*/
+static int nadekoConvertClose(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_convert_cursor *pCur = (nadeko_convert_cursor *)pVtabCur;
+    nadekoConvertReset(pCur);
+    sqlite3_free(pCur);
+    return SQLITE_OK;
+}
+
+/*
+** Advance a nadeko_convert_cursor to its next row of output.
+*/
+static int nadekoConvertNext(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_convert_cursor *pCur = (nadeko_convert_cursor *)pVtabCur;
+    pCur->iRow++;
+    return SQLITE_OK;
+}
+
+/*
+** Return values of columns for the row at which the nadeko_convert_cursor
+** is currently pointing.
+*/
+static int nadekoConvertColumn(sqlite3_vtab_cursor *pVtabCur, /* The cursor */
+    sqlite3_context *pCtx, /* First argument to sqlite3_result_...() */
+    int iColumn            /* Which column to return */
+) {
+    nadeko_convert_cursor *pCur = (nadeko_convert_cursor *)pVtabCur;
+    switch (iColumn) {
+    case NADEKO_CONVERT_FILENAME:
+        sqlite3_result_text(pCtx, pCur->azName[pCur->iRow], -1, SQLITE_TRANSIENT);
+        break;
+    case NADEKO_CONVERT_SIZE:
+        sqlite3_result_int64(pCtx, pCur->anSize[pCur->iRow]);
+        break;
+    default:
+        break;
     }
 
-    if (rename(pNdk->zTempname, pNdk->zFilename)) {
-        remove(pNdk->zTempname);
+    return SQLITE_OK;
+}
+
+/*
+** Return the rowid for the current row, which is its position in the
+** converted archive.
+*/
+static int nadekoConvertRowid(sqlite3_vtab_cursor *pVtabCur, sqlite_int64 *pRowid) {
+    nadeko_convert_cursor *pCur = (nadeko_convert_cursor *)pVtabCur;
+    *pRowid = pCur->iRow + 1;
+    return SQLITE_OK;
+}
+
+/*
+** Return TRUE if the cursor has been moved off of the last
+** row of output.
+*/
+static int nadekoConvertEof(sqlite3_vtab_cursor *pVtabCur) {
+    nadeko_convert_cursor *pCur = (nadeko_convert_cursor *)pVtabCur;
+    return pCur->iRow >= pCur->nRow;
+}
+
+/*
+** Convert the archive or directory given as the first argument into the
+** archive given as the second argument, with the options given as the
+** optional third argument.
+*/
+static int nadekoConvertFilter(sqlite3_vtab_cursor *pVtabCur,
+    int idxNumUnused,
+    const char *idxStrUnused,
+    int argc,
+    sqlite3_value **argv) {
+    (void)(idxNumUnused);
+    (void)(idxStrUnused);
+
+    nadeko_convert_cursor *pCur = (nadeko_convert_cursor *)pVtabCur;
+    const char *zSource = (const char *)(sqlite3_value_text(argv[0]));
+    const char *zTarget = (const char *)(sqlite3_value_text(argv[1]));
+    const char *zOptions = argc > 2 ? (const char *)(sqlite3_value_text(argv[2])) : 0;
+    nadekoConvertReset(pCur);
+    if (zSource == 0 || zTarget == 0) {
+        pVtabCur->pVtab->zErrMsg =
+            sqlite3_mprintf("arguments to nadeko_convert() not two filenames");
         return SQLITE_ERROR;
+    }
+
+    char *zErr = 0;
+    int rc = nadekoConvertRun(pCur, zSource, zTarget, zOptions, &zErr);
+    if (rc) {
+        nadekoConvertReset(pCur);
+        sqlite3_free(pVtabCur->pVtab->zErrMsg);
+        pVtabCur->pVtab->zErrMsg = zErr;
     } else {
-        return SQLITE_OK;
+        sqlite3_free(zErr);
     }
+
+    return rc;
 }
 
-static int nadekoRollback(sqlite3_vtab *pVtab) {
-    nadeko_vtab *pNdk = (nadeko_vtab *)(pVtab);
-    if (pNdk->iBegun == 0) {
-        return SQLITE_OK;
-    } else {
-        pNdk->iBegun = 0;
+/*
+** SQLite will invoke this method one or more times while planning a query
+** that uses the table.  The source and target are required, while the
+** options are optional.
+*/
+static int nadekoConvertBestIndex(
+    sqlite3_vtab *pVTabUnused, sqlite3_index_info *pIdxInfo) {
+    (void)(pVTabUnused);
+
+    int aConstraint[3] = {-1, -1, -1};
+    const struct sqlite3_index_constraint *pConstraint = pIdxInfo->aConstraint;
+    for (int i = 0; i < pIdxInfo->nConstraint; i++, pConstraint++) {
+        int iArg = pConstraint->iColumn - NADEKO_CONVERT_SRC;
+        if (pConstraint->usable && pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ &&
+            iArg >= 0 && iArg < 3) {
+            aConstraint[iArg] = i;
+        }
+    };
+    if (aConstraint[0] < 0 || aConstraint[1] < 0) return SQLITE_CONSTRAINT;
+
+    for (int n = 0; n < 3 && aConstraint[n] >= 0; n++) {
+        pIdxInfo->aConstraintUsage[aConstraint[n]].argvIndex = n + 1;
+        pIdxInfo->aConstraintUsage[aConstraint[n]].omit = 1;
     }
 
-    remove(pNdk->zTempname);
     return SQLITE_OK;
 }
 
 /*
 ** This following structure defines all the methods for the
-** virtual table.
+** nadeko_convert table, which copies the members of an archive or
+** directory with their metadata into a new archive whose format and
+** filters follow from its extension, decompressing and recompressing on
+** separate threads without passing the contents through SQLite.
+**
+**     SELECT count(*) FROM nadeko_convert('./example.tar.gz', './example.tar.zst');
 */
-static sqlite3_module nadekoModule = {
+static sqlite3_module nadekoConvertModule = {
     /* iVersion    */ 0,
-    /* xCreate     */ nadekoCreate,
-    /* xConnect    */ nadekoConnect,
-    /* xBestIndex  */ nadekoBestIndex,
-    /* xDisconnect */ nadekoDisconnect,
-    /* xDestroy    */ nadekoDestroy,
-    /* xOpen       */ nadekoOpen,
-    /* xClose      */ nadekoClose,
-    /* xFilter     */ nadekoFilter,
-    /* xNext       */ nadekoNext,
-    /* xEof        */ nadekoEof,
-    /* xColumn     */ nadekoColumn,
-    /* xRowid      */ nadekoRowid,
-    /* xUpdate     */ nadekoUpdate,
-    /* xBegin      */ nadekoBegin,
-    /* xSync       */ nadekoSync,
-    /* xCommit     */ nadekoCommit,
-    /* xRollback   */ nadekoRollback,
+    /* xCreate     */ 0,
+    /* xConnect    */ nadekoConvertConnect,
+    /* xBestIndex  */ nadekoConvertBestIndex,
+    /* xDisconnect */ nadekoConvertDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ nadekoConvertOpenCursor,
+    /* xClose      */ nadekoConvertClose,
+    /* xFilter     */ nadekoConvertFilter,
+    /* xNext       */ nadekoConvertNext,
+    /* xEof        */ nadekoConvertEof,
+    /* xColumn     */ nadekoConvertColumn,
+    /* xRowid      */ nadekoConvertRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
     /* xFindMethod */ 0,
     /* xRename     */ 0,
     /* xSavepoint  */ 0,
     /* xRelease    */ 0,
     /* xRollbackTo */ 0,
-    /* xShadowName */ nadekoShadowName};
+    /* xShadowName */ 0};
 
 #ifdef _WIN32
 __declspec(dllexport)
@@ -693,6 +5176,12 @@ __declspec(dllexport)
 
     int rc = SQLITE_OK;
     SQLITE_EXTENSION_INIT2(pApi);
+    nadekoChunkInitGear();
     rc = sqlite3_create_module(db, "nadeko", &nadekoModule, 0);
+    rc = rc || sqlite3_create_module(db, "nadeko_grep", &nadekoGrepModule, 0);
+    rc = rc || sqlite3_create_module(db, "nadeko_diff", &nadekoDiffModule, 0);
+    rc = rc || sqlite3_create_module(db, "nadeko_catalog", &nadekoCatalogModule, 0);
+    rc = rc || sqlite3_create_module(db, "nadeko_extract", &nadekoExtractModule, 0);
+    rc = rc || sqlite3_create_module(db, "nadeko_convert", &nadekoConvertModule, 0);
     return rc;
 }
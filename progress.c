@@ -0,0 +1,167 @@
+/*
+** This file implements progress reports and time budgets for the
+** statements executed by the driver.  While a statement runs, a progress
+** handler and the PROGRESS_ENTRY() and PROGRESS_BYTES() hooks, which the
+** nadeko() table invokes for every member it reads and every block it
+** decompresses, periodically report the rows and bytes read so far along
+** with the current member.  A statement exceeding its time budget is
+** interrupted and fails like any other statement.  The extensions define
+** the hooks as no-ops when built on their own.  Usage example:
+**
+**     nadeko --progress --statement-timeout 600 script.sql
+*/
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PROGRESS_INTERVAL_US 1000000
+#define PROGRESS_OPCODES 1000
+#define PROGRESS_MEMBER_SIZE 256
+
+#define PROGRESS_ENTRY(zName) \
+    do { \
+        if (isProgressEnabled) progressEntry(zName); \
+    } while (0)
+#define PROGRESS_BYTES(nByte) \
+    do { \
+        if (isProgressEnabled) progressBytes(nByte); \
+    } while (0)
+
+/* progress_options controls reports and time budgets of statements
+*/
+typedef struct progress_options progress_options;
+struct progress_options {
+    int isReport;          /* True to report progress periodically */
+    sqlite3_int64 iBudget; /* Time budget of statements in microseconds */
+};
+
+/* progress_state is the progress of the statement running on a thread
+*/
+typedef struct progress_state progress_state;
+struct progress_state {
+    sqlite3 *db;                        /* Connection running the statement */
+    const char *zFilename;              /* Script the statement belongs to */
+    sqlite3_int64 iLinum;               /* Line the statement starts at */
+    sqlite3_int64 iStart;               /* Start time in microseconds */
+    sqlite3_int64 iNext;                /* Time of the next report */
+    sqlite3_int64 nRow;                 /* Number of members read */
+    sqlite3_int64 nByte;                /* Number of bytes decompressed */
+    char zMember[PROGRESS_MEMBER_SIZE]; /* Name of the last member read */
+    int isReported;                     /* True once a report was written */
+    int isTimedOut;                     /* True once the budget was exceeded */
+};
+
+static progress_options progressOptions;
+static int isProgressEnabled = 0;
+static pthread_key_t progressStateKey;
+
+/*
+** Write a report of the given progress.
+*/
+static void progressReport(progress_state *p, sqlite3_int64 iNow, const char *zPhase) {
+    double rSeconds = (iNow - p->iStart) / 1e6;
+    double rRate = rSeconds > 0 ? 1 / rSeconds : 0;
+    fprintf(stderr,
+        "progress: %s:%llu: %s %.1fs, %lld rows (%.0f rows/s), "
+        "%.1f MB (%.1f MB/s)%s%s%s\n",
+        p->zFilename,
+        p->iLinum,
+        zPhase,
+        rSeconds,
+        p->nRow,
+        p->nRow * rRate,
+        p->nByte / 1e6,
+        p->nByte / 1e6 * rRate,
+        p->zMember[0] ? ", at \"" : "",
+        p->zMember,
+        p->zMember[0] ? "\"" : "");
+    p->isReported = 1;
+}
+
+/*
+** Report the given progress if due and return true if the statement
+** has exceeded its time budget.
+*/
+static int progressTick(progress_state *p) {
+    sqlite3_int64 iNow = timelineNow();
+    if (progressOptions.iBudget && iNow - p->iStart >= progressOptions.iBudget) {
+        p->isTimedOut = 1;
+        return 1;
+    } else if (progressOptions.isReport && iNow >= p->iNext) {
+        progressReport(p, iNow, "running");
+        p->iNext = iNow + PROGRESS_INTERVAL_US;
+    }
+
+    return 0;
+}
+
+/*
+** Progress handler which interrupts the statement once it has exceeded
+** its time budget.
+*/
+static int progressHandler(void *pArg) {
+    return progressTick(pArg);
+}
+
+/*
+** Count a member read by a nadeko() table on the calling thread.
+*/
+static void progressEntry(const char *zName) {
+    progress_state *p = pthread_getspecific(progressStateKey);
+    if (p == 0) return;
+    p->nRow++;
+    snprintf(p->zMember, sizeof(p->zMember), "%s", zName);
+    if (progressTick(p)) sqlite3_interrupt(p->db);
+}
+
+/*
+** Count bytes decompressed by a nadeko() table on the calling thread.
+*/
+static void progressBytes(sqlite3_int64 nByte) {
+    progress_state *p = pthread_getspecific(progressStateKey);
+    if (p == 0) return;
+    p->nByte += nByte;
+    if (progressTick(p)) sqlite3_interrupt(p->db);
+}
+
+/*
+** Start tracking the progress of the statement at the given line of the
+** given script, which is about to run on the given connection.
+*/
+static void progressBegin(
+    progress_state *p, sqlite3 *db, const char *zFilename, sqlite3_int64 iLinum) {
+    memset(p, 0, sizeof(*p));
+    if (!isProgressEnabled) return;
+    p->db = db;
+    p->zFilename = zFilename;
+    p->iLinum = iLinum;
+    p->iStart = timelineNow();
+    p->iNext = p->iStart + PROGRESS_INTERVAL_US;
+    pthread_setspecific(progressStateKey, p);
+    sqlite3_progress_handler(db, PROGRESS_OPCODES, progressHandler, p);
+}
+
+/*
+** Stop tracking the progress of the given statement, reporting its
+** totals if any report was written while it ran.
+*/
+static void progressEnd(progress_state *p) {
+    if (!isProgressEnabled) return;
+    sqlite3_progress_handler(p->db, 0, 0, 0);
+    pthread_setspecific(progressStateKey, 0);
+    if (p->isReported) {
+        progressReport(p, timelineNow(), p->isTimedOut ? "stopped after" : "finished in");
+    }
+}
+
+/*
+** Enable progress tracking as configured by progressOptions.
+*/
+static int progressStart(void) {
+    if (!progressOptions.isReport && !progressOptions.iBudget) return SQLITE_OK;
+    if (pthread_key_create(&progressStateKey, 0)) return SQLITE_NOMEM;
+    isProgressEnabled = 1;
+
+    return SQLITE_OK;
+}
@@ -0,0 +1,144 @@
+/*
+** This file implements resuming an interrupted script.  The completion
+** of every statement is recorded in the table nadeko_resume of the main
+** database, keyed by a hash of the script and the index of the
+** statement, within the same transaction as the effects of the statement.
+** A later run of the same script skips all statements recorded as
+** completed, and the records are removed once the script has finished.
+** Statements which cannot run inside a transaction, such as VACUUM, are
+** recorded right after they complete.  Statements whose effects only
+** last as long as the connection, such as ATTACH, PRAGMA or creating and
+** filling temporary tables, are never recorded and always executed
+** again, so that the statements after them find the same session state.
+** Usage example:
+**
+**     nadeko --resume --output out.db script.sql
+*/
+#include <ctype.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *const azResumeUnwrapped[] = {"BEGIN", "COMMIT", "END", "ROLLBACK",
+    "SAVEPOINT", "RELEASE", "VACUUM", "ATTACH", "DETACH", "PRAGMA", 0};
+
+/*
+** Create the table holding completed statements unless it exists and
+** return the number of statements of the given script already completed.
+*/
+static int resumeBegin(sqlite3 *db, const char *zScript, int *pnCompleted, char **pzErr) {
+    sqlite3_stmt *pSelect;
+    int rc = sqlite3_exec(db,
+        "CREATE TABLE IF NOT EXISTS main.nadeko_resume(script TEXT, statement INTEGER, "
+        "PRIMARY KEY (script, statement))",
+        0,
+        0,
+        pzErr);
+    if (rc) return rc;
+
+    if ((rc = sqlite3_prepare_v2(db,
+             "SELECT max(statement) + 1 FROM main.nadeko_resume WHERE script = ?",
+             -1,
+             &pSelect,
+             0))) {
+        *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        return rc;
+    }
+    sqlite3_bind_text(pSelect, 1, zScript, -1, SQLITE_STATIC);
+    *pnCompleted = 0;
+    if (sqlite3_step(pSelect) == SQLITE_ROW) {
+        *pnCompleted = sqlite3_column_int(pSelect, 0);
+    }
+
+    return sqlite3_finalize(pSelect);
+}
+
+/*
+** Return true if the given statement may be wrapped in a transaction
+** together with its completion record.
+*/
+static int resumeIsWrappable(const char *zSql) {
+    for (const char *const *az = azResumeUnwrapped; *az; az++) {
+        int n = strlen(*az);
+        if (!sqlite3_strnicmp(zSql, *az, n) && !isalnum((unsigned char)(zSql[n]))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+** Authorizer callback which marks statements changing the state of the
+** connection rather than the contents of a database file.
+*/
+static int resumeAuthorizer(void *pArg, int iAction, const char *zArg1,
+    const char *zArg2, const char *zDb, const char *zTrigger) {
+    (void)(zArg1);
+    (void)(zArg2);
+    (void)(zTrigger);
+
+    int *pIsSession = pArg;
+    switch (iAction) {
+    case SQLITE_ATTACH:
+    case SQLITE_DETACH:
+    case SQLITE_PRAGMA:
+    case SQLITE_CREATE_TEMP_INDEX:
+    case SQLITE_CREATE_TEMP_TABLE:
+    case SQLITE_CREATE_TEMP_TRIGGER:
+    case SQLITE_CREATE_TEMP_VIEW:
+    case SQLITE_DROP_TEMP_INDEX:
+    case SQLITE_DROP_TEMP_TABLE:
+    case SQLITE_DROP_TEMP_TRIGGER:
+    case SQLITE_DROP_TEMP_VIEW:
+        *pIsSession = 1;
+        break;
+    case SQLITE_INSERT:
+    case SQLITE_UPDATE:
+    case SQLITE_DELETE:
+    case SQLITE_CREATE_VTABLE:
+    case SQLITE_DROP_VTABLE:
+        if (zDb && !sqlite3_stricmp(zDb, "temp")) *pIsSession = 1;
+        break;
+    }
+
+    return SQLITE_OK;
+}
+
+/*
+** Return true if the given statement only changes the state of the
+** connection, such that it must be executed again when resuming.
+** Statements which cannot be prepared are assumed to change the
+** database.
+*/
+static int resumeIsSession(sqlite3 *db, const char *zSql) {
+    sqlite3_stmt *pStmt = 0;
+    int isSession = 0;
+    sqlite3_set_authorizer(db, resumeAuthorizer, &isSession);
+    if (sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0) != SQLITE_OK) isSession = 0;
+    sqlite3_set_authorizer(db, 0, 0);
+    sqlite3_finalize(pStmt);
+
+    return isSession;
+}
+
+/*
+** Record the statement with the given index of the given script as
+** completed.
+*/
+static int resumeRecord(sqlite3 *db, const char *zScript, int iStmt, char **pzErr) {
+    return nadekoExecPrintf(db,
+        pzErr,
+        "INSERT OR IGNORE INTO main.nadeko_resume VALUES (%Q, %d)",
+        zScript,
+        iStmt);
+}
+
+/*
+** Remove all completion records of the given script once it has
+** finished, so that the next run starts from the beginning.
+*/
+static int resumeFinish(sqlite3 *db, const char *zScript, char **pzErr) {
+    return nadekoExecPrintf(
+        db, pzErr, "DELETE FROM main.nadeko_resume WHERE script = %Q", zScript);
+}
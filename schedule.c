@@ -0,0 +1,532 @@
+/*
+** This file implements a dependency-aware scheduler which executes the
+** independent statements of a single script concurrently on a pool of
+** connections to the same WAL database.  Each statement is prepared on
+** the dispatching connection first, collecting the tables it reads and
+** writes through the authorizer callback.  Statements are dispatched in
+** script order, each one only after all running statements it conflicts
+** with have finished, and errors are reported in script order as well.
+**
+** Statements which touch temporary or attached databases, control
+** transactions or otherwise cannot be analyzed run alone on the
+** dispatching connection.  SQLite admits a single writer at a time, so
+** writing statements take the write lock up front and run one after
+** another, while reading statements overlap with them and each other.
+** Reading a virtual table counts as writing it, since nadeko() fills its
+** backing store while scanning.
+**
+** Statements which only create a table from a query, the common case of
+** loading archives, are staged instead.  The query runs against a
+** private database file, in which the nadeko() tables it reads are
+** created anew and to which the output database is attached read-only,
+** so that staged statements scan their inputs concurrently.  Only
+** copying the resulting table into the output database takes the write
+** lock.  Staged statements which fail, for example because they would
+** write the output database, are executed as usual.  Usage example:
+**
+**     nadeko --parallel-statements 4 --output out.db script.sql
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCHEDULE_BUSY_TIMEOUT (1 << 30)
+
+/* schedule_task is the scheduling state of a single statement
+*/
+typedef struct schedule_task schedule_task;
+struct schedule_task {
+    script_statement *pStmt; /* Statement to execute */
+    analyze_access access;   /* Tables accessed, barriers run alone */
+    int isStaged;            /* True to execute against a staging database */
+    char *zSources;          /* Statements creating the nadeko() tables read */
+    int isRunning;           /* True while dispatched but not finished */
+    int isDone;              /* True once finished */
+    int rc;                  /* Result of executing the statement */
+    char *zErr;              /* Error message, if any */
+};
+
+/* schedule_pool is the state shared between the dispatcher and workers
+*/
+typedef struct schedule_pool schedule_pool;
+struct schedule_pool {
+    schedule_task *aTask;  /* One task per statement */
+    int nTask;             /* Number of tasks */
+    int nDispatched;       /* Tasks released to the workers so far */
+    int iTaken;            /* Next released task to be taken by a worker */
+    int nRunning;          /* Tasks dispatched but not finished */
+    int isFailed;          /* True once any task failed */
+    int isStopping;        /* True once workers should exit */
+    const char *zDatabase; /* Path of the output database */
+    int iRun;              /* Number distinguishing staging databases */
+    int iOpenFlags;        /* Flags passed to sqlite3_open_v2() */
+    int (*xPrepare)(sqlite3 *, char **); /* Configures each new connection */
+    pthread_mutex_t mutex;
+    pthread_cond_t work; /* Signalled when tasks are released */
+    pthread_cond_t done; /* Signalled when tasks finish */
+};
+
+/* schedule_worker is a worker thread together with its connection
+*/
+typedef struct schedule_worker schedule_worker;
+struct schedule_worker {
+    schedule_pool *pPool;
+    sqlite3 *db;
+    pthread_t thread;
+};
+
+static int iScheduleRun = 0;
+
+/*
+** Remove all names of schema tables from the given set.
+*/
+static void scheduleRemoveSchema(analyze_set *pSet) {
+    int nKeep = 0;
+    for (int n = 0; n < pSet->nName; n++) {
+        if (sqlite3_strnicmp(pSet->azName[n], "sqlite_", 7)) {
+            pSet->azName[nKeep++] = pSet->azName[n];
+        } else {
+            sqlite3_free(pSet->azName[n]);
+        }
+    }
+    pSet->nName = nKeep;
+}
+
+/*
+** Decide whether the given analyzed task may be staged, that is whether
+** it only creates a single table from a query over ordinary tables and
+** nadeko() tables of the main database.  The statements creating the
+** nadeko() tables are collected for the staging database.
+*/
+static int scheduleStagePlan(sqlite3 *db, schedule_task *pTask) {
+    const analyze_access *pAccess = &pTask->access;
+    const char *zSql = pTask->pStmt->zSql;
+    if (pAccess->isBarrier || pAccess->create.nName != 1 || pAccess->drop.nName ||
+        pAccess->host.nName || sqlite3_strnicmp(zSql, "CREATE TABLE ", 13) ||
+        !shardContainsKeyword(zSql, "SELECT") ||
+        shardContainsKeyword(zSql, "EXISTS") ||
+        shardContainsKeyword(zSql, "sqlite_master") ||
+        shardContainsKeyword(zSql, "sqlite_schema")) {
+        return SQLITE_OK;
+    }
+    for (int n = 0; n < pAccess->write.nName; n++) {
+        const char *zName = pAccess->write.azName[n];
+        if (sqlite3_strnicmp(zName, "sqlite_", 7) &&
+            sqlite3_stricmp(zName, pAccess->create.azName[0])) {
+            return SQLITE_OK;
+        }
+    }
+
+    // Every table read must exist, and virtual ones must be plain nadeko()
+    sqlite3_stmt *pSelect;
+    int rc = sqlite3_prepare_v2(db,
+        "SELECT sql LIKE 'CREATE VIRTUAL TABLE%', replace(sql, ' (', '(') "
+        "LIKE 'CREATE VIRTUAL TABLE% USING nadeko(%', sql "
+        "FROM main.sqlite_schema WHERE type = 'table' AND name = ?",
+        -1,
+        &pSelect,
+        0);
+    if (rc) return rc;
+    sqlite3_str *pSources = sqlite3_str_new(db);
+    int isStaged = 1;
+    for (int n = 0; isStaged && n < pAccess->read.nName; n++) {
+        const char *zName = pAccess->read.azName[n];
+        if (!sqlite3_strnicmp(zName, "sqlite_", 7)) continue;
+        sqlite3_bind_text(pSelect, 1, zName, -1, SQLITE_STATIC);
+        if (sqlite3_step(pSelect) != SQLITE_ROW) {
+            isStaged = 0;
+        } else if (sqlite3_column_int(pSelect, 0)) {
+            isStaged = sqlite3_column_int(pSelect, 1);
+            sqlite3_str_appendf(pSources, "%s;", sqlite3_column_text(pSelect, 2));
+        }
+        sqlite3_reset(pSelect);
+    }
+    sqlite3_finalize(pSelect);
+    rc = sqlite3_str_errcode(pSources);
+    pTask->zSources = sqlite3_str_finish(pSources);
+    if (rc == SQLITE_OK && isStaged) {
+        pTask->isStaged = 1;
+        scheduleRemoveSchema(&pTask->access.read);
+        scheduleRemoveSchema(&pTask->access.write);
+    }
+
+    return rc;
+}
+
+/*
+** Prepare the statement of the given task on the dispatching
+** connection and derive the tables it reads and writes.
+*/
+static int scheduleAnalyze(sqlite3 *db, schedule_task *pTask, char **pzErr) {
+    analyze_access *pAccess = &pTask->access;
+    pTask->isStaged = 0;
+    sqlite3_free(pTask->zSources);
+    pTask->zSources = 0;
+    int rc = analyzeStatement(db, pTask->pStmt->zSql, pAccess, pzErr);
+    if (rc == SQLITE_OK) rc = scheduleStagePlan(db, pTask);
+
+    // Changing indexes or triggers of a table must not overlap its users
+    for (int n = 0; rc == SQLITE_OK && n < pAccess->host.nName; n++) {
+        rc = analyzeSetAdd(&pAccess->write, pAccess->host.azName[n]);
+    }
+    for (int n = 0; rc == SQLITE_OK && n < pAccess->read.nName; n++) {
+        const char *zName = pAccess->read.azName[n];
+        if (analyzeIsVirtual(db, zName)) {
+            char *zStore = sqlite3_mprintf("%s_store", zName);
+            rc = zStore ? analyzeSetAdd(&pAccess->write, zName) ||
+                              analyzeSetAdd(&pAccess->write, zStore)
+                        : SQLITE_NOMEM;
+            sqlite3_free(zStore);
+            pAccess->isWriter = 1;
+        }
+    }
+
+    return rc;
+}
+
+/*
+** Return true if the given task conflicts with any running task.
+** Must be called with the mutex held.
+*/
+static int scheduleHasConflict(schedule_pool *pPool, schedule_task *pTask) {
+    for (int n = 0; n < pPool->nDispatched; n++) {
+        schedule_task *pOther = &pPool->aTask[n];
+        if (!pOther->isRunning) continue;
+        if (analyzeSetIntersects(&pTask->access.write, &pOther->access.write) ||
+            analyzeSetIntersects(&pTask->access.write, &pOther->access.read) ||
+            analyzeSetIntersects(&pTask->access.read, &pOther->access.write)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+** Return the URI opening the given path read-only.
+*/
+static char *scheduleReadonlyUri(const char *zPath) {
+    sqlite3_str *pUri = sqlite3_str_new(0);
+    sqlite3_str_appendall(pUri, "file:");
+    for (const char *z = zPath; *z; z++) {
+        if (*z == '%' || *z == '?' || *z == '#') {
+            sqlite3_str_appendf(pUri, "%%%02X", (unsigned char)(*z));
+        } else {
+            sqlite3_str_appendchar(pUri, 1, *z);
+        }
+    }
+    sqlite3_str_appendall(pUri, "?mode=ro");
+
+    return sqlite3_str_finish(pUri);
+}
+
+/*
+** Execute the statement of the given staged task against its own staging
+** database, then copy the table it created into the output database
+** using the given connection.  Returns false if the statement failed on
+** the staging database, in which case it must be executed as usual.
+*/
+static int scheduleStage(schedule_pool *pPool, sqlite3 *db, schedule_task *pTask) {
+    const char *zTempDir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    const char *zTable = pTask->access.create.azName[0];
+    char *zStage = sqlite3_mprintf("%s/nadeko-%d-stage%d-%d.db",
+        zTempDir,
+        (int)(getpid()),
+        pPool->iRun,
+        (int)(pTask - pPool->aTask));
+    char *zOutput = scheduleReadonlyUri(pPool->zDatabase);
+    char *zErr = 0;
+    sqlite3 *dbStage = 0;
+    int rc = zStage && zOutput ? SQLITE_OK : SQLITE_NOMEM;
+
+    TIMELINE_BEGIN("driver", "stage", zTable);
+    if (rc == SQLITE_OK) remove(zStage);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_open_v2(zStage, &dbStage, pPool->iOpenFlags | SQLITE_OPEN_URI, 0);
+    }
+    if (rc == SQLITE_OK) rc = pPool->xPrepare(dbStage, &zErr);
+    if (rc == SQLITE_OK) {
+        rc = nadekoExecPrintf(dbStage, &zErr, "ATTACH %Q AS nadeko_output", zOutput);
+    }
+    if (rc == SQLITE_OK && pTask->zSources) {
+        rc = sqlite3_exec(dbStage, pTask->zSources, 0, 0, &zErr);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(dbStage, pTask->pStmt->zSql, 0, 0, &zErr);
+    }
+    sqlite3_close(dbStage);
+    sqlite3_free(zErr);
+    TIMELINE_END("driver", "stage");
+    if (rc != SQLITE_OK) {
+        if (zStage) remove(zStage);
+        sqlite3_free(zStage);
+        sqlite3_free(zOutput);
+        return 0;
+    }
+
+    TIMELINE_BEGIN("driver", "merge", zTable);
+    pTask->rc = nadekoExecPrintf(db, &pTask->zErr, "ATTACH %Q AS nadeko_stage", zStage);
+    if (pTask->rc == SQLITE_OK) {
+        pTask->rc = sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, &pTask->zErr);
+    }
+    if (pTask->rc == SQLITE_OK) {
+        sqlite3_stmt *pSelect;
+        pTask->rc = sqlite3_prepare_v2(db,
+            "SELECT sql FROM nadeko_stage.sqlite_schema WHERE name = ?",
+            -1,
+            &pSelect,
+            0);
+        if (pTask->rc == SQLITE_OK) {
+            sqlite3_bind_text(pSelect, 1, zTable, -1, SQLITE_STATIC);
+            pTask->rc = sqlite3_step(pSelect) == SQLITE_ROW
+                            ? sqlite3_exec(db,
+                                  (const char *)(sqlite3_column_text(pSelect, 0)),
+                                  0,
+                                  0,
+                                  &pTask->zErr)
+                            : SQLITE_ERROR;
+            sqlite3_finalize(pSelect);
+        }
+    }
+    if (pTask->rc == SQLITE_OK) {
+        pTask->rc = nadekoExecPrintf(db,
+            &pTask->zErr,
+            "INSERT INTO main.\"%w\" SELECT * FROM nadeko_stage.\"%w\"",
+            zTable,
+            zTable);
+    }
+    if (pTask->rc == SQLITE_OK) {
+        pTask->rc = sqlite3_exec(db, "COMMIT", 0, 0, &pTask->zErr);
+    }
+    if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    sqlite3_exec(db, "DETACH nadeko_stage", 0, 0, 0);
+    remove(zStage);
+    TIMELINE_END("driver", "merge");
+    sqlite3_free(zStage);
+    sqlite3_free(zOutput);
+
+    return 1;
+}
+
+/*
+** Execute the statement of the given task on the given connection.
+*/
+static void scheduleExecute(schedule_pool *pPool, sqlite3 *db, schedule_task *pTask) {
+    if (pTask->isStaged && scheduleStage(pPool, db, pTask)) return;
+    TIMELINE_BEGIN("driver", "statement", pTask->pStmt->zSql);
+    if (pTask->access.isWriter && !pTask->access.isBarrier) {
+        pTask->rc = sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, &pTask->zErr);
+    }
+    if (pTask->rc == SQLITE_OK) {
+        pTask->rc = sqlite3_exec(db, pTask->pStmt->zSql, 0, 0, &pTask->zErr);
+    }
+    if (pTask->rc == SQLITE_OK && !sqlite3_get_autocommit(db) &&
+        !pTask->access.isBarrier) {
+        pTask->rc = sqlite3_exec(db, "COMMIT", 0, 0, &pTask->zErr);
+    }
+    if (!sqlite3_get_autocommit(db) && !pTask->access.isBarrier) {
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    }
+    TIMELINE_END("driver", "statement");
+}
+
+/*
+** Mark the given task as finished.  Must be called with the mutex held.
+*/
+static void scheduleFinish(schedule_pool *pPool, schedule_task *pTask) {
+    if (pTask->isRunning) pPool->nRunning--;
+    pTask->isRunning = 0;
+    pTask->isDone = 1;
+    if (pTask->rc != SQLITE_OK) pPool->isFailed = 1;
+    pthread_cond_broadcast(&pPool->done);
+}
+
+/*
+** Main loop of each worker thread.
+*/
+static void *scheduleWorkerMain(void *pArg) {
+    schedule_worker *pWorker = pArg;
+    schedule_pool *pPool = pWorker->pPool;
+
+    pthread_mutex_lock(&pPool->mutex);
+    for (;;) {
+        while (!pPool->isStopping && pPool->iTaken == pPool->nDispatched) {
+            pthread_cond_wait(&pPool->work, &pPool->mutex);
+        }
+        if (pPool->iTaken == pPool->nDispatched) break;
+
+        schedule_task *pTask = &pPool->aTask[pPool->iTaken++];
+        if (pTask->access.isBarrier || pTask->isDone) continue;
+        pthread_mutex_unlock(&pPool->mutex);
+        scheduleExecute(pPool, pWorker->db, pTask);
+        pthread_mutex_lock(&pPool->mutex);
+        scheduleFinish(pPool, pTask);
+    }
+    pthread_mutex_unlock(&pPool->mutex);
+
+    return 0;
+}
+
+/*
+** Wait until the given task may be dispatched, that is until all
+** running tasks it conflicts with have finished, or until nothing at
+** all is running for barriers.  Must be called with the mutex held.
+*/
+static void scheduleWaitFor(schedule_pool *pPool, schedule_task *pTask, int isAlone) {
+    while (pPool->nRunning > 0 && (isAlone || scheduleHasConflict(pPool, pTask))) {
+        pthread_cond_wait(&pPool->done, &pPool->mutex);
+    }
+}
+
+/*
+** Dispatch all tasks in script order from the calling thread, which
+** owns the given connection.
+*/
+static void scheduleDispatch(sqlite3 *db, schedule_pool *pPool) {
+    pthread_mutex_lock(&pPool->mutex);
+    for (int n = 0; n < pPool->nTask && !pPool->isFailed; n++) {
+        schedule_task *pTask = &pPool->aTask[n];
+
+        // Statements may depend on objects created by running statements
+        pthread_mutex_unlock(&pPool->mutex);
+        char *zErr = 0;
+        int rc = scheduleAnalyze(db, pTask, &zErr);
+        pthread_mutex_lock(&pPool->mutex);
+        if (rc != SQLITE_OK) {
+            sqlite3_free(zErr);
+            zErr = 0;
+            scheduleWaitFor(pPool, pTask, 1);
+            pthread_mutex_unlock(&pPool->mutex);
+            rc = scheduleAnalyze(db, pTask, &zErr);
+            pthread_mutex_lock(&pPool->mutex);
+        }
+        if (rc != SQLITE_OK) {
+            pTask->rc = rc;
+            pTask->zErr = zErr;
+            pTask->access.isBarrier = 1;
+        }
+
+        // Run barriers on this thread and release all others to the workers
+        scheduleWaitFor(pPool, pTask, pTask->access.isBarrier);
+        pPool->nDispatched = n + 1;
+        if (pTask->access.isBarrier) {
+            if (pTask->rc == SQLITE_OK) {
+                pthread_mutex_unlock(&pPool->mutex);
+                scheduleExecute(pPool, db, pTask);
+                pthread_mutex_lock(&pPool->mutex);
+            }
+            scheduleFinish(pPool, pTask);
+        } else {
+            pTask->isRunning = 1;
+            pPool->nRunning++;
+            pthread_cond_broadcast(&pPool->work);
+        }
+    }
+
+    scheduleWaitFor(pPool, 0, 1);
+    pPool->isStopping = 1;
+    pthread_cond_broadcast(&pPool->work);
+    pthread_mutex_unlock(&pPool->mutex);
+}
+
+/*
+** Execute the given script using the given number of additional
+** connections to the main database of the given connection, which
+** must be a database file.
+*/
+static int scheduleRun(sqlite3 *db, const char *zFilename, int nWorker, int iOpenFlags,
+    int (*xPrepare)(sqlite3 *, char **)) {
+    schedule_pool pool;
+    script scr;
+    char *zErr = 0;
+    int rc;
+
+    if ((rc = loadScript(&scr, zFilename))) return rc;
+    memset(&pool, 0, sizeof(pool));
+    pool.nTask = scr.nStmt;
+    pool.aTask = sqlite3_malloc64(scr.nStmt * sizeof(*pool.aTask) + 1);
+    schedule_worker *aWorker = sqlite3_malloc64(nWorker * sizeof(*aWorker));
+    if (!pool.aTask || !aWorker) {
+        sqlite3_free(pool.aTask);
+        sqlite3_free(aWorker);
+        freeScript(&scr);
+        return SQLITE_NOMEM;
+    }
+    memset(pool.aTask, 0, scr.nStmt * sizeof(*pool.aTask));
+    memset(aWorker, 0, nWorker * sizeof(*aWorker));
+    for (int n = 0; n < scr.nStmt; n++) {
+        pool.aTask[n].pStmt = &scr.aStmt[n];
+    }
+    pthread_mutex_init(&pool.mutex, 0);
+    pthread_cond_init(&pool.work, 0);
+    pthread_cond_init(&pool.done, 0);
+
+    // Open one connection per worker
+    const char *zDatabase = sqlite3_db_filename(db, "main");
+    pool.zDatabase = zDatabase;
+    pool.iRun = iScheduleRun++;
+    pool.iOpenFlags = iOpenFlags;
+    pool.xPrepare = xPrepare;
+    sqlite3_busy_timeout(db, SCHEDULE_BUSY_TIMEOUT);
+    if ((rc = sqlite3_exec(db, "PRAGMA journal_mode = WAL", 0, 0, &zErr))) {
+        fprintf(stderr, "error: enabling WAL: %s\n", zErr);
+    }
+    int nStarted = 0;
+    for (; rc == SQLITE_OK && nStarted < nWorker; nStarted++) {
+        schedule_worker *pWorker = &aWorker[nStarted];
+        pWorker->pPool = &pool;
+        if ((rc = sqlite3_open_v2(zDatabase, &pWorker->db, iOpenFlags, 0))) {
+            fprintf(stderr, "error: opening database: %s\n", sqlite3_errstr(rc));
+        } else if ((rc = xPrepare(pWorker->db, &zErr))) {
+            fprintf(stderr, "error: %s\n", zErr);
+        } else if ((rc = sqlite3_busy_timeout(pWorker->db, SCHEDULE_BUSY_TIMEOUT))) {
+            fprintf(stderr, "internal: setting busy timeout: %s\n", sqlite3_errstr(rc));
+        } else if (pthread_create(&pWorker->thread, 0, scheduleWorkerMain, pWorker)) {
+            fprintf(stderr, "internal: starting worker: %s\n", strerror(errno));
+            rc = SQLITE_ERROR;
+        } else {
+            continue;
+        }
+        sqlite3_close(pWorker->db);
+        break;
+    }
+
+    // Dispatch, then report the first error in script order
+    if (rc == SQLITE_OK) scheduleDispatch(db, &pool);
+    pthread_mutex_lock(&pool.mutex);
+    pool.isStopping = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.mutex);
+    for (int n = 0; n < nStarted; n++) {
+        pthread_join(aWorker[n].thread, 0);
+        sqlite3_close(aWorker[n].db);
+    }
+    for (int n = 0; n < pool.nTask; n++) {
+        schedule_task *pTask = &pool.aTask[n];
+        if (rc == SQLITE_OK && pTask->rc != SQLITE_OK) {
+            fprintf(stderr,
+                "error: %s:%llu: %s\n",
+                zFilename,
+                pTask->pStmt->iLinum,
+                pTask->zErr ? pTask->zErr : sqlite3_errstr(pTask->rc));
+            rc = SQLITE_ERROR;
+        }
+        analyzeAccessFree(&pTask->access);
+        sqlite3_free(pTask->zSources);
+        sqlite3_free(pTask->zErr);
+    }
+
+    pthread_cond_destroy(&pool.work);
+    pthread_cond_destroy(&pool.done);
+    pthread_mutex_destroy(&pool.mutex);
+    sqlite3_free(pool.aTask);
+    sqlite3_free(aWorker);
+    sqlite3_free(zErr);
+    freeScript(&scr);
+
+    return rc;
+}
@@ -0,0 +1,368 @@
+/*
+** This file implements execution of SQL scripts by the driver.  Scripts
+** are split into single statements which are executed in order, while
+** reporting errors together with the line they occurred at.
+*/
+#include <errno.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <string.h>
+
+#define READ_BUFFER_SIZE (1 << 16)
+
+/* script_statement is a single statement of a script
+*/
+typedef struct script_statement script_statement;
+struct script_statement {
+    char *zSql;           /* Text of the statement, without the semicolon */
+    sqlite3_int64 iLinum; /* Line the statement starts at */
+};
+
+/* script_options controls how readAndLoadFile() executes scripts
+*/
+typedef struct script_options script_options;
+struct script_options {
+    int nTransaction; /* Statements per driver transaction, zero for none */
+    int isMemoize;    /* True to skip statements whose inputs are unchanged */
+    int isResume;     /* True to skip statements completed by a former run */
+};
+
+/* script is the representation of a script split into statements
+*/
+typedef struct script script;
+struct script {
+    const char *zFilename;   /* Name of the script file */
+    char *zBuffer;           /* Script text, terminated after each statement */
+    script_statement *aStmt; /* Statements of the script in order */
+    int nStmt;               /* Number of statements */
+};
+
+static script_options scriptOptions;
+
+void consumeSingleStatement(char **ppPoint, sqlite3_int64 *pLinum, int isOutside) {
+    int isInLargeComment = 0;
+    for (;;) {
+        if (*ppPoint[0] == '\0') {
+            break;
+        } else if (*ppPoint[0] == '\n') {
+            *pLinum += 1;
+            *ppPoint += 1;
+        } else if (*ppPoint[0] == ' ') {
+            *ppPoint += 1;
+        } else if (isInLargeComment) {
+            if (!strncmp(*ppPoint, "*/", 2)) {
+                isInLargeComment = 0;
+                *ppPoint += 2;
+            } else {
+                *ppPoint += 1;
+            }
+        } else if (!strncmp(*ppPoint, "/*", 2)) {
+            isInLargeComment = 1;
+            *ppPoint += 2;
+        } else if (!strncmp(*ppPoint, "--", 2)) {
+            char *pNewline = strchr(*ppPoint, '\n');
+            *ppPoint = pNewline ? pNewline : strchr(*ppPoint, '\0');
+        } else if (*ppPoint[0] == ';') {
+            *ppPoint += 1;
+            if (!isOutside) break;
+        } else {
+            if (isOutside) break;
+            *ppPoint += 1;
+        }
+    }
+}
+
+/*
+** Release all memory held by the given script.
+*/
+void freeScript(script *pScript) {
+    sqlite3_free(pScript->zBuffer);
+    sqlite3_free(pScript->aStmt);
+    pScript->zBuffer = 0;
+    pScript->aStmt = 0;
+    pScript->nStmt = 0;
+}
+
+/*
+** Read the given script and split it into statements.  Errors are
+** reported to the user and the script is left empty on failure.
+*/
+int loadScript(script *pScript, const char *zFilename) {
+    memset(pScript, 0, sizeof(*pScript));
+    pScript->zFilename = zFilename;
+
+    FILE *fd = fopen(zFilename, "r");
+    if (fd == 0) {
+        fprintf(stderr, "error: opening \"%s\": %s\n", zFilename, strerror(errno));
+        return errno;
+    }
+
+    size_t nBuffer = 0;
+    for (;;) {
+        char *zNew = sqlite3_realloc64(pScript->zBuffer, nBuffer + READ_BUFFER_SIZE + 1);
+        if (zNew == 0) {
+            fprintf(stderr, "error: reading \"%s\": %s\n", zFilename, "out of memory");
+            freeScript(pScript);
+            fclose(fd);
+            return SQLITE_NOMEM;
+        }
+        pScript->zBuffer = zNew;
+        size_t nRead = fread(zNew + nBuffer, sizeof(*zNew), READ_BUFFER_SIZE, fd);
+        nBuffer += nRead;
+        zNew[nBuffer] = '\0';
+        if (ferror(fd)) {
+            fprintf(stderr, "error: reading \"%s\": %s\n", zFilename, strerror(errno));
+            freeScript(pScript);
+            fclose(fd);
+            return errno;
+        } else if (nRead < READ_BUFFER_SIZE) {
+            break;
+        }
+    }
+    fclose(fd);
+
+    sqlite3_int64 iEndLinum = 1;
+    char *pEnd = pScript->zBuffer;
+    for (int nAlloc = 0;;) {
+        // Find start of SQL statement
+        char *pStart = pEnd;
+        sqlite3_int64 iStartLinum = iEndLinum;
+        consumeSingleStatement(&pStart, &iStartLinum, 1);
+        if (pStart[0] == '\0') {
+            return SQLITE_OK;
+        };
+
+        // Find end of SQL statement
+        pEnd = pStart;
+        iEndLinum = iStartLinum;
+        consumeSingleStatement(&pEnd, &iEndLinum, 0);
+        if (pEnd[0] == '\0') {
+            fprintf(stderr, "error: %s:%llu: unterminated SQL\n", zFilename, iStartLinum);
+            freeScript(pScript);
+            return SQLITE_ERROR;
+        };
+
+        // Append current SQL statement
+        if (pScript->nStmt == nAlloc) {
+            nAlloc = nAlloc ? nAlloc * 2 : 64;
+            script_statement *aNew =
+                sqlite3_realloc64(pScript->aStmt, nAlloc * sizeof(*aNew));
+            if (aNew == 0) {
+                fprintf(stderr, "error: %s:%llu: out of memory\n", zFilename, iStartLinum);
+                freeScript(pScript);
+                return SQLITE_NOMEM;
+            }
+            pScript->aStmt = aNew;
+        }
+        pEnd[-1] = '\0';
+        pScript->aStmt[pScript->nStmt].zSql = pStart;
+        pScript->aStmt[pScript->nStmt].iLinum = iStartLinum;
+        pScript->nStmt++;
+    }
+}
+
+/*
+** Commit the transaction opened by the driver, if it is still open,
+** rolling it back if the commit fails.  Transactions opened by the
+** script itself are left to the script.
+*/
+int commitScriptTransaction(sqlite3 *db, const char *zFilename, sqlite3_int64 iLinum) {
+    char *zErr = 0;
+    if (sqlite3_get_autocommit(db)) return SQLITE_OK;
+    TIMELINE_BEGIN("driver", "commit", 0);
+    int rc = sqlite3_exec(db, "COMMIT", 0, 0, &zErr);
+    TIMELINE_END("driver", "commit");
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "error: %s:%llu: committing: %s\n", zFilename, iLinum, zErr);
+        sqlite3_free(zErr);
+        if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        return SQLITE_ERROR;
+    }
+
+    return SQLITE_OK;
+}
+
+/*
+** Roll back the transaction opened by the driver, if it is still open,
+** and report how many statements were undone.
+*/
+void rollbackScriptTransaction(
+    sqlite3 *db, const char *zFilename, sqlite3_int64 iLinum, int nPending) {
+    if (sqlite3_get_autocommit(db)) return;
+    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    fprintf(stderr,
+        "error: %s:%llu: rolled back transaction of %d statements\n",
+        zFilename,
+        iLinum,
+        nPending);
+}
+
+/*
+** Set up memoization for the given script, forgetting all statements
+** which are no longer part of it.
+*/
+int beginScriptMemo(sqlite3 *db, script *pScript) {
+    char *zErr = 0;
+    int rc = memoBegin(db, &zErr);
+    for (int n = 0; rc == SQLITE_OK && n < pScript->nStmt; n++) {
+        rc = memoKeep(db, pScript->aStmt[n].zSql, &zErr);
+    }
+    if (rc == SQLITE_OK) rc = memoPurge(db, &zErr);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "error: %s: memoizing: %s\n", pScript->zFilename, zErr);
+        sqlite3_free(zErr);
+    }
+
+    return rc;
+}
+
+/*
+** Set up resuming the given script, storing its hash in the given
+** buffer of MEMO_HASH_SIZE bytes and the number of statements already
+** completed by an interrupted run in the given integer.
+*/
+int beginScriptResume(sqlite3 *db, script *pScript, char *zHash, int *pnCompleted) {
+    sqlite3_uint64 iHash = MEMO_FNV_OFFSET;
+    for (int n = 0; n < pScript->nStmt; n++) {
+        const char *zSql = pScript->aStmt[n].zSql;
+        memoHashUpdate(&iHash, zSql, strlen(zSql) + 1);
+    }
+    memoHashFinish(iHash, zHash);
+
+    char *zErr = 0;
+    int rc = resumeBegin(db, zHash, pnCompleted, &zErr);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "error: %s: resuming: %s\n", pScript->zFilename, zErr);
+        sqlite3_free(zErr);
+    } else if (*pnCompleted > 0) {
+        fprintf(stderr,
+            "resume: %s: %d of %d statements already completed\n",
+            pScript->zFilename,
+            *pnCompleted,
+            pScript->nStmt);
+    }
+
+    return rc;
+}
+
+/*
+** Execute all statements of the given script.  If nTransaction is
+** positive, the driver groups every nTransaction statements into one
+** transaction, so that both the database and any nadeko() archives are
+** only written once per group instead of once per statement.  If
+** isMemoize is set, statements are skipped as decided by memoPrepare().
+** If isResume is set, each statement is committed together with its
+** completion record, on its own unless grouped by nTransaction, and
+** statements changing only the connection are executed again.
+*/
+int readAndLoadFile(sqlite3 *db, const char *zFilename) {
+    const script_options *o = &scriptOptions;
+    char zScriptHash[MEMO_HASH_SIZE];
+    progress_state progress;
+    memo_state memo;
+    script scr;
+    int nCompleted = 0;
+    int rc;
+    if ((rc = loadScript(&scr, zFilename))) return rc;
+    if ((o->isMemoize && (rc = beginScriptMemo(db, &scr))) ||
+        (o->isResume && (rc = beginScriptResume(db, &scr, zScriptHash, &nCompleted)))) {
+        freeScript(&scr);
+        return rc;
+    }
+
+    memset(&memo, 0, sizeof(memo));
+    sqlite3_int64 iTransactionLinum = 1;
+    int nPending = 0;
+    int isOwned = 0;
+    for (int n = 0; n < scr.nStmt; n++) {
+        script_statement *pStmt = &scr.aStmt[n];
+
+        // Only statements changing the connection run again when resuming
+        int isSession = o->isResume && resumeIsSession(db, pStmt->zSql);
+        if (n < nCompleted && !isSession) continue;
+
+        // Open a new transaction if there is none
+        char *zErr = 0;
+        if (o->nTransaction && sqlite3_get_autocommit(db)) {
+            if (sqlite3_exec(db, "BEGIN", 0, 0, &zErr) != SQLITE_OK) {
+                fprintf(stderr, "error: %s:%llu: %s\n", zFilename, pStmt->iLinum, zErr);
+                sqlite3_free(zErr);
+                freeScript(&scr);
+                return SQLITE_ERROR;
+            }
+            iTransactionLinum = pStmt->iLinum;
+            nPending = 0;
+            isOwned = 1;
+        }
+
+        // Wrap the statement together with its completion record
+        int isWrapped = o->isResume && !isSession && sqlite3_get_autocommit(db) &&
+                        resumeIsWrappable(pStmt->zSql);
+        if (isWrapped) rc = sqlite3_exec(db, "BEGIN", 0, 0, &zErr);
+
+        // Execute current SQL statement unless it is up to date
+        int isSkipped = 0;
+        if (rc == SQLITE_OK && o->isMemoize) {
+            rc = memoPrepare(db, pStmt->zSql, &memo, &isSkipped, &zErr);
+        }
+        if (rc == SQLITE_OK && !isSkipped) {
+            TIMELINE_BEGIN("driver", "statement", pStmt->zSql);
+            progressBegin(&progress, db, zFilename, pStmt->iLinum);
+            rc = shardExec(db, pStmt->zSql, &zErr);
+            progressEnd(&progress);
+            TIMELINE_END("driver", "statement");
+            if (rc != SQLITE_OK && progress.isTimedOut) {
+                sqlite3_free(zErr);
+                zErr = sqlite3_mprintf("statement timeout exceeded");
+            }
+        }
+        if (rc == SQLITE_OK && o->isMemoize && !isSkipped) {
+            rc = memoRecord(db, &memo, &zErr);
+        }
+        if (rc == SQLITE_OK && o->isResume && !isSession) {
+            rc = resumeRecord(db, zScriptHash, n, &zErr);
+        }
+        if (rc == SQLITE_OK && isWrapped && !sqlite3_get_autocommit(db)) {
+            rc = sqlite3_exec(db, "COMMIT", 0, 0, &zErr);
+        }
+        if (rc != SQLITE_OK) {
+            fprintf(stderr,
+                "error: %s:%llu: %s\n",
+                zFilename,
+                pStmt->iLinum,
+                zErr ? zErr : sqlite3_errstr(rc));
+            sqlite3_free(zErr);
+            if (isWrapped && !sqlite3_get_autocommit(db)) {
+                sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+            }
+            if (isOwned) {
+                rollbackScriptTransaction(db, zFilename, iTransactionLinum, nPending + 1);
+            }
+            memoStateFree(&memo);
+            freeScript(&scr);
+            return SQLITE_ERROR;
+        }
+
+        // Commit once the transaction is full, unless the script ended it
+        if (sqlite3_get_autocommit(db)) isOwned = 0;
+        if (isOwned && ++nPending >= o->nTransaction &&
+            commitScriptTransaction(db, zFilename, pStmt->iLinum)) {
+            memoStateFree(&memo);
+            freeScript(&scr);
+            return SQLITE_ERROR;
+        }
+    }
+
+    sqlite3_int64 iLastLinum = scr.nStmt ? scr.aStmt[scr.nStmt - 1].iLinum : 1;
+    rc = isOwned ? commitScriptTransaction(db, zFilename, iLastLinum) : SQLITE_OK;
+    if (rc == SQLITE_OK && o->isResume) {
+        char *zErr = 0;
+        if ((rc = resumeFinish(db, zScriptHash, &zErr))) {
+            fprintf(stderr, "error: %s: resuming: %s\n", zFilename, zErr);
+            sqlite3_free(zErr);
+        }
+    }
+    memoStateFree(&memo);
+    freeScript(&scr);
+    return rc;
+}
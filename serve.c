@@ -0,0 +1,218 @@
+/*
+** This file implements the server mode of the driver.  The server keeps
+** a single connection to the output database open, together with its
+** page cache and the state of all nadeko() tables, and executes scripts
+** submitted over a Unix domain socket one after another.  A request
+** consists of the working directory and the absolute path of the script,
+** each terminated by a newline.  Everything the driver reports while
+** executing the script is streamed back, followed by a NUL byte and the
+** result code.  Since clients execute arbitrary SQL, including reading
+** and writing files through nadeko(), with the rights of the server, the
+** socket is created accessible to the user running the server only.
+** The server stops on SIGINT or SIGTERM.  Usage example:
+**
+**     nadeko --serve /tmp/nadeko.sock --output out.db &
+**     nadeko --connect /tmp/nadeko.sock script.sql
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVE_REQUEST_SIZE 8192
+#define SERVE_BUFFER_SIZE 4096
+#define SERVE_TIMEOUT_S 10
+
+static volatile sig_atomic_t isServeStopping = 0;
+
+/*
+** Signal handler which makes the server stop after the current request.
+*/
+static void serveHandleSignal(int iSignal) {
+    (void)(iSignal);
+    isServeStopping = 1;
+}
+
+/*
+** Fill the given address with the given socket path.
+*/
+static int serveAddress(struct sockaddr_un *pAddress, const char *zSocket) {
+    memset(pAddress, 0, sizeof(*pAddress));
+    pAddress->sun_family = AF_UNIX;
+    if (strlen(zSocket) >= sizeof(pAddress->sun_path)) {
+        fprintf(stderr, "error: socket path too long \"%s\"\n", zSocket);
+        return SQLITE_ERROR;
+    }
+    strcpy(pAddress->sun_path, zSocket);
+
+    return SQLITE_OK;
+}
+
+/*
+** Execute the request of a single client, with all reports of the
+** driver redirected to the client.  The request is complete after its
+** second newline, and clients which do not send it within
+** SERVE_TIMEOUT_S seconds are dropped, while reports which a client does
+** not read within that time are discarded, so that no client can stall
+** the server.
+*/
+static void serveHandle(sqlite3 *db, int fdClient, int fdHome) {
+    char zRequest[SERVE_REQUEST_SIZE];
+    struct timeval timeout = {SERVE_TIMEOUT_S, 0};
+    size_t nRequest = 0;
+    int nLine = 0;
+    ssize_t nRead = 1;
+    setsockopt(fdClient, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fdClient, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    while (nRequest < sizeof(zRequest) - 1 && nRead > 0 && nLine < 2) {
+        nRead = read(fdClient, zRequest + nRequest, sizeof(zRequest) - 1 - nRequest);
+        for (ssize_t n = 0; n < nRead; n++) nLine += zRequest[nRequest + n] == '\n';
+        if (nRead > 0) nRequest += nRead;
+    }
+    zRequest[nRequest] = '\0';
+
+    char *zScript = strchr(zRequest, '\n');
+    char *zEnd = zScript ? strchr(zScript + 1, '\n') : 0;
+    if (zEnd == 0) {
+        dprintf(fdClient, "error: malformed request\n%c%d\n", '\0', SQLITE_ERROR);
+        return;
+    }
+    *zScript++ = '\0';
+    *zEnd = '\0';
+
+    // Redirect reports to the client for the duration of the request
+    int rc;
+    fflush(stderr);
+    int fdSaved = dup(STDERR_FILENO);
+    dup2(fdClient, STDERR_FILENO);
+    TIMELINE_BEGIN("driver", "request", zScript);
+    if (chdir(zRequest)) {
+        fprintf(stderr, "error: changing directory: %s\n", strerror(errno));
+        rc = SQLITE_ERROR;
+    } else {
+        rc = readAndLoadFile(db, zScript);
+    }
+    TIMELINE_END("driver", "request");
+    fflush(stderr);
+    dup2(fdSaved, STDERR_FILENO);
+    close(fdSaved);
+
+    if (fchdir(fdHome)) {
+        fprintf(stderr, "internal: restoring directory: %s\n", strerror(errno));
+    }
+    dprintf(fdClient, "%c%d\n", '\0', rc);
+}
+
+/*
+** Serve requests on the given socket path using the given connection
+** until stopped by a signal.
+*/
+static int serveRun(sqlite3 *db, const char *zSocket) {
+    struct sockaddr_un address;
+    struct sigaction action;
+    struct stat st;
+    int rc = SQLITE_OK;
+
+    if (serveAddress(&address, zSocket)) return SQLITE_ERROR;
+    if (!lstat(zSocket, &st) && S_ISSOCK(st.st_mode)) {
+        // Only sockets left behind by servers which are gone are replaced
+        int fdProbe = socket(AF_UNIX, SOCK_STREAM, 0);
+        int isServed = fdProbe >= 0 &&
+                       !connect(fdProbe, (struct sockaddr *)(&address), sizeof(address));
+        if (fdProbe >= 0) close(fdProbe);
+        if (isServed) {
+            fprintf(stderr, "error: \"%s\" is already being served\n", zSocket);
+            return SQLITE_ERROR;
+        }
+        unlink(zSocket);
+    }
+    int fdHome = open(".", O_RDONLY);
+    int fdListen = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t iMask = umask(0077);
+    int isBound = fdListen >= 0 &&
+                  !bind(fdListen, (struct sockaddr *)(&address), sizeof(address));
+    umask(iMask);
+    if (fdHome < 0 || !isBound || listen(fdListen, SOMAXCONN)) {
+        fprintf(stderr, "error: serving \"%s\": %s\n", zSocket, strerror(errno));
+        if (fdListen >= 0) close(fdListen);
+        if (fdHome >= 0) close(fdHome);
+        return SQLITE_ERROR;
+    }
+
+    // Interrupt accept() on termination and survive vanished clients
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serveHandleSignal;
+    sigaction(SIGINT, &action, 0);
+    sigaction(SIGTERM, &action, 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!isServeStopping) {
+        int fdClient = accept(fdListen, 0, 0);
+        if (fdClient < 0 && errno != EINTR) {
+            fprintf(stderr, "error: accepting client: %s\n", strerror(errno));
+            rc = SQLITE_ERROR;
+            break;
+        } else if (fdClient >= 0) {
+            serveHandle(db, fdClient, fdHome);
+            close(fdClient);
+        }
+    }
+
+    close(fdListen);
+    close(fdHome);
+    unlink(zSocket);
+
+    return rc;
+}
+
+/*
+** Submit the given script to the server listening on the given socket
+** path and stream back its reports.  Returns the result code of the
+** script as reported by the server.
+*/
+static int serveSubmit(const char *zSocket, const char *zDirectory, const char *zScript) {
+    struct sockaddr_un address;
+    char aBuffer[SERVE_BUFFER_SIZE];
+    char zStatus[16];
+    size_t nStatus = 0;
+    int isStatus = 0;
+    ssize_t nRead;
+
+    if (serveAddress(&address, zSocket)) return SQLITE_ERROR;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)(&address), sizeof(address)) ||
+        dprintf(fd, "%s\n%s\n", zDirectory, zScript) < 0 || shutdown(fd, SHUT_WR)) {
+        fprintf(stderr, "error: connecting to \"%s\": %s\n", zSocket, strerror(errno));
+        if (fd >= 0) close(fd);
+        return SQLITE_ERROR;
+    }
+
+    while ((nRead = read(fd, aBuffer, sizeof(aBuffer))) > 0) {
+        char *pEnd = isStatus ? aBuffer : memchr(aBuffer, '\0', nRead);
+        size_t nText = pEnd ? (size_t)(pEnd - aBuffer) : (size_t)(nRead);
+        fwrite(aBuffer, 1, nText, stderr);
+        if (pEnd && !isStatus) nText++;
+        isStatus = isStatus || pEnd != 0;
+        for (; isStatus && nText < (size_t)(nRead) && nStatus < sizeof(zStatus) - 1;
+             nText++) {
+            zStatus[nStatus++] = aBuffer[nText];
+        }
+    }
+    close(fd);
+    zStatus[nStatus] = '\0';
+
+    if (!isStatus) {
+        fprintf(stderr, "error: connection to \"%s\" lost\n", zSocket);
+        return SQLITE_ERROR;
+    }
+
+    return atoi(zStatus);
+}
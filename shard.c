@@ -0,0 +1,349 @@
+/*
+** This file implements sharded execution of statements by the driver.
+** A statement which creates a table from a row-wise scan of a single
+** nadeko() table, without aggregates, joins, sorting or limits, is
+** executed by several worker connections at once.  Each worker reads one
+** shard of the source into its own temporary database file, after which
+** the resulting tables are appended to the new table in the main
+** database in shard order.  All other statements, and all statements
+** within an open transaction, are executed as usual.  Usage example:
+**
+**     nadeko --shards 8 --output out.db script.sql
+*/
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* shard_options controls how shardExec() executes statements
+*/
+typedef struct shard_options shard_options;
+struct shard_options {
+    int nShard;                          /* Number of worker connections */
+    int iOpenFlags;                      /* Flags passed to sqlite3_open_v2() */
+    int (*xPrepare)(sqlite3 *, char **); /* Configures each new connection */
+};
+
+/* shard_plan describes a statement considered for sharded execution
+*/
+typedef struct shard_plan shard_plan;
+struct shard_plan {
+    analyze_access access; /* Tables accessed by the statement */
+    analyze_set function;  /* Functions called by the statement */
+    char *zSource;         /* Statement creating the nadeko() source */
+};
+
+/* shard_worker is the state of a single worker connection
+*/
+typedef struct shard_worker shard_worker;
+struct shard_worker {
+    const char *zSql; /* Statement to execute */
+    char *zSource;    /* Statement creating the shard of the source */
+    char *zDatabase;  /* Database file of the worker */
+    char *zErr;       /* Error message of the worker, if any */
+    int rc;           /* Result code of the worker */
+};
+
+static shard_options shardOptions;
+static int iShardRun = 0;
+static pthread_mutex_t shardMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+** Authorizer callback which records the functions called by the
+** statement being prepared along with the tables it accesses.
+*/
+static int shardAuthorizer(void *pArg, int iAction, const char *z1, const char *z2,
+    const char *zDb, const char *zTrigger) {
+    shard_plan *pPlan = pArg;
+    if (iAction == SQLITE_FUNCTION && analyzeSetAdd(&pPlan->function, z2)) {
+        return SQLITE_DENY;
+    }
+
+    return analyzeAuthorizer(&pPlan->access, iAction, z1, z2, zDb, zTrigger);
+}
+
+/*
+** Return true if the given statement contains the given keyword outside
+** of string literals and quoted identifiers.
+*/
+static int shardContainsKeyword(const char *zSql, const char *zKeyword) {
+    int nKeyword = strlen(zKeyword);
+    char cQuote = 0;
+    for (const char *z = zSql; *z; z++) {
+        if (cQuote) {
+            if (*z == cQuote) cQuote = 0;
+        } else if (*z == '\'' || *z == '"' || *z == '`') {
+            cQuote = *z;
+        } else if (*z == '[') {
+            cQuote = ']';
+        } else if (!sqlite3_strnicmp(z, zKeyword, nKeyword) &&
+                   (z == zSql || !(isalnum((unsigned char)(z[-1])) || z[-1] == '_')) &&
+                   !(isalnum((unsigned char)(z[nKeyword])) || z[nKeyword] == '_')) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+** Return true if all functions of the given plan are scalar functions.
+*/
+static int shardIsScalar(sqlite3 *db, shard_plan *pPlan) {
+    sqlite3_stmt *pSelect;
+    int result = 1;
+    if (sqlite3_prepare_v2(db,
+            "SELECT 1 FROM pragma_function_list WHERE name = lower(?) AND type != 's'",
+            -1,
+            &pSelect,
+            0)) {
+        return 0;
+    }
+    for (int n = 0; result && n < pPlan->function.nName; n++) {
+        sqlite3_bind_text(pSelect, 1, pPlan->function.azName[n], -1, SQLITE_STATIC);
+        result = sqlite3_step(pSelect) != SQLITE_ROW;
+        sqlite3_reset(pSelect);
+    }
+    sqlite3_finalize(pSelect);
+
+    return result;
+}
+
+/*
+** Return true if the query plan of the given statement consists of a
+** single scan, which rules out joins, subqueries, compound selects and
+** sorting.
+*/
+static int shardIsSingleScan(sqlite3 *db, const char *zSql) {
+    sqlite3_stmt *pExplain;
+    char *zExplain = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", zSql);
+    int rc = zExplain ? sqlite3_prepare_v2(db, zExplain, -1, &pExplain, 0) : SQLITE_NOMEM;
+    sqlite3_free(zExplain);
+    if (rc) return 0;
+
+    int nRow = 0, isScan = 0;
+    while (sqlite3_step(pExplain) == SQLITE_ROW) {
+        const char *zDetail = (const char *)(sqlite3_column_text(pExplain, 3));
+        isScan = zDetail && !strncmp(zDetail, "SCAN ", 5);
+        nRow++;
+    }
+    sqlite3_finalize(pExplain);
+
+    return nRow == 1 && isScan;
+}
+
+/*
+** Store the statement creating the given nadeko() table of the main
+** database in the given plan, unless the table is already sharded.
+*/
+static int shardFindSource(sqlite3 *db, const char *zName, shard_plan *pPlan) {
+    sqlite3_stmt *pSelect;
+    if (sqlite3_prepare_v2(db,
+            "SELECT sql FROM main.sqlite_schema WHERE type = 'table' AND name = ? "
+            "AND sql LIKE 'CREATE VIRTUAL TABLE%USING nadeko%' "
+            "AND sql NOT LIKE '%shard=%' AND sql LIKE '%)'",
+            -1,
+            &pSelect,
+            0)) {
+        return 0;
+    }
+    sqlite3_bind_text(pSelect, 1, zName, -1, SQLITE_STATIC);
+    if (sqlite3_step(pSelect) == SQLITE_ROW) {
+        pPlan->zSource = sqlite3_mprintf("%s", sqlite3_column_text(pSelect, 0));
+    }
+    sqlite3_finalize(pSelect);
+
+    return pPlan->zSource != 0;
+}
+
+/*
+** Return true if the given statement may be executed sharded, filling
+** the given zeroed plan.  The plan must be released by the caller
+** either way.
+*/
+static int shardPlan(sqlite3 *db, const char *zSql, shard_plan *pPlan) {
+    sqlite3_stmt *pStmt = 0;
+    if (!sqlite3_get_autocommit(db) || shardContainsKeyword(zSql, "LIMIT")) return 0;
+
+    sqlite3_set_authorizer(db, shardAuthorizer, pPlan);
+    int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+    sqlite3_set_authorizer(db, 0, 0);
+    sqlite3_finalize(pStmt);
+    if (rc != SQLITE_OK || pPlan->access.isBarrier || pPlan->access.create.nName != 1 ||
+        pPlan->access.drop.nName != 0) {
+        return 0;
+    }
+
+    // The scanned table must be the only table read apart from the schema
+    const char *zSource = 0;
+    for (int n = 0; n < pPlan->access.read.nName; n++) {
+        const char *zName = pPlan->access.read.azName[n];
+        if (!sqlite3_strnicmp(zName, "sqlite_", 7)) continue;
+        if (zSource) return 0;
+        zSource = zName;
+    }
+
+    return zSource && shardFindSource(db, zSource, pPlan) && shardIsScalar(db, pPlan) &&
+           shardIsSingleScan(db, zSql);
+}
+
+/*
+** Release all memory held by the given plan.
+*/
+static void shardPlanFree(shard_plan *pPlan) {
+    analyzeAccessFree(&pPlan->access);
+    analyzeSetFree(&pPlan->function);
+    sqlite3_free(pPlan->zSource);
+}
+
+/*
+** Main function of each worker thread, which executes the statement
+** against one shard of the source in its own database.
+*/
+static void *shardWorkerMain(void *pArg) {
+    shard_worker *pWorker = pArg;
+    sqlite3 *db = 0;
+
+    remove(pWorker->zDatabase);
+    TIMELINE_BEGIN("driver", "shard", pWorker->zSource);
+    int rc = sqlite3_open_v2(pWorker->zDatabase, &db, shardOptions.iOpenFlags, 0);
+    if (rc != SQLITE_OK) {
+        pWorker->zErr = sqlite3_mprintf("opening database: %s", sqlite3_errstr(rc));
+    } else if (!(rc = shardOptions.xPrepare(db, &pWorker->zErr)) &&
+               !(rc = sqlite3_exec(db, pWorker->zSource, 0, 0, &pWorker->zErr))) {
+        rc = sqlite3_exec(db, pWorker->zSql, 0, 0, &pWorker->zErr);
+    }
+    pWorker->rc = rc;
+    sqlite3_close(db);
+    TIMELINE_END("driver", "shard");
+
+    return 0;
+}
+
+/*
+** Append the table of the given name from all worker databases to the
+** main database, creating it from the schema of the first worker.
+*/
+static int shardMerge(
+    sqlite3 *db, const char *zTable, shard_worker *aWorker, int nWorker, char **pzErr) {
+    int rc = SQLITE_OK;
+    TIMELINE_BEGIN("driver", "merge", zTable);
+    for (int n = 0; rc == SQLITE_OK && n < nWorker; n++) {
+        if ((rc = nadekoExecPrintf(
+                 db, pzErr, "ATTACH %Q AS nadeko_shard", aWorker[n].zDatabase))) {
+            break;
+        }
+        if (n == 0) {
+            sqlite3_stmt *pSelect;
+            rc = sqlite3_prepare_v2(db,
+                "SELECT sql FROM nadeko_shard.sqlite_schema WHERE name = ?",
+                -1,
+                &pSelect,
+                0);
+            if (rc == SQLITE_OK) {
+                sqlite3_bind_text(pSelect, 1, zTable, -1, SQLITE_STATIC);
+                rc = sqlite3_step(pSelect) == SQLITE_ROW
+                         ? sqlite3_exec(db,
+                               (const char *)(sqlite3_column_text(pSelect, 0)),
+                               0,
+                               0,
+                               pzErr)
+                         : SQLITE_ERROR;
+                sqlite3_finalize(pSelect);
+            }
+        }
+        if (rc == SQLITE_OK) {
+            rc = nadekoExecPrintf(db,
+                pzErr,
+                "INSERT INTO main.\"%w\" SELECT * FROM nadeko_shard.\"%w\"",
+                zTable,
+                zTable);
+        }
+        sqlite3_exec(db, "DETACH nadeko_shard", 0, 0, 0);
+    }
+    if (rc != SQLITE_OK) {
+        nadekoExecPrintf(db, 0, "DROP TABLE IF EXISTS main.\"%w\"", zTable);
+    }
+    TIMELINE_END("driver", "merge");
+
+    return rc;
+}
+
+/*
+** Execute the given statement, sharded across shardOptions.nShard worker
+** connections if possible.  Behaves like sqlite3_exec() otherwise.
+*/
+static int shardExec(sqlite3 *db, const char *zSql, char **pzErr) {
+    shard_plan plan;
+    memset(&plan, 0, sizeof(plan));
+    if (shardOptions.nShard < 2 || !shardPlan(db, zSql, &plan)) {
+        shardPlanFree(&plan);
+        return sqlite3_exec(db, zSql, 0, 0, pzErr);
+    }
+
+    int nWorker = shardOptions.nShard;
+    const char *zTempDir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    shard_worker *aWorker = sqlite3_malloc(nWorker * sizeof(*aWorker));
+    pthread_t *aThread = sqlite3_malloc(nWorker * sizeof(*aThread));
+    if (!aWorker || !aThread) {
+        sqlite3_free(aWorker);
+        sqlite3_free(aThread);
+        shardPlanFree(&plan);
+        return SQLITE_NOMEM;
+    }
+    memset(aWorker, 0, nWorker * sizeof(*aWorker));
+    pthread_mutex_lock(&shardMutex);
+    int iRun = iShardRun++;
+    pthread_mutex_unlock(&shardMutex);
+
+    // Append the shard argument to the arguments of the source
+    int rc = SQLITE_OK;
+    int nSource = strlen(plan.zSource) - 1;
+    for (int n = 0; n < nWorker; n++) {
+        aWorker[n].zSql = zSql;
+        aWorker[n].zSource = sqlite3_mprintf(
+            "%.*s, 'shard=%d/%d')", nSource, plan.zSource, n, nWorker);
+        aWorker[n].zDatabase = sqlite3_mprintf(
+            "%s/nadeko-%d-shard%d-%d.db", zTempDir, (int)(getpid()), iRun, n);
+        if (!aWorker[n].zSource || !aWorker[n].zDatabase) rc = SQLITE_NOMEM;
+    }
+
+    int nThread = 0;
+    for (; rc == SQLITE_OK && nThread < nWorker; nThread++) {
+        if (pthread_create(&aThread[nThread], 0, shardWorkerMain, &aWorker[nThread])) {
+            *pzErr = sqlite3_mprintf("starting shard workers: %s", strerror(errno));
+            rc = SQLITE_ERROR;
+            break;
+        }
+    }
+    for (int n = 0; n < nThread; n++) {
+        pthread_join(aThread[n], 0);
+    }
+    for (int n = 0; rc == SQLITE_OK && n < nWorker; n++) {
+        if ((rc = aWorker[n].rc)) {
+            *pzErr = sqlite3_mprintf("shard %d of %d: %s",
+                n,
+                nWorker,
+                aWorker[n].zErr ? aWorker[n].zErr : sqlite3_errstr(rc));
+        }
+    }
+    if (rc == SQLITE_OK) {
+        rc = shardMerge(db, plan.access.create.azName[0], aWorker, nWorker, pzErr);
+    }
+
+    for (int n = 0; n < nWorker; n++) {
+        if (aWorker[n].zDatabase) remove(aWorker[n].zDatabase);
+        sqlite3_free(aWorker[n].zSource);
+        sqlite3_free(aWorker[n].zDatabase);
+        sqlite3_free(aWorker[n].zErr);
+    }
+    sqlite3_free(aWorker);
+    sqlite3_free(aThread);
+    shardPlanFree(&plan);
+
+    return rc;
+}
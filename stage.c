@@ -0,0 +1,122 @@
+/*
+** This file implements staging of the output database.  When staging,
+** the script is executed against a private temporary database which
+** lives in the page cache and only spills to a temporary file once the
+** cache is full.  On success its final state is written to the output
+** path in one sequential pass using VACUUM INTO and atomically renamed
+** into place, producing a compact and defragmented file.  Usage example:
+**
+**     nadeko --stage-in-memory --cache-size -2097152 --output out.db script.sql
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STAGE_DEFAULT_CACHE_SIZE "-1048576"
+#define STAGE_PATH_SIZE 4096
+
+/*
+** Return the given filename as an absolute path, so it stays valid
+** when the working directory is changed.
+*/
+static char *stageAbsolutePath(const char *zFilename) {
+    char zCwd[STAGE_PATH_SIZE];
+    if (zFilename[0] == '/') {
+        return sqlite3_mprintf("%s", zFilename);
+    } else if (getcwd(zCwd, STAGE_PATH_SIZE) == 0) {
+        return 0;
+    } else {
+        return sqlite3_mprintf("%s/%s", zCwd, zFilename);
+    }
+}
+
+/*
+** Copy the current contents of the output database, if any, into
+** the staging database using the online backup API.
+*/
+static int stageLoad(sqlite3 *db, const char *zOutput) {
+    sqlite3 *pSource = 0;
+    int rc;
+
+    if (access(zOutput, F_OK)) return SQLITE_OK;
+    if ((rc = sqlite3_open_v2(zOutput, &pSource, SQLITE_OPEN_READONLY, 0))) {
+        sqlite3_close(pSource);
+        return rc;
+    }
+
+    sqlite3_backup *pBackup = sqlite3_backup_init(db, "main", pSource, "main");
+    if (pBackup == 0) {
+        rc = sqlite3_errcode(db);
+    } else {
+        sqlite3_backup_step(pBackup, -1);
+        rc = sqlite3_backup_finish(pBackup);
+    }
+    sqlite3_close(pSource);
+
+    return rc;
+}
+
+/*
+** Sync the given file or directory to disk.
+*/
+static int stageSync(const char *zPath) {
+    int fd = open(zPath, O_RDONLY);
+    int rc = fd < 0 || fsync(fd) ? SQLITE_IOERR : SQLITE_OK;
+    if (fd >= 0) close(fd);
+
+    return rc;
+}
+
+/*
+** Remove the journal, write-ahead log and shared memory files of the
+** given database, which SQLite would otherwise apply to the file renamed
+** over it.  Their contents are part of the staging database already.
+*/
+static void stageRemoveJournals(const char *zOutput) {
+    static const char *const azSuffix[] = {"-journal", "-wal", "-shm"};
+    for (int n = 0; n < (int)(sizeof(azSuffix) / sizeof(*azSuffix)); n++) {
+        char *zPath = sqlite3_mprintf("%s%s", zOutput, azSuffix[n]);
+        if (zPath) remove(zPath);
+        sqlite3_free(zPath);
+    }
+}
+
+/*
+** Write the staging database to the output path in a single pass.
+*/
+static int stagePersist(sqlite3 *db, const char *zOutput, char **pzErr) {
+    char *zTemp = sqlite3_mprintf("%s-stage%d", zOutput, (int)(getpid()));
+    if (zTemp == 0) return SQLITE_NOMEM;
+
+    remove(zTemp);
+    char *zSql = sqlite3_mprintf("VACUUM INTO %Q", zTemp);
+    int rc = zSql ? sqlite3_exec(db, zSql, 0, 0, pzErr) : SQLITE_NOMEM;
+    sqlite3_free(zSql);
+
+    if (rc == SQLITE_OK && stageSync(zTemp)) {
+        *pzErr = sqlite3_mprintf("syncing \"%s\": %s", zTemp, strerror(errno));
+        rc = SQLITE_IOERR;
+    }
+    if (rc == SQLITE_OK) stageRemoveJournals(zOutput);
+    if (rc == SQLITE_OK && rename(zTemp, zOutput)) {
+        *pzErr = sqlite3_mprintf("renaming \"%s\": %s", zTemp, strerror(errno));
+        rc = SQLITE_IOERR;
+    }
+    if (rc) remove(zTemp);
+    sqlite3_free(zTemp);
+
+    // The rename only survives a crash once the directory is synced
+    const char *zSlash = strrchr(zOutput, '/');
+    char *zDir = zSlash ? sqlite3_mprintf("%.*s", (int)(zSlash - zOutput), zOutput)
+                        : sqlite3_mprintf(".");
+    if (rc == SQLITE_OK && (zDir == 0 || stageSync(zDir[0] ? zDir : "/"))) {
+        *pzErr = sqlite3_mprintf("syncing directory of \"%s\"", zOutput);
+        rc = SQLITE_IOERR;
+    }
+    sqlite3_free(zDir);
+
+    return rc;
+}
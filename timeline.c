@@ -0,0 +1,154 @@
+/*
+** This file implements a timeline of nested spans which is written
+** to disk using the Chrome Trace Event Format.  The resulting file
+** can be loaded into Perfetto or chrome://tracing.  Spans are opened
+** and closed using the TIMELINE_BEGIN() and TIMELINE_END() macros,
+** which the extensions define as no-ops when built on their own.
+** Usage example:
+**
+**     nadeko --timeline out.json script.sql
+*/
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define TIMELINE_DETAIL_SIZE 256
+
+#define TIMELINE_BEGIN(zCat, zName, zDetail) \
+    do { \
+        if (pTimelineFile) timelineEvent('B', zCat, zName, zDetail); \
+    } while (0)
+#define TIMELINE_END(zCat, zName) \
+    do { \
+        if (pTimelineFile) timelineEvent('E', zCat, zName, 0); \
+    } while (0)
+
+static FILE *pTimelineFile = 0;
+static int isTimelineEmpty = 1;
+static int iTimelineThreads = 0;
+static pthread_key_t timelineThreadKey;
+static pthread_mutex_t timelineMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+** Return microseconds elapsed on the monotonic clock.
+*/
+static sqlite3_int64 timelineNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (sqlite3_int64)(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+** Write the given string as a quoted JSON string, truncating
+** it after the given number of bytes.
+*/
+static void timelineWriteString(FILE *fd, const char *zString, int nLimit) {
+    fputc('"', fd);
+    for (int n = 0; zString[n] != '\0'; n++) {
+        unsigned char c = zString[n];
+        if (n == nLimit) {
+            fputs("...", fd);
+            break;
+        } else if (c == '"' || c == '\\') {
+            fputc('\\', fd);
+            fputc(c, fd);
+        } else if (c == '\n') {
+            fputs("\\n", fd);
+        } else if (c < 0x20) {
+            fprintf(fd, "\\u%04x", c);
+        } else {
+            fputc(c, fd);
+        }
+    }
+    fputc('"', fd);
+}
+
+/*
+** Begin a new event record.  Must be called with the mutex held.
+*/
+static void timelineWriteSeparator(void) {
+    fputs(isTimelineEmpty ? "\n" : ",\n", pTimelineFile);
+    isTimelineEmpty = 0;
+}
+
+/*
+** Return the small integer identifying the calling thread within
+** the timeline, assigning and naming a new one on first use.  Must
+** be called with the mutex held.
+*/
+static int timelineThreadId(void) {
+    intptr_t iThread = (intptr_t)(pthread_getspecific(timelineThreadKey));
+    if (iThread == 0) {
+        iThread = ++iTimelineThreads;
+        pthread_setspecific(timelineThreadKey, (void *)(iThread));
+        timelineWriteSeparator();
+        fprintf(pTimelineFile,
+            "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s %d\"}}",
+            (int)(iThread),
+            iThread == 1 ? "main" : "worker",
+            (int)(iThread));
+    }
+
+    return iThread;
+}
+
+/*
+** Record the beginning ('B') or end ('E') of a span on the timeline.
+*/
+static void timelineEvent(char cPhase, const char *zCat, const char *zName,
+    const char *zDetail) {
+    sqlite3_int64 iNow = timelineNow();
+    pthread_mutex_lock(&timelineMutex);
+    if (pTimelineFile) {
+        int iThread = timelineThreadId();
+        timelineWriteSeparator();
+        fprintf(pTimelineFile,
+            "{\"ph\":\"%c\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%lld",
+            cPhase,
+            zCat,
+            zName,
+            iThread,
+            iNow);
+        if (zDetail) {
+            fputs(",\"args\":{\"detail\":", pTimelineFile);
+            timelineWriteString(pTimelineFile, zDetail, TIMELINE_DETAIL_SIZE);
+            fputc('}', pTimelineFile);
+        }
+        fputc('}', pTimelineFile);
+    }
+    pthread_mutex_unlock(&timelineMutex);
+}
+
+/*
+** Start writing the timeline to the given filename.
+*/
+static int timelineOpen(const char *zFilename) {
+    if (!(pTimelineFile = fopen(zFilename, "w"))) {
+        return SQLITE_CANTOPEN;
+    } else if (pthread_key_create(&timelineThreadKey, 0)) {
+        fclose(pTimelineFile);
+        pTimelineFile = 0;
+        return SQLITE_NOMEM;
+    }
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", pTimelineFile);
+
+    return SQLITE_OK;
+}
+
+/*
+** Finish writing the timeline, if any.
+*/
+static void timelineClose(void) {
+    pthread_mutex_lock(&timelineMutex);
+    if (pTimelineFile) {
+        fputs("\n]}\n", pTimelineFile);
+        fclose(pTimelineFile);
+        pTimelineFile = 0;
+        pthread_key_delete(timelineThreadKey);
+    }
+    pthread_mutex_unlock(&timelineMutex);
+}
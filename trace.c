@@ -0,0 +1,299 @@
+/*
+** This file implements low-overhead asynchronous tracing.  The trace
+** callback only samples the event and writes a compact fixed-size
+** record into a lock-free ring buffer, which is drained and formatted
+** by a background writer thread.  Records are dropped rather than
+** blocking the caller whenever the ring buffer is full.  Usage example:
+**
+**     nadeko --trace --trace-sample row=1000,stmt=1 script.sql
+*/
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_RING_SIZE (1 << 14)
+#define TRACE_TEXT_SIZE 32
+#define TRACE_IDLE_NANOSECONDS 1000000
+
+/* For convenience, define symbolic names for each event type. */
+#define TRACE_TYPE_STMT 0
+#define TRACE_TYPE_ROW 1
+#define TRACE_TYPE_PROFILE 2
+#define TRACE_TYPE_CLOSE 3
+#define TRACE_TYPE_COUNT 4
+
+/* trace_record is a single event as stored in the ring buffer
+*/
+typedef struct trace_record trace_record;
+struct trace_record {
+    unsigned int uSequence;      /* Slot sequence for the ring buffer */
+    unsigned char uType;         /* One of TRACE_TYPE_* */
+    unsigned char isTruncated;   /* True if zText was cut short */
+    sqlite3_int64 iTime;         /* Monotonic timestamp in nanoseconds */
+    sqlite3_int64 iValue;        /* Event payload, e.g. elapsed nanoseconds */
+    sqlite3_uint64 iStmt;        /* Address identifying the statement */
+    char zText[TRACE_TEXT_SIZE]; /* Unterminated prefix of the SQL text */
+};
+
+static const char *const azTraceType[TRACE_TYPE_COUNT] = {
+    "stmt", "row", "profile", "close"};
+
+static trace_record aTraceRing[TRACE_RING_SIZE];
+static unsigned int uTraceHead = 0;
+static unsigned int uTraceTail = 0;
+static unsigned int aTraceSample[TRACE_TYPE_COUNT] = {1, 1, 1, 1};
+static unsigned int aTraceCount[TRACE_TYPE_COUNT];
+static sqlite3_int64 iTraceDropped = 0;
+static sqlite3_int64 iTraceStart = 0;
+static int isTraceStopping = 0;
+static int isTraceStarted = 0;
+static pthread_t traceWriterThread;
+
+/*
+** Return nanoseconds elapsed on the monotonic clock.
+*/
+static sqlite3_int64 traceNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (sqlite3_int64)(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/*
+** Claim a free slot in the ring buffer, or return NULL if the
+** buffer is full.  Any number of threads may call this concurrently.
+*/
+static trace_record *traceClaim(unsigned int *puPosition) {
+    unsigned int uPos = __atomic_load_n(&uTraceHead, __ATOMIC_RELAXED);
+    for (;;) {
+        trace_record *pRec = &aTraceRing[uPos & (TRACE_RING_SIZE - 1)];
+        unsigned int uSeq = __atomic_load_n(&pRec->uSequence, __ATOMIC_ACQUIRE);
+        int iDiff = (int)(uSeq - uPos);
+        if (iDiff == 0) {
+            if (__atomic_compare_exchange_n(&uTraceHead,
+                    &uPos,
+                    uPos + 1,
+                    1,
+                    __ATOMIC_RELAXED,
+                    __ATOMIC_RELAXED)) {
+                *puPosition = uPos;
+                return pRec;
+            }
+        } else if (iDiff < 0) {
+            __atomic_fetch_add(&iTraceDropped, 1, __ATOMIC_RELAXED);
+            return 0;
+        } else {
+            uPos = __atomic_load_n(&uTraceHead, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+** Publish a slot previously claimed using traceClaim().
+*/
+static void tracePublish(trace_record *pRec, unsigned int uPosition) {
+    __atomic_store_n(&pRec->uSequence, uPosition + 1, __ATOMIC_RELEASE);
+}
+
+/*
+** Format a single record and release its slot.  Only ever called
+** from the writer thread.
+*/
+static void traceWriteRecord(trace_record *pRec) {
+    double rTime = (pRec->iTime - iTraceStart) / 1000000.0;
+    switch (pRec->uType) {
+    case TRACE_TYPE_STMT:
+        fprintf(stderr,
+            "trace: +%.3fms: prepare: %.*s%s\n",
+            rTime,
+            (int)(strnlen(pRec->zText, TRACE_TEXT_SIZE)),
+            pRec->zText,
+            pRec->isTruncated ? "..." : "");
+        break;
+    case TRACE_TYPE_ROW:
+        fprintf(stderr,
+            "trace: +%.3fms: row: statement %llx resulted in a row\n",
+            rTime,
+            pRec->iStmt);
+        break;
+    case TRACE_TYPE_PROFILE:
+        fprintf(stderr,
+            "trace: +%.3fms: profile: statement %llx took %fms\n",
+            rTime,
+            pRec->iStmt,
+            pRec->iValue / 1000000.0);
+        break;
+    case TRACE_TYPE_CLOSE:
+        fprintf(stderr, "trace: +%.3fms: close database connection\n", rTime);
+        break;
+    }
+}
+
+/*
+** Drain all published records from the ring buffer and return the
+** number of records written.
+*/
+static int traceDrain(void) {
+    int nWritten = 0;
+    for (;;) {
+        trace_record *pRec = &aTraceRing[uTraceTail & (TRACE_RING_SIZE - 1)];
+        unsigned int uSeq = __atomic_load_n(&pRec->uSequence, __ATOMIC_ACQUIRE);
+        if (uSeq != uTraceTail + 1) break;
+        traceWriteRecord(pRec);
+        __atomic_store_n(&pRec->uSequence, uTraceTail + TRACE_RING_SIZE, __ATOMIC_RELEASE);
+        uTraceTail++;
+        nWritten++;
+    }
+
+    return nWritten;
+}
+
+/*
+** Main loop of the background writer thread.
+*/
+static void *traceWriterMain(void *pArgUnused) {
+    (void)(pArgUnused);
+
+    struct timespec idle = {0, TRACE_IDLE_NANOSECONDS};
+    while (!__atomic_load_n(&isTraceStopping, __ATOMIC_ACQUIRE)) {
+        if (traceDrain() == 0) nanosleep(&idle, 0);
+    }
+    traceDrain();
+
+    return 0;
+}
+
+/*
+** Callback for sqlite3_trace_v2() which records sampled events
+** without formatting them.
+*/
+int traceLogCallback(unsigned int uMask, void *pCtxUnused, void *pData, void *pExtra) {
+    (void)(pCtxUnused);
+
+    int iType;
+    switch (uMask) {
+    case SQLITE_TRACE_STMT:
+        iType = TRACE_TYPE_STMT;
+        break;
+    case SQLITE_TRACE_ROW:
+        iType = TRACE_TYPE_ROW;
+        break;
+    case SQLITE_TRACE_PROFILE:
+        iType = TRACE_TYPE_PROFILE;
+        break;
+    case SQLITE_TRACE_CLOSE:
+        iType = TRACE_TYPE_CLOSE;
+        break;
+    default:
+        return SQLITE_OK;
+    }
+
+    unsigned int uSample = aTraceSample[iType];
+    if (uSample == 0) return SQLITE_OK;
+    if (uSample > 1 &&
+        __atomic_fetch_add(&aTraceCount[iType], 1, __ATOMIC_RELAXED) % uSample) {
+        return SQLITE_OK;
+    }
+
+    unsigned int uPosition;
+    trace_record *pRec = traceClaim(&uPosition);
+    if (pRec == 0) return SQLITE_OK;
+    pRec->uType = iType;
+    pRec->iTime = traceNow();
+    pRec->iStmt = (sqlite3_uint64)(uintptr_t)(pData);
+    pRec->iValue = 0;
+    pRec->isTruncated = 0;
+    if (iType == TRACE_TYPE_STMT) {
+        const char *zSql = pExtra;
+        int n = 0;
+        while (n < TRACE_TEXT_SIZE && zSql[n] != '\0' && zSql[n] != '\n') {
+            pRec->zText[n] = zSql[n];
+            n++;
+        }
+        if (n < TRACE_TEXT_SIZE) pRec->zText[n] = '\0';
+        pRec->isTruncated = zSql[n] != '\0';
+    } else if (iType == TRACE_TYPE_PROFILE) {
+        pRec->iValue = *(sqlite3_int64 *)(pExtra);
+    }
+    tracePublish(pRec, uPosition);
+
+    return SQLITE_OK;
+}
+
+/*
+** Parse a comma separated list of TYPE=N sampling rates, where only
+** every Nth event of the given type is recorded and zero disables the
+** type entirely.
+*/
+static int traceParseSample(const char *zSpec) {
+    while (*zSpec) {
+        int iType;
+        for (iType = 0; iType < TRACE_TYPE_COUNT; iType++) {
+            size_t n = strlen(azTraceType[iType]);
+            if (!strncmp(zSpec, azTraceType[iType], n) && zSpec[n] == '=') break;
+        }
+        if (iType == TRACE_TYPE_COUNT) return SQLITE_ERROR;
+
+        char *zEnd;
+        zSpec += strlen(azTraceType[iType]) + 1;
+        long iRate = strtol(zSpec, &zEnd, 10);
+        if (zEnd == zSpec || iRate < 0) return SQLITE_ERROR;
+        aTraceSample[iType] = iRate;
+
+        if (*zEnd == ',') {
+            zEnd++;
+        } else if (*zEnd != '\0') {
+            return SQLITE_ERROR;
+        }
+        zSpec = zEnd;
+    }
+
+    return SQLITE_OK;
+}
+
+/*
+** Return the given sqlite3_trace_v2() mask without the event types
+** that are not sampled at all, so SQLite does not even invoke the
+** callback for them.
+*/
+static unsigned int traceMask(unsigned int uMask) {
+    if (aTraceSample[TRACE_TYPE_STMT] == 0) uMask &= ~SQLITE_TRACE_STMT;
+    if (aTraceSample[TRACE_TYPE_ROW] == 0) uMask &= ~SQLITE_TRACE_ROW;
+    if (aTraceSample[TRACE_TYPE_PROFILE] == 0) uMask &= ~SQLITE_TRACE_PROFILE;
+    if (aTraceSample[TRACE_TYPE_CLOSE] == 0) uMask &= ~SQLITE_TRACE_CLOSE;
+
+    return uMask;
+}
+
+/*
+** Initialize the ring buffer and start the background writer.
+*/
+static int traceStart(void) {
+    for (unsigned int n = 0; n < TRACE_RING_SIZE; n++) {
+        aTraceRing[n].uSequence = n;
+    }
+    iTraceStart = traceNow();
+    if (pthread_create(&traceWriterThread, 0, traceWriterMain, 0)) {
+        return SQLITE_ERROR;
+    }
+    isTraceStarted = 1;
+
+    return SQLITE_OK;
+}
+
+/*
+** Stop the background writer after it has drained all records, unless
+** it was never started.
+*/
+static void traceStop(void) {
+    if (!isTraceStarted) return;
+    isTraceStarted = 0;
+    __atomic_store_n(&isTraceStopping, 1, __ATOMIC_RELEASE);
+    pthread_join(traceWriterThread, 0);
+    if (iTraceDropped) {
+        fprintf(stderr, "trace: dropped %lld events\n", iTraceDropped);
+    }
+}
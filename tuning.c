@@ -0,0 +1,217 @@
+/*
+** This file implements the connection tuning switches of the driver.
+** Tuning options are either given explicitly or taken from one of the
+** named presets, in which case explicit options take precedence.  Global
+** options must be applied before sqlite3_initialize() is invoked while
+** connection options are applied as PRAGMAs right after opening the
+** database.  Usage example:
+**
+**     nadeko --profile-preset bulk --cache-size -1048576 script.sql
+**
+** The readonly preset opens the database read-only, so scripts which
+** create nadeko() tables, and with them their _store tables, fail with
+** it.
+*/
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* tuning_options holds all settings which may be changed by the
+** tuning switches, where unset values, NULL or -1 for the lookaside,
+** keep the SQLite defaults
+*/
+typedef struct tuning_options tuning_options;
+struct tuning_options {
+    const char *zThreading;   /* One of "single", "multi" or "serialized" */
+    const char *zJournal;     /* Argument to PRAGMA journal_mode */
+    const char *zSynchronous; /* Argument to PRAGMA synchronous */
+    const char *zLocking;     /* Argument to PRAGMA locking_mode */
+    const char *zTempStore;   /* Argument to PRAGMA temp_store */
+    const char *zCacheSize;   /* Argument to PRAGMA cache_size */
+    const char *zMmapSize;    /* Argument to PRAGMA mmap_size */
+    int iLookasideSize;       /* Size of each lookaside slot in bytes */
+    int iLookasideCount;      /* Number of lookaside slots per connection */
+    int iPageCacheCount;      /* Number of preallocated page cache lines */
+    int isReadonly;           /* True to open the database read-only */
+};
+
+/* tuning_preset associates a tuning_options set with its name
+*/
+typedef struct tuning_preset tuning_preset;
+struct tuning_preset {
+    const char *zName;
+    tuning_options options;
+};
+
+/* The bulk preset trades durability for speed: it keeps its rollback
+** journal in memory and does not sync, so a crash may corrupt the
+** database, while ROLLBACK, and with it the transaction switches and
+** --resume, keeps working.  The safe preset syncs every transaction.
+*/
+static const tuning_preset aTuningPreset[] = {
+    {"bulk",
+        {"multi", "memory", "off", "exclusive", "memory", "-262144", "268435456", 1200,
+            500, 4096, 0}},
+    {"safe", {"serialized", "wal", "full", 0, 0, 0, 0, -1, -1, 0, 0}},
+    {"readonly",
+        {"multi", 0, 0, 0, "memory", "-65536", "1073741824", -1, -1, 0, 1}},
+};
+
+static const char *const azTuningJournal[] = {
+    "delete", "truncate", "persist", "memory", "wal", "off", 0};
+static const char *const azTuningThreading[] = {"single", "multi", "serialized", 0};
+
+static tuning_options tuningOptions = {0, 0, 0, 0, 0, 0, 0, -1, -1, 0, 0};
+
+/*
+** Return true if the given string is contained in the given
+** NULL terminated list of strings.
+*/
+static int tuningIsOneOf(const char *zValue, const char *const *azList) {
+    for (; *azList; azList++) {
+        if (!sqlite3_stricmp(zValue, *azList)) return 1;
+    }
+
+    return 0;
+}
+
+/*
+** Return true if the given string is a decimal integer.
+*/
+static int tuningIsInteger(const char *zValue, int isSigned) {
+    char *zEnd;
+    if (!isSigned && zValue[0] == '-') return 0;
+    strtoll(zValue, &zEnd, 10);
+    return zEnd != zValue && *zEnd == '\0';
+}
+
+/*
+** Fill all tuning options which have not been set explicitly
+** from the preset with the given name.
+*/
+static int tuningApplyPreset(const char *zName) {
+    const tuning_preset *pPreset = 0;
+    for (size_t n = 0; n < sizeof(aTuningPreset) / sizeof(*aTuningPreset); n++) {
+        if (!strcmp(aTuningPreset[n].zName, zName)) pPreset = &aTuningPreset[n];
+    }
+    if (pPreset == 0) {
+        fprintf(stderr, "error: unknown preset \"%s\"\n", zName);
+        return SQLITE_ERROR;
+    }
+
+    const tuning_options *p = &pPreset->options;
+    tuning_options *o = &tuningOptions;
+    if (!o->zThreading) o->zThreading = p->zThreading;
+    if (!o->zJournal) o->zJournal = p->zJournal;
+    if (!o->zSynchronous) o->zSynchronous = p->zSynchronous;
+    if (!o->zLocking) o->zLocking = p->zLocking;
+    if (!o->zTempStore) o->zTempStore = p->zTempStore;
+    if (!o->zCacheSize) o->zCacheSize = p->zCacheSize;
+    if (!o->zMmapSize) o->zMmapSize = p->zMmapSize;
+    if (o->iLookasideSize < 0) {
+        o->iLookasideSize = p->iLookasideSize;
+        o->iLookasideCount = p->iLookasideCount;
+    }
+    if (!o->iPageCacheCount) o->iPageCacheCount = p->iPageCacheCount;
+    if (!o->isReadonly) o->isReadonly = p->isReadonly;
+
+    return SQLITE_OK;
+}
+
+/*
+** Check all explicitly given or preset tuning options for validity.
+*/
+static int tuningValidate(void) {
+    const tuning_options *o = &tuningOptions;
+    if (o->zThreading && !tuningIsOneOf(o->zThreading, azTuningThreading)) {
+        fprintf(stderr, "error: unknown threading mode \"%s\"\n", o->zThreading);
+        return SQLITE_ERROR;
+    } else if (o->zJournal && !tuningIsOneOf(o->zJournal, azTuningJournal)) {
+        fprintf(stderr, "error: unknown journal mode \"%s\"\n", o->zJournal);
+        return SQLITE_ERROR;
+    } else if (o->zCacheSize && !tuningIsInteger(o->zCacheSize, 1)) {
+        fprintf(stderr, "error: invalid cache size \"%s\"\n", o->zCacheSize);
+        return SQLITE_ERROR;
+    } else if (o->zMmapSize && !tuningIsInteger(o->zMmapSize, 0)) {
+        fprintf(stderr, "error: invalid mmap size \"%s\"\n", o->zMmapSize);
+        return SQLITE_ERROR;
+    }
+
+    return SQLITE_OK;
+}
+
+/*
+** Apply all process-wide tuning options.  Must be invoked before
+** sqlite3_initialize().
+*/
+static int tuningConfigureGlobal(void) {
+    const tuning_options *o = &tuningOptions;
+    int rc = SQLITE_OK;
+
+    if (o->zThreading && !sqlite3_stricmp(o->zThreading, "single")) {
+        rc = sqlite3_config(SQLITE_CONFIG_SINGLETHREAD);
+    } else if (o->zThreading && !sqlite3_stricmp(o->zThreading, "multi")) {
+        rc = sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
+    } else if (o->zThreading) {
+        rc = sqlite3_config(SQLITE_CONFIG_SERIALIZED);
+    }
+    if (rc == SQLITE_OK && o->iLookasideSize >= 0) {
+        rc = sqlite3_config(SQLITE_CONFIG_LOOKASIDE, o->iLookasideSize, o->iLookasideCount);
+    }
+    if (rc == SQLITE_OK && o->iPageCacheCount) {
+        int iHeaderSize = 0;
+        sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &iHeaderSize);
+        rc = sqlite3_config(
+            SQLITE_CONFIG_PAGECACHE, 0, 4096 + iHeaderSize, o->iPageCacheCount);
+    }
+
+    return rc;
+}
+
+/*
+** Return flags for sqlite3_open_v2() according to the tuning options.
+*/
+static int tuningOpenFlags(int iFlags) {
+    const tuning_options *o = &tuningOptions;
+    if (o->isReadonly) {
+        iFlags &= ~(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        iFlags |= SQLITE_OPEN_READONLY;
+    }
+    if (o->zThreading && sqlite3_stricmp(o->zThreading, "serialized")) {
+        iFlags &= ~SQLITE_OPEN_FULLMUTEX;
+        iFlags |= SQLITE_OPEN_NOMUTEX;
+    }
+
+    return iFlags;
+}
+
+/*
+** Apply all per-connection tuning options to the given database.
+*/
+static int tuningConfigureConnection(sqlite3 *db, char **pzErr) {
+    const tuning_options *o = &tuningOptions;
+    const struct {
+        const char *zPragma;
+        const char *zValue;
+    } aPragma[] = {
+        {"locking_mode", o->zLocking},
+        {"journal_mode", o->zJournal},
+        {"synchronous", o->zSynchronous},
+        {"temp_store", o->zTempStore},
+        {"cache_size", o->zCacheSize},
+        {"mmap_size", o->zMmapSize},
+    };
+
+    for (size_t n = 0; n < sizeof(aPragma) / sizeof(*aPragma); n++) {
+        if (aPragma[n].zValue == 0) continue;
+        char *zSql =
+            sqlite3_mprintf("PRAGMA %s = %s", aPragma[n].zPragma, aPragma[n].zValue);
+        if (zSql == 0) return SQLITE_NOMEM;
+        int rc = sqlite3_exec(db, zSql, 0, 0, pzErr);
+        sqlite3_free(zSql);
+        if (rc) return rc;
+    }
+
+    return SQLITE_OK;
+}
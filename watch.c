@@ -0,0 +1,265 @@
+/*
+** This file implements the watch mode of the driver.  After executing the
+** script, the script file itself and every archive or directory behind a
+** nadeko() table of the main database are watched with inotify, and the
+** script is executed again on a new connection once they have changed
+** and settled, so that nadeko() tables read their inputs again.  Watch
+** mode implies memoization, so that only statements which depend on the
+** changed inputs are executed again.  Files are watched through their
+** directory, so that inputs which are replaced by renaming them, as
+** nadeko() does when writing an archive, stay watched.  The driver stops
+** on SIGINT or SIGTERM.  Usage example:
+**
+**     nadeko --watch --output dashboard.db dashboard.sql
+*/
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WATCH_SETTLE_MS 200
+#define WATCH_EVENT_SIZE 4096
+#define WATCH_MASK                                                                     \
+    (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+/* watch_target is a watched directory, restricted to a single entry when
+** watching a file
+*/
+typedef struct watch_target watch_target;
+struct watch_target {
+    int iWatch;  /* Watch descriptor returned by inotify_add_watch() */
+    char *zName; /* Name of the watched entry, or NULL for all entries */
+};
+
+/* watch_list is the set of all targets of a single wait
+*/
+typedef struct watch_list watch_list;
+struct watch_list {
+    int fd;                /* File descriptor returned by inotify_init() */
+    watch_target *aTarget; /* Watched targets */
+    int nTarget;           /* Number of targets */
+    int nAlloc;            /* Allocated size of aTarget */
+};
+
+static volatile sig_atomic_t isWatchStopping = 0;
+
+/*
+** Signal handler which makes the driver stop waiting for changes.
+*/
+static void watchHandleSignal(int iSignal) {
+    (void)(iSignal);
+    isWatchStopping = 1;
+}
+
+/*
+** Watch the given directory, or only the given entry of it.
+*/
+static int watchAdd(watch_list *pList, const char *zDirectory, const char *zName) {
+    if (pList->nTarget == pList->nAlloc) {
+        int nAlloc = pList->nAlloc ? pList->nAlloc * 2 : 16;
+        watch_target *aNew = sqlite3_realloc(pList->aTarget, nAlloc * sizeof(*aNew));
+        if (aNew == 0) return SQLITE_NOMEM;
+        pList->aTarget = aNew;
+        pList->nAlloc = nAlloc;
+    }
+
+    watch_target *pTarget = &pList->aTarget[pList->nTarget];
+    if ((pTarget->iWatch = inotify_add_watch(pList->fd, zDirectory, WATCH_MASK)) < 0) {
+        fprintf(stderr, "error: watching \"%s\": %s\n", zDirectory, strerror(errno));
+        return SQLITE_ERROR;
+    }
+    pTarget->zName = 0;
+    if (zName && !(pTarget->zName = sqlite3_mprintf("%s", zName))) return SQLITE_NOMEM;
+    pList->nTarget++;
+
+    return SQLITE_OK;
+}
+
+/*
+** Watch the given directory and all directories below it.
+*/
+static int watchAddTree(watch_list *pList, const char *zDirectory) {
+    int rc = watchAdd(pList, zDirectory, 0);
+    DIR *pDir = rc ? 0 : opendir(zDirectory);
+    if (pDir == 0) return rc;
+
+    struct dirent *pEntry;
+    while (rc == SQLITE_OK && (pEntry = readdir(pDir))) {
+        if (!strcmp(pEntry->d_name, ".") || !strcmp(pEntry->d_name, "..")) continue;
+        char *zPath = sqlite3_mprintf("%s/%s", zDirectory, pEntry->d_name);
+        struct stat st;
+        if (zPath == 0) {
+            rc = SQLITE_NOMEM;
+        } else if (!lstat(zPath, &st) && S_ISDIR(st.st_mode)) {
+            rc = watchAddTree(pList, zPath);
+        }
+        sqlite3_free(zPath);
+    }
+    closedir(pDir);
+
+    return rc;
+}
+
+/*
+** Watch the input at the given path, which is either a directory or a
+** file watched through its directory.
+*/
+static int watchAddInput(watch_list *pList, const char *zPath) {
+    struct stat st;
+    if (!stat(zPath, &st) && S_ISDIR(st.st_mode)) return watchAddTree(pList, zPath);
+
+    const char *zSlash = strrchr(zPath, '/');
+    if (zSlash == 0) return watchAdd(pList, ".", zPath);
+    int nDirectory = zSlash == zPath ? 1 : (int)(zSlash - zPath);
+    char *zDirectory = sqlite3_mprintf("%.*s", nDirectory, zPath);
+    int rc = zDirectory ? watchAdd(pList, zDirectory, zSlash + 1) : SQLITE_NOMEM;
+    sqlite3_free(zDirectory);
+
+    return rc;
+}
+
+/*
+** Watch the given script and the sources of all nadeko() tables of the
+** main database.
+*/
+static int watchAddInputs(watch_list *pList, sqlite3 *db, const char *zFilename) {
+    sqlite3_stmt *pSelect;
+    int rc = watchAddInput(pList, zFilename);
+    if (rc) return rc;
+    if ((rc = sqlite3_prepare_v2(db,
+             "SELECT sql FROM main.sqlite_schema WHERE type = 'table' "
+             "AND sql LIKE 'CREATE VIRTUAL TABLE%USING nadeko%'",
+             -1,
+             &pSelect,
+             0))) {
+        return rc;
+    }
+
+    while (rc == SQLITE_OK && sqlite3_step(pSelect) == SQLITE_ROW) {
+        char *zPath = memoSourcePath((const char *)(sqlite3_column_text(pSelect, 0)));
+        if (zPath) rc = watchAddInput(pList, zPath);
+        sqlite3_free(zPath);
+    }
+    sqlite3_finalize(pSelect);
+
+    return rc;
+}
+
+/*
+** Read all pending events and return true if any of them concerns a
+** watched target.
+*/
+static int watchReadEvents(watch_list *pList) {
+    char aBuffer[WATCH_EVENT_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    int isRelevant = 0;
+    ssize_t nRead = read(pList->fd, aBuffer, sizeof(aBuffer));
+
+    for (char *p = aBuffer; nRead > 0 && p < aBuffer + nRead;) {
+        const struct inotify_event *pEvent = (const struct inotify_event *)(p);
+        for (int n = 0; n < pList->nTarget; n++) {
+            const watch_target *pTarget = &pList->aTarget[n];
+            if (pTarget->iWatch != pEvent->wd) continue;
+            isRelevant = isRelevant || !pTarget->zName ||
+                         (pEvent->len && !strcmp(pTarget->zName, pEvent->name));
+        }
+        p += sizeof(struct inotify_event) + pEvent->len;
+    }
+
+    return isRelevant;
+}
+
+/*
+** Release all watches and memory held by the given list.
+*/
+static void watchListFree(watch_list *pList) {
+    for (int n = 0; n < pList->nTarget; n++) {
+        sqlite3_free(pList->aTarget[n].zName);
+    }
+    sqlite3_free(pList->aTarget);
+    if (pList->fd >= 0) close(pList->fd);
+    memset(pList, 0, sizeof(*pList));
+    pList->fd = -1;
+}
+
+/*
+** Wait until any input of the given script has changed and no further
+** changes happened for WATCH_SETTLE_MS.  Returns SQLITE_DONE if stopped
+** by a signal.
+*/
+static int watchWait(sqlite3 *db, const char *zFilename) {
+    watch_list list;
+    memset(&list, 0, sizeof(list));
+    if ((list.fd = inotify_init()) < 0) {
+        fprintf(stderr, "error: initializing inotify: %s\n", strerror(errno));
+        return SQLITE_ERROR;
+    }
+
+    int rc = watchAddInputs(&list, db, zFilename);
+    struct pollfd pfd = {list.fd, POLLIN, 0};
+    for (int isChanged = 0; rc == SQLITE_OK && !isWatchStopping;) {
+        int nReady = poll(&pfd, 1, isChanged ? WATCH_SETTLE_MS : -1);
+        if (nReady > 0) {
+            isChanged = watchReadEvents(&list) || isChanged;
+        } else if (nReady == 0) {
+            break;
+        }
+    }
+    watchListFree(&list);
+
+    return rc == SQLITE_OK && isWatchStopping ? SQLITE_DONE : rc;
+}
+
+/*
+** Close the given connection and open its main database again, so that
+** nadeko() tables read their inputs afresh rather than serving the
+** contents their store was filled with during the previous execution.
+*/
+static int watchReopen(
+    sqlite3 **pDb, int iOpenFlags, int (*xPrepare)(sqlite3 *, char **)) {
+    char *zErr = 0;
+    char *zPath = sqlite3_mprintf("%s", sqlite3_db_filename(*pDb, "main"));
+    int rc = zPath ? SQLITE_OK : SQLITE_NOMEM;
+
+    sqlite3_close(*pDb);
+    *pDb = 0;
+    if (rc == SQLITE_OK && (rc = sqlite3_open_v2(zPath, pDb, iOpenFlags, 0))) {
+        fprintf(stderr, "error: opening database: %s\n", sqlite3_errstr(rc));
+    } else if (rc == SQLITE_OK && (rc = xPrepare(*pDb, &zErr))) {
+        fprintf(stderr, "error: %s\n", zErr);
+    }
+    sqlite3_free(zErr);
+    sqlite3_free(zPath);
+
+    return rc;
+}
+
+/*
+** Execute the given script, then execute it again on a new connection
+** to the same database whenever its inputs change until stopped by a
+** signal.  Returns the result of the last execution.
+*/
+static int watchRun(sqlite3 **pDb, const char *zFilename, int iOpenFlags,
+    int (*xPrepare)(sqlite3 *, char **)) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = watchHandleSignal;
+    sigaction(SIGINT, &action, 0);
+    sigaction(SIGTERM, &action, 0);
+
+    int rc = readAndLoadFile(*pDb, zFilename);
+    for (;;) {
+        int rcWait = watchWait(*pDb, zFilename);
+        if (rcWait == SQLITE_DONE) return rc;
+        if (rcWait != SQLITE_OK) return rcWait;
+        fprintf(stderr, "watch: %s: inputs changed, executing again\n", zFilename);
+        if ((rc = watchReopen(pDb, iOpenFlags, xPrepare))) return rc;
+        rc = readAndLoadFile(*pDb, zFilename);
+    }
+}